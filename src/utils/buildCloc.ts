@@ -0,0 +1,95 @@
+#!/usr/bin/env bun
+import { $ } from 'bun'
+import { suffix } from 'bun:ffi'
+import { createHash } from 'node:crypto'
+import { existsSync, readFileSync } from 'node:fs'
+import { mkdir, readdir } from 'node:fs/promises'
+import { dirname, resolve } from 'node:path'
+import { parseArgs } from 'node:util'
+
+// Builds the cloc engine as an optimized shared library that clocEngine.ts
+// loads with dlopen instead of compiling cloc.c through TinyCC on every run.
+//
+//   bun run build:cloc                          -O3 + LTO
+//   bun run build:cloc --pgo-generate build/pgo instrumented build
+//   bun run build:cloc --pgo-use build/pgo      optimized with the profile
+
+const SOURCE = resolve('src/utils/cloc.c')
+
+const { values } = parseArgs({
+	args: Bun.argv.slice(2),
+	options: {
+		out: { type: 'string', default: `build/libcloc.${suffix}` },
+		'pgo-generate': { type: 'string' },
+		'pgo-use': { type: 'string' },
+	},
+})
+
+const out = resolve(values.out as string)
+// The object path must be identical across PGO stages, whatever --out is:
+// GCC names the profile data after it
+const object = resolve('build/cloc.o')
+const compiler = process.env.CC || 'cc'
+const isClang = (await $`${compiler} --version`.text()).includes('clang')
+
+// Plain -flto makes GCC's lto-wrapper warn that it runs LTRANS serially
+const lto = isClang ? '-flto' : '-flto=auto'
+// The loader compares this with the hash of cloc.c as it is then, so a
+// library built from other source is never used, whatever the file times
+const sourceHash = createHash('sha256')
+	.update(readFileSync(SOURCE))
+	.digest('hex')
+const flags = [
+	'-O3',
+	lto,
+	'-fPIC',
+	'-Wall',
+	`-DCLOC_SOURCE_HASH="${sourceHash}"`,
+]
+const linkFlags = ['-O3', lto, '-shared']
+
+const pgoGenerate = values['pgo-generate'] && resolve(values['pgo-generate'])
+const pgoUse = values['pgo-use'] && resolve(values['pgo-use'])
+
+if (pgoGenerate) {
+	await mkdir(pgoGenerate, { recursive: true })
+	const profile = isClang
+		? `-fprofile-instr-generate=${pgoGenerate}/cloc-%p.profraw`
+		: `-fprofile-generate=${pgoGenerate}`
+	flags.push(profile, '-fprofile-update=atomic')
+	linkFlags.push(profile)
+} else if (pgoUse) {
+	if (!existsSync(pgoUse)) {
+		console.error(`❌ No profile data at ${pgoUse}`)
+		process.exit(1)
+	}
+	if (isClang) {
+		// Clang needs the raw profiles merged into one .profdata first
+		const raw = (await readdir(pgoUse))
+			.filter((f) => f.endsWith('.profraw'))
+			.map((f) => `${pgoUse}/${f}`)
+		if (raw.length > 0) {
+			await $`llvm-profdata merge -o ${pgoUse}/cloc.profdata ${raw}`
+		}
+		flags.push(`-fprofile-instr-use=${pgoUse}/cloc.profdata`)
+	} else {
+		// A profile that isn't found must fail the build, not fall back to -O3
+		flags.push(
+			`-fprofile-use=${pgoUse}`,
+			'-fprofile-correction',
+			'-Werror=missing-profile'
+		)
+	}
+}
+
+console.log(
+	`🔧 Building ${out} with ${compiler}${pgoGenerate ? ' (PGO instrumented)' : pgoUse ? ' (PGO optimized)' : ''}...`
+)
+
+await mkdir(dirname(out), { recursive: true })
+await mkdir(dirname(object), { recursive: true })
+await $`${compiler} ${flags} -c ${SOURCE} -o ${object}`
+await $`${compiler} ${linkFlags} ${object} -o ${out}`
+await $`rm -f ${object}`
+
+console.log(`✅ Built ${out}`)
@@ -1,4 +1,30 @@
-// Portable C code without standard library dependencies
+// Portable C code. The counting kernels have no standard library
+// dependencies; everything around them (the walker, the git object store,
+// archives, the index and result files) uses libc, POSIX I/O and pthreads,
+// with io_uring, inotify and perf counters compiled in only on Linux.
+// Compressed data is inflated here, without zlib.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// SHA-256 of the cloc.c a library was built from, passed in by buildCloc.ts;
+// the loader only uses a prebuilt library whose hash matches the source
+#ifndef CLOC_SOURCE_HASH
+#define CLOC_SOURCE_HASH ""
+#endif
+
+const char* cloc_source_hash(void) {
+    return CLOC_SOURCE_HASH;
+}
 
 // Dynamic language definitions from JSON
 typedef struct {
@@ -10,18 +36,35 @@ typedef struct {
     char block_end[8];
 } dynamic_lang_t;
 
-// Global language database (loaded from JSON)
-static dynamic_lang_t g_languages[300]; // Static allocation for 300 languages
-static int g_lang_count = 0;
+#define MAX_LANGUAGES 512
 
-// String utilities
-static int str_len(const char* s) {
-    if (!s) return 0;
-    int len = 0;
-    while (s[len]) len++;
-    return len;
-}
+// Extension index slot: a lowercase extension (with its dot) and the first
+// language that lists it
+typedef struct {
+    char ext[16];
+    int lang;                 // index into langs, -1 for an empty slot
+} ext_slot_t;
+
+// A language database. It is filled by add_language calls (or parsed whole
+// from a table) and frozen the first time it is used or shared; from then
+// on it is immutable and any number of threads may read it. Contexts,
+// analyses and jobs each hold a reference, and the last one to let go frees
+// it, so a reload can swap in a new database while older analyses finish on
+// the one they started with.
+typedef struct {
+    dynamic_lang_t langs[MAX_LANGUAGES];
+    int count;
+    int frozen;
+    long long refs;           // guarded by g_db_lock
+    long long generation;     // 0 for a context's first table, +1 per reload
+    ext_slot_t* ext_index;    // built on freeze, power-of-two sized
+    int ext_mask;
+} lang_db_t;
+
+// Guards reference counts and freezing; never taken per file
+static pthread_mutex_t g_db_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// String utilities
 static void str_copy(char* dst, const char* src, int max_len) {
     int i = 0;
     while (src && src[i] && i < max_len - 1) {
@@ -31,30 +74,29 @@ static void str_copy(char* dst, const char* src, int max_len) {
     dst[i] = '\0';
 }
 
+static char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
 static int str_equals_ci(const char* a, const char* b) {
     if (!a || !b) return 0;
     while (*a && *b) {
-        char ca = *a >= 'A' && *a <= 'Z' ? *a + 32 : *a;
-        char cb = *b >= 'A' && *b <= 'Z' ? *b + 32 : *b;
-        if (ca != cb) return 0;
+        if (ascii_lower(*a) != ascii_lower(*b)) return 0;
         a++;
         b++;
     }
     return *a == *b;
 }
 
-// Add a single language definition
-void add_language(
+// Fill in a single language definition
+static void lang_def_init(
+    dynamic_lang_t* lang,
     const char* name,
     const char* extensions,      // Comma-separated extensions
     const char* line_comment,
     const char* block_start,
     const char* block_end
 ) {
-    if (g_lang_count >= 300) return; // Max languages reached
-
-    dynamic_lang_t* lang = &g_languages[g_lang_count++];
-
     // Copy name
     str_copy(lang->name, name, 64);
 
@@ -65,7 +107,8 @@ void add_language(
         int start = 0;
         int pos = 0;
 
-        while (ext_str[pos] && lang->ext_count < 20) {
+        // Runs up to and including the terminating NUL so the last extension is kept
+        while (lang->ext_count < 20) {
             if (ext_str[pos] == ',' || ext_str[pos] == '\0') {
                 // Extract extension
                 int len = pos - start;
@@ -95,20 +138,142 @@ void add_language(
     str_copy(lang->block_end, block_end, 8);
 }
 
-// Fast language detection using dynamic database
-static const dynamic_lang_t* detect_language(const char* filepath) {
-    if (g_lang_count == 0) return 0; // No languages loaded
+// Add a language to a database nobody else can see yet. Returns 0, or -1 if
+// the database is full.
+static int lang_db_add(
+    lang_db_t* db,
+    const char* name,
+    const char* extensions,
+    const char* line_comment,
+    const char* block_start,
+    const char* block_end
+) {
+    if (db->count >= MAX_LANGUAGES) return -1;
+    lang_def_init(&db->langs[db->count++], name, extensions, line_comment, block_start, block_end);
+    return 0;
+}
+
+// Add every language of a table: one per line, with the name, extensions,
+// line comment, block start and block end separated by tabs. Returns the
+// number of languages added, or -1 if the table doesn't fit.
+static int lang_db_parse(lang_db_t* db, const char* table) {
+    char line[4096];
+    int added = 0;
+    while (*table) {
+        int len = (int)strcspn(table, "\n");
+        if (len >= (int)sizeof line) return -1;
+        memcpy(line, table, len);
+        line[len] = '\0';
+        table += len + (table[len] == '\n');
+        if (len && line[len - 1] == '\r') line[--len] = '\0';
+        if (!len) continue;
+
+        char* fields[5] = { "", "", "", "", "" };
+        char* p = line;
+        for (int i = 0; i < 5 && p; i++) {
+            fields[i] = p;
+            p = strchr(p, '\t');
+            if (p) *p++ = '\0';
+        }
+        if (lang_db_add(db, fields[0], fields[1], fields[2], fields[3], fields[4]) != 0) return -1;
+        added++;
+    }
+    return added;
+}
+
+static unsigned ext_hash(const char* ext) {
+    unsigned h = 2166136261u;
+    while (*ext) h = (h ^ (unsigned char)*ext++) * 16777619u;
+    return h;
+}
+
+// Build the extension index. An extension listed by several languages maps
+// to the first of them, as the linear scan did.
+static void lang_db_build_index(lang_db_t* db) {
+    int total = 0;
+    for (int i = 0; i < db->count; i++) total += db->langs[i].ext_count;
+    int cap = 64;
+    while (cap < total * 2) cap <<= 1;
+
+    ext_slot_t* index = malloc(cap * sizeof(ext_slot_t));
+    if (!index) return; // detect_language falls back to scanning
+    for (int i = 0; i < cap; i++) index[i].lang = -1;
+
+    for (int i = 0; i < db->count; i++) {
+        for (int j = 0; j < db->langs[i].ext_count; j++) {
+            char key[16];
+            int k = 0;
+            for (; db->langs[i].extensions[j][k]; k++) key[k] = ascii_lower(db->langs[i].extensions[j][k]);
+            key[k] = '\0';
+
+            unsigned h = ext_hash(key) & (cap - 1);
+            while (index[h].lang >= 0 && strcmp(index[h].ext, key) != 0) h = (h + 1) & (cap - 1);
+            if (index[h].lang >= 0) continue;
+            memcpy(index[h].ext, key, k + 1);
+            index[h].lang = i;
+        }
+    }
+    db->ext_index = index;
+    db->ext_mask = cap - 1;
+}
+
+static lang_db_t* lang_db_create(void) {
+    lang_db_t* db = calloc(1, sizeof(lang_db_t));
+    if (db) db->refs = 1;
+    return db;
+}
+
+// Take a reference for a reader, freezing the database on first use.
+// Caller holds g_db_lock.
+static void lang_db_retain_locked(lang_db_t* db) {
+    if (!db->frozen) {
+        lang_db_build_index(db);
+        db->frozen = 1;
+    }
+    db->refs++;
+}
+
+static void lang_db_release(lang_db_t* db) {
+    if (!db) return;
+    pthread_mutex_lock(&g_db_lock);
+    int last = --db->refs == 0;
+    pthread_mutex_unlock(&g_db_lock);
+    if (last) {
+        free(db->ext_index);
+        free(db);
+    }
+}
+
+// Language of a path from its last extension, or 0
+static const dynamic_lang_t* detect_language(const lang_db_t* db, const char* filepath) {
+    if (!db || db->count == 0) return 0; // No languages loaded
 
     // Find the last dot for extension
     const char* ext = 0;
-    for (const char* p = filepath    ; *p; p++) {
+    for (const char* p = filepath; *p; p++) {
         if (*p == '.') ext = p;
     }
     if (!ext) return 0;
 
+    if (db->ext_index) {
+        char key[16];
+        int len = 0;
+        for (; ext[len]; len++) {
+            if (len == 15) return 0; // longer than any stored extension
+            key[len] = ascii_lower(ext[len]);
+        }
+        key[len] = '\0';
+
+        unsigned h = ext_hash(key) & db->ext_mask;
+        for (; db->ext_index[h].lang >= 0; h = (h + 1) & db->ext_mask) {
+            if (strcmp(db->ext_index[h].ext, key) == 0) return &db->langs[db->ext_index[h].lang];
+        }
+        return 0;
+    }
+
     // Check each language
-    for (int i = 0; i < g_lang_count; i++) {
-        const dynamic_lang_t* lang = &g_languages[i];
+    for (int i = 0; i < db->count; i++) {
+        const dynamic_lang_t* lang = &db->langs[i];
         for (int j = 0; j < lang->ext_count; j++) {
             if (str_equals_ci(ext, lang->extensions[j])) {
                 return lang;
@@ -118,35 +283,593 @@ static const dynamic_lang_t* detect_language(const char* filepath) {
     return 0;
 }
 
-// Optimized byte matching
-static int bytes_match(const unsigned char* buf, int pos, const char* pattern, int pattern_len, int buf_len) {
-    if (!pattern || pattern_len == 0) return 0;
-    if (pos + pattern_len > buf_len) return 0;
+// Input encodings recognised by the counter
+enum {
+    ENC_UTF8 = 0,
+    ENC_UTF16LE,
+    ENC_UTF16BE,
+    ENC_UTF32LE,
+    ENC_UTF32BE,
+    ENC_BINARY
+};
 
-    for (int i = 0; i < pattern_len; i++) {
-        if (buf[pos + i] != (unsigned char)pattern[i]) return 0;
+// Bytes sampled when sniffing files that carry no BOM
+#define SNIFF_BYTES 512
+
+// Detect the encoding of a buffer from its BOM, or from the NUL layout of the
+// first bytes when there is none. UTF-16/32 text that is mostly ASCII has its
+// zero bytes in fixed lanes; NULs anywhere else mean the file is binary.
+static int detect_encoding(const unsigned char* buf, int len, int* bom_len) {
+    *bom_len = 0;
+
+    if (len >= 4 && buf[0] == 0xFF && buf[1] == 0xFE && buf[2] == 0 && buf[3] == 0) {
+        *bom_len = 4;
+        return ENC_UTF32LE;
     }
-    return 1;
+    if (len >= 4 && buf[0] == 0 && buf[1] == 0 && buf[2] == 0xFE && buf[3] == 0xFF) {
+        *bom_len = 4;
+        return ENC_UTF32BE;
+    }
+    if (len >= 2 && buf[0] == 0xFF && buf[1] == 0xFE) {
+        *bom_len = 2;
+        return ENC_UTF16LE;
+    }
+    if (len >= 2 && buf[0] == 0xFE && buf[1] == 0xFF) {
+        *bom_len = 2;
+        return ENC_UTF16BE;
+    }
+    if (len >= 3 && buf[0] == 0xEF && buf[1] == 0xBB && buf[2] == 0xBF) {
+        *bom_len = 3;
+        return ENC_UTF8;
+    }
+
+    // Count zero bytes per position modulo 4
+    int sample = len < SNIFF_BYTES ? len : SNIFF_BYTES;
+    int zeros[4] = {0, 0, 0, 0};
+    int total = 0;
+    for (int i = 0; i < sample; i++) {
+        if (buf[i] == 0) {
+            zeros[i & 3]++;
+            total++;
+        }
+    }
+    if (total == 0) return ENC_UTF8;
+
+    // Each lane holds a quarter of the sample; "mostly zero" means 3/4 of it.
+    // UTF-32 below U+10000 has its two high bytes zero whatever the script,
+    // and needs at least one whole code unit to be guessed at all.
+    int lane = sample / 4;
+    int hi = lane - lane / 4;
+    int lo = lane / 8;
+    if (sample >= 4 && zeros[2] >= hi && zeros[3] >= hi && zeros[0] <= lo) return ENC_UTF32LE;
+    if (sample >= 4 && zeros[0] >= hi && zeros[1] >= hi && zeros[3] <= lo) return ENC_UTF32BE;
+
+    // UTF-16 puts its zero bytes on one parity only: half the sample for
+    // ASCII, only the newlines and spaces for other scripts, while the other
+    // parity is zero only for the rare U+xx00 character
+    int odd = zeros[1] + zeros[3];
+    int even = zeros[0] + zeros[2];
+    if (odd > sample / 256 && even <= odd / 8) return ENC_UTF16LE;
+    if (even > sample / 256 && odd <= even / 8) return ENC_UTF16BE;
+    return ENC_BINARY;
 }
 
-// Process a single file buffer
-static void count_file_buffer(const unsigned char* buffer, int buf_size, const dynamic_lang_t* lang, int* result) {
-    result[0] = result[1] = result[2] = result[3] = result[4] = 0;
-    result[4] = buf_size; // size
+static int encoding_unit_size(int enc) {
+    switch (enc) {
+    case ENC_UTF16LE:
+    case ENC_UTF16BE:
+        return 2;
+    case ENC_UTF32LE:
+    case ENC_UTF32BE:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Read code unit i of a buffer in the given encoding
+static unsigned int load_unit(const unsigned char* data, int i, int enc) {
+    const unsigned char* p;
+    switch (enc) {
+    case ENC_UTF16LE:
+        p = data + i * 2;
+        return p[0] | (unsigned int)p[1] << 8;
+    case ENC_UTF16BE:
+        p = data + i * 2;
+        return (unsigned int)p[0] << 8 | p[1];
+    case ENC_UTF32LE:
+        p = data + i * 4;
+        return p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+    case ENC_UTF32BE:
+        p = data + i * 4;
+        return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+    default:
+        return data[i];
+    }
+}
+
+// Little-endian 64-bit load; compilers fold this into a single mov
+static unsigned long long load_u64(const unsigned char* p) {
+    return (unsigned long long)p[0] | (unsigned long long)p[1] << 8 |
+           (unsigned long long)p[2] << 16 | (unsigned long long)p[3] << 24 |
+           (unsigned long long)p[4] << 32 | (unsigned long long)p[5] << 40 |
+           (unsigned long long)p[6] << 48 | (unsigned long long)p[7] << 56;
+}
+
+// Word-at-a-time newline search. Each variant XORs eight bytes with the
+// newline code unit broadcast across its lanes and tests for a zero lane; the
+// exact position inside the word is then found with the scalar loop.
+static int scan_newline_8(const unsigned char* data, int i, int n, int enc) {
+    (void)enc;
+    while (i + 8 <= n) {
+        unsigned long long x = load_u64(data + i) ^ 0x0A0A0A0A0A0A0A0AULL;
+        if ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) break;
+        i += 8;
+    }
+    while (i < n && data[i] != '\n') i++;
+    return i;
+}
+
+static int scan_newline_16(const unsigned char* data, int i, int n, int enc) {
+    unsigned long long nl = enc == ENC_UTF16LE ? 0x000A000A000A000AULL : 0x0A000A000A000A00ULL;
+    while (i + 4 <= n) {
+        unsigned long long x = load_u64(data + i * 2) ^ nl;
+        if ((x - 0x0001000100010001ULL) & ~x & 0x8000800080008000ULL) break;
+        i += 4;
+    }
+    while (i < n && load_unit(data, i, enc) != '\n') i++;
+    return i;
+}
+
+static int scan_newline_32(const unsigned char* data, int i, int n, int enc) {
+    unsigned long long nl = enc == ENC_UTF32LE ? 0x0000000A0000000AULL : 0x0A0000000A000000ULL;
+    while (i + 2 <= n) {
+        unsigned long long x = load_u64(data + i * 4) ^ nl;
+        if ((x - 0x0000000100000001ULL) & ~x & 0x8000000080000000ULL) break;
+        i += 2;
+    }
+    while (i < n && load_unit(data, i, enc) != '\n') i++;
+    return i;
+}
+
+// SIMD variants of the newline search, compiled per ISA with target
+// attributes so a single build carries all of them. TinyCC has neither the
+// attributes nor the intrinsics and only gets the SWAR kernels.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__TINYC__)
+#define CLOC_HAVE_X86_KERNELS 1
+#endif
+
+#ifdef CLOC_HAVE_X86_KERNELS
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+// Newline code unit as it appears in a little-endian load of the input
+static unsigned int newline_lane(int enc) {
+    switch (enc) {
+    case ENC_UTF16BE:
+        return 0x0A00;
+    case ENC_UTF32BE:
+        return 0x0A000000;
+    default:
+        return '\n';
+    }
+}
+
+__attribute__((target("sse2")))
+static int scan_newline_8_sse2(const unsigned char* data, int i, int n, int enc) {
+    __m128i nl = _mm_set1_epi8('\n');
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (m) return i + __builtin_ctz(m);
+        i += 16;
+    }
+    return scan_newline_8(data, i, n, enc);
+}
+
+__attribute__((target("sse2")))
+static int scan_newline_16_sse2(const unsigned char* data, int i, int n, int enc) {
+    __m128i nl = _mm_set1_epi16((short)newline_lane(enc));
+    while (i + 8 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i * 2));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, nl));
+        if (m) return i + __builtin_ctz(m) / 2;
+        i += 8;
+    }
+    return scan_newline_16(data, i, n, enc);
+}
+
+__attribute__((target("sse2")))
+static int scan_newline_32_sse2(const unsigned char* data, int i, int n, int enc) {
+    __m128i nl = _mm_set1_epi32((int)newline_lane(enc));
+    while (i + 4 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i * 4));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(v, nl));
+        if (m) return i + __builtin_ctz(m) / 4;
+        i += 4;
+    }
+    return scan_newline_32(data, i, n, enc);
+}
+
+__attribute__((target("avx2")))
+static int scan_newline_8_avx2(const unsigned char* data, int i, int n, int enc) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    while (i + 32 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (m) return i + __builtin_ctz(m);
+        i += 32;
+    }
+    return scan_newline_8(data, i, n, enc);
+}
+
+__attribute__((target("avx2")))
+static int scan_newline_16_avx2(const unsigned char* data, int i, int n, int enc) {
+    __m256i nl = _mm256_set1_epi16((short)newline_lane(enc));
+    while (i + 16 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i * 2));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, nl));
+        if (m) return i + __builtin_ctz(m) / 2;
+        i += 16;
+    }
+    return scan_newline_16(data, i, n, enc);
+}
+
+__attribute__((target("avx2")))
+static int scan_newline_32_avx2(const unsigned char* data, int i, int n, int enc) {
+    __m256i nl = _mm256_set1_epi32((int)newline_lane(enc));
+    while (i + 8 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i * 4));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, nl));
+        if (m) return i + __builtin_ctz(m) / 4;
+        i += 8;
+    }
+    return scan_newline_32(data, i, n, enc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_newline_8_avx512(const unsigned char* data, int i, int n, int enc) {
+    __m512i nl = _mm512_set1_epi8('\n');
+    while (i + 64 <= n) {
+        __m512i v = _mm512_loadu_si512((const void*)(data + i));
+        unsigned long long m = _mm512_cmpeq_epi8_mask(v, nl);
+        if (m) return i + __builtin_ctzll(m);
+        i += 64;
+    }
+    return scan_newline_8(data, i, n, enc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_newline_16_avx512(const unsigned char* data, int i, int n, int enc) {
+    __m512i nl = _mm512_set1_epi16((short)newline_lane(enc));
+    while (i + 32 <= n) {
+        __m512i v = _mm512_loadu_si512((const void*)(data + i * 2));
+        unsigned m = _mm512_cmpeq_epi16_mask(v, nl);
+        if (m) return i + __builtin_ctz(m);
+        i += 32;
+    }
+    return scan_newline_16(data, i, n, enc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_newline_32_avx512(const unsigned char* data, int i, int n, int enc) {
+    __m512i nl = _mm512_set1_epi32((int)newline_lane(enc));
+    while (i + 16 <= n) {
+        __m512i v = _mm512_loadu_si512((const void*)(data + i * 4));
+        unsigned m = _mm512_cmpeq_epi32_mask(v, nl);
+        if (m) return i + __builtin_ctz(m);
+        i += 16;
+    }
+    return scan_newline_32(data, i, n, enc);
+}
+
+#endif
+
+// Kernel variants, in increasing order of preference
+enum {
+    KERNEL_SWAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_COUNT
+};
+
+typedef int (*scan_newline_fn)(const unsigned char* data, int i, int n, int enc);
+
+typedef struct {
+    scan_newline_fn nl8;
+    scan_newline_fn nl16;
+    scan_newline_fn nl32;
+} count_kernel_t;
+
+static const count_kernel_t g_kernels[KERNEL_COUNT] = {
+    {scan_newline_8, scan_newline_16, scan_newline_32},
+#ifdef CLOC_HAVE_X86_KERNELS
+    {scan_newline_8_sse2, scan_newline_16_sse2, scan_newline_32_sse2},
+    {scan_newline_8_avx2, scan_newline_16_avx2, scan_newline_32_avx2},
+    {scan_newline_8_avx512, scan_newline_16_avx512, scan_newline_32_avx512},
+#endif
+};
+
+// Best kernel variant this CPU and OS support, from cpuid and XCR0
+static int cpu_best_kernel(void) {
+    int best = KERNEL_SWAR;
+#ifdef CLOC_HAVE_X86_KERNELS
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return best;
+    if (d & bit_SSE2) best = KERNEL_SSE2;
+
+    // AVX state must be enabled by the OS, not just present in the CPU
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) return best;
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x06) != 0x06) return best;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return best;
+    if (b & bit_AVX2) best = KERNEL_AVX2;
+    if ((b & bit_AVX512F) && (b & bit_AVX512BW) && (xcr0_lo & 0xE6) == 0xE6) best = KERNEL_AVX512;
+#endif
+    return best;
+}
+
+// ENGINE CONTEXT - language database and options for one embedder
+//
+// Every entry point works on a cloc_ctx_t, so analyses with different
+// language tables or kernels can run side by side. A context holds a
+// reference to a language database and its counting kernel choice; a
+// context created from another shares its (then frozen) database read-only.
+// The legacy exports run on a process-wide default context.
+//
+// cloc_ctx_load_languages replaces a context's database: the new one is
+// built and indexed off to the side, then published with a pointer swap.
+// Every analysis pins the database it starts with, so in-flight work
+// finishes on the old generation, which is freed once the last of it
+// drains. Readers take g_db_lock only to pin, once per call or job.
+
+typedef struct cloc_ctx {
+    lang_db_t* db;            // current generation, swapped under g_db_lock
+    const count_kernel_t* kernel;
+    struct file_cache* cache; // created by the first WALK_CACHED walk
+} cloc_ctx_t;
+
+// Counting threads a walk may add; with the walker they fill a job's
+// thread stats (JOB_MAX_THREADS)
+#define POOL_MAX_THREADS 63
 
-    if (buf_size == 0) {
-        result[0] = 1; // lines
-        result[3] = 1; // blanks
+// Select the counting kernels; -1 picks the best the CPU supports, a
+// specific variant can be forced for benchmarking. Returns the variant now
+// in use, or -1 if the requested one can't run here.
+int cloc_ctx_select_kernel(void* handle, int variant) {
+    cloc_ctx_t* ctx = handle;
+    int best = cpu_best_kernel();
+    if (variant < 0) variant = best;
+    if (variant >= KERNEL_COUNT || variant > best) return -1;
+    ctx->kernel = &g_kernels[variant];
+    return variant;
+}
+
+// The context's current database, frozen and referenced until the caller
+// releases it
+static lang_db_t* ctx_languages(cloc_ctx_t* ctx) {
+    pthread_mutex_lock(&g_db_lock);
+    lang_db_t* db = ctx->db;
+    lang_db_retain_locked(db);
+    pthread_mutex_unlock(&g_db_lock);
+    return db;
+}
+
+// New context with an empty language database, or sharing the database of
+// `share` if given. Returns 0 on OOM.
+void* cloc_ctx_create(void* share) {
+    cloc_ctx_t* ctx = calloc(1, sizeof(cloc_ctx_t));
+    if (!ctx) return 0;
+    if (share) {
+        ctx->db = ctx_languages(share);
+    } else if (!(ctx->db = lang_db_create())) {
+        free(ctx);
+        return 0;
+    }
+    cloc_ctx_select_kernel(ctx, -1);
+    return ctx;
+}
+
+static void file_cache_release(struct file_cache* cache);
+
+// Running jobs keep their own references to the database and cache
+void cloc_ctx_destroy(void* handle) {
+    cloc_ctx_t* ctx = handle;
+    if (!ctx) return;
+    lang_db_release(ctx->db);
+    file_cache_release(ctx->cache);
+    free(ctx);
+}
+
+// Add a language to the context's database. The definition is built off to
+// the side and appended under g_db_lock, the lock a first use freezes the
+// database under, so it is either in the frozen database whole or refused.
+// Returns 0, or -1 once the database is full or has been used, shared or
+// replaced by a loaded table.
+int cloc_ctx_add_language(
+    void* handle,
+    const char* name,
+    const char* extensions,
+    const char* line_comment,
+    const char* block_start,
+    const char* block_end
+) {
+    cloc_ctx_t* ctx = handle;
+    dynamic_lang_t lang;
+    lang_def_init(&lang, name, extensions, line_comment, block_start, block_end);
+
+    pthread_mutex_lock(&g_db_lock);
+    lang_db_t* db = ctx->db;
+    int added = !db->frozen && db->count < MAX_LANGUAGES;
+    if (added) db->langs[db->count++] = lang;
+    pthread_mutex_unlock(&g_db_lock);
+    return added ? 0 : -1;
+}
+
+// Replace the context's languages with a table in the lang_db_parse
+// format. Returns the new language count, or -1 (leaving the current
+// database in place) if the table is malformed or too large.
+int cloc_ctx_load_languages(void* handle, const char* table) {
+    cloc_ctx_t* ctx = handle;
+    lang_db_t* db = lang_db_create();
+    if (!db) return -1;
+    int count = lang_db_parse(db, table);
+    if (count < 0) {
+        lang_db_release(db);
+        return -1;
+    }
+
+    // Not yet visible to any reader
+    lang_db_build_index(db);
+    db->frozen = 1;
+
+    pthread_mutex_lock(&g_db_lock);
+    lang_db_t* old = ctx->db;
+    db->generation = old->generation + 1;
+    ctx->db = db;
+    pthread_mutex_unlock(&g_db_lock);
+
+    lang_db_release(old);
+    return count;
+}
+
+int cloc_ctx_language_count(void* handle) {
+    lang_db_t* db = ctx_languages(handle);
+    int count = db->count;
+    lang_db_release(db);
+    return count;
+}
+
+// Number of reloads the context has published
+long long cloc_ctx_generation(void* handle) {
+    lang_db_t* db = ctx_languages(handle);
+    long long generation = db->generation;
+    lang_db_release(db);
+    return generation;
+}
+
+static cloc_ctx_t* g_default_ctx;
+static pthread_once_t g_default_ctx_once = PTHREAD_ONCE_INIT;
+
+static void default_ctx_init(void) {
+    g_default_ctx = cloc_ctx_create(0);
+}
+
+static cloc_ctx_t* default_ctx(void) {
+    pthread_once(&g_default_ctx_once, default_ctx_init);
+    return g_default_ctx;
+}
+
+// Add a single language definition to the default context. Returns 0, or
+// -1 if it was refused: definitions must all be added before the context's
+// first analysis, which freezes its database.
+int add_language(
+    const char* name,
+    const char* extensions,      // Comma-separated extensions
+    const char* line_comment,
+    const char* block_start,
+    const char* block_end
+) {
+    cloc_ctx_t* ctx = default_ctx();
+    return ctx ? cloc_ctx_add_language(ctx, name, extensions, line_comment, block_start, block_end) : -1;
+}
+
+int select_count_kernel(int variant) {
+    cloc_ctx_t* ctx = default_ctx();
+    return ctx ? cloc_ctx_select_kernel(ctx, variant) : -1;
+}
+
+// Index of the next newline unit at or after i, or n if there is none
+static int scan_newline(const count_kernel_t* kernel, const unsigned char* data, int i, int n, int enc) {
+    switch (enc) {
+    case ENC_UTF16LE:
+    case ENC_UTF16BE:
+        return kernel->nl16(data, i, n, enc);
+    case ENC_UTF32LE:
+    case ENC_UTF32BE:
+        return kernel->nl32(data, i, n, enc);
+    default:
+        return kernel->nl8(data, i, n, enc);
+    }
+}
+
+// Comment marker expressed in code units of the input encoding
+typedef struct {
+    unsigned int units[8];
+    int len;
+} unit_pattern_t;
+
+// Convert a UTF-8 comment marker into code units. UTF-8 input matches the
+// raw bytes; UTF-16 needs surrogate pairs for characters outside the BMP.
+static void make_unit_pattern(unit_pattern_t* pat, const char* marker, int enc) {
+    pat->len = 0;
+    if (!marker) return;
+
+    const unsigned char* s = (const unsigned char*)marker;
+    if (enc == ENC_UTF8) {
+        while (*s && pat->len < 8) pat->units[pat->len++] = *s++;
         return;
     }
 
-    const char* line_comment = (lang && lang->line_comment[0]) ? lang->line_comment : 0;
-    const char* block_start = (lang && lang->block_start[0]) ? lang->block_start : 0;
-    const char* block_end = (lang && lang->block_end[0]) ? lang->block_end : 0;
+    while (*s) {
+        unsigned int cp = *s++;
+        int extra = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : cp >= 0xC0 ? 1 : 0;
+        if (extra) cp &= 0x3F >> extra;
+        while (extra-- > 0 && (*s & 0xC0) == 0x80) cp = cp << 6 | (*s++ & 0x3F);
+
+        int is_16 = enc == ENC_UTF16LE || enc == ENC_UTF16BE;
+        if (is_16 && cp > 0xFFFF) {
+            if (pat->len + 2 > 8) break;
+            cp -= 0x10000;
+            pat->units[pat->len++] = 0xD800 | (cp >> 10);
+            pat->units[pat->len++] = 0xDC00 | (cp & 0x3FF);
+        } else {
+            if (pat->len + 1 > 8) break;
+            pat->units[pat->len++] = cp;
+        }
+    }
+}
+
+// Code unit matching
+static int units_match(const unsigned char* data, int pos, int n, const unit_pattern_t* pat, int enc) {
+    if (pat->len == 0) return 0;
+    if (pos + pat->len > n) return 0;
+
+    for (int k = 0; k < pat->len; k++) {
+        if (load_unit(data, pos + k, enc) != pat->units[k]) return 0;
+    }
+    return 1;
+}
+
+// Line kinds as classify_lines reports them
+enum { LINE_CODE, LINE_COMMENT, LINE_BLANK };
+
+// One classified line, in code units from the end of the BOM
+typedef struct {
+    int start;
+    int end;                  // the newline, or the end of the input
+    int kind;                 // LINE_*
+} line_class_t;
+
+// Classify the lines of a text buffer whose encoding is already known. The
+// input is classified in place in its own code units, so UTF-16/32 files are
+// counted without transcoding them. If lines_out is given it receives every
+// line, and must have room for as many as a plain count reports.
+static inline void classify_lines(const count_kernel_t* kernel, const unsigned char* buffer, int buf_size, int enc,
+                                  int bom_len, const dynamic_lang_t* lang, int* result, line_class_t* lines_out) {
+    result[4] = buf_size; // size
+
+    const unsigned char* data = buffer + bom_len;
+    int n = (buf_size - bom_len) / encoding_unit_size(enc);
 
-    int lc_len = str_len(line_comment);
-    int bs_len = str_len(block_start);
-    int be_len = str_len(block_end);
+    unit_pattern_t lc, bs, be;
+    make_unit_pattern(&lc, lang && lang->line_comment[0] ? lang->line_comment : 0, enc);
+    make_unit_pattern(&bs, lang && lang->block_start[0] ? lang->block_start : 0, enc);
+    make_unit_pattern(&be, lang && lang->block_end[0] ? lang->block_end : 0, enc);
 
     int lines = 1;
     int code = 0;
@@ -154,85 +877,92 @@ static void count_file_buffer(const unsigned char* buffer, int buf_size, const d
     int blanks = 0;
     int i = 0;
     int in_block = 0;
-    int line_start = 1;
-    int is_empty = 1;
-
-    while (i < buf_size) {
-        unsigned char c = buffer[i];
 
-        if (c == '\n') {
-            if (in_block) comments++;
-            else if (is_empty) blanks++;
-            else code++;
-
-            lines++;
-            line_start = 1;
-            is_empty = 1;
-            i++;
-            continue;
-        }
+    for (;;) {
+        int line_start = i;
 
-        if (line_start && (c == ' ' || c == '\t')) {
+        // Skip leading whitespace
+        while (i < n) {
+            unsigned int c = load_unit(data, i, enc);
+            if (c != ' ' && c != '\t') break;
             i++;
-            continue;
         }
 
-        if (line_start) {
-            line_start = 0;
+        int is_empty = 1;
+        int is_comment = 0;
 
-            // Check for block comment end
-            if (in_block && bytes_match(buffer, i, block_end, be_len, buf_size)) {
-                in_block = 0;
-                i += be_len;
-                is_empty = 0;
-                continue;
-            }
+        if (i < n && load_unit(data, i, enc) != '\n') {
+            is_empty = 0;
 
-            if (!in_block) {
-                // Check for line comment
-                if (bytes_match(buffer, i, line_comment, lc_len, buf_size)) {
-                    comments++;
-                    while (i < buf_size && buffer[i] != '\n') i++;
-                    continue;
+            // Only the first significant unit of a line can open or close a comment
+            if (in_block) {
+                if (units_match(data, i, n, &be, enc)) {
+                    in_block = 0;
+                    i += be.len;
                 }
+            } else if (units_match(data, i, n, &lc, enc)) {
+                is_comment = 1;
+            } else if (units_match(data, i, n, &bs, enc)) {
+                in_block = 1;
+                i += bs.len;
 
-                // Check for block comment start
-                if (bytes_match(buffer, i, block_start, bs_len, buf_size)) {
-                    in_block = 1;
-                    i += bs_len;
-
-                    // Check if block comment ends on same line
-                    if (be_len > 0) {
-                        for (int j = i; j <= buf_size - be_len; j++) {
-                            if (buffer[j] == '\n') break;
-                            if (bytes_match(buffer, j, block_end, be_len, buf_size)) {
-                                in_block = 0;
-                                i = j + be_len;
-                                break;
-                            }
+                // Check if block comment ends on same line
+                if (be.len > 0) {
+                    for (int j = i; j <= n - be.len; j++) {
+                        if (load_unit(data, j, enc) == '\n') break;
+                        if (units_match(data, j, n, &be, enc)) {
+                            in_block = 0;
+                            i = j + be.len;
+                            break;
                         }
                     }
-                    is_empty = 0;
-                    continue;
                 }
             }
+
+            i = scan_newline(kernel, data, i, n, enc);
+        }
+
+        int kind = in_block || is_comment ? LINE_COMMENT : is_empty ? LINE_BLANK : LINE_CODE;
+        if (kind == LINE_COMMENT) comments++;
+        else if (kind == LINE_BLANK) blanks++;
+        else code++;
+        if (lines_out) {
+            line_class_t* line = &lines_out[lines - 1];
+            line->start = line_start;
+            line->end = i;
+            line->kind = kind;
         }
 
-        if (c != ' ' && c != '\t') is_empty = 0;
+        if (i >= n) break;
+
+        // Consume the newline
+        lines++;
         i++;
     }
 
-    // Handle final line
-    if (in_block) comments++;
-    else if (is_empty) blanks++;
-    else code++;
-
     result[0] = lines;
     result[1] = code;
     result[2] = comments;
     result[3] = blanks;
 }
 
+static void count_encoded_buffer(const count_kernel_t* kernel, const unsigned char* buffer, int buf_size, int enc,
+                                 int bom_len, const dynamic_lang_t* lang, int* result) {
+    classify_lines(kernel, buffer, buf_size, enc, bom_len, lang, result, 0);
+}
+
+// Process a single file buffer. Binary buffers report zero lines.
+static void count_file_buffer(const count_kernel_t* kernel, const unsigned char* buffer, int buf_size,
+                              const dynamic_lang_t* lang, int* result) {
+    result[0] = result[1] = result[2] = result[3] = result[4] = 0;
+    result[4] = buf_size; // size
+
+    int bom_len;
+    int enc = detect_encoding(buffer, buf_size, &bom_len);
+    if (enc == ENC_BINARY) return;
+    count_encoded_buffer(kernel, buffer, buf_size, enc, bom_len, lang, result);
+}
+
 // Analyze a single file
 void analyze_file(
     const char* file_path,
@@ -240,21 +970,29 @@ void analyze_file(
     int file_size,
     int* result  // Output: [lines, code, comments, blanks, size]
 ) {
+    cloc_ctx_t* ctx = default_ctx();
+    if (!ctx) return;
+    lang_db_t* db = ctx_languages(ctx);
+
     // Detect language
-    const dynamic_lang_t* lang = detect_language(file_path);
+    const dynamic_lang_t* lang = detect_language(db, file_path);
 
     // Count lines in this file
-    count_file_buffer(file_buffer, file_size, lang, result);
+    count_file_buffer(ctx->kernel, file_buffer, file_size, lang, result);
+    lang_db_release(db);
 }
 
 // Get language name for a file
 void get_language_name(const char* file_path, char* lang_name, int max_len) {
-    const dynamic_lang_t* lang = detect_language(file_path);
+    cloc_ctx_t* ctx = default_ctx();
+    lang_db_t* db = ctx ? ctx_languages(ctx) : 0;
+    const dynamic_lang_t* lang = detect_language(db, file_path);
     if (lang) {
         str_copy(lang_name, lang->name, max_len);
     } else {
         str_copy(lang_name, "Unknown", max_len);
     }
+    lang_db_release(db);
 }
 
 // Cleanup function
@@ -301,13 +1039,17 @@ void analyze_batch(
     char* lang_names_out,     // Output: concatenated language names (64 chars each)
     int* results_out          // Output: [lines, code, comments, blanks, size] per file
 ) {
+    cloc_ctx_t* ctx = default_ctx();
+    if (!ctx) return;
+    lang_db_t* db = ctx_languages(ctx);
+
     for (int i = 0; i < num_files; i++) {
         const char* file_path = file_paths[i];
         const unsigned char* buffer = file_buffers[i];
         int file_size = file_sizes[i];
 
         // Get language
-        const dynamic_lang_t* lang = detect_language(file_path);
+        const dynamic_lang_t* lang = detect_language(db, file_path);
 
         // Store language name (64 chars per file)
         char* lang_name_pos = lang_names_out + (i * 64);
@@ -319,8 +1061,9 @@ void analyze_batch(
 
         // Analyze file and store results (5 ints per file)
         int* result_pos = results_out + (i * 5);
-        count_file_buffer(buffer, file_size, lang, result_pos);
+        count_file_buffer(ctx->kernel, buffer, file_size, lang, result_pos);
     }
+    lang_db_release(db);
 }
 
 // Aggregate results by language in C for maximum speed
@@ -388,3 +1131,7253 @@ void aggregate_results(
         stats_out[4] = temp_stats[i].size;
     }
 }
+
+// IGNORE RULES - gitignore semantics, compiled once per directory level
+//
+// Each .gitignore/.clocignore line becomes a rule holding a token program.
+// Plain names and "*.ext" patterns are recognised at compile time and matched
+// with a single compare; everything else runs through the token matcher.
+// Levels are chained from the deepest directory up to the built-in defaults
+// and the last matching rule of the deepest level decides.
+
+enum {
+    TOK_LIT,    // literal byte
+    TOK_ANY,    // ? - any byte except '/'
+    TOK_CLASS,  // [...] - byte class, never '/'
+    TOK_STAR,   // * - any run without '/'
+    TOK_DIRS,   // **/ - zero or more leading directories
+    TOK_ALL     // trailing ** - everything that is left (at least one byte)
+};
+
+enum {
+    RULE_GLOB,
+    RULE_EXACT,   // literal, compared as a whole
+    RULE_SUFFIX   // "*literal" against the basename
+};
+
+typedef struct {
+    unsigned char op;
+    unsigned char arg;  // literal byte or class index
+} glob_tok_t;
+
+typedef struct {
+    int kind;
+    int negate;
+    int dir_only;
+    int anchored;       // matched against the path relative to the ignore file
+    int tok_start;
+    int tok_count;
+    int lit_start;      // literal for RULE_EXACT / RULE_SUFFIX
+    int lit_len;
+} ignore_rule_t;
+
+typedef struct ignore_level {
+    const struct ignore_level* parent;
+    int base_len;       // length of the owning directory's relative path
+    ignore_rule_t* rules;
+    int rule_count;
+    int rule_cap;
+    glob_tok_t* toks;
+    int tok_count;
+    int tok_cap;
+    unsigned char (*classes)[32];
+    int class_count;
+    int class_cap;
+    char* lits;
+    int lit_count;
+    int lit_cap;
+} ignore_level_t;
+
+// Grow a level-owned array; returns 0 when out of memory
+static int grow_array(void** arr, int* cap, int need, int elem_size) {
+    if (need <= *cap) return 1;
+    int cap2 = *cap ? *cap * 2 : 16;
+    while (cap2 < need) cap2 *= 2;
+    void* p = realloc(*arr, (size_t)cap2 * elem_size);
+    if (!p) return 0;
+    *arr = p;
+    *cap = cap2;
+    return 1;
+}
+
+static void ignore_level_free(ignore_level_t* lv) {
+    free(lv->rules);
+    free(lv->toks);
+    free(lv->classes);
+    free(lv->lits);
+}
+
+static int push_tok(ignore_level_t* lv, int op, int arg) {
+    if (!grow_array((void**)&lv->toks, &lv->tok_cap, lv->tok_count + 1, sizeof(glob_tok_t))) return 0;
+    lv->toks[lv->tok_count].op = (unsigned char)op;
+    lv->toks[lv->tok_count].arg = (unsigned char)arg;
+    lv->tok_count++;
+    return 1;
+}
+
+// Parse a [...] class starting at pat[i] == '['. Returns the index just past
+// the closing bracket, or -1 if the class is unterminated.
+static int compile_class(ignore_level_t* lv, const char* pat, int i, int len) {
+    int j = i + 1;
+    int negate = 0;
+    if (j < len && (pat[j] == '!' || pat[j] == '^')) {
+        negate = 1;
+        j++;
+    }
+
+    unsigned char bits[32];
+    memset(bits, 0, sizeof(bits));
+    int first = 1;
+    while (j < len && (pat[j] != ']' || first)) {
+        unsigned char lo = (unsigned char)pat[j];
+        if (lo == '\\' && j + 1 < len) lo = (unsigned char)pat[++j];
+        unsigned char hi = lo;
+        if (j + 2 < len && pat[j + 1] == '-' && pat[j + 2] != ']') {
+            hi = (unsigned char)pat[j + 2];
+            j += 2;
+        }
+        for (int c = lo; c <= hi; c++) bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+        first = 0;
+        j++;
+    }
+    if (j >= len) return -1;
+
+    if (negate) {
+        for (int k = 0; k < 32; k++) bits[k] = (unsigned char)~bits[k];
+    }
+    bits['/' >> 3] &= (unsigned char)~(1 << ('/' & 7));
+
+    if (lv->class_count >= 256) return -1;
+    if (!grow_array((void**)&lv->classes, &lv->class_cap, lv->class_count + 1, 32)) return -1;
+    memcpy(lv->classes[lv->class_count], bits, 32);
+    if (!push_tok(lv, TOK_CLASS, lv->class_count)) return -1;
+    lv->class_count++;
+    return j + 1;
+}
+
+// Compile one ignore-file line into a rule of the level
+static void compile_ignore_rule(ignore_level_t* lv, const char* line, int len) {
+    // Trailing CR and unescaped trailing spaces are not part of the pattern
+    while (len > 0 && line[len - 1] == '\r') len--;
+    while (len > 0 && line[len - 1] == ' ' && !(len > 1 && line[len - 2] == '\\')) len--;
+    if (len == 0 || line[0] == '#') return;
+
+    ignore_rule_t rule;
+    memset(&rule, 0, sizeof(rule));
+
+    if (line[0] == '!') {
+        rule.negate = 1;
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        rule.dir_only = 1;
+        len--;
+    }
+    for (int i = 0; i < len; i++) {
+        if (line[i] == '/') rule.anchored = 1;
+    }
+    if (len > 0 && line[0] == '/') {
+        line++;
+        len--;
+    }
+    if (len == 0) return;
+
+    int tok_mark = lv->tok_count;
+    int class_mark = lv->class_count;
+    int wild = 0;
+    int escaped = 0;
+    rule.tok_start = lv->tok_count;
+
+    for (int i = 0; i < len;) {
+        char c = line[i];
+        int seg_start = i == 0 || line[i - 1] == '/';
+        int ok = 1;
+        if (c == '\\' && i + 1 < len) {
+            ok = push_tok(lv, TOK_LIT, (unsigned char)line[i + 1]);
+            escaped = 1;
+            i += 2;
+        } else if (c == '*' && i + 1 < len && line[i + 1] == '*' && seg_start && (i + 2 == len || line[i + 2] == '/')) {
+            wild = 1;
+            if (i + 2 == len) {
+                ok = push_tok(lv, TOK_ALL, 0);
+                i += 2;
+            } else {
+                ok = push_tok(lv, TOK_DIRS, 0);
+                i += 3;
+            }
+        } else if (c == '*') {
+            wild = 1;
+            ok = push_tok(lv, TOK_STAR, 0);
+            while (i < len && line[i] == '*') i++;
+        } else if (c == '?') {
+            wild = 1;
+            ok = push_tok(lv, TOK_ANY, 0);
+            i++;
+        } else if (c == '[') {
+            int next = compile_class(lv, line, i, len);
+            if (next < 0) {
+                ok = push_tok(lv, TOK_LIT, '[');
+                i++;
+            } else {
+                wild = 1;
+                i = next;
+            }
+        } else {
+            ok = push_tok(lv, TOK_LIT, (unsigned char)c);
+            i++;
+        }
+        if (!ok) {
+            lv->tok_count = tok_mark;
+            lv->class_count = class_mark;
+            return;
+        }
+    }
+    rule.tok_count = lv->tok_count - rule.tok_start;
+
+    // Fast paths: a literal, or "*literal" on the basename
+    const glob_tok_t* t = lv->toks + rule.tok_start;
+    int lit_from = -1;
+    if (!wild) {
+        rule.kind = RULE_EXACT;
+        lit_from = 0;
+    } else if (!rule.anchored && !escaped && t[0].op == TOK_STAR) {
+        int plain = rule.tok_count > 1;
+        for (int k = 1; k < rule.tok_count; k++) {
+            if (t[k].op != TOK_LIT) plain = 0;
+        }
+        if (plain) {
+            rule.kind = RULE_SUFFIX;
+            lit_from = 1;
+        }
+    }
+    if (lit_from >= 0) {
+        rule.lit_len = rule.tok_count - lit_from;
+        if (!grow_array((void**)&lv->lits, &lv->lit_cap, lv->lit_count + rule.lit_len, 1)) {
+            lv->tok_count = tok_mark;
+            lv->class_count = class_mark;
+            return;
+        }
+        rule.lit_start = lv->lit_count;
+        for (int k = lit_from; k < rule.tok_count; k++) lv->lits[lv->lit_count++] = (char)t[k].arg;
+    }
+
+    if (!grow_array((void**)&lv->rules, &lv->rule_cap, lv->rule_count + 1, sizeof(ignore_rule_t))) {
+        lv->tok_count = tok_mark;
+        lv->class_count = class_mark;
+        return;
+    }
+    lv->rules[lv->rule_count++] = rule;
+}
+
+static void compile_ignore_text(ignore_level_t* lv, const char* text, int len) {
+    int start = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i == len || text[i] == '\n') {
+            compile_ignore_rule(lv, text + start, i - start);
+            start = i + 1;
+        }
+    }
+}
+
+// Built-in defaults, the level below every ignore file so they can be negated
+static void compile_default_ignores(ignore_level_t* lv) {
+    static const char defaults[] = ".git/\nnode_modules/\n";
+    compile_ignore_text(lv, defaults, (int)sizeof(defaults) - 1);
+}
+
+static int glob_match(const ignore_level_t* lv, const glob_tok_t* t, int tn, const char* s, int sn) {
+    int ti = 0;
+    int si = 0;
+    while (ti < tn) {
+        unsigned char c = si < sn ? (unsigned char)s[si] : 0;
+        switch (t[ti].op) {
+        case TOK_LIT:
+            if (si >= sn || c != t[ti].arg) return 0;
+            break;
+        case TOK_ANY:
+            if (si >= sn || c == '/') return 0;
+            break;
+        case TOK_CLASS:
+            if (si >= sn || !(lv->classes[t[ti].arg][c >> 3] & (1 << (c & 7)))) return 0;
+            break;
+        case TOK_STAR:
+            for (;;) {
+                if (glob_match(lv, t + ti + 1, tn - ti - 1, s + si, sn - si)) return 1;
+                if (si >= sn || s[si] == '/') return 0;
+                si++;
+            }
+        case TOK_DIRS:
+            for (;;) {
+                if (glob_match(lv, t + ti + 1, tn - ti - 1, s + si, sn - si)) return 1;
+                while (si < sn && s[si] != '/') si++;
+                if (si >= sn) return 0;
+                si++;
+            }
+        case TOK_ALL:
+            return si < sn;
+        }
+        ti++;
+        si++;
+    }
+    return si == sn;
+}
+
+static int rule_matches(const ignore_level_t* lv, const ignore_rule_t* rule,
+                        const char* path, int path_len, const char* name, int name_len) {
+    const char* s = rule->anchored ? path : name;
+    int sn = rule->anchored ? path_len : name_len;
+    const char* lit = lv->lits + rule->lit_start;
+
+    switch (rule->kind) {
+    case RULE_EXACT:
+        return sn == rule->lit_len && memcmp(s, lit, sn) == 0;
+    case RULE_SUFFIX:
+        return sn >= rule->lit_len && memcmp(s + sn - rule->lit_len, lit, rule->lit_len) == 0;
+    default:
+        return glob_match(lv, lv->toks + rule->tok_start, rule->tok_count, s, sn);
+    }
+}
+
+// Decide whether an entry is ignored. rel is the entry's path relative to the
+// walk root, name its final component.
+static int ignore_check(const ignore_level_t* lv, const char* rel, int rel_len,
+                        const char* name, int name_len, int is_dir) {
+    for (; lv; lv = lv->parent) {
+        const char* path = rel;
+        int path_len = rel_len;
+        if (lv->base_len > 0) {
+            path += lv->base_len + 1;
+            path_len -= lv->base_len + 1;
+        }
+        for (int r = lv->rule_count - 1; r >= 0; r--) {
+            const ignore_rule_t* rule = &lv->rules[r];
+            if (rule->dir_only && !is_dir) continue;
+            if (rule_matches(lv, rule, path, path_len, name, name_len)) return !rule->negate;
+        }
+    }
+    return 0;
+}
+
+// PHASE ACCOUNTING - where each engine thread spends its time
+//
+// A thread is always in exactly one phase. Every transition charges the
+// monotonic time since the previous one to the phase being left, so the
+// phases add up to the thread's wall time. Items and bytes are counted as
+// work enters a phase, which gives per-phase throughput directly.
+
+enum {
+    PHASE_WALK,               // readdir, stat, ignore rules, dedup
+    PHASE_READ,               // open/read/close, io_uring submission and reaping
+    PHASE_SNIFF,              // BOM and binary detection
+    PHASE_DETECT,             // language detection
+    PHASE_COUNT,              // line classification
+    PHASE_AGGREGATE,          // per-language totals and the final result copy
+    PHASES
+};
+
+// Per-thread breakdown, layout shared with clocEngine.ts, all fields 64-bit
+typedef struct {
+    long long tid;
+    long long node;           // NUMA node the thread is pinned to, -1 if it isn't
+    long long wall_ns;
+    long long ns[PHASES];
+    long long items[PHASES];  // entries, files read/sniffed/counted, lookups
+    long long bytes[PHASES];
+} thread_stats_t;
+
+#define THREAD_STAT_FIELDS (3 + 3 * PHASES)
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long current_tid(void) {
+#ifdef __linux__
+    return (long long)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+// HARDWARE COUNTERS - optional perf_event_open instrumentation per phase
+//
+// When the caller asks for it, one counter group is opened for the calling
+// thread, and one for each pool worker, and read at every phase transition;
+// the delta since the previous read is charged to the phase being left, and
+// the workers' counts are added to the walk's when they finish. A transition costs one read()
+// syscall, so the layer is off unless requested. Counters the CPU, the
+// hypervisor or perf_event_paranoid don't allow are reported as unavailable,
+// and kernel time is dropped (user_only) when only user space may be
+// counted. Multiplexed counters are scaled by time enabled / time running.
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_EVENTS
+};
+
+// Result layout shared with clocEngine.ts, all fields 64-bit
+typedef struct {
+    long long available;      // bit per PERF_* event that could be opened
+    long long user_only;      // 1 if kernel-mode work is excluded
+    long long counters[PHASES][PERF_EVENTS];
+} perf_stats_t;
+
+// Add a pool worker's counts to the walk's. An event stays available only if
+// every thread could count it, so a total never silently misses a thread.
+static void perf_merge(perf_stats_t* to, const perf_stats_t* from) {
+    to->available &= from->available;
+    to->user_only |= from->user_only;
+    for (int p = 0; p < PHASES; p++) {
+        for (int i = 0; i < PERF_EVENTS; i++) to->counters[p][i] += from->counters[p][i];
+    }
+}
+
+#if defined(__linux__) && !defined(__TINYC__) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#define CLOC_HAVE_PERF 1
+#endif
+#endif
+
+#ifdef CLOC_HAVE_PERF
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+typedef struct perf_counters {
+    int group_fd;
+    int fds[PERF_EVENTS];
+    int slot[PERF_EVENTS];    // position in the group read, -1 if unavailable
+    int nr;
+    unsigned long long last[3 + PERF_EVENTS]; // nr, time enabled, time running, values
+    perf_stats_t* out;
+} perf_counters_t;
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} g_perf_events[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int perf_open_event(int event, int group_fd, int user_only) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = g_perf_events[event].type;
+    attr.config = g_perf_events[event].config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static int perf_read(perf_counters_t* pc, unsigned long long* values) {
+    ssize_t want = (ssize_t)((3 + pc->nr) * sizeof(unsigned long long));
+    return read(pc->group_fd, values, want) == want ? 0 : -1;
+}
+
+static void perf_close(perf_counters_t* pc) {
+    if (!pc) return;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (pc->fds[i] >= 0) close(pc->fds[i]);
+    }
+    free(pc);
+}
+
+// Open the counters for the calling thread. Returns 0 if no counter at all
+// could be opened.
+static perf_counters_t* perf_open(perf_stats_t* out) {
+    perf_counters_t* pc = calloc(1, sizeof(perf_counters_t));
+    if (!pc) return 0;
+    memset(out, 0, sizeof(*out));
+    pc->out = out;
+    pc->group_fd = -1;
+
+    // Try with kernel work included first; paranoid >= 2 only allows user space
+    for (int user_only = 0; user_only < 2 && pc->nr == 0; user_only++) {
+        for (int i = 0; i < PERF_EVENTS; i++) {
+            pc->fds[i] = perf_open_event(i, pc->group_fd, user_only);
+            pc->slot[i] = pc->fds[i] >= 0 ? pc->nr++ : -1;
+            if (pc->fds[i] >= 0 && pc->group_fd < 0) pc->group_fd = pc->fds[i];
+        }
+        if (pc->nr == 0) continue;
+        out->user_only = user_only;
+    }
+    if (pc->nr == 0) {
+        free(pc);
+        return 0;
+    }
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (pc->slot[i] >= 0) out->available |= 1LL << i;
+    }
+
+    ioctl(pc->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    if (perf_read(pc, pc->last) != 0) {
+        perf_close(pc);
+        return 0;
+    }
+    return pc;
+}
+
+// Charge everything counted since the last call to `phase`
+static void perf_charge(perf_counters_t* pc, int phase) {
+    unsigned long long now[3 + PERF_EVENTS];
+    if (perf_read(pc, now) == 0) {
+        unsigned long long enabled = now[1] - pc->last[1];
+        unsigned long long running = now[2] - pc->last[2];
+        for (int i = 0; i < PERF_EVENTS; i++) {
+            if (pc->slot[i] < 0) continue;
+            unsigned long long delta = now[3 + pc->slot[i]] - pc->last[3 + pc->slot[i]];
+            if (running && running < enabled) delta = (unsigned long long)((double)delta * enabled / running);
+            pc->out->counters[phase][i] += (long long)delta;
+        }
+        memcpy(pc->last, now, sizeof(now));
+    }
+}
+
+// Drop everything counted since the last call, charging it to no phase
+static void perf_skip(perf_counters_t* pc) {
+    perf_read(pc, pc->last);
+}
+
+#else
+
+typedef struct perf_counters perf_counters_t;
+
+static perf_counters_t* perf_open(perf_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    return 0;
+}
+
+static void perf_close(perf_counters_t* pc) {
+    (void)pc;
+}
+
+static void perf_charge(perf_counters_t* pc, int phase) {
+    (void)pc;
+    (void)phase;
+}
+
+static void perf_skip(perf_counters_t* pc) {
+    (void)pc;
+}
+
+#endif
+
+// NATIVE DIRECTORY WALKER - traversal, ignore rules, reading and counting in one pass
+
+// Walk flags
+#define WALK_NO_IGNORE_FILES 1  // don't read .gitignore / .clocignore
+#define WALK_HIDDEN 2           // enter dot-files and dot-directories
+#define WALK_NO_FOLLOW 4        // skip symlinks instead of following them
+#define WALK_SYNC_IO 8          // read with blocking syscalls even if io_uring works
+#define WALK_CACHED 16          // reuse the context's per-file results where still valid
+#define WALK_BY_DIR 32          // also roll the counts up per directory (jobs only)
+#define WALK_FILE_RECORDS 64    // keep every counted file's counts (result files only)
+#define WALK_ARCHIVES 128       // count inside .tar, .tar.gz, .tgz and .zip files (see ARCHIVES)
+
+// Walk counters reported next to the per-language results
+enum {
+    WALK_DIRS,
+    WALK_DIRS_IGNORED,
+    WALK_FILES,
+    WALK_FILES_IGNORED,
+    WALK_FILES_UNKNOWN,
+    WALK_FILES_BINARY,
+    WALK_FILES_UNREADABLE,
+    WALK_FILES_DUPLICATE,     // hardlinks / symlinks to a file already counted
+    WALK_BYTES_DUPLICATE,     // bytes not re-read because of the above
+    WALK_DIRS_DUPLICATE,      // directories reached again through a symlink
+    WALK_LINKS_SKIPPED,       // symlinks skipped under WALK_NO_FOLLOW
+    WALK_ASYNC_IO,            // 1 if files were read through io_uring
+    WALK_THREADS,             // entries written to the thread stats output
+    WALK_CANCELLED,           // 1 if the walk stopped early; totals are partial
+    WALK_FILES_CACHED,        // files counted from the result cache without reading
+    WALK_NUMA_NODES,          // NUMA nodes the counting pool was spread over
+    WALK_STEALS_LOCAL,        // batches a pool worker took from another on its node
+    WALK_STEALS_REMOTE,       // batches a pool worker took from another node
+    WALK_ARCHIVES_READ,       // archives whose members were counted
+    WALK_STAT_FIELDS
+};
+
+// Open-addressing set of (dev, inode) pairs so every physical file and
+// directory is visited at most once. Inode 0 is never valid and marks empty
+// slots.
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+} inode_key_t;
+
+typedef struct {
+    inode_key_t* slots;
+    size_t cap;               // power of two
+    size_t count;
+} inode_set_t;
+
+static size_t inode_hash(unsigned long long dev, unsigned long long ino) {
+    unsigned long long h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+// Returns 1 if the pair was added, 0 if it was already present, -1 on OOM
+static int inode_set_insert(inode_set_t* set, unsigned long long dev, unsigned long long ino) {
+    if (ino == 0) return 1;
+
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 1024;
+        inode_key_t* slots = calloc(cap, sizeof(inode_key_t));
+        if (!slots) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->slots[i].ino) continue;
+            size_t j = inode_hash(set->slots[i].dev, set->slots[i].ino) & (cap - 1);
+            while (slots[j].ino) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+
+    size_t j = inode_hash(dev, ino) & (set->cap - 1);
+    while (set->slots[j].ino) {
+        if (set->slots[j].ino == ino && set->slots[j].dev == dev) return 0;
+        j = (j + 1) & (set->cap - 1);
+    }
+    set->slots[j].dev = dev;
+    set->slots[j].ino = ino;
+    set->count++;
+    return 1;
+}
+
+// FILE RESULT CACHE - per-file counts kept warm between walks
+//
+// A context can remember the counts of every file it has read, keyed by
+// (dev, inode) and revalidated against the file's size, mtime and ctime,
+// so WALK_CACHED walks only read and count files that changed since an
+// earlier one; a warm rescan costs a stat per file. Entries hold language
+// indices, so they belong to one language database generation and the
+// cache empties itself when a walk brings another. One walk uses the cache
+// at a time; a walk that finds it busy runs uncached.
+//
+// Entries carry no path, so a file that is deleted can't be looked up and
+// dropped. Instead every entry records the last walk that found it, and
+// every FILE_CACHE_SWEEP_WALKS walks the entries no walk found in that long
+// are evicted: deleted and replaced files, and subtrees nobody asks about.
+
+#define FILE_CACHE_MAX_ENTRIES (4 << 20)
+#define FILE_CACHE_SWEEP_WALKS 64
+
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime_ns;
+    long long ctime_ns;
+} file_key_t;
+
+typedef struct {
+    file_key_t key;           // ino 0 marks an empty slot
+    int lang;                 // index into the database's langs
+    int binary;
+    int counts[4];            // lines, code, comments, blanks
+    long long seen;           // the last walk that stored or found the entry
+} file_cache_entry_t;
+
+typedef struct file_cache {
+    pthread_mutex_t lock;     // held by the walk using the cache
+    long long refs;           // guarded by g_db_lock
+    long long generation;     // database generation of the entries
+    long long walks;          // WALK_CACHED walks that used the cache
+    file_cache_entry_t* slots;
+    size_t cap;               // power of two
+    size_t count;
+} file_cache_t;
+
+static void file_key_from_stat(file_key_t* key, const struct stat* st) {
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime_ns = (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    key->ctime_ns = (long long)st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+// The context's cache, created on first use and referenced until released
+static file_cache_t* ctx_cache(cloc_ctx_t* ctx) {
+    pthread_mutex_lock(&g_db_lock);
+    if (!ctx->cache && (ctx->cache = calloc(1, sizeof(file_cache_t)))) {
+        pthread_mutex_init(&ctx->cache->lock, 0);
+        ctx->cache->refs = 1;
+    }
+    file_cache_t* cache = ctx->cache;
+    if (cache) cache->refs++;
+    pthread_mutex_unlock(&g_db_lock);
+    return cache;
+}
+
+static void file_cache_release(file_cache_t* cache) {
+    if (!cache) return;
+    pthread_mutex_lock(&g_db_lock);
+    int last = --cache->refs == 0;
+    pthread_mutex_unlock(&g_db_lock);
+    if (last) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->slots);
+        free(cache);
+    }
+}
+
+static void file_cache_clear(file_cache_t* cache) {
+    free(cache->slots);
+    cache->slots = 0;
+    cache->cap = 0;
+    cache->count = 0;
+}
+
+// The entry for a file if it is unchanged since it was stored under the
+// same language, or 0. A hit counts as the current walk finding it.
+static const file_cache_entry_t* file_cache_lookup(file_cache_t* cache, const file_key_t* key, int lang) {
+    if (!cache->cap) return 0;
+    size_t j = inode_hash(key->dev, key->ino) & (cache->cap - 1);
+    for (; cache->slots[j].key.ino; j = (j + 1) & (cache->cap - 1)) {
+        file_cache_entry_t* e = &cache->slots[j];
+        if (e->key.ino != key->ino || e->key.dev != key->dev) continue;
+        if (e->lang != lang || e->key.size != key->size || e->key.mtime_ns != key->mtime_ns ||
+            e->key.ctime_ns != key->ctime_ns)
+            return 0;
+        e->seen = cache->walks;
+        return e;
+    }
+    return 0;
+}
+
+// Remember (or replace) a file's counts; result is 0 for binary files
+static void file_cache_store(file_cache_t* cache, const file_key_t* key, int lang, const int* result) {
+    if (key->ino == 0) return;
+    if (cache->count >= FILE_CACHE_MAX_ENTRIES) file_cache_clear(cache);
+
+    if ((cache->count + 1) * 2 > cache->cap) {
+        size_t cap = cache->cap ? cache->cap * 2 : 1024;
+        file_cache_entry_t* slots = calloc(cap, sizeof(file_cache_entry_t));
+        if (!slots) return;
+        for (size_t i = 0; i < cache->cap; i++) {
+            if (!cache->slots[i].key.ino) continue;
+            size_t j = inode_hash(cache->slots[i].key.dev, cache->slots[i].key.ino) & (cap - 1);
+            while (slots[j].key.ino) j = (j + 1) & (cap - 1);
+            slots[j] = cache->slots[i];
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->cap = cap;
+    }
+
+    size_t j = inode_hash(key->dev, key->ino) & (cache->cap - 1);
+    while (cache->slots[j].key.ino &&
+           (cache->slots[j].key.ino != key->ino || cache->slots[j].key.dev != key->dev))
+        j = (j + 1) & (cache->cap - 1);
+    file_cache_entry_t* e = &cache->slots[j];
+    if (!e->key.ino) cache->count++;
+    e->key = *key;
+    e->lang = lang;
+    e->binary = result == 0;
+    for (int i = 0; i < 4; i++) e->counts[i] = result ? result[i] : 0;
+    e->seen = cache->walks;
+}
+
+// Evict the entries no walk has found in FILE_CACHE_SWEEP_WALKS walks,
+// rehashing the rest into a table sized for them. Out of memory, nothing
+// is evicted.
+static void file_cache_sweep(file_cache_t* cache) {
+    size_t kept = 0;
+    for (size_t i = 0; i < cache->cap; i++) {
+        const file_cache_entry_t* e = &cache->slots[i];
+        if (e->key.ino && cache->walks - e->seen < FILE_CACHE_SWEEP_WALKS) kept++;
+    }
+    if (kept == cache->count) return;
+
+    size_t cap = cache->cap;
+    while (cap > 1024 && kept * 8 < cap) cap /= 2;
+    file_cache_entry_t* slots = calloc(cap, sizeof(file_cache_entry_t));
+    if (!slots) return;
+    for (size_t i = 0; i < cache->cap; i++) {
+        const file_cache_entry_t* e = &cache->slots[i];
+        if (!e->key.ino || cache->walks - e->seen >= FILE_CACHE_SWEEP_WALKS) continue;
+        size_t j = inode_hash(e->key.dev, e->key.ino) & (cap - 1);
+        while (slots[j].key.ino) j = (j + 1) & (cap - 1);
+        slots[j] = *e;
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->cap = cap;
+    cache->count = kept;
+}
+
+// Per-language totals, 64-bit so monorepo-sized trees don't overflow
+typedef struct {
+    long long files;
+    long long lines;
+    long long code;
+    long long comments;
+    long long blanks;
+    long long size;
+} lang_totals_t;
+
+#define LANG_STAT_FIELDS 6
+
+// DIRECTORY ROLLUPS - per-directory, per-language subtotals
+//
+// A WALK_BY_DIR walk also builds a tree of the directories it enters, and
+// adds each file's counts to its directory's entry for the file's language.
+// Nodes, paths and entries come from one arena and are freed together.
+// Once the walk is done the tree is rolled up, children into parents, so
+// every directory holds its whole subtree's totals. A hash on the
+// root-relative path then answers any directory's subtotals with a single
+// lookup, and a report by directory reads the nodes as they are.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t used;
+    size_t cap;               // payload bytes following the header
+} arena_block_t;
+
+typedef struct {
+    arena_block_t* head;      // the block being carved up
+} arena_t;
+
+static void* arena_alloc(arena_t* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_block_t* b = arena->head;
+    if (!b || b->cap - b->used < size) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(arena_block_t) + cap);
+        if (!b) return 0;
+        b->next = arena->head;
+        b->used = 0;
+        b->cap = cap;
+        arena->head = b;
+    }
+    void* p = (char*)(b + 1) + b->used;
+    b->used += size;
+    return p;
+}
+
+static void arena_free(arena_t* arena) {
+    while (arena->head) {
+        arena_block_t* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+static size_t path_hash(const char* s, size_t len) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    return (size_t)h;
+}
+
+static void lang_totals_add(lang_totals_t* dst, const lang_totals_t* src) {
+    dst->files += src->files;
+    dst->lines += src->lines;
+    dst->code += src->code;
+    dst->comments += src->comments;
+    dst->blanks += src->blanks;
+    dst->size += src->size;
+}
+
+typedef struct dir_lang {
+    struct dir_lang* next;
+    int lang;                 // index into the database's langs
+    lang_totals_t own;        // files directly in the directory
+    lang_totals_t t;          // the whole subtree, set by the rollup
+} dir_lang_t;
+
+typedef struct dir_node {
+    struct dir_node* parent;
+    struct dir_node* older;   // previously created node
+    dir_lang_t* langs;        // languages in the directory or, once rolled up, below it
+    lang_totals_t total;      // every language, set by the rollup
+    int depth;                // 0 for the root
+    int path_len;
+    char path[];              // root-relative, "" for the root
+} dir_node_t;
+
+typedef struct dir_tree {
+    lang_db_t* db;            // referenced, for the language names
+    char* root;               // the walked root, as normalized by walker_set_root
+    arena_t arena;
+    dir_node_t* newest;       // creation list; parents are always older than their children
+    dir_node_t** index;       // open addressing on the path
+    size_t cap;               // power of two
+    size_t count;
+} dir_tree_t;
+
+static dir_tree_t* dir_tree_create(lang_db_t* db) {
+    dir_tree_t* tree = calloc(1, sizeof(dir_tree_t));
+    if (!tree) return 0;
+    pthread_mutex_lock(&g_db_lock);
+    lang_db_retain_locked(db);
+    pthread_mutex_unlock(&g_db_lock);
+    tree->db = db;
+    return tree;
+}
+
+void cloc_dir_tree_free(void* handle) {
+    dir_tree_t* tree = handle;
+    if (!tree) return;
+    lang_db_release(tree->db);
+    free(tree->root);
+    arena_free(&tree->arena);
+    free(tree->index);
+    free(tree);
+}
+
+static int dir_tree_index(dir_tree_t* tree, dir_node_t* node) {
+    if ((tree->count + 1) * 2 > tree->cap) {
+        size_t cap = tree->cap ? tree->cap * 2 : 256;
+        dir_node_t** index = calloc(cap, sizeof(dir_node_t*));
+        if (!index) return 0;
+        for (size_t i = 0; i < tree->cap; i++) {
+            if (!tree->index[i]) continue;
+            size_t j = path_hash(tree->index[i]->path, tree->index[i]->path_len) & (cap - 1);
+            while (index[j]) j = (j + 1) & (cap - 1);
+            index[j] = tree->index[i];
+        }
+        free(tree->index);
+        tree->index = index;
+        tree->cap = cap;
+    }
+
+    size_t j = path_hash(node->path, node->path_len) & (tree->cap - 1);
+    while (tree->index[j]) j = (j + 1) & (tree->cap - 1);
+    tree->index[j] = node;
+    tree->count++;
+    return 1;
+}
+
+static const dir_node_t* dir_tree_find(const dir_tree_t* tree, const char* path, int len) {
+    if (!tree->cap) return 0;
+    size_t mask = tree->cap - 1;
+    for (size_t j = path_hash(path, len) & mask; tree->index[j]; j = (j + 1) & mask) {
+        const dir_node_t* node = tree->index[j];
+        if (node->path_len == len && memcmp(node->path, path, len) == 0) return node;
+    }
+    return 0;
+}
+
+// The node for the directory at the root-relative path rel[0..len), or 0
+// when out of memory
+static dir_node_t* dir_tree_enter(dir_tree_t* tree, dir_node_t* parent, const char* rel, int len) {
+    dir_node_t* node = arena_alloc(&tree->arena, sizeof(dir_node_t) + len + 1);
+    if (!node) return 0;
+    memset(node, 0, sizeof(dir_node_t));
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 0;
+    node->path_len = len;
+    memcpy(node->path, rel, len);
+    node->path[len] = '\0';
+    if (!dir_tree_index(tree, node)) return 0;
+    node->older = tree->newest;
+    tree->newest = node;
+    return node;
+}
+
+static dir_lang_t* dir_node_lang(dir_tree_t* tree, dir_node_t* node, int lang) {
+    for (dir_lang_t* e = node->langs; e; e = e->next) {
+        if (e->lang == lang) return e;
+    }
+    dir_lang_t* e = arena_alloc(&tree->arena, sizeof(dir_lang_t));
+    if (!e) return 0;
+    memset(e, 0, sizeof(dir_lang_t));
+    e->lang = lang;
+    e->next = node->langs;
+    node->langs = e;
+    return e;
+}
+
+static void dir_tree_add_file(dir_tree_t* tree, dir_node_t* node, int lang, const int* counts, long long size) {
+    dir_lang_t* e = dir_node_lang(tree, node, lang);
+    if (!e) return;
+    e->own.files++;
+    e->own.lines += counts[0];
+    e->own.code += counts[1];
+    e->own.comments += counts[2];
+    e->own.blanks += counts[3];
+    e->own.size += size;
+}
+
+// Newest first visits every child before its parent, so one pass folds
+// each directory's finished subtree totals into the one above
+static void dir_tree_rollup(dir_tree_t* tree) {
+    for (dir_node_t* node = tree->newest; node; node = node->older) {
+        for (dir_lang_t* e = node->langs; e; e = e->next) {
+            lang_totals_add(&e->t, &e->own);
+            lang_totals_add(&node->total, &e->t);
+            dir_lang_t* up = node->parent ? dir_node_lang(tree, node->parent, e->lang) : 0;
+            if (up) lang_totals_add(&up->t, &e->t);
+        }
+    }
+}
+
+// Skip "./" and slashes around a root-relative path; returns the length left
+static int rel_path_trim(const char** path) {
+    const char* p = *path;
+    while (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) p += p[1] ? 2 : 1;
+    while (p[0] == '/') p++;
+    int len = (int)strlen(p);
+    while (len > 0 && p[len - 1] == '/') len--;
+    *path = p;
+    return len;
+}
+
+static void write_totals(long long* out, const lang_totals_t* t) {
+    out[0] = t->files;
+    out[1] = t->lines;
+    out[2] = t->code;
+    out[3] = t->comments;
+    out[4] = t->blanks;
+    out[5] = t->size;
+}
+
+// How many directories lie at most max_depth below the root (depth 0),
+// and the bytes their NUL-terminated paths take
+int cloc_dir_tree_count(void* handle, int max_depth, long long* path_bytes_out) {
+    const dir_tree_t* tree = handle;
+    int count = 0;
+    long long bytes = 0;
+    for (const dir_node_t* node = tree->newest; node; node = node->older) {
+        if (node->depth > max_depth) continue;
+        count++;
+        bytes += node->path_len + 1;
+    }
+    *path_bytes_out = bytes;
+    return count;
+}
+
+// Subtree totals of the directories at most max_depth below the root,
+// latest walked first: NUL-terminated root-relative paths back to back in
+// paths_out and LANG_STAT_FIELDS per directory in stats_out. Returns the
+// number of directories written.
+int cloc_dir_tree_list(void* handle, int max_depth, char* paths_out, int paths_cap, long long* stats_out,
+                       int max_dirs) {
+    const dir_tree_t* tree = handle;
+    int count = 0;
+    int used = 0;
+    for (const dir_node_t* node = tree->newest; node && count < max_dirs; node = node->older) {
+        if (node->depth > max_depth) continue;
+        if (used + node->path_len + 1 > paths_cap) break;
+        memcpy(paths_out + used, node->path, node->path_len + 1);
+        used += node->path_len + 1;
+        write_totals(stats_out + count * LANG_STAT_FIELDS, &node->total);
+        count++;
+    }
+    return count;
+}
+
+// Per-language totals of the subtree at a root-relative path ("" or "."
+// for the root) in the analyze_directory layout. Returns the number of
+// languages written, or -1 if the walk did not enter that directory.
+int cloc_dir_tree_query(void* handle, const char* path, char* lang_names_out, long long* lang_stats_out,
+                        int max_langs) {
+    const dir_tree_t* tree = handle;
+    int len = rel_path_trim(&path);
+    const dir_node_t* node = dir_tree_find(tree, path, len);
+    if (!node) return -1;
+    int count = 0;
+    for (const dir_lang_t* e = node->langs; e && count < max_langs; e = e->next) {
+        str_copy(lang_names_out + count * 64, tree->db->langs[e->lang].name, 64);
+        write_totals(lang_stats_out + count * LANG_STAT_FIELDS, &e->t);
+        count++;
+    }
+    return count;
+}
+
+// PERSISTED INDEX - prefix queries over a saved rollup, without a rescan
+//
+// cloc_dir_tree_save writes a rollup as a flat file that cloc_index_open
+// maps back in without parsing. Rows are the walked directories sorted
+// with '/' below every other byte, so each directory's subtree is the run
+// of rows from its own to its `end`. Every language has a posting list of
+// the rows holding its files, each carrying the running totals up to and
+// including that row. A directory's totals for a language are then two
+// binary searches in that list and a subtraction, whatever the subtree's
+// size. The file is read on the machine (and engine build) that wrote it;
+// the header rejects anything else.
+
+#include <sys/mman.h>
+
+#define INDEX_MAGIC "CLOCIDX"
+#define INDEX_VERSION 1
+
+typedef struct {
+    char magic[8];
+    long long version;
+    long long header_size;    // sizeof(index_header_t), a layout check
+    long long file_size;
+    long long root_off;       // NUL-terminated walked root
+    long long lang_count;
+    long long langs_off;      // 64-byte names
+    long long postings_off;   // index_posting_t per language
+    long long dir_count;
+    long long dirs_off;       // index_dir_t per row, in row order
+    long long entry_count;
+    long long entries_off;    // index_entry_t, grouped by language
+} index_header_t;
+
+typedef struct {
+    long long path_off;       // NUL-terminated root-relative path
+    long long path_len;
+    long long end;            // one past the subtree's last row
+} index_dir_t;
+
+typedef struct {
+    long long first;          // the language's first entry
+    long long count;
+} index_posting_t;
+
+typedef struct {
+    long long row;
+    long long totals[LANG_STAT_FIELDS]; // the language over rows <= row
+} index_entry_t;
+
+typedef struct {
+    const unsigned char* map;
+    size_t size;
+    const index_header_t* header;
+    const char (*langs)[64];
+    const index_posting_t* postings;
+    const index_dir_t* dirs;
+    const index_entry_t* entries;
+} cloc_index_t;
+
+// Path order with '/' below every other byte, so a directory's subtree
+// sorts into one run right after it
+static int compare_rel_paths(const char* a, int a_len, const char* b, int b_len) {
+    int n = a_len < b_len ? a_len : b_len;
+    for (int i = 0; i < n; i++) {
+        unsigned char x = a[i] == '/' ? 0 : (unsigned char)a[i];
+        unsigned char y = b[i] == '/' ? 0 : (unsigned char)b[i];
+        if (x != y) return x < y ? -1 : 1;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_dir_nodes(const void* a, const void* b) {
+    const dir_node_t* x = *(const dir_node_t* const*)a;
+    const dir_node_t* y = *(const dir_node_t* const*)b;
+    return compare_rel_paths(x->path, x->path_len, y->path, y->path_len);
+}
+
+static long long align8(long long n) {
+    return (n + 7) & ~7LL;
+}
+
+// Write a file beside path and rename it over path, so readers never map
+// a partial file. The temporary name is new to this process and call, and
+// created exclusively, so concurrent writers of the same path never share
+// one or follow a link planted there. Returns 0 or -1.
+static int write_file_replace(const char* path, const void* data, long long len) {
+    static unsigned serial; // races only cost a retry: O_EXCL decides
+    char tmp[4096];
+    int fd = -1;
+    for (int attempt = 0; attempt < 16 && fd < 0; attempt++) {
+        int n = snprintf(tmp, sizeof(tmp), "%s.%d.%u.tmp", path, (int)getpid(), serial++);
+        if (n < 0 || n >= (int)sizeof(tmp)) return -1;
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno != EEXIST) return -1;
+    }
+    if (fd < 0) return -1;
+    long long done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char*)data + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    int ok = done == len;
+    if (close(fd) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) unlink(tmp);
+    return ok ? 0 : -1;
+}
+
+// Save a job's rollup as an index file, replacing path atomically.
+// Returns 0 on success, -1 on failure.
+int cloc_dir_tree_save(void* handle, const char* path) {
+    const dir_tree_t* tree = handle;
+    const lang_db_t* db = tree->db;
+    long long rows = (long long)tree->count;
+    const char* root = tree->root ? tree->root : "";
+
+    dir_node_t** order = malloc((rows ? rows : 1) * sizeof(dir_node_t*));
+    long long* row_end = malloc((rows ? rows : 1) * sizeof(long long));
+    long long* stack = malloc((rows ? rows : 1) * sizeof(long long));
+    int* lang_slot = malloc((db->count ? db->count : 1) * sizeof(int));
+    long long* lang_entries = calloc(db->count ? db->count : 1, sizeof(long long));
+    if (!order || !row_end || !stack || !lang_slot || !lang_entries) {
+        free(order);
+        free(row_end);
+        free(stack);
+        free(lang_slot);
+        free(lang_entries);
+        return -1;
+    }
+
+    long long n = 0;
+    for (dir_node_t* node = tree->newest; node && n < rows; node = node->older) order[n++] = node;
+    qsort(order, n, sizeof(dir_node_t*), compare_dir_nodes);
+
+    // A row's subtree ends at the first later row that isn't below it
+    long long depth = 0;
+    for (long long i = 0; i <= n; i++) {
+        while (depth > 0) {
+            const dir_node_t* top = order[stack[depth - 1]];
+            const dir_node_t* next = i < n ? order[i] : 0;
+            int below = next && next->path_len > top->path_len &&
+                        memcmp(next->path, top->path, top->path_len) == 0 &&
+                        (top->path_len == 0 || next->path[top->path_len] == '/');
+            if (below) break;
+            row_end[stack[--depth]] = i;
+        }
+        if (i < n) stack[depth++] = i;
+    }
+
+    // Languages with files somewhere get a slot, in database order
+    long long lang_count = 0;
+    long long entry_count = 0;
+    for (long long i = 0; i < n; i++) {
+        for (const dir_lang_t* e = order[i]->langs; e; e = e->next) {
+            if (e->own.files) lang_entries[e->lang]++;
+        }
+    }
+    for (int l = 0; l < db->count; l++) {
+        lang_slot[l] = lang_entries[l] ? (int)lang_count++ : -1;
+        entry_count += lang_entries[l];
+    }
+
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.header_size = sizeof(index_header_t);
+    header.lang_count = lang_count;
+    header.dir_count = n;
+    header.entry_count = entry_count;
+    header.root_off = sizeof(index_header_t);
+    header.langs_off = align8(header.root_off + (long long)strlen(root) + 1);
+    header.postings_off = header.langs_off + lang_count * 64;
+    header.dirs_off = header.postings_off + lang_count * (long long)sizeof(index_posting_t);
+    header.entries_off = header.dirs_off + n * (long long)sizeof(index_dir_t);
+    long long paths_off = header.entries_off + entry_count * (long long)sizeof(index_entry_t);
+    long long paths_size = 0;
+    for (long long i = 0; i < n; i++) paths_size += order[i]->path_len + 1;
+    header.file_size = paths_off + paths_size;
+
+    // The whole file is laid out in memory and written in one go
+    unsigned char* out = calloc(1, header.file_size);
+    int ok = out != 0;
+    if (ok) {
+        memcpy(out, &header, sizeof(header));
+        memcpy(out + header.root_off, root, strlen(root) + 1);
+
+        char (*langs)[64] = (char (*)[64])(out + header.langs_off);
+        index_posting_t* postings = (index_posting_t*)(out + header.postings_off);
+        index_dir_t* dirs = (index_dir_t*)(out + header.dirs_off);
+        index_entry_t* entries = (index_entry_t*)(out + header.entries_off);
+
+        long long first = 0;
+        for (int l = 0; l < db->count; l++) {
+            if (lang_slot[l] < 0) continue;
+            str_copy(langs[lang_slot[l]], db->langs[l].name, 64);
+            postings[lang_slot[l]].first = first;
+            first += lang_entries[l];
+            lang_entries[l] = postings[lang_slot[l]].first; // now the next entry to fill
+        }
+
+        // Rows in order, so every posting list comes out sorted by row
+        long long path_off = paths_off;
+        lang_totals_t* running = calloc(db->count ? db->count : 1, sizeof(lang_totals_t));
+        ok = running != 0;
+        for (long long i = 0; ok && i < n; i++) {
+            const dir_node_t* node = order[i];
+            dirs[i].path_off = path_off;
+            dirs[i].path_len = node->path_len;
+            dirs[i].end = row_end[i];
+            memcpy(out + path_off, node->path, node->path_len + 1);
+            path_off += node->path_len + 1;
+
+            for (const dir_lang_t* e = node->langs; e; e = e->next) {
+                if (!e->own.files) continue;
+                lang_totals_add(&running[e->lang], &e->own);
+                index_entry_t* entry = &entries[lang_entries[e->lang]++];
+                entry->row = i;
+                write_totals(entry->totals, &running[e->lang]);
+                postings[lang_slot[e->lang]].count++;
+            }
+        }
+        free(running);
+    }
+
+    ok = ok && write_file_replace(path, out, header.file_size) == 0;
+
+    free(out);
+    free(order);
+    free(row_end);
+    free(stack);
+    free(lang_slot);
+    free(lang_entries);
+    return ok ? 0 : -1;
+}
+
+static int index_range_ok(const index_header_t* h, long long off, long long count, long long size) {
+    return off >= 0 && count >= 0 && off % 8 == 0 && (size == 0 || count <= h->file_size / size) &&
+           off + count * size <= h->file_size;
+}
+
+void cloc_index_close(void* handle) {
+    cloc_index_t* index = handle;
+    if (!index) return;
+    if (index->map) munmap((void*)index->map, index->size);
+    free(index);
+}
+
+// Map an index file and check it end to end, so queries can trust it.
+// Returns the index, or 0 if the file is missing, foreign or damaged.
+void* cloc_index_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    cloc_index_t* index = calloc(1, sizeof(cloc_index_t));
+    if (!index || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(index_header_t)) {
+        close(fd);
+        free(index);
+        return 0;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(index);
+        return 0;
+    }
+    index->map = map;
+    index->size = st.st_size;
+
+    const index_header_t* h = map;
+    int ok = memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && h->version == INDEX_VERSION &&
+             h->header_size == sizeof(index_header_t) && h->file_size == st.st_size &&
+             h->root_off >= (long long)sizeof(index_header_t) && h->root_off < h->file_size &&
+             memchr((const char*)map + h->root_off, 0, h->file_size - h->root_off) &&
+             index_range_ok(h, h->langs_off, h->lang_count, 64) &&
+             index_range_ok(h, h->postings_off, h->lang_count, sizeof(index_posting_t)) &&
+             index_range_ok(h, h->dirs_off, h->dir_count, sizeof(index_dir_t)) &&
+             index_range_ok(h, h->entries_off, h->entry_count, sizeof(index_entry_t));
+    if (ok) {
+        index->header = h;
+        index->langs = (const char (*)[64])((const char*)map + h->langs_off);
+        index->postings = (const index_posting_t*)((const char*)map + h->postings_off);
+        index->dirs = (const index_dir_t*)((const char*)map + h->dirs_off);
+        index->entries = (const index_entry_t*)((const char*)map + h->entries_off);
+    }
+    for (long long l = 0; ok && l < h->lang_count; l++) {
+        const index_posting_t* p = &index->postings[l];
+        ok = memchr(index->langs[l], 0, 64) && p->first >= 0 && p->count >= 0 &&
+             p->first <= h->entry_count - p->count;
+    }
+    for (long long i = 0; ok && i < h->dir_count; i++) {
+        const index_dir_t* d = &index->dirs[i];
+        ok = d->end > i && d->end <= h->dir_count && d->path_len >= 0 && d->path_off >= 0 &&
+             d->path_off <= h->file_size - d->path_len - 1 && ((const char*)map)[d->path_off + d->path_len] == 0;
+    }
+    if (!ok) {
+        cloc_index_close(index);
+        return 0;
+    }
+    return index;
+}
+
+// The root the indexed walk started from
+const char* cloc_index_root(void* handle) {
+    const cloc_index_t* index = handle;
+    return (const char*)index->map + index->header->root_off;
+}
+
+// The row of a root-relative directory, or -1
+static long long index_find_dir(const cloc_index_t* index, const char* path, int len) {
+    long long lo = 0, hi = index->header->dir_count;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        const index_dir_t* d = &index->dirs[mid];
+        int c = compare_rel_paths((const char*)index->map + d->path_off, (int)d->path_len, path, len);
+        if (c == 0) return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+// Entries of a posting list with row < row
+static long long index_entries_before(const index_entry_t* entries, long long count, long long row) {
+    long long lo = 0, hi = count;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if (entries[mid].row < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// One language's totals over rows [lo, hi); returns its file count
+static long long index_range_totals(const cloc_index_t* index, long long lang, long long lo, long long hi,
+                                    long long* out) {
+    const index_posting_t* p = &index->postings[lang];
+    const index_entry_t* entries = index->entries + p->first;
+    long long a = index_entries_before(entries, p->count, lo);
+    long long b = index_entries_before(entries, p->count, hi);
+    for (int f = 0; f < LANG_STAT_FIELDS; f++)
+        out[f] = (b ? entries[b - 1].totals[f] : 0) - (a ? entries[a - 1].totals[f] : 0);
+    return out[0];
+}
+
+// Per-language totals under a root-relative directory ("" or "." for the
+// root) in the analyze_directory layout. Returns the number of languages
+// written, or -1 if the directory isn't in the index.
+int cloc_index_query(void* handle, const char* path, char* lang_names_out, long long* lang_stats_out,
+                     int max_langs) {
+    const cloc_index_t* index = handle;
+    int len = rel_path_trim(&path);
+    long long row = index_find_dir(index, path, len);
+    if (row < 0) return -1;
+
+    int count = 0;
+    for (long long l = 0; l < index->header->lang_count && count < max_langs; l++) {
+        long long* out = lang_stats_out + count * LANG_STAT_FIELDS;
+        if (!index_range_totals(index, l, row, index->dirs[row].end, out)) continue;
+        memcpy(lang_names_out + count * 64, index->langs[l], 64);
+        count++;
+    }
+    return count;
+}
+
+// One language's totals under a directory into stats_out (zeros when it
+// has no files there). Returns 0, or -1 if the directory isn't in the index.
+int cloc_index_query_language(void* handle, const char* path, const char* language, long long* stats_out) {
+    const cloc_index_t* index = handle;
+    int len = rel_path_trim(&path);
+    long long row = index_find_dir(index, path, len);
+    if (row < 0) return -1;
+
+    memset(stats_out, 0, LANG_STAT_FIELDS * sizeof(long long));
+    for (long long l = 0; l < index->header->lang_count; l++) {
+        if (strncmp(index->langs[l], language, 64) == 0) {
+            index_range_totals(index, l, row, index->dirs[row].end, stats_out);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Relaxed 64-bit loads and stores for fields shared with other threads.
+// TinyCC has no __atomic builtins; aligned 64-bit accesses are single
+// instructions on the 64-bit targets it builds for.
+#ifdef __TINYC__
+#define atomic_store_ll(p, v) (*(volatile long long*)(p) = (v))
+#define atomic_load_ll(p) (*(volatile long long*)(p))
+#else
+#define atomic_store_ll(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_ll(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+// Live progress of a walk. The walking thread (and its counting pool, one
+// thread at a time) publishes into it and another thread (or cloc.ts,
+// reading the memory in place) polls it and may set cancel; the reader takes
+// no locks, every field is one relaxed 64-bit access.
+typedef struct {
+    long long dirs;
+    long long files;          // files counted so far
+    long long bytes;          // bytes counted so far
+    long long cancel;         // set by the reader to stop at the next entry
+    long long done;           // set by a job once its results can be fetched
+} walk_progress_t;
+
+struct uring_ingest;
+struct count_pool;
+struct cloc_watch;
+struct result_files;
+
+// Watch mode bookkeeping, see WATCH MODE below
+static const ignore_level_t* watch_add_dir(struct cloc_watch* watch, const char* path, const struct stat* st,
+                                           ignore_level_t* level, const ignore_level_t* parent);
+static void watch_track_file(struct cloc_watch* watch, const char* path, int lang, const int* counts,
+                             long long size);
+
+// Per-file records for a result file, see RESULT FILES below
+static void result_files_add(struct result_files* files, const char* rel, int lang, const int* counts,
+                             long long size);
+
+// Called for each file a walk would count, with its full and root-relative
+// paths and its language index, by walks that only list files
+typedef void (*walk_visit_fn)(void* arg, const char* path, const char* rel, int lang);
+
+// One worker's part of a tree, see SHARDS below. By default every path
+// belongs to the shard its hash picks; with names, whole top-level entries
+// are handed out instead.
+typedef struct {
+    int index;
+    int count;
+    const char** names;       // planned top-level entries, sorted; 0 to hash every path
+    const int* owners;        // the shard of each planned entry
+    int name_count;
+} walk_shard_t;
+
+typedef struct {
+    char path[4096];
+    int rel_off;              // where the root-relative part of path starts
+    int flags;
+    const lang_db_t* db;      // frozen language database
+    const count_kernel_t* kernel;
+    unsigned char* buf;       // reusable read buffer
+    long long buf_cap;
+    lang_totals_t* totals;    // indexed like db->langs
+    inode_set_t seen;         // files and directories already visited
+    file_cache_t* cache;      // locked for this walk, 0 unless WALK_CACHED
+    struct uring_ingest* uring; // async ingestion, 0 for the sync path
+    struct count_pool* pool;  // counting threads the walker hands files to, or 0
+    pthread_mutex_t* shared;  // held to update what pool threads share, 0 without a pool
+    perf_counters_t* perf;    // hardware counters, 0 unless requested
+    int phase;                // PHASE_* the walker is in
+    long long phase_start;    // monotonic ns when it entered it
+    thread_stats_t times;
+    walk_progress_t* progress; // 0 unless the walk runs as a job
+    long long bytes_published; // counted bytes already added to progress
+    struct cloc_watch* watch; // 0 unless the walk feeds a watch
+    walk_visit_fn visit;      // set when the walk only lists files, without reading them
+    void* visit_arg;
+    struct result_files* records; // 0 unless the walk keeps per-file records
+    const walk_shard_t* shard; // 0 unless the walk covers one shard of the tree
+    dir_tree_t* tree;         // 0 unless WALK_BY_DIR
+    dir_node_t* dir;          // the tree's node for the directory being walked
+    const ignore_level_t* rules; // in force for the file being walked, for archive members
+    long long stats[WALK_STAT_FIELDS];
+} walker_t;
+
+// Switch phases, charging the time (and counters) since the last switch to
+// the phase being left. Returns that phase so callers can restore it.
+static int walk_phase(walker_t* w, int phase) {
+    int prev = w->phase;
+    if (phase == prev) return prev;
+
+    long long now = monotonic_ns();
+    w->times.ns[prev] += now - w->phase_start;
+    w->phase_start = now;
+    if (w->perf) perf_charge(w->perf, prev);
+    w->phase = phase;
+    return prev;
+}
+
+// Whether the walk was asked to stop; a cancelled walk's totals are partial
+static int walk_cancelled(walker_t* w) {
+    if (!w->progress || !atomic_load_ll(&w->progress->cancel)) return 0;
+    w->stats[WALK_CANCELLED] = 1;
+    return 1;
+}
+
+// A large file is read this much at a time, with a cancel check in between
+#define READ_CHUNK (8 << 20)
+#define READ_CANCELLED -2
+
+// Read a whole file into the walker's buffer. Returns the size, -1 if it
+// can't be read, or READ_CANCELLED if the walk was cancelled part way.
+static long long read_file(walker_t* w, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size > 0x7FFFFFFF) {
+        close(fd);
+        return -1;
+    }
+
+    long long want = st.st_size;
+    if (want > w->buf_cap) {
+        unsigned char* p = realloc(w->buf, want);
+        if (!p) {
+            close(fd);
+            return -1;
+        }
+        w->buf = p;
+        w->buf_cap = want;
+    }
+
+    long long got = 0;
+    while (got < want) {
+        if (got > 0 && walk_cancelled(w)) {
+            close(fd);
+            return READ_CANCELLED;
+        }
+        long long chunk = want - got < READ_CHUNK ? want - got : READ_CHUNK;
+        ssize_t n = read(fd, w->buf + got, chunk);
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        if (n == 0) break;
+        got += n;
+    }
+    close(fd);
+    return got;
+}
+
+// Add one file's counts to the walker's per-language totals. path is the
+// file's full path, which is w->path unless it was read asynchronously.
+static void aggregate_file(walker_t* w, const char* path, const dynamic_lang_t* lang, const int* counts,
+                           long long size) {
+    int prev = walk_phase(w, PHASE_AGGREGATE);
+    w->times.items[PHASE_AGGREGATE]++;
+    lang_totals_t* t = &w->totals[lang - w->db->langs];
+    t->files++;
+    t->lines += counts[0];
+    t->code += counts[1];
+    t->comments += counts[2];
+    t->blanks += counts[3];
+    t->size += size;
+    w->stats[WALK_FILES]++;
+
+    if (w->shared) pthread_mutex_lock(w->shared);
+    if (w->watch) watch_track_file(w->watch, path, (int)(lang - w->db->langs), counts, size);
+    if (w->records) result_files_add(w->records, path + w->rel_off, (int)(lang - w->db->langs), counts, size);
+    if (w->dir) dir_tree_add_file(w->tree, w->dir, (int)(lang - w->db->langs), counts, size);
+    if (w->progress) {
+        // Pool threads add to the same progress, so it moves by deltas
+        long long bytes = w->times.bytes[PHASE_COUNT];
+        atomic_store_ll(&w->progress->files, atomic_load_ll(&w->progress->files) + 1);
+        atomic_store_ll(&w->progress->bytes,
+                        atomic_load_ll(&w->progress->bytes) + bytes - w->bytes_published);
+        w->bytes_published = bytes;
+    }
+    if (w->shared) pthread_mutex_unlock(w->shared);
+    walk_phase(w, prev);
+}
+
+static void walk_cache_store(walker_t* w, const file_key_t* key, const dynamic_lang_t* lang, const int* result) {
+    if (w->shared) pthread_mutex_lock(w->shared);
+    file_cache_store(w->cache, key, (int)(lang - w->db->langs), result);
+    if (w->shared) pthread_mutex_unlock(w->shared);
+}
+
+// Count the buffer read from path and add it to the walker's per-language
+// totals, caching the result under key if given
+static void tally_file(walker_t* w, const char* path, const dynamic_lang_t* lang, const unsigned char* buf,
+                       long long size, const file_key_t* key) {
+    int prev = walk_phase(w, PHASE_SNIFF);
+    int bom_len;
+    int enc = detect_encoding(buf, (int)size, &bom_len);
+    w->times.items[PHASE_SNIFF]++;
+    w->times.bytes[PHASE_SNIFF] += size < SNIFF_BYTES ? size : SNIFF_BYTES;
+    if (enc == ENC_BINARY) {
+        w->stats[WALK_FILES_BINARY]++;
+        if (key) walk_cache_store(w, key, lang, 0);
+        walk_phase(w, prev);
+        return;
+    }
+
+    int result[5];
+    walk_phase(w, PHASE_COUNT);
+    count_encoded_buffer(w->kernel, buf, (int)size, enc, bom_len, lang, result);
+    w->times.items[PHASE_COUNT]++;
+    w->times.bytes[PHASE_COUNT] += size;
+
+    if (key) walk_cache_store(w, key, lang, result);
+    aggregate_file(w, path, lang, result, result[4]);
+    walk_phase(w, prev);
+}
+
+// Synchronous ingestion: open, fstat, read and close in turn
+static void ingest_sync(walker_t* w, const char* path, const dynamic_lang_t* lang, const file_key_t* key) {
+    int prev = walk_phase(w, PHASE_READ);
+    long long size = read_file(w, path);
+    if (size == READ_CANCELLED) {
+        // Not counted at all, like the files after it
+    } else if (size < 0) {
+        w->stats[WALK_FILES_UNREADABLE]++;
+    } else {
+        w->times.items[PHASE_READ]++;
+        w->times.bytes[PHASE_READ] += size;
+        // A file that changed between the stat and the read is not cached
+        tally_file(w, path, lang, w->buf, size, key && key->size == size ? key : 0);
+    }
+    walk_phase(w, prev);
+}
+
+// ASYNC INGESTION - io_uring batched open/read with a synchronous fallback
+//
+// Up to URING_SLOTS files are in flight at once. Each slot owns a pool buffer
+// registered with the ring; the walker queues an OPENAT, its completion queues
+// a READ_FIXED into the slot's buffer and the read completion is counted
+// straight away, so directory traversal, kernel I/O and counting overlap.
+// Files the walk's stat found too big for a buffer never enter the ring and
+// are read synchronously; one that grew to fill its buffer since is re-read
+// in full. The ring is
+// driven through raw syscalls and needs the GCC/Clang atomics, so TinyCC
+// builds and kernels without io_uring use ingest_sync.
+
+#if defined(__linux__) && !defined(__TINYC__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CLOC_HAVE_URING 1
+#endif
+#endif
+
+#ifdef CLOC_HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_SLOTS 256
+#define URING_BUF_SIZE (64 * 1024)
+#define URING_MAX_FAILURES 64   // enter calls failing in a row, with nothing reaped, before the ring is given up
+
+// user_data layout: slot index in the low bits, operation above
+#define URING_OP_OPEN (1ULL << 32)
+#define URING_OP_READ (2ULL << 32)
+#define URING_OP_CLOSE (3ULL << 32)
+#define URING_OP_CANCEL (4ULL << 32)
+
+typedef struct {
+    const dynamic_lang_t* lang;
+    int fd;
+    int reading;              // the READ is queued, not the OPENAT
+    int cached;               // key is valid and the result should be cached
+    file_key_t key;
+    dir_node_t* dir;          // the walker's directory when the file was queued
+    char path[4096];
+} uring_slot_t;
+
+typedef struct uring_ingest {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned pending;         // SQEs queued but not yet submitted
+    unsigned inflight;        // submitted operations not yet completed
+    int fixed_bufs;           // pool registered with IORING_REGISTER_BUFFERS
+    unsigned char* pool;      // URING_SLOTS * URING_BUF_SIZE
+    uring_slot_t* slots;
+    int free_slots[URING_SLOTS];
+    int free_count;
+    int failures;             // consecutive failed enter calls that reaped nothing
+    int broken;               // given up on; the rest of the walk reads synchronously
+    int orphaned;             // operations were left with the kernel; the pool can't be freed
+} uring_ingest_t;
+
+static int uring_setup_sys(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter_sys(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int uring_register_sys(int fd, unsigned op, void* arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void uring_destroy(uring_ingest_t* u) {
+    if (!u) return;
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map && u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_len);
+    if (u->ring_fd >= 0) close(u->ring_fd);
+    // Reads the kernel still owns may write into the pool until the ring's
+    // teardown cancels them, so an orphaned pool is left allocated
+    if (!u->orphaned) free(u->pool);
+    free(u->slots);
+    free(u);
+}
+
+// Set up a ring with the operations ingestion needs, or return 0
+static uring_ingest_t* uring_create(void) {
+    uring_ingest_t* u = calloc(1, sizeof(uring_ingest_t));
+    if (!u) return 0;
+    u->ring_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = uring_setup_sys(URING_SLOTS * 2, &p);
+    if (u->ring_fd < 0) {
+        uring_destroy(u);
+        return 0;
+    }
+    u->sq_entries = p.sq_entries;
+    u->cq_entries = p.cq_entries;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+        u->cq_map_len = u->sq_map_len;
+    }
+    u->sq_map = mmap(0, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        uring_destroy(u);
+        return 0;
+    }
+    u->cq_map = p.features & IORING_FEAT_SINGLE_MMAP
+        ? u->sq_map
+        : mmap(0, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_destroy(u);
+        return 0;
+    }
+
+    unsigned char* sq = u->sq_map;
+    unsigned char* cq = u->cq_map;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // OPENAT and CLOSE arrived in 5.6; older kernels take the sync path
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_len);
+    int ok = probe && uring_register_sys(u->ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+             probe->last_op >= IORING_OP_CLOSE &&
+             (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) {
+        uring_destroy(u);
+        return 0;
+    }
+
+    u->pool = malloc((size_t)URING_SLOTS * URING_BUF_SIZE);
+    u->slots = calloc(URING_SLOTS, sizeof(uring_slot_t));
+    if (!u->pool || !u->slots) {
+        uring_destroy(u);
+        return 0;
+    }
+
+    // Registered buffers skip the per-read page pinning; a tight
+    // RLIMIT_MEMLOCK only costs us that, plain READ still works
+    struct iovec iov[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        iov[i].iov_base = u->pool + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    u->fixed_bufs = uring_register_sys(u->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0;
+
+    for (int i = 0; i < URING_SLOTS; i++) u->free_slots[i] = URING_SLOTS - 1 - i;
+    u->free_count = URING_SLOTS;
+    return u;
+}
+
+static int uring_submit(uring_ingest_t* u, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int rc = uring_enter_sys(u->ring_fd, u->pending, min_complete, flags);
+        if (rc >= 0) {
+            u->pending -= (unsigned)rc < u->pending ? (unsigned)rc : u->pending;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+// Next free submission entry; flushes the queue if the ring is full
+static struct io_uring_sqe* uring_get_sqe(uring_ingest_t* u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        uring_submit(u, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) return 0;
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    u->inflight++;
+    return sqe;
+}
+
+static void uring_release_slot(uring_ingest_t* u, int slot) {
+    u->free_slots[u->free_count++] = slot;
+}
+
+static void uring_queue_close(uring_ingest_t* u, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+    if (!sqe) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = URING_OP_CLOSE;
+}
+
+static void uring_complete(walker_t* w, uring_ingest_t* u, unsigned long long data, int res) {
+    int slot_idx = (int)(data & 0xFFFFFFFFULL);
+    unsigned long long op = data & ~0xFFFFFFFFULL;
+    uring_slot_t* slot = &u->slots[slot_idx];
+
+    if (op == URING_OP_CLOSE || op == URING_OP_CANCEL) return;
+
+    // Completions after the ring was abandoned only give back their files;
+    // uring_abandon reads each slot's file synchronously once the ring is quiet
+    if (u->broken) {
+        if (op == URING_OP_OPEN && res >= 0) close(res);
+        if (op == URING_OP_READ) {
+            close(slot->fd);
+            slot->fd = -1;
+        }
+        return;
+    }
+
+    if (res < 0) {
+        if (op == URING_OP_READ) uring_queue_close(u, slot->fd);
+        w->stats[WALK_FILES_UNREADABLE]++;
+        uring_release_slot(u, slot_idx);
+        return;
+    }
+
+    if (op == URING_OP_OPEN) {
+        slot->fd = res;
+        struct io_uring_sqe* sqe = uring_get_sqe(u);
+        if (!sqe) {
+            close(slot->fd);
+            ingest_sync(w, slot->path, slot->lang, slot->cached ? &slot->key : 0);
+            uring_release_slot(u, slot_idx);
+            return;
+        }
+        slot->reading = 1;
+        sqe->opcode = u->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = slot->fd;
+        sqe->addr = (unsigned long long)(size_t)(u->pool + (size_t)slot_idx * URING_BUF_SIZE);
+        sqe->len = URING_BUF_SIZE;
+        sqe->off = 0;
+        if (u->fixed_bufs) sqe->buf_index = (unsigned short)slot_idx;
+        sqe->user_data = URING_OP_READ | (unsigned)slot_idx;
+        return;
+    }
+
+    uring_queue_close(u, slot->fd);
+    if (res == URING_BUF_SIZE) {
+        // Only a file that grew since the walk's stat fills its buffer
+        ingest_sync(w, slot->path, slot->lang, slot->cached ? &slot->key : 0);
+    } else {
+        w->times.items[PHASE_READ]++;
+        w->times.bytes[PHASE_READ] += res;
+        const file_key_t* key = slot->cached && slot->key.size == res ? &slot->key : 0;
+        tally_file(w, slot->path, slot->lang, u->pool + (size_t)slot_idx * URING_BUF_SIZE, res, key);
+    }
+    uring_release_slot(u, slot_idx);
+}
+
+// Process every completion posted so far; returns how many there were
+static int uring_reap_completions(walker_t* w, uring_ingest_t* u) {
+    int reaped = 0;
+    unsigned head = *u->cq_head;
+    for (;;) {
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+        unsigned long long data = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        u->inflight--;
+
+        // Counts belong to the directory the file was queued from
+        dir_node_t* dir = w->dir;
+        w->dir = u->slots[data & 0xFFFFFFFFULL].dir;
+        uring_complete(w, u, data, res);
+        w->dir = dir;
+        reaped++;
+    }
+    return reaped;
+}
+
+// Cancel the operations in flight and reap until the ring is quiet; the
+// completions only close the files late OPENATs opened. busy gets the slots
+// that were in use, none of whose files is counted yet. If the kernel won't
+// even take the cancellations, whatever it still holds is orphaned: the pool
+// stays allocated for reads that may yet land in it, and a file an orphaned
+// OPENAT opens is only closed with the process.
+static void uring_quiesce(walker_t* w, uring_ingest_t* u, char* busy) {
+    memset(busy, 1, URING_SLOTS);
+    for (int i = 0; i < u->free_count; i++) busy[u->free_slots[i]] = 0;
+    u->broken = 1;
+
+    for (int i = 0; i < URING_SLOTS; i++) {
+        if (!busy[i]) continue;
+        struct io_uring_sqe* sqe = uring_get_sqe(u);
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (u->slots[i].reading ? URING_OP_READ : URING_OP_OPEN) | (unsigned)i;
+        sqe->user_data = URING_OP_CANCEL | (unsigned)i;
+    }
+    for (int failures = 0; u->inflight && failures < URING_MAX_FAILURES;) {
+        int failed = uring_submit(u, 1) != 0;
+        int reaped = uring_reap_completions(w, u);
+        failures = failed && !reaped ? failures + 1 : 0;
+    }
+    u->orphaned = u->inflight != 0;
+    u->pending = 0;
+    u->inflight = 0;
+}
+
+// Give up on a ring the kernel keeps refusing: once it is quiet, every file
+// still queued is read and counted synchronously, as is the rest of the walk
+static void uring_abandon(walker_t* w, uring_ingest_t* u) {
+    char busy[URING_SLOTS];
+    uring_quiesce(w, u, busy);
+
+    dir_node_t* dir = w->dir;
+    for (int i = 0; i < URING_SLOTS; i++) {
+        if (!busy[i]) continue;
+        uring_slot_t* slot = &u->slots[i];
+        if (slot->fd >= 0) close(slot->fd);
+        w->dir = slot->dir;
+        ingest_sync(w, slot->path, slot->lang, slot->cached ? &slot->key : 0);
+        uring_release_slot(u, i);
+    }
+    w->dir = dir;
+}
+
+// Submit queued entries and process completions; waits for at least one if
+// asked. A failed enter still leaves earlier completions to reap, and
+// reaping them is often what lets the next one through.
+static void uring_reap(walker_t* w, uring_ingest_t* u, int wait) {
+    int failed = uring_submit(u, wait && u->inflight ? 1 : 0) != 0;
+    int reaped = uring_reap_completions(w, u);
+    if (!failed || reaped) {
+        u->failures = 0;
+    } else if (++u->failures >= URING_MAX_FAILURES) {
+        uring_abandon(w, u);
+    }
+}
+
+// Queue the file at w->path, size bytes at the walk's stat, for an async
+// open + read
+static void uring_push(walker_t* w, uring_ingest_t* u, const dynamic_lang_t* lang, const file_key_t* key,
+                       long long size) {
+    // Keep the completion queue from overflowing and wait for a free slot
+    while (!u->broken && (u->free_count == 0 || u->inflight + 2 >= u->cq_entries)) uring_reap(w, u, 1);
+    // A file that can't fit a slot's buffer would only be read twice
+    if (u->broken || size >= URING_BUF_SIZE) {
+        ingest_sync(w, w->path, lang, key);
+        return;
+    }
+
+    int slot_idx = u->free_slots[--u->free_count];
+    uring_slot_t* slot = &u->slots[slot_idx];
+    slot->lang = lang;
+    slot->fd = -1;
+    slot->reading = 0;
+    slot->cached = key != 0;
+    if (key) slot->key = *key;
+    slot->dir = w->dir;
+    str_copy(slot->path, w->path, sizeof(slot->path));
+
+    struct io_uring_sqe* sqe = uring_get_sqe(u);
+    if (!sqe) {
+        ingest_sync(w, slot->path, lang, key);
+        uring_release_slot(u, slot_idx);
+        return;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long long)(size_t)slot->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = URING_OP_OPEN | (unsigned)slot_idx;
+
+    // Opportunistically pick up finished work without blocking
+    if (u->pending >= 32) uring_reap(w, u, 0);
+}
+
+// Wait for every in-flight operation. A cancelled walk stops waiting: what
+// is still in flight is cancelled and left uncounted, like the files after it.
+static void uring_drain(walker_t* w, uring_ingest_t* u) {
+    while (u->inflight && !u->broken) {
+        if (walk_cancelled(w)) {
+            char busy[URING_SLOTS];
+            uring_quiesce(w, u, busy);
+            for (int i = 0; i < URING_SLOTS; i++) {
+                if (!busy[i]) continue;
+                if (u->slots[i].fd >= 0) close(u->slots[i].fd);
+                uring_release_slot(u, i);
+            }
+            return;
+        }
+        uring_reap(w, u, 1);
+    }
+}
+
+#else
+
+typedef struct uring_ingest uring_ingest_t;
+
+static uring_ingest_t* uring_create(void) {
+    return 0;
+}
+
+static void uring_destroy(uring_ingest_t* u) {
+    (void)u;
+}
+
+static void uring_push(walker_t* w, uring_ingest_t* u, const dynamic_lang_t* lang, const file_key_t* key,
+                       long long size) {
+    (void)w;
+    (void)u;
+    (void)lang;
+    (void)key;
+    (void)size;
+}
+
+static void uring_drain(walker_t* w, uring_ingest_t* u) {
+    (void)w;
+    (void)u;
+}
+
+#endif
+
+// COUNTING POOL - NUMA-aware reader/counter threads behind one walker
+//
+// Given a thread count, a walk keeps traversal, detection and cache
+// lookups on its own thread and hands every file it would read to a pool of
+// worker threads. Each worker is a walker of its own for ingestion: it reads
+// with blocking syscalls into its own buffer, counts, and adds to its own
+// per-language totals, which are folded into the walk's when it ends. What
+// the threads still share (the file cache, the directory rollup, per-file
+// records and progress) is updated under one lock, once per file.
+//
+// Files travel in batches, dealt to the workers' queues in turn. An idle
+// worker takes from its own queue first, then steals from workers on its
+// node, then from other nodes, nearest first by the firmware's distance
+// table; a batch dealt to a busy worker wakes the nearest idle one. On a
+// host with several NUMA nodes, worker i is pinned to the CPUs of node
+// i % nodes and allocates its walker, read buffer and totals once pinned,
+// so the kernel's first-touch policy places them on that node and a worker
+// never reads into or aggregates through remote memory. Every worker
+// reports its node in its thread stats, for a per-node breakdown. A
+// worker's wait for batches is in its wall time but in no phase. When the
+// walk is instrumented, every worker opens hardware counters of its own.
+
+#define POOL_MAX_NODES 64
+#define POOL_CPU_WORDS 16         // CPU masks of up to 1024 CPUs
+#define POOL_LONG_BITS ((int)(8 * sizeof(unsigned long)))
+#define POOL_BATCH_FILES 32
+#define POOL_BATCH_BYTES 16384    // path bytes per batch; any one path fits
+#define POOL_QUEUED_PER_WORKER 4  // batches queued per worker before the walker waits
+
+typedef struct {
+    int count;                // nodes with CPUs, 0 where the topology is unknown
+    int ids[POOL_MAX_NODES];
+    unsigned long cpus[POOL_MAX_NODES][POOL_CPU_WORDS];
+    int distance[POOL_MAX_NODES][POOL_MAX_NODES]; // between node indices
+} numa_topology_t;
+
+static numa_topology_t g_numa;
+static pthread_once_t g_numa_once = PTHREAD_ONCE_INIT;
+
+// First line of a sysfs file; returns 0 or -1
+static int read_sysfs_line(const char* path, char* buf, int cap) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    int ok = fgets(buf, cap, f) != 0;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// Set the bits of a sysfs list such as "0-3,8" below max; returns how many
+static int numa_parse_list(const char* list, unsigned long* mask, int max) {
+    int n = 0;
+    for (;;) {
+        char* end;
+        long lo = strtol(list, &end, 10);
+        if (end == list || lo < 0) break;
+        long hi = lo;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi && i < max; i++, n++) mask[i / POOL_LONG_BITS] |= 1UL << (i % POOL_LONG_BITS);
+        if (*end != ',') break;
+        list = end + 1;
+    }
+    return n;
+}
+
+static void numa_init(void) {
+#ifdef __linux__
+    static char buf[8192];
+    char path[96];
+    unsigned long online[POOL_MAX_NODES / POOL_LONG_BITS + 1];
+    memset(online, 0, sizeof(online));
+    if (read_sysfs_line("/sys/devices/system/node/online", buf, sizeof(buf)) != 0) return;
+    numa_parse_list(buf, online, POOL_MAX_NODES);
+
+    // Nodes without CPUs (memory only) get no workers
+    int rank[POOL_MAX_NODES];  // position among the online nodes, as distance files list them
+    int online_count = 0;
+    for (int id = 0; id < POOL_MAX_NODES; id++) {
+        if (!(online[id / POOL_LONG_BITS] >> (id % POOL_LONG_BITS) & 1)) continue;
+        int i = g_numa.count;
+        rank[i] = online_count++;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (read_sysfs_line(path, buf, sizeof(buf)) == 0 &&
+            numa_parse_list(buf, g_numa.cpus[i], POOL_CPU_WORDS * POOL_LONG_BITS) > 0) {
+            g_numa.ids[g_numa.count++] = id;
+        } else {
+            memset(g_numa.cpus[i], 0, sizeof(g_numa.cpus[i]));
+        }
+    }
+
+    for (int i = 0; i < g_numa.count; i++) {
+        for (int j = 0; j < g_numa.count; j++) g_numa.distance[i][j] = i == j ? 10 : 20;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", g_numa.ids[i]);
+        if (read_sysfs_line(path, buf, sizeof(buf)) != 0) continue;
+        int d[POOL_MAX_NODES], n = 0;
+        for (char *p = buf, *end; n < POOL_MAX_NODES; p = end) {
+            long v = strtol(p, &end, 10);
+            if (end == p) break;
+            d[n++] = (int)v;
+        }
+        for (int j = 0; j < g_numa.count; j++) {
+            if (rank[j] < n) g_numa.distance[i][j] = d[rank[j]];
+        }
+    }
+#endif
+}
+
+// Keep the calling thread on a node's CPUs
+static void numa_pin(int node) {
+#if defined(__linux__) && defined(SYS_sched_setaffinity)
+    syscall(SYS_sched_setaffinity, 0, sizeof(g_numa.cpus[node]), g_numa.cpus[node]);
+#endif
+}
+
+typedef struct {
+    const dynamic_lang_t* lang;
+    dir_node_t* dir;          // rollup node of the file's directory
+    int path_off;             // into the batch's paths
+    int keyed;                // key is valid and the result should be cached
+    file_key_t key;
+} pool_task_t;
+
+typedef struct pool_batch {
+    struct pool_batch* next;
+    int count;
+    int used;                 // path bytes taken
+    pool_task_t tasks[POOL_BATCH_FILES];
+    char paths[POOL_BATCH_BYTES];
+} pool_batch_t;
+
+enum { POOL_STARTING, POOL_READY, POOL_FAILED };
+
+typedef struct {
+    struct count_pool* pool;
+    pthread_t thread;
+    pthread_cond_t wake;      // signalled when there may be work for this worker
+    int node;                 // index into g_numa, -1 where the topology is unknown
+    int state;                // POOL_*
+    int idle;                 // waiting on wake
+    pool_batch_t* head;       // batches dealt to this worker
+    pool_batch_t* tail;
+    int victims[POOL_MAX_THREADS]; // the workers to steal from, nearest first
+    int victim_count;
+    int local_victims;        // how many of them share this worker's node
+    walker_t* w;              // allocated by the worker once pinned
+    perf_stats_t perf;        // the worker's counters when the walk has them
+} pool_worker_t;
+
+typedef struct count_pool {
+    pthread_mutex_t lock;     // queues, worker states and the counts below
+    pthread_cond_t space;     // a batch was taken, the walker may deal again
+    pthread_cond_t ready;     // a worker finished starting
+    pthread_mutex_t shared;   // walker_t.shared for the walker and every worker
+    int queued;
+    int closed;
+    int count;                // workers created
+    int live[POOL_MAX_THREADS]; // the ones that started, in deal order
+    int live_count;
+    int next;                 // index into live of the next batch's worker
+    const walker_t* parent;
+    pool_batch_t* batch;      // being filled by the walker
+    pool_worker_t workers[POOL_MAX_THREADS];
+} count_pool_t;
+
+static pool_batch_t* pool_pop(pool_worker_t* pw) {
+    pool_batch_t* batch = pw->head;
+    if (batch && !(pw->head = batch->next)) pw->tail = 0;
+    return batch;
+}
+
+// A batch for pw, its own or stolen; called with the pool lock held
+static pool_batch_t* pool_take(count_pool_t* pool, pool_worker_t* pw) {
+    pool_batch_t* batch = pool_pop(pw);
+    for (int i = 0; !batch && i < pw->victim_count; i++) {
+        batch = pool_pop(&pool->workers[pw->victims[i]]);
+        if (batch) pw->w->stats[i < pw->local_victims ? WALK_STEALS_LOCAL : WALK_STEALS_REMOTE]++;
+    }
+    if (batch) pool->queued--;
+    return batch;
+}
+
+// Ingest a batch on a worker. The wait for it is charged to no phase.
+static void pool_run(walker_t* w, const pool_batch_t* batch) {
+    w->phase_start = monotonic_ns();
+    if (w->perf) perf_skip(w->perf);
+    for (int i = 0; i < batch->count; i++) {
+        const pool_task_t* t = &batch->tasks[i];
+        if (walk_cancelled(w)) break;
+        w->dir = t->dir;
+        ingest_sync(w, batch->paths + t->path_off, t->lang, t->keyed ? &t->key : 0);
+    }
+}
+
+static void* pool_worker_main(void* arg) {
+    pool_worker_t* pw = arg;
+    count_pool_t* pool = pw->pool;
+    const walker_t* parent = pool->parent;
+    if (pw->node >= 0 && g_numa.count > 1) numa_pin(pw->node);
+
+    // Allocated once pinned, so first touch puts them on the worker's node
+    walker_t* w = calloc(1, sizeof(walker_t));
+    lang_totals_t* totals = calloc(parent->db->count ? parent->db->count : 1, sizeof(lang_totals_t));
+    if (w && totals) {
+        w->flags = parent->flags;
+        w->db = parent->db;
+        w->kernel = parent->kernel;
+        w->totals = totals;
+        w->cache = parent->cache;
+        w->shared = &pool->shared;
+        w->progress = parent->progress;
+        w->records = parent->records;
+        w->tree = parent->tree;
+        w->rel_off = parent->rel_off;
+        w->phase = PHASE_WALK;
+        w->times.tid = current_tid();
+        w->times.node = pw->node >= 0 ? g_numa.ids[pw->node] : -1;
+        // Counters count the thread that opens them; a worker that can't
+        // open any zeroes pw->perf, which marks the walk's as unavailable
+        if (parent->perf) w->perf = perf_open(&pw->perf);
+    } else {
+        free(w);
+        free(totals);
+        w = 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pw->w = w;
+    pw->state = w ? POOL_READY : POOL_FAILED;
+    pthread_cond_signal(&pool->ready);
+    long long start = monotonic_ns();
+    while (w) {
+        pool_batch_t* batch = pool_take(pool, pw);
+        if (!batch) {
+            if (pool->closed) break;
+            pw->idle = 1;
+            pthread_cond_wait(&pw->wake, &pool->lock);
+            pw->idle = 0;
+            continue;
+        }
+        pthread_cond_signal(&pool->space);
+        pthread_mutex_unlock(&pool->lock);
+        pool_run(w, batch);
+        free(batch);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (w) {
+        w->times.wall_ns = monotonic_ns() - start;
+        perf_close(w->perf);
+    }
+    return 0;
+}
+
+// Order pw's victims: its node's workers from the next one on, then other
+// nodes' by distance; called once every worker has started
+static void pool_plan_steals(count_pool_t* pool, pool_worker_t* pw, int self) {
+    int keys[POOL_MAX_THREADS];
+    pw->victim_count = 0;
+    pw->local_victims = 0;
+    for (int k = 1; k < pool->live_count; k++) {
+        int v = pool->live[(self + k) % pool->live_count];
+        int node = pool->workers[v].node;
+        int key = node == pw->node ? 0 : g_numa.distance[pw->node][node] * POOL_MAX_NODES + node;
+        if (key == 0) pw->local_victims++;
+
+        // Insertion sort, stable so each band keeps the rotation
+        int i = pw->victim_count++;
+        for (; i > 0 && keys[i - 1] > key; i--) {
+            keys[i] = keys[i - 1];
+            pw->victims[i] = pw->victims[i - 1];
+        }
+        keys[i] = key;
+        pw->victims[i] = v;
+    }
+}
+
+static void pool_free(count_pool_t* pool) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->shared);
+    pthread_cond_destroy(&pool->space);
+    pthread_cond_destroy(&pool->ready);
+    free(pool);
+}
+
+// Start a pool of up to threads workers behind the walker. Returns 0, with
+// the walker left to count on its own, if none could start.
+static count_pool_t* pool_start(walker_t* w, int threads) {
+    pthread_once(&g_numa_once, numa_init);
+    count_pool_t* pool = calloc(1, sizeof(count_pool_t));
+    if (!pool) return 0;
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_mutex_init(&pool->shared, 0);
+    pthread_cond_init(&pool->space, 0);
+    pthread_cond_init(&pool->ready, 0);
+    pool->parent = w;
+
+    for (int i = 0; i < threads && i < POOL_MAX_THREADS; i++) {
+        pool_worker_t* pw = &pool->workers[i];
+        pw->pool = pool;
+        pw->node = g_numa.count ? i % g_numa.count : -1;
+        pthread_cond_init(&pw->wake, 0);
+        if (pthread_create(&pw->thread, 0, pool_worker_main, pw) != 0) {
+            pthread_cond_destroy(&pw->wake);
+            break;
+        }
+        pool->count++;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->count;) {
+        if (pool->workers[i].state == POOL_STARTING) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        } else {
+            i++;
+        }
+    }
+    unsigned long nodes[POOL_MAX_NODES / POOL_LONG_BITS + 1];
+    memset(nodes, 0, sizeof(nodes));
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->workers[i].state != POOL_READY) continue;
+        pool->live[pool->live_count++] = i;
+        int node = pool->workers[i].node;
+        if (node >= 0 && !(nodes[node / POOL_LONG_BITS] >> (node % POOL_LONG_BITS) & 1)) {
+            nodes[node / POOL_LONG_BITS] |= 1UL << (node % POOL_LONG_BITS);
+            w->stats[WALK_NUMA_NODES]++;
+        }
+    }
+    for (int k = 0; k < pool->live_count; k++) pool_plan_steals(pool, &pool->workers[pool->live[k]], k);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->live_count == 0) {
+        // Workers that failed to start have already returned
+        for (int i = 0; i < pool->count; i++) {
+            pthread_join(pool->workers[i].thread, 0);
+            pthread_cond_destroy(&pool->workers[i].wake);
+        }
+        pool_free(pool);
+        return 0;
+    }
+    w->pool = pool;
+    w->shared = &pool->shared;
+    return pool;
+}
+
+// Queue a full batch on the next worker, waiting while the queues are full
+static void pool_deal(count_pool_t* pool, pool_batch_t* batch) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued >= pool->live_count * POOL_QUEUED_PER_WORKER) {
+        pthread_cond_wait(&pool->space, &pool->lock);
+    }
+    pool_worker_t* pw = &pool->workers[pool->live[pool->next]];
+    pool->next = (pool->next + 1) % pool->live_count;
+    batch->next = 0;
+    if (pw->tail) {
+        pw->tail->next = batch;
+    } else {
+        pw->head = batch;
+    }
+    pw->tail = batch;
+    pool->queued++;
+
+    // Wake the worker, or if it is busy the nearest idle one to steal it
+    pool_worker_t* waker = pw->idle ? pw : 0;
+    for (int i = 0; !waker && i < pw->victim_count; i++) {
+        pool_worker_t* v = &pool->workers[pw->victims[i]];
+        if (v->idle) waker = v;
+    }
+    if (waker) {
+        waker->idle = 0;
+        pthread_cond_signal(&waker->wake);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Add the file at w->path to the walker's batch, dealing the batch when full
+static void pool_submit(walker_t* w, const dynamic_lang_t* lang, const file_key_t* key) {
+    count_pool_t* pool = w->pool;
+    int len = (int)strlen(w->path) + 1;
+    pool_batch_t* batch = pool->batch;
+    if (batch && (batch->count == POOL_BATCH_FILES || batch->used + len > POOL_BATCH_BYTES)) {
+        pool_deal(pool, batch);
+        batch = pool->batch = 0;
+    }
+    if (!batch) {
+        batch = pool->batch = malloc(sizeof(pool_batch_t));
+        if (!batch) {
+            ingest_sync(w, w->path, lang, key);
+            return;
+        }
+        batch->count = 0;
+        batch->used = 0;
+    }
+
+    pool_task_t* t = &batch->tasks[batch->count++];
+    t->lang = lang;
+    t->dir = w->dir;
+    t->path_off = batch->used;
+    t->keyed = key != 0;
+    if (key) t->key = *key;
+    memcpy(batch->paths + batch->used, w->path, len);
+    batch->used += len;
+}
+
+// Deal the last batch, wait for the workers to drain every queue and fold
+// their totals and counters into the walker's, and their hardware counters
+// into perf_out when the walk is instrumented. Writes up to max_threads
+// workers' thread stats and returns how many.
+static int pool_finish(walker_t* w, thread_stats_t* threads_out, int max_threads, perf_stats_t* perf_out) {
+    count_pool_t* pool = w->pool;
+    if (pool->batch && pool->batch->count) {
+        pool_deal(pool, pool->batch);
+    } else {
+        free(pool->batch);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    for (int i = 0; i < pool->count; i++) pthread_cond_signal(&pool->workers[i].wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    int written = 0;
+    for (int i = 0; i < pool->count; i++) {
+        pool_worker_t* pw = &pool->workers[i];
+        pthread_join(pw->thread, 0);
+        pthread_cond_destroy(&pw->wake);
+        walker_t* ww = pw->w;
+        if (!ww) continue;
+
+        for (int l = 0; l < w->db->count; l++) {
+            const lang_totals_t* from = &ww->totals[l];
+            lang_totals_t* to = &w->totals[l];
+            to->files += from->files;
+            to->lines += from->lines;
+            to->code += from->code;
+            to->comments += from->comments;
+            to->blanks += from->blanks;
+            to->size += from->size;
+        }
+        for (int k = 0; k < WALK_STAT_FIELDS; k++) w->stats[k] += ww->stats[k];
+        if (perf_out) perf_merge(perf_out, &pw->perf);
+        if (written < max_threads) threads_out[written++] = ww->times;
+
+        free(ww->seen.slots);
+        free(ww->buf);
+        free(ww->totals);
+        free(ww);
+    }
+
+    pool_free(pool);
+    w->pool = 0;
+    w->shared = 0;
+    return written;
+}
+
+// The shard a top-level entry belongs to: its planned one, or by hash
+static int shard_owner(const walk_shard_t* s, const char* name, int len) {
+    int lo = 0, hi = s->name_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strncmp(s->names[mid], name, len);
+        if (c == 0) c = s->names[mid][len] != 0;
+        if (c == 0) return s->owners[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (int)(path_hash(name, len) % (size_t)s->count);
+}
+
+// Whether the entry at w->path[0..len) is this walk's to count. The root
+// directory belongs to shard 0. Entries below an owned top-level entry are
+// owned too, since other shards' top-level entries are never entered.
+static int walk_owns(const walker_t* w, int len) {
+    const walk_shard_t* s = w->shard;
+    if (!s) return 1;
+    const char* rel = w->path + w->rel_off;
+    int rel_len = len > w->rel_off ? len - w->rel_off : 0;
+    if (rel_len == 0) return s->index == 0;
+    if (!s->names) return (int)(path_hash(rel, rel_len) % (size_t)s->count) == s->index;
+    if (memchr(rel, '/', rel_len)) return 1;
+    return shard_owner(s, rel, rel_len) == s->index;
+}
+
+static int archive_kind(const char* name);
+static void walk_archive(walker_t* w, int kind, int len);
+
+// A file that isn't owned (by a walk over a hashed shard) still enters the
+// inode set, so that of several links to one file, every shard counts the
+// one a whole walk would have: the first in walk order.
+// st is the file's stat when the caller already has it. Files are always
+// identified by st_dev and st_ino from stat: readdir's d_ino can differ from
+// them (on overlayfs, say), which would let a file and a link to it both count.
+static void walk_file(walker_t* w, const char* name, const struct stat* st, int owned) {
+    walk_phase(w, PHASE_DETECT);
+    const dynamic_lang_t* lang = detect_language(w->db, name);
+    int archive = !lang && (w->flags & WALK_ARCHIVES) && !w->visit ? archive_kind(name) : 0;
+    w->times.items[PHASE_DETECT]++;
+    walk_phase(w, PHASE_WALK);
+    if (!lang && !archive) {
+        if (owned) w->stats[WALK_FILES_UNKNOWN]++;
+        return;
+    }
+
+    // Only files that would be counted are stat'ed and enter the set, which
+    // keeps both cheap
+    struct stat file_st;
+    if (!st) {
+        if (stat(w->path, &file_st) != 0) {
+            if (owned) w->stats[WALK_FILES_UNREADABLE]++;
+            return;
+        }
+        st = &file_st;
+    }
+    int first = inode_set_insert(&w->seen, st->st_dev, st->st_ino) != 0;
+    if (!owned) return;
+    if (!first) {
+        w->stats[WALK_FILES_DUPLICATE]++;
+        w->stats[WALK_BYTES_DUPLICATE] += st->st_size;
+        return;
+    }
+    if (archive) {
+        walk_archive(w, archive, (int)strlen(w->path));
+        return;
+    }
+    if (w->visit) {
+        w->visit(w->visit_arg, w->path, w->path + w->rel_off, (int)(lang - w->db->langs));
+        return;
+    }
+
+    // Unchanged files are counted from the cache without opening them
+    file_key_t key;
+    if (w->cache) {
+        file_key_from_stat(&key, st);
+        // A copy, since pool threads may grow the cache once it's unlocked
+        file_cache_entry_t hit;
+        if (w->shared) pthread_mutex_lock(w->shared);
+        const file_cache_entry_t* e = file_cache_lookup(w->cache, &key, (int)(lang - w->db->langs));
+        if (e) hit = *e;
+        if (w->shared) pthread_mutex_unlock(w->shared);
+        if (e) {
+            w->stats[WALK_FILES_CACHED]++;
+            if (hit.binary) {
+                w->stats[WALK_FILES_BINARY]++;
+            } else {
+                aggregate_file(w, w->path, lang, hit.counts, hit.key.size);
+            }
+            return;
+        }
+    }
+
+    if (w->pool) {
+        walk_phase(w, PHASE_READ);
+        pool_submit(w, lang, w->cache ? &key : 0);
+        walk_phase(w, PHASE_WALK);
+    } else if (w->uring) {
+        walk_phase(w, PHASE_READ);
+        uring_push(w, w->uring, lang, w->cache ? &key : 0, st->st_size);
+        walk_phase(w, PHASE_WALK);
+    } else {
+        ingest_sync(w, w->path, lang, w->cache ? &key : 0);
+    }
+}
+
+// Append the ignore file `name` of the directory at w->path[0..dir_len) to a level
+static void load_ignore_file(walker_t* w, int dir_len, const char* name, ignore_level_t* lv) {
+    int name_len = (int)strlen(name);
+    if (dir_len + 1 + name_len >= (int)sizeof(w->path)) return;
+    w->path[dir_len] = '/';
+    memcpy(w->path + dir_len + 1, name, name_len + 1);
+
+    long long size = read_file(w, w->path);
+    w->path[dir_len] = '\0';
+    if (size > 0) compile_ignore_text(lv, (const char*)w->buf, (int)size);
+}
+
+static void walk_dir(walker_t* w, int dir_len, const ignore_level_t* parent) {
+    DIR* dir = opendir(dir_len ? w->path : "/");
+    if (!dir) return;
+
+    // A directory seen before was reached through a symlink loop or a second link
+    struct stat dir_st;
+    if (fstat(dirfd(dir), &dir_st) != 0) {
+        closedir(dir);
+        return;
+    }
+    int owned = walk_owns(w, dir_len);
+    if (inode_set_insert(&w->seen, dir_st.st_dev, dir_st.st_ino) == 0) {
+        if (owned) w->stats[WALK_DIRS_DUPLICATE]++;
+        closedir(dir);
+        return;
+    }
+    if (owned) w->stats[WALK_DIRS]++;
+    if (w->progress) atomic_store_ll(&w->progress->dirs, w->stats[WALK_DIRS]);
+
+    int rel_len = dir_len > w->rel_off ? dir_len - w->rel_off : 0;
+    dir_node_t* up = w->dir;
+    if (w->tree) {
+        // Pool workers add languages to nodes from the same arena
+        if (w->shared) pthread_mutex_lock(w->shared);
+        dir_node_t* node = dir_tree_enter(w->tree, up, w->path + w->rel_off, rel_len);
+        if (w->shared) pthread_mutex_unlock(w->shared);
+        if (node) w->dir = node;
+    }
+
+    ignore_level_t level;
+    memset(&level, 0, sizeof(level));
+    level.parent = parent;
+    level.base_len = rel_len;
+    if (!(w->flags & WALK_NO_IGNORE_FILES)) {
+        load_ignore_file(w, dir_len, ".gitignore", &level);
+        load_ignore_file(w, dir_len, ".clocignore", &level);
+    }
+    const ignore_level_t* rules = level.rule_count ? &level : parent;
+    if (w->watch) rules = watch_add_dir(w->watch, w->path, &dir_st, &level, parent);
+
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        // Checked between entries, so files already read are still counted
+        if (walk_cancelled(w)) break;
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if (name[0] == '.' && !(w->flags & WALK_HIDDEN)) continue;
+
+        w->times.items[PHASE_WALK]++;
+        int name_len = (int)strlen(name);
+        int len = dir_len + 1 + name_len;
+        if (len >= (int)sizeof(w->path)) continue;
+        w->path[dir_len] = '/';
+        memcpy(w->path + dir_len + 1, name, name_len + 1);
+
+        // Another shard's top-level entries are never entered; with hashed
+        // paths, directories are still walked for this shard's files
+        int owned = walk_owns(w, len);
+        if (!owned && w->shard->names) {
+            w->path[dir_len] = '\0';
+            continue;
+        }
+
+        // Entries are typed from d_type where it is known; links and unknown
+        // types are resolved first, and their stat is kept for walk_file
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+        struct stat st;
+        const struct stat* file_st = 0;
+        if (entry->d_type == DT_LNK && (w->flags & WALK_NO_FOLLOW)) {
+            if (owned) w->stats[WALK_LINKS_SKIPPED]++;
+        } else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            int rc = w->flags & WALK_NO_FOLLOW ? lstat(w->path, &st) : stat(w->path, &st);
+            if (rc == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+                file_st = &st;
+            }
+            if (rc == 0 && S_ISLNK(st.st_mode) && owned) w->stats[WALK_LINKS_SKIPPED]++;
+        }
+
+        if (is_dir || is_file) {
+            const char* rel = w->path + w->rel_off;
+            if (ignore_check(rules, rel, len - w->rel_off, name, name_len, is_dir)) {
+                if (owned) w->stats[is_dir ? WALK_DIRS_IGNORED : WALK_FILES_IGNORED]++;
+            } else if (is_dir) {
+                walk_dir(w, len, rules);
+            } else {
+                w->rules = rules;
+                walk_file(w, name, file_st, owned);
+            }
+        }
+        w->path[dir_len] = '\0';
+    }
+
+    closedir(dir);
+    ignore_level_free(&level);
+    w->dir = up;
+}
+
+// Put a root path into w->path without trailing slashes ("/" becomes "").
+// Returns its length, or -1 if it is too long or not a directory.
+static int walker_set_root(walker_t* w, const char* root) {
+    int root_len = (int)strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') root_len--;
+    if (root_len == 1 && root[0] == '/') root_len = 0;
+    if (root_len >= (int)sizeof(w->path)) return -1;
+
+    memcpy(w->path, root, root_len);
+    w->path[root_len] = '\0';
+    w->rel_off = root_len + 1;
+
+    struct stat st;
+    if (stat(root_len ? w->path : "/", &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    return root_len;
+}
+
+// Visit the files a walk of root would count, without reading them.
+// Returns 0, or -1 if root can't be walked.
+static int walk_visit_tree(const lang_db_t* db, const char* root, int flags, walk_visit_fn visit, void* arg) {
+    walker_t* w = calloc(1, sizeof(walker_t));
+    if (!w) return -1;
+    w->flags = flags;
+    w->db = db;
+    w->visit = visit;
+    w->visit_arg = arg;
+    w->phase = PHASE_WALK;
+    w->phase_start = monotonic_ns();
+
+    ignore_level_t defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    compile_default_ignores(&defaults);
+    int root_len = walker_set_root(w, root);
+    if (root_len >= 0) walk_dir(w, root_len, &defaults);
+
+    ignore_level_free(&defaults);
+    free(w->seen.slots);
+    free(w->buf);
+    free(w);
+    return root_len < 0 ? -1 : 0;
+}
+
+// Write the languages with files in the analyze_directory layout; returns
+// how many were written
+static int write_lang_totals(const lang_db_t* db, const lang_totals_t* totals, char* lang_names_out,
+                             long long* lang_stats_out, int max_langs) {
+    int count = 0;
+    for (int i = 0; i < db->count && count < max_langs; i++) {
+        if (totals[i].files == 0) continue;
+        str_copy(lang_names_out + count * 64, db->langs[i].name, 64);
+        long long* out = lang_stats_out + count * LANG_STAT_FIELDS;
+        out[0] = totals[i].files;
+        out[1] = totals[i].lines;
+        out[2] = totals[i].code;
+        out[3] = totals[i].comments;
+        out[4] = totals[i].blanks;
+        out[5] = totals[i].size;
+        count++;
+    }
+    return count;
+}
+
+// Walk, read, count and aggregate a tree (or one shard of it) on the
+// calling thread, with a pool of threads more counting if threads > 0,
+// publishing progress and keeping per-file records if asked to
+static int walk_tree(const lang_db_t* db, const count_kernel_t* kernel, int threads, file_cache_t* cache,
+                     dir_tree_t* tree, struct result_files* records, const walk_shard_t* shard, const char* root,
+                     int flags, char* lang_names_out, long long* lang_stats_out, int max_langs,
+                     long long* walk_stats_out, long long* thread_stats_out, int max_threads,
+                     long long* perf_stats_out, walk_progress_t* progress) {
+    walker_t* w = calloc(1, sizeof(walker_t));
+    lang_totals_t* totals = calloc(db->count ? db->count : 1, sizeof(lang_totals_t));
+    if (!w || !totals) {
+        free(w);
+        free(totals);
+        return -1;
+    }
+    w->flags = flags;
+    w->db = db;
+    w->kernel = kernel;
+    w->totals = totals;
+    w->progress = progress;
+    w->tree = tree;
+    w->records = records;
+    w->shard = shard;
+
+    // Entries from another language table would carry stale indices
+    if (cache && pthread_mutex_trylock(&cache->lock) == 0) {
+        if (cache->generation != db->generation) {
+            file_cache_clear(cache);
+            cache->generation = db->generation;
+        }
+        cache->walks++;
+        w->cache = cache;
+    }
+
+    ignore_level_t defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    compile_default_ignores(&defaults);
+
+    int count = -1;
+    int root_len = walker_set_root(w, root);
+    if (tree && root_len >= 0 && (tree->root = malloc(root_len + 1))) memcpy(tree->root, w->path, root_len + 1);
+    if (root_len >= 0) {
+        long long start = monotonic_ns();
+        w->times.tid = current_tid();
+        w->times.node = -1;
+        w->phase = PHASE_WALK;
+        w->phase_start = start;
+
+        // Opened first, so pool threads know to open theirs
+        if (perf_stats_out) w->perf = perf_open((perf_stats_t*)perf_stats_out);
+        // Pool threads read with blocking syscalls, in parallel
+        if (threads > 0) pool_start(w, threads);
+        if (!w->pool && !(flags & WALK_SYNC_IO)) w->uring = uring_create();
+        w->stats[WALK_ASYNC_IO] = w->uring != 0;
+        walk_dir(w, root_len, &defaults);
+        walk_phase(w, PHASE_READ);
+        if (w->uring) uring_drain(w, w->uring);
+        uring_destroy(w->uring);
+        int pooled = 0;
+        if (w->pool) {
+            thread_stats_t* pool_stats = max_threads > 0 ? (thread_stats_t*)thread_stats_out + 1 : 0;
+            perf_stats_t* perf = w->perf ? (perf_stats_t*)perf_stats_out : 0;
+            pooled = pool_finish(w, pool_stats, max_threads > 0 ? max_threads - 1 : 0, perf);
+        }
+        walk_phase(w, PHASE_AGGREGATE);
+
+        if (tree) dir_tree_rollup(tree);
+        count = write_lang_totals(db, totals, lang_names_out, lang_stats_out, max_langs);
+        walk_phase(w, PHASE_WALK); // flushes the aggregate phase
+        perf_close(w->perf);
+
+        // The walker first, then its pool
+        w->times.wall_ns = monotonic_ns() - start;
+        if (max_threads > 0) {
+            memcpy(thread_stats_out, &w->times, sizeof(thread_stats_t));
+            w->stats[WALK_THREADS] = 1 + pooled;
+        }
+    }
+
+    for (int i = 0; i < WALK_STAT_FIELDS; i++) walk_stats_out[i] = w->stats[i];
+
+    if (w->cache) {
+        if (w->cache->walks % FILE_CACHE_SWEEP_WALKS == 0) file_cache_sweep(w->cache);
+        pthread_mutex_unlock(&w->cache->lock);
+    }
+    ignore_level_free(&defaults);
+    free(w->seen.slots);
+    free(w->buf);
+    free(w);
+    free(totals);
+    return count;
+}
+
+// Walk a directory tree and aggregate per language in a single native call.
+// Returns the number of languages written, or -1 if the root can't be walked.
+int cloc_analyze_directory(
+    void* handle,
+    const char* root,
+    int flags,
+    int threads,               // counting pool size (see COUNTING POOL), 0 to count on the walking thread
+    char* lang_names_out,      // Output: language names (64 chars each)
+    long long* lang_stats_out, // Output: [files, lines, code, comments, blanks, size] per language
+    int max_langs,
+    long long* walk_stats_out, // Output: WALK_STAT_FIELDS counters
+    long long* thread_stats_out, // Output: thread_stats_t per engine thread
+    int max_threads,
+    long long* perf_stats_out  // Output: perf_stats_t, or 0 to run uninstrumented
+) {
+    cloc_ctx_t* ctx = handle;
+    lang_db_t* db = ctx_languages(ctx);
+    file_cache_t* cache = flags & WALK_CACHED ? ctx_cache(ctx) : 0;
+    int count = walk_tree(db, ctx->kernel, threads, cache, 0, 0, 0, root, flags, lang_names_out,
+                          lang_stats_out, max_langs, walk_stats_out, thread_stats_out, max_threads,
+                          perf_stats_out, 0);
+    file_cache_release(cache);
+    lang_db_release(db);
+    return count;
+}
+
+// cloc_analyze_directory on the default context
+int analyze_directory(
+    const char* root,
+    int flags,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* walk_stats_out,
+    long long* thread_stats_out,
+    int max_threads,
+    long long* perf_stats_out
+) {
+    cloc_ctx_t* ctx = default_ctx();
+    if (!ctx) return -1;
+    return cloc_analyze_directory(ctx, root, flags, 0, lang_names_out, lang_stats_out, max_langs, walk_stats_out,
+                                  thread_stats_out, max_threads, perf_stats_out);
+}
+
+// BACKGROUND JOBS - analyze_directory on its own thread
+//
+// For callers that can't block (the bot's event loop): cloc_job_start copies
+// its arguments and returns at once. cloc_job_progress exposes the job's
+// walk_progress_t, which the caller polls and cancels through directly;
+// once `done` is set, cloc_job_finish joins the thread, copies the results
+// out and frees the job (and with it the progress block). A cancelled job
+// still yields the totals of everything counted before it stopped. The job
+// holds its own references to the context's language database, kernel
+// choice and result cache, so the context can be changed or destroyed while
+// it runs. A WALK_BY_DIR job also builds a directory rollup, which the caller
+// takes with cloc_job_dir_tree before finishing the job.
+
+#define JOB_MAX_THREADS 64
+
+typedef struct {
+    pthread_t thread;
+    lang_db_t* db;
+    const count_kernel_t* kernel;
+    int pool_threads;
+    file_cache_t* cache;
+    dir_tree_t* tree;
+    char* root;
+    int flags;
+    int want_perf;
+    int joined;
+    int result;
+    walk_progress_t progress;
+    char* lang_names;
+    long long* lang_stats;
+    long long walk_stats[WALK_STAT_FIELDS];
+    thread_stats_t threads[JOB_MAX_THREADS];
+    perf_stats_t perf;
+} cloc_job_t;
+
+static void* job_main(void* arg) {
+    cloc_job_t* job = arg;
+    job->result = walk_tree(job->db, job->kernel, job->pool_threads, job->cache, job->tree, 0, 0, job->root,
+                            job->flags, job->lang_names, job->lang_stats, job->db->count, job->walk_stats,
+                            (long long*)job->threads, JOB_MAX_THREADS, job->want_perf ? (long long*)&job->perf : 0,
+                            &job->progress);
+    atomic_store_ll(&job->progress.done, 1);
+    return 0;
+}
+
+static void job_free(cloc_job_t* job) {
+    lang_db_release(job->db);
+    file_cache_release(job->cache);
+    cloc_dir_tree_free(job->tree);
+    free(job->root);
+    free(job->lang_names);
+    free(job->lang_stats);
+    free(job);
+}
+
+// Start analyzing root in the background, counting on a pool of threads
+// as cloc_analyze_directory does. Returns the job, or 0 if the thread could
+// not be created.
+void* cloc_job_start(void* handle, const char* root, int flags, int threads, int want_perf) {
+    cloc_ctx_t* ctx = handle;
+    cloc_job_t* job = calloc(1, sizeof(cloc_job_t));
+    if (!job) return 0;
+    job->db = ctx_languages(ctx);
+    job->kernel = ctx->kernel;
+    job->pool_threads = threads;
+    if (flags & WALK_CACHED) job->cache = ctx_cache(ctx);
+    if (flags & WALK_BY_DIR) job->tree = dir_tree_create(job->db);
+    int langs = job->db->count ? job->db->count : 1;
+    job->root = malloc(strlen(root) + 1);
+    job->lang_names = calloc(langs, 64);
+    job->lang_stats = calloc(langs, LANG_STAT_FIELDS * sizeof(long long));
+    if (!job->root || !job->lang_names || !job->lang_stats || (flags & WALK_BY_DIR && !job->tree)) {
+        job_free(job);
+        return 0;
+    }
+    strcpy(job->root, root);
+    job->flags = flags;
+    job->want_perf = want_perf;
+
+    if (pthread_create(&job->thread, 0, job_main, job) != 0) {
+        job_free(job);
+        return 0;
+    }
+    return job;
+}
+
+// The job's progress block, valid until cloc_job_finish
+void* cloc_job_progress(void* handle) {
+    cloc_job_t* job = handle;
+    return &job->progress;
+}
+
+// Wait for a WALK_BY_DIR job and hand its directory rollup to the caller,
+// who frees it with cloc_dir_tree_free. Returns 0 for other jobs, or if the
+// rollup was already taken.
+void* cloc_job_dir_tree(void* handle) {
+    cloc_job_t* job = handle;
+    if (!job->joined) pthread_join(job->thread, 0);
+    job->joined = 1;
+    dir_tree_t* tree = job->tree;
+    job->tree = 0;
+    return tree;
+}
+
+// Wait for the job and copy its results out in the analyze_directory layout,
+// then free it. Returns the language count or -1 if the root couldn't be
+// walked; WALK_CANCELLED marks partial totals.
+int cloc_job_finish(
+    void* handle,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* walk_stats_out,
+    long long* thread_stats_out,
+    int max_threads,
+    long long* perf_stats_out
+) {
+    cloc_job_t* job = handle;
+    if (!job->joined) pthread_join(job->thread, 0);
+
+    int count = job->result;
+    if (count > max_langs) count = max_langs;
+    if (count > 0) {
+        memcpy(lang_names_out, job->lang_names, (size_t)count * 64);
+        memcpy(lang_stats_out, job->lang_stats, (size_t)count * LANG_STAT_FIELDS * sizeof(long long));
+    }
+
+    long long threads = job->walk_stats[WALK_THREADS];
+    if (threads > max_threads) threads = max_threads;
+    memcpy(walk_stats_out, job->walk_stats, sizeof(job->walk_stats));
+    walk_stats_out[WALK_THREADS] = threads;
+    memcpy(thread_stats_out, job->threads, (size_t)threads * sizeof(thread_stats_t));
+    if (perf_stats_out && job->want_perf) memcpy(perf_stats_out, &job->perf, sizeof(perf_stats_t));
+
+    job_free(job);
+    return count;
+}
+
+// WATCH MODE - a tree's totals kept current from inotify events
+//
+// cloc_watch_start walks the tree once with an inotify watch on every
+// directory it enters, and records each counted file's language and counts
+// in a path-keyed table. cloc_watch_poll then reads the pending events and
+// re-counts only the files they name: the file's old counts come out of its
+// language's totals and the new ones go in, so an edit costs one read and
+// count however large the tree is. New directories are walked (and watched)
+// as they appear, removed ones take their files with them, and an edited
+// .gitignore or .clocignore re-walks the directory it governs. If the
+// kernel's event queue overflows, the tree is walked again from scratch,
+// and if the root itself is deleted or moved away the totals are cleared
+// and the watch stops applying events.
+//
+// A directory already tracked is never walked again through a symlink that
+// an event brings in, but a second link to a file is only recognised
+// within one walk or event. Files are counted again when a writer closes
+// them: writes through a shared mapping after the descriptor was closed,
+// or by a writer that keeps the file open, show up only at the next close
+// or full walk. A watch is driven from one thread and keeps the language
+// database it started with.
+
+enum {
+    WATCH_EVENTS,             // inotify events read
+    WATCH_FILES_UPDATED,      // files counted again after an event
+    WATCH_FILES_REMOVED,      // files taken out by delete and move events
+    WATCH_RESCANS,            // directories walked again for new ignore rules
+    WATCH_OVERFLOWS,          // full walks after the event queue overflowed
+    WATCH_DIRS,               // directories tracked
+    WATCH_DIRS_UNWATCHED,     // directories inotify refused (watch limit)
+    WATCH_FILES,              // files tracked
+    WATCH_ROOT_GONE,          // 1 once the root was deleted or moved away
+    WATCH_STAT_FIELDS
+};
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENT_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+// Only the root asks for these: below it, the parent's events say as much
+#define WATCH_ROOT_MASK (WATCH_EVENT_MASK | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    char* path;               // 0 for a dropped entry
+    int wd;                   // -1 if the directory has no watch of its own
+    ignore_level_t* level;    // the directory's own rules, 0 if it has none
+    const ignore_level_t* parent; // the rules in force above it
+    unsigned long long dev, ino;  // what walks started by events must not enter again
+} watch_dir_t;
+
+typedef struct {
+    char* path;               // 0 for an empty or removed slot
+    int removed;              // tombstone, keeps probe chains intact
+    int lang;                 // index into the database's langs
+    int counts[4];            // lines, code, comments, blanks
+    long long size;
+} watch_file_t;
+
+typedef struct cloc_watch {
+    int fd;                   // inotify instance
+    lang_db_t* db;            // pinned for the watch's lifetime
+    walker_t* w;              // sync IO, kept between events
+    lang_totals_t* totals;    // the walker's, indexed like db->langs
+    ignore_level_t defaults;
+    char* root;               // as normalized by walker_set_root
+    int live;                 // set once the first walk is done
+    watch_dir_t* dirs;
+    int dir_count;            // entries in use, dropped ones included
+    int dir_cap;
+    int* wd_dirs;             // inotify wd -> index in dirs + 1
+    int wd_cap;
+    watch_file_t* files;      // open addressing on the path
+    size_t file_cap;          // power of two
+    size_t file_used;         // live entries and tombstones
+    long long stats[WATCH_STAT_FIELDS];
+} cloc_watch_t;
+
+static watch_file_t* watch_find_file(cloc_watch_t* watch, const char* path) {
+    if (!watch->file_cap) return 0;
+    size_t mask = watch->file_cap - 1;
+    for (size_t j = path_hash(path, strlen(path)) & mask;; j = (j + 1) & mask) {
+        watch_file_t* f = &watch->files[j];
+        if (!f->path && !f->removed) return 0;
+        if (f->path && strcmp(f->path, path) == 0) return f;
+    }
+}
+
+// Move the live entries into a table of cap slots, dropping tombstones
+static int watch_rehash_files(cloc_watch_t* watch, size_t cap) {
+    watch_file_t* files = calloc(cap, sizeof(watch_file_t));
+    if (!files) return 0;
+    size_t used = 0;
+    for (size_t i = 0; i < watch->file_cap; i++) {
+        if (!watch->files[i].path) continue;
+        size_t j = path_hash(watch->files[i].path, strlen(watch->files[i].path)) & (cap - 1);
+        while (files[j].path) j = (j + 1) & (cap - 1);
+        files[j] = watch->files[i];
+        used++;
+    }
+    free(watch->files);
+    watch->files = files;
+    watch->file_cap = cap;
+    watch->file_used = used;
+    return 1;
+}
+
+// Take a tracked file out of the totals and the table
+static void watch_remove_file(cloc_watch_t* watch, watch_file_t* f) {
+    lang_totals_t* t = &watch->totals[f->lang];
+    t->files--;
+    t->lines -= f->counts[0];
+    t->code -= f->counts[1];
+    t->comments -= f->counts[2];
+    t->blanks -= f->counts[3];
+    t->size -= f->size;
+    watch->w->stats[WALK_FILES]--;
+    watch->stats[WATCH_FILES]--;
+
+    free(f->path);
+    f->path = 0;
+    f->removed = 1;
+}
+
+// Called from aggregate_file for every counted file; the totals are about
+// to include it, so an earlier count of the same path comes out first
+static void watch_track_file(cloc_watch_t* watch, const char* path, int lang, const int* counts,
+                             long long size) {
+    watch_file_t* f = watch_find_file(watch, path);
+    if (f) {
+        watch_remove_file(watch, f);
+        f->removed = 0;
+    } else {
+        if ((watch->file_used + 1) * 2 > watch->file_cap) {
+            size_t cap = watch->file_cap ? watch->file_cap : 1024;
+            if ((size_t)(watch->stats[WATCH_FILES] + 1) * 4 > cap) cap *= 2;
+            if (!watch_rehash_files(watch, cap)) return;
+        }
+        size_t mask = watch->file_cap - 1;
+        size_t j = path_hash(path, strlen(path)) & mask;
+        while (watch->files[j].path) j = (j + 1) & mask;
+        f = &watch->files[j];
+        if (!f->removed) watch->file_used++;
+        f->removed = 0;
+    }
+
+    f->path = malloc(strlen(path) + 1);
+    if (!f->path) {
+        f->removed = 1;
+        return;
+    }
+    strcpy(f->path, path);
+    f->lang = lang;
+    memcpy(f->counts, counts, sizeof(f->counts));
+    f->size = size;
+    watch->stats[WATCH_FILES]++;
+    if (watch->live) watch->stats[WATCH_FILES_UPDATED]++;
+}
+
+// Called from walk_dir for every directory entered. The watch takes over
+// the directory's ignore level, which later events need; returns the rules
+// for the directory's entries.
+static const ignore_level_t* watch_add_dir(cloc_watch_t* watch, const char* path, const struct stat* st,
+                                           ignore_level_t* level, const ignore_level_t* parent) {
+    const ignore_level_t* rules = level->rule_count ? level : parent;
+    if (!grow_array((void**)&watch->dirs, &watch->dir_cap, watch->dir_count + 1, sizeof(watch_dir_t)))
+        return rules;
+
+    watch_dir_t* d = &watch->dirs[watch->dir_count];
+    d->path = malloc(strlen(path) + 1);
+    d->level = level->rule_count ? malloc(sizeof(ignore_level_t)) : 0;
+    if (!d->path || (level->rule_count && !d->level)) {
+        free(d->path);
+        free(d->level);
+        return rules;
+    }
+    strcpy(d->path, path);
+    if (d->level) {
+        *d->level = *level;
+        memset(level, 0, sizeof(*level));
+        rules = d->level;
+    }
+    d->parent = parent;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+
+    // A directory reached through a second path keeps its first watch
+    int old_cap = watch->wd_cap;
+    int mask = strcmp(path, watch->root) == 0 ? WATCH_ROOT_MASK : WATCH_EVENT_MASK;
+    d->wd = inotify_add_watch(watch->fd, path[0] ? path : "/", mask);
+    if (d->wd >= 0 && grow_array((void**)&watch->wd_dirs, &watch->wd_cap, d->wd + 1, sizeof(int))) {
+        memset(watch->wd_dirs + old_cap, 0, (size_t)(watch->wd_cap - old_cap) * sizeof(int));
+        if (watch->wd_dirs[d->wd])
+            d->wd = -1;
+        else
+            watch->wd_dirs[d->wd] = watch->dir_count + 1;
+    } else {
+        if (d->wd >= 0) inotify_rm_watch(watch->fd, d->wd);
+        d->wd = -1;
+        watch->stats[WATCH_DIRS_UNWATCHED]++;
+    }
+
+    watch->dir_count++;
+    watch->stats[WATCH_DIRS]++;
+    return rules;
+}
+
+static void watch_drop_dir(cloc_watch_t* watch, watch_dir_t* d) {
+    if (d->wd >= 0) {
+        inotify_rm_watch(watch->fd, d->wd);
+        watch->wd_dirs[d->wd] = 0;
+    }
+    if (d->level) ignore_level_free(d->level);
+    free(d->level);
+    free(d->path);
+    memset(d, 0, sizeof(*d));
+    watch->stats[WATCH_DIRS]--;
+}
+
+// Drop the directory at path with everything below it; returns the number
+// of files taken out
+static long long watch_forget_tree(cloc_watch_t* watch, const char* path) {
+    size_t len = strlen(path);
+    long long removed = 0;
+    for (size_t i = 0; i < watch->file_cap; i++) {
+        watch_file_t* f = &watch->files[i];
+        if (f->path && strncmp(f->path, path, len) == 0 && f->path[len] == '/') {
+            watch_remove_file(watch, f);
+            removed++;
+        }
+    }
+    for (int i = 0; i < watch->dir_count; i++) {
+        watch_dir_t* d = &watch->dirs[i];
+        if (d->path && strncmp(d->path, path, len) == 0 && (d->path[len] == '/' || d->path[len] == '\0'))
+            watch_drop_dir(watch, d);
+    }
+    return removed;
+}
+
+static long long watch_forget_file(cloc_watch_t* watch, const char* path) {
+    watch_file_t* f = watch_find_file(watch, path);
+    if (!f) return 0;
+    watch_remove_file(watch, f);
+    return 1;
+}
+
+// Squeeze out dropped directories once they outnumber the live ones
+static void watch_compact_dirs(cloc_watch_t* watch) {
+    if (watch->dir_count < 64 || watch->dir_count < 2 * watch->stats[WATCH_DIRS]) return;
+    int n = 0;
+    for (int i = 0; i < watch->dir_count; i++) {
+        if (!watch->dirs[i].path) continue;
+        watch->dirs[n] = watch->dirs[i];
+        if (watch->dirs[n].wd >= 0) watch->wd_dirs[watch->dirs[n].wd] = n + 1;
+        n++;
+    }
+    watch->dir_count = n;
+}
+
+static void walker_reset_seen(walker_t* w) {
+    free(w->seen.slots);
+    memset(&w->seen, 0, sizeof(w->seen));
+}
+
+// Start the seen set from every directory the watch tracks, so a walk an
+// event starts treats a symlink back into the tree as a duplicate instead
+// of counting that subtree a second time
+static void watch_seed_seen(cloc_watch_t* watch) {
+    walker_reset_seen(watch->w);
+    for (int i = 0; i < watch->dir_count; i++) {
+        const watch_dir_t* d = &watch->dirs[i];
+        if (d->path) inode_set_insert(&watch->w->seen, d->dev, d->ino);
+    }
+}
+
+// Walk the whole tree, replacing whatever the watch knew before
+static void watch_walk_root(cloc_watch_t* watch) {
+    walker_t* w = watch->w;
+    watch->live = 0;
+    watch_forget_tree(watch, watch->root);
+    walker_reset_seen(w);
+    int root_len = walker_set_root(w, watch->root);
+    if (root_len >= 0) walk_dir(w, root_len, &watch->defaults);
+    watch->live = 1;
+}
+
+static void watch_event(cloc_watch_t* watch, const struct inotify_event* ev) {
+    walker_t* w = watch->w;
+    int idx = ev->wd >= 0 && ev->wd < watch->wd_cap ? watch->wd_dirs[ev->wd] - 1 : -1;
+    if (idx < 0) return;
+    watch_dir_t* dir = &watch->dirs[idx];
+
+    // Nothing counted under the old path is there any more, and following
+    // the directory to wherever it went would count a different tree
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        watch_forget_tree(watch, watch->root);
+        watch->stats[WATCH_ROOT_GONE] = 1;
+        return;
+    }
+
+    // The kernel dropped the watch; the parent's event drops the directory
+    if (ev->mask & IN_IGNORED) {
+        watch->wd_dirs[ev->wd] = 0;
+        dir->wd = -1;
+        return;
+    }
+    if (!ev->len) return;
+
+    const char* name = ev->name;
+    int dir_len = (int)strlen(dir->path);
+    int name_len = (int)strlen(name);
+    int len = dir_len + 1 + name_len;
+    if (len >= (int)sizeof(w->path)) return;
+    memcpy(w->path, dir->path, dir_len);
+    w->path[dir_len] = '/';
+    memcpy(w->path + dir_len + 1, name, name_len + 1);
+    const ignore_level_t* rules = dir->level ? dir->level : dir->parent;
+
+    // New ignore rules can change what counts anywhere below the directory
+    if (!(w->flags & WALK_NO_IGNORE_FILES) && (strcmp(name, ".gitignore") == 0 || strcmp(name, ".clocignore") == 0)) {
+        const ignore_level_t* parent = dir->parent;
+        w->path[dir_len] = '\0';
+        watch_forget_tree(watch, w->path);
+        watch_seed_seen(watch);
+        watch->stats[WATCH_RESCANS]++;
+        walk_dir(w, dir_len, parent);
+        return;
+    }
+    if (name[0] == '.' && !(w->flags & WALK_HIDDEN)) return;
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watch->stats[WATCH_FILES_REMOVED] +=
+            ev->mask & IN_ISDIR ? watch_forget_tree(watch, w->path) : watch_forget_file(watch, w->path);
+        return;
+    }
+
+    // Created, written or moved in: whatever was known about the path goes
+    // and it is counted afresh
+    struct stat st;
+    int rc = w->flags & WALK_NO_FOLLOW ? lstat(w->path, &st) : stat(w->path, &st);
+    if (rc != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) return;
+    int is_dir = S_ISDIR(st.st_mode);
+    if (is_dir) {
+        watch_forget_tree(watch, w->path);
+        watch_seed_seen(watch);
+    } else {
+        watch_forget_file(watch, w->path);
+        walker_reset_seen(w);
+    }
+
+    if (ignore_check(rules, w->path + w->rel_off, len - w->rel_off, name, name_len, is_dir)) {
+        w->stats[is_dir ? WALK_DIRS_IGNORED : WALK_FILES_IGNORED]++;
+    } else if (is_dir) {
+        walk_dir(w, len, rules);
+    } else {
+        w->rules = rules;
+        walk_file(w, name, &st, 1);
+    }
+}
+
+// Free a watch; also cleans up after a failed cloc_watch_start
+void cloc_watch_stop(void* handle) {
+    cloc_watch_t* watch = handle;
+    if (!watch) return;
+    for (int i = 0; i < watch->dir_count; i++) {
+        if (watch->dirs[i].level) ignore_level_free(watch->dirs[i].level);
+        free(watch->dirs[i].level);
+        free(watch->dirs[i].path);
+    }
+    for (size_t i = 0; i < watch->file_cap; i++) free(watch->files[i].path);
+    if (watch->fd >= 0) close(watch->fd);
+    if (watch->w) {
+        free(watch->w->seen.slots);
+        free(watch->w->buf);
+        free(watch->w);
+    }
+    if (watch->db) lang_db_release(watch->db);
+    ignore_level_free(&watch->defaults);
+    free(watch->root);
+    free(watch->dirs);
+    free(watch->wd_dirs);
+    free(watch->files);
+    free(watch->totals);
+    free(watch);
+}
+
+// Walk root and start watching it. Returns the watch, or 0 if the root
+// can't be walked or inotify is unavailable. WALK_CACHED is ignored, as is
+// WALK_ARCHIVES since events name files on disk, and IO is always
+// synchronous.
+void* cloc_watch_start(void* handle, const char* root, int flags) {
+    cloc_ctx_t* ctx = handle;
+    cloc_watch_t* watch = calloc(1, sizeof(cloc_watch_t));
+    if (!watch) return 0;
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watch->db = ctx_languages(ctx);
+    watch->w = calloc(1, sizeof(walker_t));
+    watch->totals = calloc(watch->db->count ? watch->db->count : 1, sizeof(lang_totals_t));
+    if (watch->fd < 0 || !watch->w || !watch->totals) {
+        cloc_watch_stop(watch);
+        return 0;
+    }
+
+    walker_t* w = watch->w;
+    w->flags = (flags | WALK_SYNC_IO) & ~(WALK_CACHED | WALK_ARCHIVES);
+    w->db = watch->db;
+    w->kernel = ctx->kernel;
+    w->totals = watch->totals;
+    w->watch = watch;
+    w->times.tid = current_tid();
+    w->phase_start = monotonic_ns();
+    compile_default_ignores(&watch->defaults);
+
+    int root_len = walker_set_root(w, root);
+    if (root_len < 0 || !(watch->root = malloc(root_len + 1))) {
+        cloc_watch_stop(watch);
+        return 0;
+    }
+    memcpy(watch->root, w->path, root_len + 1);
+    watch_walk_root(watch);
+    return watch;
+}
+
+// Apply the pending events, waiting up to timeout_ms for the first.
+// Returns the number of events read.
+int cloc_watch_poll(void* handle, int timeout_ms) {
+    cloc_watch_t* watch = handle;
+    struct pollfd pfd = { watch->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+
+    union {
+        struct inotify_event ev;
+        char bytes[64 * 1024];
+    } buf;
+    int events = 0;
+    int overflow = 0;
+    ssize_t n;
+    while ((n = read(watch->fd, buf.bytes, sizeof(buf.bytes))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)(buf.bytes + off);
+            off += sizeof(struct inotify_event) + ev->len;
+            events++;
+            if (ev->mask & IN_Q_OVERFLOW)
+                overflow = 1;
+            else if (!overflow && !watch->stats[WATCH_ROOT_GONE])
+                watch_event(watch, ev);
+        }
+    }
+
+    // Events were lost, so nothing short of a full walk is trustworthy
+    if (overflow && !watch->stats[WATCH_ROOT_GONE]) {
+        watch->stats[WATCH_OVERFLOWS]++;
+        watch_walk_root(watch);
+    }
+    watch_compact_dirs(watch);
+    watch->stats[WATCH_EVENTS] += events;
+    return events;
+}
+
+// Copy the current totals out in the analyze_directory layout, plus the
+// walker's counters since the start and WATCH_STAT_FIELDS watch counters.
+// Returns the number of languages written.
+int cloc_watch_results(
+    void* handle,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* walk_stats_out,
+    long long* watch_stats_out
+) {
+    cloc_watch_t* watch = handle;
+    int count = write_lang_totals(watch->db, watch->totals, lang_names_out, lang_stats_out, max_langs);
+    memcpy(walk_stats_out, watch->w->stats, sizeof(watch->w->stats));
+    memcpy(watch_stats_out, watch->stats, sizeof(watch->stats));
+    return count;
+}
+
+#else
+
+void* cloc_watch_start(void* handle, const char* root, int flags) {
+    (void)handle;
+    (void)root;
+    (void)flags;
+    return 0;
+}
+
+int cloc_watch_poll(void* handle, int timeout_ms) {
+    (void)handle;
+    (void)timeout_ms;
+    return 0;
+}
+
+int cloc_watch_results(
+    void* handle,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* walk_stats_out,
+    long long* watch_stats_out
+) {
+    (void)handle;
+    (void)lang_names_out;
+    (void)lang_stats_out;
+    (void)max_langs;
+    (void)walk_stats_out;
+    (void)watch_stats_out;
+    return -1;
+}
+
+void cloc_watch_stop(void* handle) {
+    (void)handle;
+}
+
+static const ignore_level_t* watch_add_dir(struct cloc_watch* watch, const char* path, const struct stat* st,
+                                           ignore_level_t* level, const ignore_level_t* parent) {
+    (void)watch;
+    (void)path;
+    (void)st;
+    return level->rule_count ? level : parent;
+}
+
+static void watch_track_file(struct cloc_watch* watch, const char* path, int lang, const int* counts,
+                             long long size) {
+    (void)watch;
+    (void)path;
+    (void)lang;
+    (void)counts;
+    (void)size;
+}
+
+#endif
+
+// INFLATE - DEFLATE (RFC 1951) decoding for git objects and archives
+//
+// A small table-driven decoder with no zlib dependency, so every build of
+// the engine (TinyCC included) can read compressed data. Input comes from
+// in..in_end, topped up through `fill` when it runs dry. Output goes either
+// straight into a caller buffer of known size (`sink` unset; overflowing it
+// is an error) or through a window that is handed to `sink` whenever it
+// fills, keeping the last 32 KiB for back-references. Huffman codes up to
+// INFLATE_FAST_BITS long are resolved with one table lookup, longer ones bit
+// by bit. zlib streams have their Adler-32 trailer checked; gzip and zip
+// checksums are left to the archive readers.
+
+#define INFLATE_FAST_BITS 9
+#define INFLATE_HISTORY 32768
+#define INFLATE_MAX_MATCH 258
+#define INFLATE_WINDOW (2 * INFLATE_HISTORY) // window size for sink mode
+#define INFLATE_MAX_RATIO 1032    // no DEFLATE stream expands its input more than this
+
+typedef struct {
+    unsigned short fast[1 << INFLATE_FAST_BITS]; // length << 9 | symbol, 0 for longer codes
+    unsigned short count[16];                    // codes of each length
+    unsigned short symbol[288];                  // symbols in canonical code order
+} huffman_t;
+
+typedef struct inflate_state {
+    const unsigned char* in;
+    const unsigned char* in_end;
+    int (*fill)(struct inflate_state* z);        // refill in..in_end; 0 when input has ended
+    void* arg;                                   // for fill and sink
+    unsigned long long bits;
+    int bit_count;
+    unsigned char* out;
+    long long out_pos;
+    long long out_cap;
+    long long out_flushed;                       // sink mode: out[0..out_flushed) was handed over
+    int (*sink)(void* arg, const unsigned char* data, long long len); // non-zero stops
+    huffman_t lit;
+    huffman_t dist;
+} inflate_state_t;
+
+static const unsigned short inflate_len_base[29] = { 3,  4,  5,  6,  7,  8,  9,  10,  11,  13,  15,  17,  19,  23, 27,
+                                                     31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char inflate_len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                     2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short inflate_dist_base[30] = { 1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                                      33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                                      1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char inflate_dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                                      6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Canonical code from code lengths; incomplete codes are accepted (an
+// unused code then fails to decode), over-subscribed ones are not
+static int huffman_build(huffman_t* h, const unsigned char* lengths, int n) {
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++) h->count[lengths[i]]++;
+    h->count[0] = 0;
+
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0) return -1;
+    }
+
+    int offs[16];
+    int next[16];
+    offs[1] = 0;
+    next[1] = 0;
+    for (int len = 1; len < 15; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+        next[len + 1] = (next[len] + h->count[len]) << 1;
+    }
+
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int sym = 0; sym < n; sym++) {
+        int len = lengths[sym];
+        if (!len) continue;
+        h->symbol[offs[len]++] = (unsigned short)sym;
+
+        // Codes are sent most significant bit first into a stream read from
+        // the least significant end, so the table is indexed bit-reversed
+        int code = next[len]++;
+        if (len > INFLATE_FAST_BITS) continue;
+        int rev = 0;
+        for (int b = 0; b < len; b++) rev |= ((code >> b) & 1) << (len - 1 - b);
+        for (int r = rev; r < (1 << INFLATE_FAST_BITS); r += 1 << len) h->fast[r] = (unsigned short)(len << 9 | sym);
+    }
+    return 0;
+}
+
+// Top up to at least `need` bits; -1 if the input ends first
+static int inflate_need(inflate_state_t* z, int need) {
+    while (z->bit_count < need) {
+        if (z->in == z->in_end && (!z->fill || !z->fill(z))) return -1;
+        z->bits |= (unsigned long long)*z->in++ << z->bit_count;
+        z->bit_count += 8;
+    }
+    return 0;
+}
+
+static int inflate_bits(inflate_state_t* z, int n) {
+    if (inflate_need(z, n) != 0) return -1;
+    int v = (int)(z->bits & ((1ull << n) - 1));
+    z->bits >>= n;
+    z->bit_count -= n;
+    return v;
+}
+
+static int huffman_decode(inflate_state_t* z, const huffman_t* h) {
+    if (z->bit_count < 15) {
+        // Near the end of the input fewer bits may be left than a long code
+        // needs; whatever is there still decodes a short one
+        while (z->bit_count <= 56 && (z->in < z->in_end || (z->fill && z->fill(z)))) {
+            z->bits |= (unsigned long long)*z->in++ << z->bit_count;
+            z->bit_count += 8;
+        }
+    }
+    unsigned e = h->fast[z->bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (e && (int)(e >> 9) <= z->bit_count) {
+        z->bits >>= e >> 9;
+        z->bit_count -= e >> 9;
+        return e & 511;
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16 && z->bit_count > 0; len++) {
+        code |= (int)(z->bits & 1);
+        z->bits >>= 1;
+        z->bit_count--;
+        int count = h->count[len];
+        if (code - count < first) return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// Make room for `need` more output bytes, handing the window to the sink
+// if there is one
+static int inflate_room(inflate_state_t* z, long long need) {
+    if (z->out_pos + need <= z->out_cap) return 0;
+    if (!z->sink || z->sink(z->arg, z->out + z->out_flushed, z->out_pos - z->out_flushed) != 0) return -1;
+    long long keep = z->out_pos < INFLATE_HISTORY ? z->out_pos : INFLATE_HISTORY;
+    memmove(z->out, z->out + z->out_pos - keep, keep);
+    z->out_pos = z->out_flushed = keep;
+    return 0;
+}
+
+static int inflate_stored(inflate_state_t* z) {
+    z->bits >>= z->bit_count & 7;
+    z->bit_count -= z->bit_count & 7;
+    int len = inflate_bits(z, 16);
+    int nlen = inflate_bits(z, 16);
+    if (len < 0 || nlen < 0 || len != (~nlen & 0xffff)) return -1;
+
+    while (len > 0) {
+        if (z->out_pos == z->out_cap && inflate_room(z, 1) != 0) return -1;
+        if (z->bit_count >= 8) {
+            z->out[z->out_pos++] = (unsigned char)z->bits;
+            z->bits >>= 8;
+            z->bit_count -= 8;
+            len--;
+            continue;
+        }
+        if (z->in == z->in_end && (!z->fill || !z->fill(z))) return -1;
+        long long n = z->in_end - z->in;
+        if (n > len) n = len;
+        if (n > z->out_cap - z->out_pos) n = z->out_cap - z->out_pos;
+        memcpy(z->out + z->out_pos, z->in, n);
+        z->out_pos += n;
+        z->in += n;
+        len -= (int)n;
+    }
+    return 0;
+}
+
+static int inflate_codes(inflate_state_t* z, const huffman_t* lit, const huffman_t* dist) {
+    for (;;) {
+        int sym = huffman_decode(z, lit);
+        if (sym < 0) return -1;
+        if (sym < 256) {
+            if (z->out_pos == z->out_cap && inflate_room(z, 1) != 0) return -1;
+            z->out[z->out_pos++] = (unsigned char)sym;
+            continue;
+        }
+        if (sym == 256) return 0;
+
+        sym -= 257;
+        if (sym >= 29) return -1;
+        int extra = inflate_bits(z, inflate_len_extra[sym]);
+        int dsym = huffman_decode(z, dist);
+        if (extra < 0 || dsym < 0 || dsym >= 30) return -1;
+        int len = inflate_len_base[sym] + extra;
+        extra = inflate_bits(z, inflate_dist_extra[dsym]);
+        if (extra < 0) return -1;
+        long long d = inflate_dist_base[dsym] + extra;
+
+        if (inflate_room(z, len) != 0 || d > z->out_pos) return -1;
+        unsigned char* to = z->out + z->out_pos;
+        const unsigned char* from = to - d;
+        if (d >= len) {
+            memcpy(to, from, len);
+        } else {
+            for (int i = 0; i < len; i++) to[i] = from[i];
+        }
+        z->out_pos += len;
+    }
+}
+
+static huffman_t g_fixed_lit;
+static huffman_t g_fixed_dist;
+static pthread_once_t g_fixed_once = PTHREAD_ONCE_INIT;
+
+static void inflate_fixed_init(void) {
+    unsigned char lengths[288];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    huffman_build(&g_fixed_lit, lengths, 288);
+    memset(lengths, 5, 30);
+    huffman_build(&g_fixed_dist, lengths, 30);
+}
+
+static int inflate_dynamic(inflate_state_t* z) {
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char lengths[320];
+
+    int nlen = inflate_bits(z, 5) + 257;
+    int ndist = inflate_bits(z, 5) + 1;
+    int ncode = inflate_bits(z, 4) + 4;
+    if (nlen < 257 || ndist < 1 || ncode < 4 || nlen > 286 || ndist > 30) return -1;
+
+    memset(lengths, 0, 19);
+    for (int i = 0; i < ncode; i++) {
+        int len = inflate_bits(z, 3);
+        if (len < 0) return -1;
+        lengths[order[i]] = (unsigned char)len;
+    }
+    if (huffman_build(&z->lit, lengths, 19) != 0) return -1;
+
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = huffman_decode(z, &z->lit);
+        if (sym < 0) return -1;
+        if (sym < 16) {
+            lengths[i++] = (unsigned char)sym;
+            continue;
+        }
+        int len = 0, extra, rep;
+        if (sym == 16) {
+            if (i == 0) return -1;
+            len = lengths[i - 1];
+            rep = 3 + (extra = inflate_bits(z, 2));
+        } else if (sym == 17) {
+            rep = 3 + (extra = inflate_bits(z, 3));
+        } else {
+            rep = 11 + (extra = inflate_bits(z, 7));
+        }
+        if (extra < 0 || i + rep > nlen + ndist) return -1;
+        while (rep--) lengths[i++] = (unsigned char)len;
+    }
+    if (lengths[256] == 0) return -1;
+
+    if (huffman_build(&z->lit, lengths, nlen) != 0 || huffman_build(&z->dist, lengths + nlen, ndist) != 0) return -1;
+    return inflate_codes(z, &z->lit, &z->dist);
+}
+
+// Decode one raw DEFLATE stream up to and including its final block, then
+// hand the rest of the window to the sink. Returns 0, or -1 on corrupt or
+// truncated input, output overflow, or a sink that stopped.
+static int inflate_run(inflate_state_t* z) {
+    pthread_once(&g_fixed_once, inflate_fixed_init);
+    int last;
+    do {
+        last = inflate_bits(z, 1);
+        int type = inflate_bits(z, 2);
+        int rc;
+        if (last < 0 || type < 0) return -1;
+        if (type == 0) rc = inflate_stored(z);
+        else if (type == 1) rc = inflate_codes(z, &g_fixed_lit, &g_fixed_dist);
+        else if (type == 2) rc = inflate_dynamic(z);
+        else rc = -1;
+        if (rc != 0) return -1;
+    } while (!last);
+
+    if (z->sink && z->out_pos > z->out_flushed) {
+        if (z->sink(z->arg, z->out + z->out_flushed, z->out_pos - z->out_flushed) != 0) return -1;
+        z->out_flushed = z->out_pos;
+    }
+    return 0;
+}
+
+// Skip a zlib (RFC 1950) header
+static int zlib_header(inflate_state_t* z) {
+    int cmf = inflate_bits(z, 8);
+    int flg = inflate_bits(z, 8);
+    if (cmf < 0 || flg < 0 || (cmf & 0x0f) != 8 || (cmf << 8 | flg) % 31 != 0 || (flg & 0x20)) return -1;
+    return 0;
+}
+
+static unsigned adler32(const unsigned char* data, long long len) {
+    unsigned long long a = 1, b = 0;
+    while (len > 0) {
+        // The most bytes before b can overflow 32 bits, as in zlib
+        long long n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (unsigned)(b << 16 | a);
+}
+
+// Check the big-endian Adler-32 of the whole output that follows the final
+// block, from the next byte boundary. Returns 0 if it matches.
+static int zlib_trailer(inflate_state_t* z, const unsigned char* data, long long len) {
+    z->bits >>= z->bit_count & 7;
+    z->bit_count &= ~7;
+    unsigned sum = 0;
+    for (int i = 0; i < 4; i++) {
+        int byte = inflate_bits(z, 8);
+        if (byte < 0) return -1;
+        sum = sum << 8 | (unsigned)byte;
+    }
+    return sum == adler32(data, len) ? 0 : -1;
+}
+
+// Inflate a zlib stream of known output size into out. Returns 0 if it
+// decodes to exactly out_len bytes.
+static int zlib_inflate(const unsigned char* in, long long in_len, unsigned char* out, long long out_len) {
+    inflate_state_t z;
+    memset(&z, 0, sizeof(z));
+    z.in = in;
+    z.in_end = in + in_len;
+    z.out = out;
+    z.out_cap = out_len;
+    if (zlib_header(&z) != 0 || inflate_run(&z) != 0 || z.out_pos != out_len) return -1;
+    return zlib_trailer(&z, out, out_len);
+}
+
+// GIT OBJECT STORE - count a revision straight from .git, without a checkout
+//
+// cloc_git_open finds the git directory of a work tree, a linked work tree
+// or a bare repository and maps every pack and its .idx (version 2) in the
+// object directory and its alternates. A revision is a full or abbreviated
+// object id or a ref name (looked up in the order git uses, loose refs
+// before packed-refs), optionally followed by ~N and ^N. Its commit's tree
+// is walked like a directory: ignore files are read from the tree's own
+// blobs, and the hidden-file rule and language detection are the walker's,
+// so a revision counts the same as its checkout would. Blobs are inflated
+// from their pack (rebuilding delta chains, with recent bases cached) or
+// their loose object into the walker's buffer; blobs of unknown languages
+// are never read. Symlinks and submodules are skipped. A repository handle
+// is used by one thread at a time.
+
+#define GIT_MAX_OBJECT_DIRS 8
+#define GIT_CACHE_SLOTS 1024          // power of two
+#define GIT_CACHE_BYTES (64ll << 20)
+#define GIT_MAX_DELTA_DEPTH 10000
+
+enum {
+    GIT_OBJ_COMMIT = 1,
+    GIT_OBJ_TREE = 2,
+    GIT_OBJ_BLOB = 3,
+    GIT_OBJ_TAG = 4,
+    GIT_OBJ_OFS_DELTA = 6,
+    GIT_OBJ_REF_DELTA = 7
+};
+
+// Why cloc_git_open returned no repository
+enum {
+    GIT_OPEN_OK,
+    GIT_OPEN_NOT_FOUND,       // no git directory with a HEAD and objects
+    GIT_OPEN_OBJECT_FORMAT,   // extensions.objectFormat isn't sha1
+};
+
+enum {
+    GIT_OBJECTS_PACKED,       // objects read from packs
+    GIT_OBJECTS_LOOSE,        // objects read from loose files
+    GIT_DELTAS,               // deltas applied to rebuild packed objects
+    GIT_CACHE_HITS,           // delta chains cut short by a cached base
+    GIT_BYTES_INFLATED,
+    GIT_PACKS,                // packs mapped
+    GIT_STAT_FIELDS
+};
+
+typedef struct {
+    unsigned char* data;
+    long long len;
+    long long cap;
+} byte_buf_t;
+
+static int byte_buf_reserve(byte_buf_t* b, long long need) {
+    if (need <= b->cap) return 0;
+    long long cap = b->cap ? b->cap : 4096;
+    while (cap < need) cap *= 2;
+    unsigned char* p = realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+typedef struct {
+    const unsigned char* idx;
+    long long idx_size;
+    const unsigned char* pack;
+    long long pack_size;
+    long long count;
+} git_pack_t;
+
+typedef struct {
+    int pack;
+    int type;
+    long long offset;
+    unsigned char* data;      // 0 for an empty slot
+    long long size;
+} git_cache_slot_t;
+
+typedef struct {
+    char git_dir[4096];       // HEAD and the work tree's own pseudo-refs
+    char common_dir[4096];    // refs, packed-refs and objects
+    char* object_dirs[GIT_MAX_OBJECT_DIRS]; // objects/ and its alternates
+    int object_dir_count;
+    git_pack_t* packs;
+    int pack_count;
+    int last_pack;            // where the previous lookup hit
+    git_cache_slot_t* cache;  // delta bases, direct-mapped by pack and offset
+    long long cache_bytes;
+    long long* chain;         // (pack, offset) pairs of a delta chain
+    int chain_cap;
+    byte_buf_t delta;         // an inflated delta
+    byte_buf_t scratch;       // the other side of applying one
+    byte_buf_t file;          // a loose object or packed-refs as stored
+    byte_buf_t meta;          // commits and tags while resolving a revision
+    unsigned char window[INFLATE_WINDOW];
+    long long stats[GIT_STAT_FIELDS];
+} git_repo_t;
+
+static unsigned git_be32(const unsigned char* p) {
+    return (unsigned)p[0] << 24 | (unsigned)p[1] << 16 | (unsigned)p[2] << 8 | p[3];
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = ascii_lower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static int git_parse_id(const char* hex, unsigned char* id) {
+    for (int i = 0; i < 20; i++) {
+        int hi = hex_digit(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_digit(hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        id[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+static void git_format_id(const unsigned char* id, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 20; i++) {
+        hex[2 * i] = digits[id[i] >> 4];
+        hex[2 * i + 1] = digits[id[i] & 15];
+    }
+    hex[40] = '\0';
+}
+
+// dir/name, or name itself if it is absolute
+static int git_path(char* out, int cap, const char* dir, const char* name) {
+    int n = name[0] == '/' ? snprintf(out, cap, "%s", name) : snprintf(out, cap, "%s/%s", dir, name);
+    return n >= 0 && n < cap ? 0 : -1;
+}
+
+// Read a whole file into b; returns its size or -1
+static long long read_whole_file(const char* path, byte_buf_t* b) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || byte_buf_reserve(b, st.st_size + 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    b->len = 0;
+    while (b->len < st.st_size) {
+        ssize_t n = read(fd, b->data + b->len, st.st_size - b->len);
+        if (n <= 0) break;
+        b->len += n;
+    }
+    close(fd);
+    return b->len == st.st_size ? b->len : -1;
+}
+
+// A small text file (a ref, gitdir or commondir) without trailing whitespace
+static int read_text_file(const char* path, char* out, int cap) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int len = 0;
+    ssize_t n;
+    while (len < cap - 1 && (n = read(fd, out + len, cap - 1 - len)) > 0) len += (int)n;
+    close(fd);
+    while (len > 0 && (out[len - 1] == '\n' || out[len - 1] == '\r' || out[len - 1] == ' ')) len--;
+    out[len] = '\0';
+    return len;
+}
+
+static const unsigned char* map_file(const char* path, long long* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    *size = st.st_size;
+    return map;
+}
+
+// Map one .idx/.pack pair if both are well formed
+static void git_add_pack(git_repo_t* repo, const char* idx_path) {
+    char pack_path[4096];
+    int len = (int)strlen(idx_path);
+    if (len + 2 > (int)sizeof(pack_path)) return;
+    memcpy(pack_path, idx_path, len - 4);
+    memcpy(pack_path + len - 4, ".pack", 6);
+
+    git_pack_t p;
+    memset(&p, 0, sizeof(p));
+    p.idx = map_file(idx_path, &p.idx_size);
+    p.pack = map_file(pack_path, &p.pack_size);
+
+    // Version 2 index: magic, fanout, ids, CRCs, offsets, large offsets, checksums
+    int ok = p.idx && p.pack && p.idx_size >= 8 + 1024 + 40 && memcmp(p.idx, "\377tOc", 4) == 0 &&
+             git_be32(p.idx + 4) == 2 && p.pack_size >= 32 && memcmp(p.pack, "PACK", 4) == 0;
+    if (ok) {
+        p.count = git_be32(p.idx + 8 + 255 * 4);
+        ok = p.count <= (p.idx_size - 8 - 1024 - 40) / 28 && git_be32(p.pack + 8) == p.count;
+    }
+    for (int i = 0; ok && i < 255; i++) ok = git_be32(p.idx + 8 + i * 4) <= git_be32(p.idx + 8 + (i + 1) * 4);
+
+    git_pack_t* packs = ok ? realloc(repo->packs, (repo->pack_count + 1) * sizeof(git_pack_t)) : 0;
+    if (!packs) {
+        if (p.idx) munmap((void*)p.idx, p.idx_size);
+        if (p.pack) munmap((void*)p.pack, p.pack_size);
+        return;
+    }
+    repo->packs = packs;
+    repo->packs[repo->pack_count++] = p;
+    repo->stats[GIT_PACKS]++;
+}
+
+// An object directory, its packs and (nested as deep as git allows) the
+// alternates it borrows from
+static void git_add_object_dir(git_repo_t* repo, const char* dir, int depth) {
+    if (repo->object_dir_count == GIT_MAX_OBJECT_DIRS || depth > 5) return;
+    char* copy = strdup(dir);
+    if (!copy) return;
+    repo->object_dirs[repo->object_dir_count++] = copy;
+
+    char path[4096];
+    if (git_path(path, sizeof(path), dir, "pack") == 0) {
+        DIR* packs = opendir(path);
+        struct dirent* entry;
+        while (packs && (entry = readdir(packs))) {
+            int len = (int)strlen(entry->d_name);
+            char idx_path[4096];
+            if (len > 4 && strcmp(entry->d_name + len - 4, ".idx") == 0 &&
+                snprintf(idx_path, sizeof(idx_path), "%s/%s", path, entry->d_name) < (int)sizeof(idx_path)) {
+                git_add_pack(repo, idx_path);
+            }
+        }
+        if (packs) closedir(packs);
+    }
+
+    char alternates[8192];
+    if (git_path(path, sizeof(path), dir, "info/alternates") != 0 ||
+        read_text_file(path, alternates, sizeof(alternates)) <= 0) {
+        return;
+    }
+    char* save;
+    for (char* line = strtok_r(alternates, "\n", &save); line; line = strtok_r(0, "\n", &save)) {
+        if (line[0] == '#' || line[0] == '\0') continue;
+        char alt[4096];
+        if (git_path(alt, sizeof(alt), dir, line) == 0) git_add_object_dir(repo, alt, depth + 1);
+    }
+}
+
+void cloc_git_close(void* handle) {
+    git_repo_t* repo = handle;
+    if (!repo) return;
+    for (int i = 0; i < repo->pack_count; i++) {
+        munmap((void*)repo->packs[i].idx, repo->packs[i].idx_size);
+        munmap((void*)repo->packs[i].pack, repo->packs[i].pack_size);
+    }
+    for (int i = 0; i < repo->object_dir_count; i++) free(repo->object_dirs[i]);
+    for (int i = 0; repo->cache && i < GIT_CACHE_SLOTS; i++) free(repo->cache[i].data);
+    free(repo->cache);
+    free(repo->packs);
+    free(repo->chain);
+    free(repo->delta.data);
+    free(repo->scratch.data);
+    free(repo->file.data);
+    free(repo->meta.data);
+    free(repo);
+}
+
+// Whether a config file sets extensions.objectFormat to anything but sha1.
+// Object ids are 20 bytes throughout, so such a repository can't be read.
+static int git_config_foreign_format(git_repo_t* repo, const char* config) {
+    long long len = read_whole_file(config, &repo->file);
+    if (len < 0) return 0;
+    char* text = (char*)repo->file.data;
+    text[len] = '\0';
+    int in_extensions = 0;
+    char* save;
+    for (char* line = strtok_r(text, "\n", &save); line; line = strtok_r(0, "\n", &save)) {
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '[') {
+            in_extensions = strncasecmp(line, "[extensions]", 12) == 0;
+            continue;
+        }
+        if (!in_extensions || strncasecmp(line, "objectformat", 12) != 0) continue;
+        const char* value = line + 12;
+        while (*value == ' ' || *value == '\t') value++;
+        if (*value++ != '=') continue;
+        while (*value == ' ' || *value == '\t') value++;
+        return strncasecmp(value, "sha1", 4) != 0;
+    }
+    return 0;
+}
+
+// Open the repository of a work tree (its .git directory, or the .git file
+// of a linked work tree), or a bare repository. Returns 0 if path is none
+// or the repository can't be read, with the reason in status_out (a
+// GIT_OPEN_* value) if it is set.
+void* cloc_git_open(const char* path, int* status_out) {
+    if (status_out) *status_out = GIT_OPEN_NOT_FOUND;
+    git_repo_t* repo = calloc(1, sizeof(git_repo_t));
+    if (!repo) return 0;
+    repo->cache = calloc(GIT_CACHE_SLOTS, sizeof(git_cache_slot_t));
+
+    char dot_git[4096], link[4096], objects[4096];
+    struct stat st;
+    int ok = repo->cache && git_path(dot_git, sizeof(dot_git), path, ".git") == 0;
+    if (ok && stat(dot_git, &st) == 0 && S_ISDIR(st.st_mode)) {
+        str_copy(repo->git_dir, dot_git, sizeof(repo->git_dir));
+    } else if (ok && stat(dot_git, &st) == 0) {
+        ok = read_text_file(dot_git, link, sizeof(link)) > 8 && strncmp(link, "gitdir: ", 8) == 0 &&
+             git_path(repo->git_dir, sizeof(repo->git_dir), path, link + 8) == 0;
+    } else if (ok) {
+        str_copy(repo->git_dir, path, sizeof(repo->git_dir));
+    }
+
+    // Linked work trees share the refs and objects of the main repository
+    if (ok && git_path(link, sizeof(link), repo->git_dir, "commondir") == 0 &&
+        read_text_file(link, objects, sizeof(objects)) > 0) {
+        ok = git_path(repo->common_dir, sizeof(repo->common_dir), repo->git_dir, objects) == 0;
+    } else {
+        str_copy(repo->common_dir, repo->git_dir, sizeof(repo->common_dir));
+    }
+
+    ok = ok && git_path(link, sizeof(link), repo->git_dir, "HEAD") == 0 && stat(link, &st) == 0 &&
+         git_path(objects, sizeof(objects), repo->common_dir, "objects") == 0 && stat(objects, &st) == 0 &&
+         S_ISDIR(st.st_mode);
+    if (ok && git_path(link, sizeof(link), repo->common_dir, "config") == 0 &&
+        git_config_foreign_format(repo, link)) {
+        if (status_out) *status_out = GIT_OPEN_OBJECT_FORMAT;
+        ok = 0;
+    }
+    if (!ok) {
+        cloc_git_close(repo);
+        return 0;
+    }
+    git_add_object_dir(repo, objects, 0);
+    if (status_out) *status_out = GIT_OPEN_OK;
+    return repo;
+}
+
+static long long git_pack_offset(const git_pack_t* p, long long i) {
+    const unsigned char* offsets = p->idx + 8 + 1024 + p->count * 24;
+    unsigned off = git_be32(offsets + i * 4);
+    if (!(off & 0x80000000u)) return off;
+
+    // Packs over 2 GiB keep the larger offsets in a table of their own
+    long long at = 8 + 1024 + p->count * 28 + (long long)(off & 0x7fffffffu) * 8;
+    if (at + 8 > p->idx_size - 40) return -1;
+    return (long long)git_be32(p->idx + at) << 32 | git_be32(p->idx + at + 4);
+}
+
+// Binary search within the ids sharing the first byte
+static long long git_pack_find(const git_pack_t* p, const unsigned char* id) {
+    const unsigned char* fanout = p->idx + 8;
+    long long lo = id[0] ? git_be32(fanout + (id[0] - 1) * 4) : 0;
+    long long hi = git_be32(fanout + id[0] * 4);
+    const unsigned char* ids = fanout + 1024;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(ids + mid * 20, id, 20);
+        if (cmp == 0) return git_pack_offset(p, mid);
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+static int git_find_packed(git_repo_t* repo, const unsigned char* id, int* pack, long long* offset) {
+    for (int i = 0; i < repo->pack_count; i++) {
+        int p = (repo->last_pack + i) % repo->pack_count;
+        long long off = git_pack_find(&repo->packs[p], id);
+        if (off >= 0) {
+            repo->last_pack = p;
+            *pack = p;
+            *offset = off;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Parse the pack entry at offset: its type, inflated size and where its
+// zlib data starts, and for deltas where the base is
+static int git_pack_entry(const git_pack_t* p, long long offset, int* type, long long* size, long long* data_off,
+                          long long* base_off, const unsigned char** base_id) {
+    long long end = p->pack_size - 20;
+    if (offset < 12 || offset >= end) return -1;
+    long long start = offset;
+    const unsigned char* d = p->pack;
+    unsigned c = d[offset++];
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    for (int shift = 4; c & 0x80; shift += 7) {
+        if (offset >= end || shift > 56) return -1;
+        c = d[offset++];
+        *size |= (long long)(c & 0x7f) << shift;
+    }
+
+    if (*type == GIT_OBJ_OFS_DELTA) {
+        // Big-endian base-128 with an implicit +1 per continuation byte
+        if (offset >= end) return -1;
+        c = d[offset++];
+        long long back = c & 0x7f;
+        while (c & 0x80) {
+            if (offset >= end || back > (1ll << 55)) return -1;
+            c = d[offset++];
+            back = ((back + 1) << 7) | (c & 0x7f);
+        }
+        *base_off = start - back;
+        if (back <= 0 || *base_off < 12) return -1;
+    } else if (*type == GIT_OBJ_REF_DELTA) {
+        if (offset + 20 > end) return -1;
+        *base_id = d + offset;
+        offset += 20;
+    }
+    *data_off = offset;
+    return 0;
+}
+
+static git_cache_slot_t* git_cache_slot(git_repo_t* repo, int pack, long long offset) {
+    unsigned long long h = ((unsigned long long)offset ^ (unsigned long long)pack << 48) * 0x9E3779B97F4A7C15ull;
+    return &repo->cache[h >> 54 & (GIT_CACHE_SLOTS - 1)];
+}
+
+// Keep a copy of a delta base; an object too big for the budget is not kept
+static void git_cache_store(git_repo_t* repo, int pack, long long offset, int type, const unsigned char* data,
+                            long long size) {
+    git_cache_slot_t* slot = git_cache_slot(repo, pack, offset);
+    if (slot->data) {
+        repo->cache_bytes -= slot->size;
+        free(slot->data);
+        slot->data = 0;
+    }
+    if (size > GIT_CACHE_BYTES / 16 || repo->cache_bytes + size > GIT_CACHE_BYTES) return;
+    slot->data = malloc(size ? size : 1);
+    if (!slot->data) return;
+    memcpy(slot->data, data, size);
+    slot->pack = pack;
+    slot->type = type;
+    slot->offset = offset;
+    slot->size = size;
+    repo->cache_bytes += size;
+}
+
+static long long git_delta_size(const unsigned char** p, const unsigned char* end) {
+    long long size = 0;
+    for (int shift = 0; *p < end && shift < 63; shift += 7) {
+        unsigned c = *(*p)++;
+        size |= (long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return size;
+    }
+    return -1;
+}
+
+// Rebuild an object from its base and a delta of copy and insert opcodes
+static int git_apply_delta(const unsigned char* base, long long base_len, const unsigned char* delta,
+                           long long delta_len, byte_buf_t* out) {
+    const unsigned char* p = delta;
+    const unsigned char* end = delta + delta_len;
+    long long src_len = git_delta_size(&p, end);
+    long long dst_len = git_delta_size(&p, end);
+    if (src_len != base_len || dst_len < 0 || byte_buf_reserve(out, dst_len ? dst_len : 1) != 0) return -1;
+
+    long long n = 0;
+    while (p < end) {
+        unsigned op = *p++;
+        if (op & 0x80) {
+            long long off = 0, len = 0;
+            for (int i = 0; i < 4; i++) {
+                if (!(op & (1u << i))) continue;
+                if (p == end) return -1;
+                off |= (long long)*p++ << (8 * i);
+            }
+            for (int i = 0; i < 3; i++) {
+                if (!(op & (0x10u << i))) continue;
+                if (p == end) return -1;
+                len |= (long long)*p++ << (8 * i);
+            }
+            if (len == 0) len = 0x10000;
+            if (off + len > base_len || n + len > dst_len) return -1;
+            memcpy(out->data + n, base + off, len);
+            n += len;
+        } else if (op) {
+            if (op > end - p || n + op > dst_len) return -1;
+            memcpy(out->data + n, p, op);
+            p += op;
+            n += op;
+        } else {
+            return -1;
+        }
+    }
+    out->len = n;
+    return n == dst_len ? 0 : -1;
+}
+
+static int git_loose_sink(void* arg, const unsigned char* data, long long len) {
+    byte_buf_t* b = arg;
+    if (byte_buf_reserve(b, b->len + len) != 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// A loose object is one zlib stream of "<type> <size>\0" and the content
+static int git_read_loose(git_repo_t* repo, const unsigned char* id, int* type, byte_buf_t* out) {
+    static const char* const type_names[] = { 0, "commit", "tree", "blob", "tag" };
+    char hex[41], path[4096];
+    git_format_id(id, hex);
+    long long stored = -1;
+    for (int i = 0; i < repo->object_dir_count && stored < 0; i++) {
+        if (snprintf(path, sizeof(path), "%s/%.2s/%s", repo->object_dirs[i], hex, hex + 2) < (int)sizeof(path)) {
+            stored = read_whole_file(path, &repo->file);
+        }
+    }
+    if (stored < 0) return -1;
+
+    inflate_state_t z;
+    memset(&z, 0, sizeof(z));
+    z.in = repo->file.data;
+    z.in_end = repo->file.data + stored;
+    z.out = repo->window;
+    z.out_cap = INFLATE_WINDOW;
+    z.sink = git_loose_sink;
+    z.arg = out;
+    out->len = 0;
+    if (zlib_header(&z) != 0 || inflate_run(&z) != 0 || zlib_trailer(&z, out->data, out->len) != 0) return -1;
+
+    const unsigned char* nul = memchr(out->data, 0, out->len < 32 ? out->len : 32);
+    if (!nul) return -1;
+    long long header = nul - out->data + 1;
+    *type = 0;
+    for (int t = GIT_OBJ_COMMIT; t <= GIT_OBJ_TAG; t++) {
+        int len = (int)strlen(type_names[t]);
+        if (memcmp(out->data, type_names[t], len) == 0 && out->data[len] == ' ') *type = t;
+    }
+    if (!*type || atoll((const char*)out->data + strlen(type_names[*type]) + 1) != out->len - header) return -1;
+
+    memmove(out->data, out->data + header, out->len - header);
+    out->len -= header;
+    repo->stats[GIT_OBJECTS_LOOSE]++;
+    repo->stats[GIT_BYTES_INFLATED] += out->len;
+    return 0;
+}
+
+static int git_inflate_entry(git_repo_t* repo, int pack, long long data_off, long long size, byte_buf_t* out) {
+    const git_pack_t* p = &repo->packs[pack];
+    if (byte_buf_reserve(out, size ? size : 1) != 0 ||
+        zlib_inflate(p->pack + data_off, p->pack_size - 20 - data_off, out->data, size) != 0) {
+        return -1;
+    }
+    out->len = size;
+    repo->stats[GIT_BYTES_INFLATED] += size;
+    return 0;
+}
+
+// Follow a delta chain down to a whole (or cached) object, then apply the
+// deltas back up. Every intermediate object is a base a sibling delta is
+// likely to need next, so they are the ones cached.
+static int git_read_packed(git_repo_t* repo, int pack, long long offset, int* type_out, byte_buf_t* out) {
+    int depth = 0;
+    int type = 0;
+    long long size, data_off, base_off;
+    const unsigned char* base_id;
+    for (;;) {
+        git_cache_slot_t* slot = git_cache_slot(repo, pack, offset);
+        if (slot->data && slot->pack == pack && slot->offset == offset) {
+            if (byte_buf_reserve(out, slot->size ? slot->size : 1) != 0) return -1;
+            memcpy(out->data, slot->data, slot->size);
+            out->len = slot->size;
+            type = slot->type;
+            repo->stats[GIT_CACHE_HITS]++;
+            break;
+        }
+        if (git_pack_entry(&repo->packs[pack], offset, &type, &size, &data_off, &base_off, &base_id) != 0) return -1;
+        if (type != GIT_OBJ_OFS_DELTA && type != GIT_OBJ_REF_DELTA) {
+            if (type < GIT_OBJ_COMMIT || type > GIT_OBJ_TAG || git_inflate_entry(repo, pack, data_off, size, out) != 0) {
+                return -1;
+            }
+            if (depth) git_cache_store(repo, pack, offset, type, out->data, out->len);
+            break;
+        }
+
+        if (depth == GIT_MAX_DELTA_DEPTH) return -1;
+        if (depth == repo->chain_cap &&
+            !grow_array((void**)&repo->chain, &repo->chain_cap, depth + 1, 2 * sizeof(long long))) {
+            return -1;
+        }
+        repo->chain[2 * depth] = pack;
+        repo->chain[2 * depth + 1] = offset;
+        depth++;
+        if (type == GIT_OBJ_OFS_DELTA) {
+            offset = base_off;
+        } else if (git_find_packed(repo, base_id, &pack, &offset) != 0) {
+            // The base of a ref delta may also be a loose object
+            if (git_read_loose(repo, base_id, &type, out) != 0) return -1;
+            break;
+        }
+    }
+
+    while (depth-- > 0) {
+        pack = (int)repo->chain[2 * depth];
+        offset = repo->chain[2 * depth + 1];
+        int delta_type;
+        if (git_pack_entry(&repo->packs[pack], offset, &delta_type, &size, &data_off, &base_off, &base_id) != 0 ||
+            git_inflate_entry(repo, pack, data_off, size, &repo->delta) != 0 ||
+            git_apply_delta(out->data, out->len, repo->delta.data, repo->delta.len, &repo->scratch) != 0) {
+            return -1;
+        }
+        byte_buf_t built = repo->scratch;
+        repo->scratch = *out;
+        *out = built;
+        repo->stats[GIT_DELTAS]++;
+        if (depth) git_cache_store(repo, pack, offset, type, out->data, out->len);
+    }
+    repo->stats[GIT_OBJECTS_PACKED]++;
+    *type_out = type;
+    return 0;
+}
+
+// Read an object into out (which may come back as a different allocation)
+static int git_read_object(git_repo_t* repo, const unsigned char* id, int* type, byte_buf_t* out) {
+    int pack;
+    long long offset;
+    if (git_find_packed(repo, id, &pack, &offset) == 0) return git_read_packed(repo, pack, offset, type, out);
+    return git_read_loose(repo, id, type, out);
+}
+
+// The id following "<field> " on a header line of a commit or tag (the
+// n-th such line for parents)
+static int git_header_id(const byte_buf_t* obj, const char* field, int n, unsigned char* id) {
+    int field_len = (int)strlen(field);
+    const char* p = (const char*)obj->data;
+    const char* end = p + obj->len;
+    while (p < end && *p != '\n') {
+        const char* eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (eol - p >= field_len + 41 && memcmp(p, field, field_len) == 0 && p[field_len] == ' ' && --n == 0) {
+            return git_parse_id(p + field_len + 1, id);
+        }
+        p = eol + 1;
+    }
+    return -1;
+}
+
+// Follow tags (and for trees, the commit) until an object of `want`
+static int git_peel(git_repo_t* repo, unsigned char* id, int want) {
+    for (int hops = 0; hops < 16; hops++) {
+        int type;
+        if (git_read_object(repo, id, &type, &repo->meta) != 0) return -1;
+        if (type == want) return 0;
+        if (type == GIT_OBJ_TAG) {
+            if (git_header_id(&repo->meta, "object", 1, id) != 0) return -1;
+        } else if (type == GIT_OBJ_COMMIT && want == GIT_OBJ_TREE) {
+            if (git_header_id(&repo->meta, "tree", 1, id) != 0) return -1;
+        } else {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// A ref's object id: the loose ref file (following symbolic refs), else
+// its line in packed-refs
+static int git_read_ref(git_repo_t* repo, const char* name, unsigned char* id, int depth) {
+    // Pseudo-refs like HEAD belong to the work tree, refs/ is shared
+    const char* dir = strncmp(name, "refs/", 5) == 0 ? repo->common_dir : repo->git_dir;
+    char path[4096], text[4096];
+    if (depth > 5 || git_path(path, sizeof(path), dir, name) != 0) return -1;
+    int len = read_text_file(path, text, sizeof(text));
+    if (len > 5 && strncmp(text, "ref: ", 5) == 0) return git_read_ref(repo, text + 5, id, depth + 1);
+    if (len >= 40) return git_parse_id(text, id);
+
+    int name_len = (int)strlen(name);
+    if (git_path(path, sizeof(path), repo->common_dir, "packed-refs") != 0) return -1;
+    long long size = read_whole_file(path, &repo->file);
+    const char* p = (const char*)repo->file.data;
+    const char* end = p + (size > 0 ? size : 0);
+    while (p < end) {
+        const char* eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (eol - p == 41 + name_len && p[40] == ' ' && memcmp(p + 41, name, name_len) == 0) {
+            return git_parse_id(p, id);
+        }
+        p = eol + 1;
+    }
+    return -1;
+}
+
+// An abbreviated id (4 to 39 hex digits) that names exactly one object
+static int git_find_abbrev(git_repo_t* repo, const char* hex, unsigned char* id) {
+    int len = (int)strlen(hex);
+    char lower[41];
+    if (len < 4 || len > 40) return -1;
+    for (int i = 0; i < len; i++) {
+        if (hex_digit(hex[i]) < 0) return -1;
+        lower[i] = ascii_lower(hex[i]);
+    }
+    unsigned char lowest[20];
+    memset(lowest, 0, sizeof(lowest));
+    for (int i = 0; i < len; i++) lowest[i / 2] |= (unsigned char)(hex_digit(lower[i]) << (i % 2 ? 0 : 4));
+
+    int matches = 0;
+    char candidate[41];
+    for (int p = 0; p < repo->pack_count; p++) {
+        const git_pack_t* pk = &repo->packs[p];
+        const unsigned char* ids = pk->idx + 8 + 1024;
+        long long lo = lowest[0] ? git_be32(pk->idx + 8 + (lowest[0] - 1) * 4) : 0;
+        long long hi = git_be32(pk->idx + 8 + lowest[0] * 4);
+        while (lo < hi) {
+            long long mid = lo + (hi - lo) / 2;
+            if (memcmp(ids + mid * 20, lowest, 20) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        for (; lo < pk->count; lo++) {
+            git_format_id(ids + lo * 20, candidate);
+            if (strncmp(candidate, lower, len) != 0) break;
+            if (!matches || memcmp(id, ids + lo * 20, 20) != 0) matches++;
+            memcpy(id, ids + lo * 20, 20);
+        }
+    }
+    for (int d = 0; d < repo->object_dir_count; d++) {
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s/%.2s", repo->object_dirs[d], lower) >= (int)sizeof(path)) continue;
+        DIR* dir = opendir(path);
+        struct dirent* entry;
+        while (dir && (entry = readdir(dir))) {
+            if (strlen(entry->d_name) != 38 || strncmp(entry->d_name, lower + 2, len - 2) != 0) continue;
+            unsigned char found[20];
+            candidate[0] = lower[0];
+            candidate[1] = lower[1];
+            memcpy(candidate + 2, entry->d_name, 39);
+            if (git_parse_id(candidate, found) != 0) continue;
+            if (!matches || memcmp(id, found, 20) != 0) matches++;
+            memcpy(id, found, 20);
+        }
+        if (dir) closedir(dir);
+    }
+    return matches == 1 ? 0 : -1;
+}
+
+// <id | ref | abbreviated id>, then any of ~N (first parent N times) and ^N
+// (the N-th parent; ^0 is the commit itself)
+static int git_resolve(git_repo_t* repo, const char* rev, unsigned char* id) {
+    static const char* const ref_rules[] = { "%s", "refs/%s", "refs/tags/%s", "refs/heads/%s",
+                                             "refs/remotes/%s", "refs/remotes/%s/HEAD" };
+    char name[1024], ref[1100];
+    int name_len = (int)strcspn(rev, "~^");
+    if (name_len >= (int)sizeof(name)) return -1;
+    memcpy(name, rev, name_len);
+    name[name_len] = '\0';
+    if (!name_len) str_copy(name, "HEAD", sizeof(name));
+
+    int found = name_len == 40 && git_parse_id(name, id) == 0;
+    for (int i = 0; !found && i < (int)(sizeof(ref_rules) / sizeof(ref_rules[0])); i++) {
+        snprintf(ref, sizeof(ref), ref_rules[i], name);
+        found = git_read_ref(repo, ref, id, 0) == 0;
+    }
+    if (!found && git_find_abbrev(repo, name, id) != 0) return -1;
+
+    for (const char* s = rev + name_len; *s;) {
+        char op = *s++;
+        char* after;
+        long n = strtol(s, &after, 10);
+        if (after == s) n = 1;
+        s = after;
+        if ((op != '~' && op != '^') || n < 0 || git_peel(repo, id, GIT_OBJ_COMMIT) != 0) return -1;
+        if (op == '^' && n > 0 && git_header_id(&repo->meta, "parent", (int)n, id) != 0) return -1;
+        for (long i = 0; op == '~' && i < n; i++) {
+            if ((i > 0 && git_peel(repo, id, GIT_OBJ_COMMIT) != 0) || git_header_id(&repo->meta, "parent", 1, id) != 0) {
+                return -1;
+            }
+        }
+    }
+    return git_peel(repo, id, GIT_OBJ_COMMIT) == 0 || git_peel(repo, id, GIT_OBJ_TREE) == 0 ? 0 : -1;
+}
+
+typedef struct {
+    int mode;
+    const char* name;
+    int name_len;
+    const unsigned char* id;
+} git_tree_entry_t;
+
+// Tree entries are "<octal mode> <name>\0<20-byte id>"; returns the next
+// entry's start, or 0 at the end or on a malformed entry
+static const unsigned char* git_tree_next(const unsigned char* p, const unsigned char* end, git_tree_entry_t* e) {
+    int mode = 0;
+    while (p < end && *p >= '0' && *p <= '7') mode = mode * 8 + (*p++ - '0');
+    if (p >= end || *p++ != ' ') return 0;
+    const unsigned char* nul = memchr(p, 0, end - p);
+    if (!nul || end - nul < 21) return 0;
+    e->mode = mode;
+    e->name = (const char*)p;
+    e->name_len = (int)(nul - p);
+    e->id = nul + 1;
+    return nul + 21;
+}
+
+#define GIT_MODE_TYPE(mode) ((mode) & 0170000)
+#define GIT_MODE_DIR 0040000
+#define GIT_MODE_FILE 0100000
+#define GIT_MODE_LINK 0120000
+
+// Read a blob into the walker's buffer; returns its size or -1
+static long long git_read_blob(walker_t* w, git_repo_t* repo, const unsigned char* id) {
+    byte_buf_t buf = { w->buf, 0, w->buf_cap };
+    int type;
+    int rc = git_read_object(repo, id, &type, &buf);
+    w->buf = buf.data;
+    w->buf_cap = buf.cap;
+    return rc == 0 && type == GIT_OBJ_BLOB && buf.len <= 0x7FFFFFFF ? buf.len : -1;
+}
+
+static void git_load_ignore_file(walker_t* w, git_repo_t* repo, const byte_buf_t* tree, const char* name,
+                                 ignore_level_t* lv) {
+    git_tree_entry_t e;
+    const unsigned char* end = tree->data + tree->len;
+    for (const unsigned char* p = tree->data; p && (p = git_tree_next(p, end, &e));) {
+        if (GIT_MODE_TYPE(e.mode) != GIT_MODE_FILE || strlen(name) != (size_t)e.name_len ||
+            memcmp(e.name, name, e.name_len) != 0) {
+            continue;
+        }
+        long long size = git_read_blob(w, repo, e.id);
+        if (size > 0) compile_ignore_text(lv, (const char*)w->buf, (int)size);
+        return;
+    }
+}
+
+static void git_walk_blob(walker_t* w, git_repo_t* repo, const char* name, const unsigned char* id) {
+    walk_phase(w, PHASE_DETECT);
+    const dynamic_lang_t* lang = detect_language(w->db, name);
+    w->times.items[PHASE_DETECT]++;
+    walk_phase(w, PHASE_WALK);
+    if (!lang) {
+        w->stats[WALK_FILES_UNKNOWN]++;
+        return;
+    }
+
+    walk_phase(w, PHASE_READ);
+    long long size = git_read_blob(w, repo, id);
+    if (size < 0) {
+        w->stats[WALK_FILES_UNREADABLE]++;
+    } else {
+        w->times.items[PHASE_READ]++;
+        w->times.bytes[PHASE_READ] += size;
+        tally_file(w, w->path, lang, w->buf, size, 0);
+    }
+    walk_phase(w, PHASE_WALK);
+}
+
+// walk_dir over a tree object. w->path is the entry's path below a root of
+// "", so the relative part starts at w->rel_off == 1.
+static void git_walk_tree(walker_t* w, git_repo_t* repo, const unsigned char* id, int dir_len,
+                          const ignore_level_t* parent) {
+    byte_buf_t tree = { 0, 0, 0 };
+    int type;
+    walk_phase(w, PHASE_READ);
+    int rc = git_read_object(repo, id, &type, &tree);
+    walk_phase(w, PHASE_WALK);
+    if (rc != 0 || type != GIT_OBJ_TREE) {
+        free(tree.data);
+        return;
+    }
+    w->stats[WALK_DIRS]++;
+    if (w->progress) atomic_store_ll(&w->progress->dirs, w->stats[WALK_DIRS]);
+
+    int rel_len = dir_len > w->rel_off ? dir_len - w->rel_off : 0;
+    dir_node_t* up = w->dir;
+    if (w->tree) {
+        dir_node_t* node = dir_tree_enter(w->tree, up, w->path + w->rel_off, rel_len);
+        if (node) w->dir = node;
+    }
+
+    ignore_level_t level;
+    memset(&level, 0, sizeof(level));
+    level.parent = parent;
+    level.base_len = rel_len;
+    if (!(w->flags & WALK_NO_IGNORE_FILES)) {
+        git_load_ignore_file(w, repo, &tree, ".gitignore", &level);
+        git_load_ignore_file(w, repo, &tree, ".clocignore", &level);
+    }
+    const ignore_level_t* rules = level.rule_count ? &level : parent;
+
+    git_tree_entry_t e;
+    const unsigned char* end = tree.data + tree.len;
+    for (const unsigned char* p = tree.data; (p = git_tree_next(p, end, &e));) {
+        if (walk_cancelled(w)) break;
+        if (e.name[0] == '.' && !(w->flags & WALK_HIDDEN)) continue;
+
+        w->times.items[PHASE_WALK]++;
+        int len = dir_len + 1 + e.name_len;
+        if (len >= (int)sizeof(w->path)) continue;
+        w->path[dir_len] = '/';
+        memcpy(w->path + dir_len + 1, e.name, e.name_len + 1);
+
+        // Submodules (gitlinks) point into another repository
+        int kind = GIT_MODE_TYPE(e.mode);
+        if (kind == GIT_MODE_LINK) {
+            w->stats[WALK_LINKS_SKIPPED]++;
+        } else if (kind == GIT_MODE_DIR || kind == GIT_MODE_FILE) {
+            int is_dir = kind == GIT_MODE_DIR;
+            const char* name = w->path + dir_len + 1;
+            if (ignore_check(rules, w->path + w->rel_off, len - w->rel_off, name, e.name_len, is_dir)) {
+                w->stats[is_dir ? WALK_DIRS_IGNORED : WALK_FILES_IGNORED]++;
+            } else if (is_dir) {
+                git_walk_tree(w, repo, e.id, len, rules);
+            } else {
+                git_walk_blob(w, repo, name, e.id);
+            }
+        }
+        w->path[dir_len] = '\0';
+    }
+
+    ignore_level_free(&level);
+    free(tree.data);
+    w->dir = up;
+}
+
+// Resolve a revision to the commit (or tree) it names, as 40 hex digits
+// into id_out. Returns 0, or -1 if it names nothing countable.
+int cloc_git_resolve(void* handle, const char* rev, char* id_out) {
+    unsigned char id[20];
+    if (git_resolve(handle, rev, id) != 0) return -1;
+    git_format_id(id, id_out);
+    return 0;
+}
+
+// Count a revision of the repository in the cloc_analyze_directory layout.
+// Returns the number of languages written, or -1 if rev can't be resolved.
+int cloc_git_analyze(
+    void* handle,
+    void* repo_handle,
+    const char* rev,
+    int flags,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* walk_stats_out,
+    long long* thread_stats_out,
+    int max_threads
+) {
+    cloc_ctx_t* ctx = handle;
+    git_repo_t* repo = repo_handle;
+    unsigned char tree[20];
+    if (git_resolve(repo, rev, tree) != 0 || git_peel(repo, tree, GIT_OBJ_TREE) != 0) return -1;
+
+    lang_db_t* db = ctx_languages(ctx);
+    walker_t* w = calloc(1, sizeof(walker_t));
+    lang_totals_t* totals = calloc(db->count ? db->count : 1, sizeof(lang_totals_t));
+    int count = -1;
+    if (w && totals) {
+        w->flags = flags;
+        w->db = db;
+        w->kernel = ctx->kernel;
+        w->totals = totals;
+        w->rel_off = 1;
+
+        ignore_level_t defaults;
+        memset(&defaults, 0, sizeof(defaults));
+        compile_default_ignores(&defaults);
+
+        long long start = monotonic_ns();
+        w->times.tid = current_tid();
+        w->times.node = -1;
+        w->phase = PHASE_WALK;
+        w->phase_start = start;
+        git_walk_tree(w, repo, tree, 0, &defaults);
+        walk_phase(w, PHASE_AGGREGATE);
+        count = write_lang_totals(db, totals, lang_names_out, lang_stats_out, max_langs);
+        walk_phase(w, PHASE_WALK);
+        w->times.wall_ns = monotonic_ns() - start;
+        if (max_threads > 0) {
+            memcpy(thread_stats_out, &w->times, sizeof(thread_stats_t));
+            w->stats[WALK_THREADS] = 1;
+        }
+        for (int i = 0; i < WALK_STAT_FIELDS; i++) walk_stats_out[i] = w->stats[i];
+        ignore_level_free(&defaults);
+        free(w->buf);
+    }
+    free(w);
+    free(totals);
+    lang_db_release(db);
+    return count;
+}
+
+// Object store counters since the repository was opened (GIT_* order)
+void cloc_git_stats(void* handle, long long* stats_out) {
+    const git_repo_t* repo = handle;
+    memcpy(stats_out, repo->stats, sizeof(repo->stats));
+}
+
+// TREE DIFF - the files that differ between two git trees
+//
+// tree_diff walks two trees side by side in git's entry order and hands
+// every file whose blob differs (or that only one side has) to a callback,
+// with the same hidden, ignore and language rules as git_walk_tree. A
+// subtree with the same id on both sides is skipped whole, unless the
+// ignore files above it differ between the sides, so a diff costs in
+// proportion to what changed rather than to the size of the trees.
+
+// Called per changed file: its name (w->path holds the whole path) and its
+// blob before and after, either of which may be 0
+typedef void (*tree_diff_fn)(void* arg, const char* name, const unsigned char* old_id, const unsigned char* new_id);
+
+typedef struct {
+    walker_t* w;              // path, flags and buffer
+    git_repo_t* repo;
+    tree_diff_fn file;
+    void* arg;
+    long long trees_read;
+    long long trees_skipped;  // unchanged subtrees not entered
+} tree_diff_t;
+
+// Git's tree order: names compared bytewise, directories as if ending in '/'
+static int git_entry_cmp(const git_tree_entry_t* a, const git_tree_entry_t* b) {
+    int n = a->name_len < b->name_len ? a->name_len : b->name_len;
+    int c = memcmp(a->name, b->name, n);
+    if (c) return c;
+    int ca = a->name_len > n ? (unsigned char)a->name[n] : GIT_MODE_TYPE(a->mode) == GIT_MODE_DIR ? '/' : 0;
+    int cb = b->name_len > n ? (unsigned char)b->name[n] : GIT_MODE_TYPE(b->mode) == GIT_MODE_DIR ? '/' : 0;
+    return ca - cb;
+}
+
+// The id of a tree's ignore file, or 0 if it has none
+static const unsigned char* git_ignore_id(const byte_buf_t* tree, const char* name) {
+    git_tree_entry_t e;
+    const unsigned char* end = tree->data + tree->len;
+    for (const unsigned char* p = tree->data; p && (p = git_tree_next(p, end, &e));) {
+        if (GIT_MODE_TYPE(e.mode) == GIT_MODE_FILE && strlen(name) == (size_t)e.name_len &&
+            memcmp(e.name, name, e.name_len) == 0)
+            return e.id;
+    }
+    return 0;
+}
+
+static int git_same_ignore(const byte_buf_t* a, const byte_buf_t* b, const char* name) {
+    const unsigned char* ia = git_ignore_id(a, name);
+    const unsigned char* ib = git_ignore_id(b, name);
+    return ia == ib || (ia && ib && memcmp(ia, ib, 20) == 0);
+}
+
+typedef struct {
+    byte_buf_t tree;
+    ignore_level_t level;
+    const ignore_level_t* rules;
+    const unsigned char* next; // past e, or 0 once the tree is done
+    git_tree_entry_t e;
+} tree_diff_side_t;
+
+static void tree_diff(tree_diff_t* d, const unsigned char* const* ids, int dir_len,
+                      const ignore_level_t* const* parents, int same_rules);
+
+// One name's change: old and new are its entries before and after, either
+// of which may be missing. w->path holds the parent directory.
+static void tree_diff_change(tree_diff_t* d, const git_tree_entry_t* old, const git_tree_entry_t* new, int dir_len,
+                             const ignore_level_t* const* rules, int same_rules) {
+    walker_t* w = d->w;
+    const git_tree_entry_t* any = old ? old : new;
+    if (any->name[0] == '.' && !(w->flags & WALK_HIDDEN)) return;
+    int len = dir_len + 1 + any->name_len;
+    if (len >= (int)sizeof(w->path)) return;
+    w->path[dir_len] = '/';
+    memcpy(w->path + dir_len + 1, any->name, any->name_len + 1);
+    const char* name = w->path + dir_len + 1;
+
+    // Symlinks and submodules are never counted, as in git_walk_tree
+    const git_tree_entry_t* sides[2] = { old, new };
+    const unsigned char* dirs[2] = { 0, 0 };
+    const unsigned char* files[2] = { 0, 0 };
+    for (int k = 0; k < 2; k++) {
+        if (!sides[k]) continue;
+        int kind = GIT_MODE_TYPE(sides[k]->mode);
+        if (kind != GIT_MODE_DIR && kind != GIT_MODE_FILE) continue;
+        int is_dir = kind == GIT_MODE_DIR;
+        if (ignore_check(rules[k], w->path + w->rel_off, len - w->rel_off, name, any->name_len, is_dir)) continue;
+        if (is_dir) {
+            dirs[k] = sides[k]->id;
+        } else {
+            files[k] = sides[k]->id;
+        }
+    }
+    if (files[0] || files[1]) d->file(d->arg, name, files[0], files[1]);
+    if (dirs[0] || dirs[1]) tree_diff(d, dirs, len, rules, same_rules && dirs[0] && dirs[1]);
+    w->path[dir_len] = '\0';
+}
+
+// Report the changes from the old tree ids[0] to the new tree ids[1]
+// (either may be 0 for none) at w->path. same_rules means both sides
+// inherit the same ignore rules, so an entry with the same id on both
+// sides has no changes to report.
+static void tree_diff(tree_diff_t* d, const unsigned char* const* ids, int dir_len,
+                      const ignore_level_t* const* parents, int same_rules) {
+    walker_t* w = d->w;
+    int rel_len = dir_len > w->rel_off ? dir_len - w->rel_off : 0;
+    tree_diff_side_t sides[2];
+    memset(sides, 0, sizeof(sides));
+    for (int k = 0; k < 2; k++) {
+        tree_diff_side_t* s = &sides[k];
+        s->level.parent = parents[k];
+        s->level.base_len = rel_len;
+        s->rules = parents[k];
+        if (!ids[k]) continue;
+
+        int type;
+        d->trees_read++;
+        if (git_read_object(d->repo, ids[k], &type, &s->tree) != 0 || type != GIT_OBJ_TREE) {
+            s->tree.len = 0;
+            continue;
+        }
+        if (!(w->flags & WALK_NO_IGNORE_FILES)) {
+            git_load_ignore_file(w, d->repo, &s->tree, ".gitignore", &s->level);
+            git_load_ignore_file(w, d->repo, &s->tree, ".clocignore", &s->level);
+        }
+        if (s->level.rule_count) s->rules = &s->level;
+        s->next = git_tree_next(s->tree.data, s->tree.data + s->tree.len, &s->e);
+    }
+
+    int same = same_rules && ((w->flags & WALK_NO_IGNORE_FILES) ||
+                              (git_same_ignore(&sides[0].tree, &sides[1].tree, ".gitignore") &&
+                               git_same_ignore(&sides[0].tree, &sides[1].tree, ".clocignore")));
+    const ignore_level_t* rules[2] = { sides[0].rules, sides[1].rules };
+
+    // Both trees are in git's order, so a merge pairs up the entries
+    while (sides[0].next || sides[1].next) {
+        int c = !sides[0].next ? 1 : !sides[1].next ? -1 : git_entry_cmp(&sides[0].e, &sides[1].e);
+        const git_tree_entry_t* old = c <= 0 ? &sides[0].e : 0;
+        const git_tree_entry_t* new = c >= 0 ? &sides[1].e : 0;
+        if (old && new && same && old->mode == new->mode && memcmp(old->id, new->id, 20) == 0) {
+            if (GIT_MODE_TYPE(old->mode) == GIT_MODE_DIR) d->trees_skipped++;
+        } else {
+            tree_diff_change(d, old, new, dir_len, rules, same);
+        }
+        for (int k = 0; k < 2; k++) {
+            tree_diff_side_t* s = &sides[k];
+            if ((k ? new : old) && s->next) s->next = git_tree_next(s->next, s->tree.data + s->tree.len, &s->e);
+        }
+    }
+
+    for (int k = 0; k < 2; k++) {
+        ignore_level_free(&sides[k].level);
+        free(sides[k].tree.data);
+    }
+}
+
+// HISTORY - line counts over every commit, memoized by blob id
+//
+// cloc_history_start lists a revision's first-parent chain, oldest first,
+// and each cloc_history_next moves the totals on by one commit: its tree
+// is diffed against the previous commit's, subtrees with the same id (and
+// the same ignore files above them) are skipped whole, and each changed
+// file's old counts are subtracted and its new ones added. Counts come from
+// a memo keyed by (blob id, language), so a blob is read and counted once
+// however many commits carry it. The memo can be saved and loaded by a
+// later run, which then only counts the blobs that are new since. Saved
+// entries hold a language's name and a hash of its comment markers, and
+// entries whose language is gone or counts differently are dropped on load.
+// As in result files, the header records the writer's byte order, so a
+// memo from another architecture is ignored rather than misread.
+
+#define MEMO_MAGIC "CLOCMEM"
+#define MEMO_VERSION 2
+#define MEMO_BYTE_ORDER 0x0102030405060708LL
+
+enum {
+    HISTORY_COMMITS,          // in the first-parent chain
+    HISTORY_TREES_READ,
+    HISTORY_TREES_SKIPPED,    // unchanged subtrees not entered
+    HISTORY_BLOBS_COUNTED,
+    HISTORY_MEMO_HITS,
+    HISTORY_MEMO_LOADED,      // entries taken from the memo file
+    HISTORY_MEMO_ENTRIES,
+    HISTORY_STAT_FIELDS
+};
+
+typedef struct {
+    unsigned char id[20];
+    int lang;                 // index into the database's langs, -1 marks an empty slot
+    int binary;
+    int counts[4];            // lines, code, comments, blanks
+    long long size;
+} blob_memo_entry_t;
+
+typedef struct {
+    blob_memo_entry_t* slots;
+    size_t cap;               // power of two
+    size_t count;
+} blob_memo_t;
+
+typedef struct {
+    char magic[8];
+    long long version;
+    long long byte_order;     // MEMO_BYTE_ORDER as the writer stores it
+    long long header_size;    // sizeof(memo_header_t), a layout check
+    long long entry_size;     // sizeof(blob_memo_entry_t), likewise
+    long long lang_count;     // memo_lang_t per language, then the entries
+    long long entry_count;
+} memo_header_t;
+
+typedef struct {
+    char name[64];
+    unsigned long long markers; // lang_markers_hash
+} memo_lang_t;
+
+typedef struct {
+    unsigned char commit[20];
+    unsigned char tree[20];
+    long long time;           // committer time, seconds since the epoch
+} history_commit_t;
+
+typedef struct {
+    git_repo_t* repo;
+    lang_db_t* db;
+    walker_t* w;              // path, flags, buffer and kernel for the diffs
+    tree_diff_t diff;
+    lang_totals_t* totals;    // as of the last commit returned
+    ignore_level_t defaults;
+    blob_memo_t memo;
+    history_commit_t* commits;
+    int count;
+    int next;
+    const unsigned char* tree; // the last commit's tree, 0 before the first
+    long long stats[HISTORY_STAT_FIELDS];
+} cloc_history_t;
+
+// What decides a language's counts besides its name
+static unsigned long long lang_markers_hash(const dynamic_lang_t* lang) {
+    char buf[3 * 8];
+    memcpy(buf, lang->line_comment, 8);
+    memcpy(buf + 8, lang->block_start, 8);
+    memcpy(buf + 16, lang->block_end, 8);
+    for (int i = 0; i < 3; i++) {
+        size_t len = strnlen(buf + i * 8, 8);
+        memset(buf + i * 8 + len, 0, 8 - len);
+    }
+    return path_hash(buf, sizeof(buf));
+}
+
+static size_t blob_memo_hash(const unsigned char* id, int lang) {
+    unsigned long long h;
+    memcpy(&h, id, sizeof(h));
+    return (size_t)(h ^ (unsigned long long)lang * 0x9E3779B97F4A7C15ULL);
+}
+
+static const blob_memo_entry_t* blob_memo_lookup(const blob_memo_t* memo, const unsigned char* id, int lang) {
+    if (!memo->cap) return 0;
+    for (size_t j = blob_memo_hash(id, lang) & (memo->cap - 1); memo->slots[j].lang >= 0;
+         j = (j + 1) & (memo->cap - 1)) {
+        const blob_memo_entry_t* e = &memo->slots[j];
+        if (e->lang == lang && memcmp(e->id, id, 20) == 0) return e;
+    }
+    return 0;
+}
+
+// Remember (or replace) a blob's counts; result is 0 for binary blobs.
+// Returns the entry, valid until the next store, or 0 if out of memory.
+static const blob_memo_entry_t* blob_memo_store(blob_memo_t* memo, const unsigned char* id, int lang,
+                                                const int* result, long long size) {
+    if ((memo->count + 1) * 2 > memo->cap) {
+        size_t cap = memo->cap ? memo->cap * 2 : 4096;
+        blob_memo_entry_t* slots = malloc(cap * sizeof(blob_memo_entry_t));
+        if (!slots) return 0;
+        for (size_t i = 0; i < cap; i++) slots[i].lang = -1;
+        for (size_t i = 0; i < memo->cap; i++) {
+            if (memo->slots[i].lang < 0) continue;
+            size_t j = blob_memo_hash(memo->slots[i].id, memo->slots[i].lang) & (cap - 1);
+            while (slots[j].lang >= 0) j = (j + 1) & (cap - 1);
+            slots[j] = memo->slots[i];
+        }
+        free(memo->slots);
+        memo->slots = slots;
+        memo->cap = cap;
+    }
+
+    size_t j = blob_memo_hash(id, lang) & (memo->cap - 1);
+    while (memo->slots[j].lang >= 0 && (memo->slots[j].lang != lang || memcmp(memo->slots[j].id, id, 20) != 0))
+        j = (j + 1) & (memo->cap - 1);
+    blob_memo_entry_t* e = &memo->slots[j];
+    if (e->lang < 0) memo->count++;
+    memcpy(e->id, id, 20);
+    e->lang = lang;
+    e->binary = result == 0;
+    for (int i = 0; i < 4; i++) e->counts[i] = result ? result[i] : 0;
+    e->size = size;
+    return e;
+}
+
+// Add a saved memo's entries whose language still counts the same way.
+// Returns the number added, or -1 if path is not a readable memo.
+static long long blob_memo_load(blob_memo_t* memo, const lang_db_t* db, const char* path) {
+    byte_buf_t file = { 0, 0, 0 };
+    if (read_whole_file(path, &file) < 0) {
+        free(file.data);
+        return -1;
+    }
+    const memo_header_t* h = (const memo_header_t*)file.data;
+    long long body = file.len - (long long)sizeof(memo_header_t);
+    int ok = body >= 0 && memcmp(h->magic, MEMO_MAGIC, sizeof(MEMO_MAGIC)) == 0 && h->version == MEMO_VERSION &&
+             h->byte_order == MEMO_BYTE_ORDER && h->header_size == sizeof(memo_header_t) &&
+             h->entry_size == sizeof(blob_memo_entry_t) &&
+             h->lang_count >= 0 && h->lang_count <= MAX_LANGUAGES && h->entry_count >= 0 &&
+             h->entry_count <= (body - h->lang_count * (long long)sizeof(memo_lang_t)) /
+                                   (long long)sizeof(blob_memo_entry_t);
+    if (!ok) {
+        free(file.data);
+        return -1;
+    }
+
+    const memo_lang_t* langs = (const memo_lang_t*)(file.data + sizeof(memo_header_t));
+    const blob_memo_entry_t* entries = (const blob_memo_entry_t*)(langs + h->lang_count);
+    int map[MAX_LANGUAGES];
+    for (long long l = 0; l < h->lang_count; l++) {
+        map[l] = -1;
+        for (int i = 0; i < db->count; i++) {
+            if (strncmp(langs[l].name, db->langs[i].name, 64) == 0 &&
+                langs[l].markers == lang_markers_hash(&db->langs[i])) {
+                map[l] = i;
+                break;
+            }
+        }
+    }
+
+    long long added = 0;
+    for (long long i = 0; i < h->entry_count; i++) {
+        blob_memo_entry_t e;
+        memcpy(&e, &entries[i], sizeof(e));
+        if (e.lang < 0 || e.lang >= h->lang_count || map[e.lang] < 0) continue;
+        if (!blob_memo_store(memo, e.id, map[e.lang], e.binary ? 0 : e.counts, e.size)) break;
+        added++;
+    }
+    free(file.data);
+    return added;
+}
+
+// The blob's counts as a file of lang, from the memo or read and counted
+static const blob_memo_entry_t* history_blob(cloc_history_t* h, const unsigned char* id, int lang) {
+    const blob_memo_entry_t* e = blob_memo_lookup(&h->memo, id, lang);
+    if (e) {
+        h->stats[HISTORY_MEMO_HITS]++;
+        return e;
+    }
+    walker_t* w = h->w;
+    long long size = git_read_blob(w, h->repo, id);
+    if (size < 0) return 0;
+
+    int bom_len;
+    int enc = detect_encoding(w->buf, (int)size, &bom_len);
+    int result[5];
+    if (enc != ENC_BINARY) count_encoded_buffer(w->kernel, w->buf, (int)size, enc, bom_len, &h->db->langs[lang], result);
+    h->stats[HISTORY_BLOBS_COUNTED]++;
+    return blob_memo_store(&h->memo, id, lang, enc == ENC_BINARY ? 0 : result, enc == ENC_BINARY ? size : result[4]);
+}
+
+// Add (sign 1) or take away (sign -1) a file's counts
+static void history_count(cloc_history_t* h, const dynamic_lang_t* lang, const unsigned char* id, int sign) {
+    const blob_memo_entry_t* e = history_blob(h, id, (int)(lang - h->db->langs));
+    if (!e || e->binary) return;
+
+    lang_totals_t* t = &h->totals[e->lang];
+    t->files += sign;
+    t->lines += sign * e->counts[0];
+    t->code += sign * e->counts[1];
+    t->comments += sign * e->counts[2];
+    t->blanks += sign * e->counts[3];
+    t->size += sign * e->size;
+}
+
+// tree_diff callback: the old blob's counts out, the new one's in
+static void history_file(void* arg, const char* name, const unsigned char* old_id, const unsigned char* new_id) {
+    cloc_history_t* h = arg;
+    const dynamic_lang_t* lang = detect_language(h->db, name);
+    if (!lang) return;
+    if (old_id) history_count(h, lang, old_id, -1);
+    if (new_id) history_count(h, lang, new_id, 1);
+}
+
+// The committer line's timestamp: "committer <name> <<email>> <time> <tz>"
+static long long git_commit_time(const byte_buf_t* obj) {
+    const char* p = (const char*)obj->data;
+    const char* end = p + obj->len;
+    while (p < end && *p != '\n') {
+        const char* eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (eol - p > 10 && memcmp(p, "committer ", 10) == 0) {
+            const char* q = eol;
+            while (q > p && q[-1] != '>') q--;
+            while (q < eol && *q == ' ') q++;
+            long long t = 0;
+            while (q < eol && *q >= '0' && *q <= '9') t = t * 10 + (*q++ - '0');
+            return t;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+void cloc_history_free(void* handle) {
+    cloc_history_t* h = handle;
+    if (!h) return;
+    if (h->w) free(h->w->buf);
+    free(h->w);
+    free(h->totals);
+    free(h->memo.slots);
+    free(h->commits);
+    ignore_level_free(&h->defaults);
+    if (h->db) lang_db_release(h->db);
+    free(h);
+}
+
+// Start a history over rev's first-parent chain, loading memo_path (if
+// given and readable) into the memo. The chain ends at a root commit or
+// at the first parent missing from the repository, as in a shallow clone.
+// Returns a handle for cloc_history_next, or 0 if rev names no commit.
+void* cloc_history_start(void* handle, void* repo_handle, const char* rev, int flags, const char* memo_path) {
+    cloc_ctx_t* ctx = handle;
+    git_repo_t* repo = repo_handle;
+    unsigned char id[20];
+    if (git_resolve(repo, rev, id) != 0 || git_peel(repo, id, GIT_OBJ_COMMIT) != 0) return 0;
+
+    cloc_history_t* h = calloc(1, sizeof(cloc_history_t));
+    if (!h) return 0;
+    h->repo = repo;
+    h->db = ctx_languages(ctx);
+    h->w = calloc(1, sizeof(walker_t));
+    h->totals = calloc(h->db->count ? h->db->count : 1, sizeof(lang_totals_t));
+    if (!h->w || !h->totals) {
+        cloc_history_free(h);
+        return 0;
+    }
+    h->w->flags = flags;
+    h->w->db = h->db;
+    h->w->kernel = ctx->kernel;
+    h->w->rel_off = 1;
+    h->diff.w = h->w;
+    h->diff.repo = repo;
+    h->diff.file = history_file;
+    h->diff.arg = h;
+    compile_default_ignores(&h->defaults);
+
+    int cap = 0;
+    for (;;) {
+        int type;
+        if (git_read_object(repo, id, &type, &repo->meta) != 0 || type != GIT_OBJ_COMMIT) break;
+        if (!grow_array((void**)&h->commits, &cap, h->count + 1, sizeof(history_commit_t))) break;
+        history_commit_t* c = &h->commits[h->count];
+        if (git_header_id(&repo->meta, "tree", 1, c->tree) != 0) break;
+        memcpy(c->commit, id, 20);
+        c->time = git_commit_time(&repo->meta);
+        h->count++;
+        if (git_header_id(&repo->meta, "parent", 1, id) != 0) break;
+    }
+    for (int i = 0, j = h->count - 1; i < j; i++, j--) {
+        history_commit_t t = h->commits[i];
+        h->commits[i] = h->commits[j];
+        h->commits[j] = t;
+    }
+    h->stats[HISTORY_COMMITS] = h->count;
+
+    if (memo_path) {
+        long long loaded = blob_memo_load(&h->memo, h->db, memo_path);
+        if (loaded > 0) h->stats[HISTORY_MEMO_LOADED] = loaded;
+    }
+    return h;
+}
+
+// Move on to the next commit, oldest first: its id (40 hex digits) and
+// committer time go to id_out and time_out, its totals to the
+// cloc_analyze_directory layout. Returns the number of languages written,
+// or -1 once every commit has been returned.
+int cloc_history_next(
+    void* handle,
+    char* id_out,
+    long long* time_out,
+    char* lang_names_out,
+    long long* lang_stats_out,
+    int max_langs,
+    long long* history_stats_out
+) {
+    cloc_history_t* h = handle;
+    if (h->next >= h->count) return -1;
+    const history_commit_t* c = &h->commits[h->next++];
+
+    const unsigned char* ids[2] = { h->tree, c->tree };
+    const ignore_level_t* rules[2] = { &h->defaults, &h->defaults };
+    tree_diff(&h->diff, ids, 0, rules, 1);
+    h->tree = c->tree;
+    h->stats[HISTORY_TREES_READ] = h->diff.trees_read;
+    h->stats[HISTORY_TREES_SKIPPED] = h->diff.trees_skipped;
+
+    git_format_id(c->commit, id_out);
+    *time_out = c->time;
+    h->stats[HISTORY_MEMO_ENTRIES] = (long long)h->memo.count;
+    memcpy(history_stats_out, h->stats, sizeof(h->stats));
+    return write_lang_totals(h->db, h->totals, lang_names_out, lang_stats_out, max_langs);
+}
+
+// Save the memo for a later history, replacing path atomically. Returns 0
+// on success, -1 on failure.
+int cloc_history_save(void* handle, const char* path) {
+    const cloc_history_t* h = handle;
+    long long size = (long long)sizeof(memo_header_t) + h->db->count * (long long)sizeof(memo_lang_t) +
+                     (long long)h->memo.count * (long long)sizeof(blob_memo_entry_t);
+    unsigned char* out = calloc(1, size);
+    if (!out) return -1;
+
+    memo_header_t* header = (memo_header_t*)out;
+    memcpy(header->magic, MEMO_MAGIC, sizeof(MEMO_MAGIC));
+    header->version = MEMO_VERSION;
+    header->byte_order = MEMO_BYTE_ORDER;
+    header->header_size = sizeof(memo_header_t);
+    header->entry_size = sizeof(blob_memo_entry_t);
+    header->lang_count = h->db->count;
+    header->entry_count = (long long)h->memo.count;
+
+    memo_lang_t* langs = (memo_lang_t*)(out + sizeof(memo_header_t));
+    for (int i = 0; i < h->db->count; i++) {
+        str_copy(langs[i].name, h->db->langs[i].name, 64);
+        langs[i].markers = lang_markers_hash(&h->db->langs[i]);
+    }
+    blob_memo_entry_t* entries = (blob_memo_entry_t*)(langs + h->db->count);
+    for (size_t i = 0; i < h->memo.cap; i++) {
+        if (h->memo.slots[i].lang >= 0) *entries++ = h->memo.slots[i];
+    }
+
+    int rc = write_file_replace(path, out, size);
+    free(out);
+    return rc;
+}
+
+// LINE DIFF - added, removed and modified lines per language between trees
+//
+// Two directories (or two revisions) are paired up file by file. Files
+// with the same content on both sides are skipped: revisions compare blob
+// ids and never read them, directories compare a hash of each side taken
+// once as it is read. The rest are
+// classified line by line with the counter's own rules and diffed with
+// Myers' algorithm over line hashes that include each line's kind, so a
+// line that moves into or out of a block comment is a change. As in git's
+// xdiff, lines that don't occur on the other side at all are marked as
+// changes up front and left out of the search, which keeps big additions
+// and deletions cheap without making the result any less minimal. Within each
+// run of changes, removed and added lines of the same kind pair up as
+// modified; the remainder are added or removed. Files only one side has
+// count all their lines as added or removed, so per language and kind
+// added minus removed is always the change in the counter's totals.
+//
+// The search is linear in space, and the edit cost explored for any one
+// split is capped (like git's xdiff) at the square root of the lines
+// involved, at least DIFF_MIN_COST; past it the diff settles for the
+// furthest point reached, which may report a few more changes than the
+// minimum.
+
+#define DIFF_MIN_COST 1024
+
+// Per-language results, in the layout clocEngine.ts reads
+enum {
+    DIFF_FILES_ADDED,
+    DIFF_FILES_REMOVED,
+    DIFF_FILES_MODIFIED,
+    DIFF_CODE_ADDED,          // then removed and modified, for each LINE_* kind
+    DIFF_CODE_REMOVED,
+    DIFF_CODE_MODIFIED,
+    DIFF_COMMENTS_ADDED,
+    DIFF_COMMENTS_REMOVED,
+    DIFF_COMMENTS_MODIFIED,
+    DIFF_BLANKS_ADDED,
+    DIFF_BLANKS_REMOVED,
+    DIFF_BLANKS_MODIFIED,
+    DIFF_LANG_FIELDS
+};
+
+enum {
+    DIFF_STAT_FILES_DIFFED,   // text on both sides, diffed line by line
+    DIFF_STAT_FILES_SAME,     // same content on both sides
+    DIFF_STAT_TREES_SKIPPED,  // revisions: unchanged subtrees not entered
+    DIFF_STAT_LINES,          // lines classified, both sides
+    DIFF_STAT_EDITS,          // lines the diffs added or removed
+    DIFF_STAT_APPROXIMATE,    // diffs that hit the cost cap
+    DIFF_STAT_BYTES,          // bytes read
+    DIFF_STAT_FIELDS
+};
+
+typedef struct {
+    char* path;               // root-relative, in the list's arena
+    int lang;
+} diff_entry_t;
+
+typedef struct diff_list {
+    diff_entry_t* entries;
+    int count;
+    int cap;
+    arena_t arena;
+} diff_list_t;
+
+// walk_visit_fn collecting a diff_list_t
+static void diff_list_add(void* arg, const char* path, const char* rel, int lang) {
+    diff_list_t* list = arg;
+    if (!grow_array((void**)&list->entries, &list->cap, list->count + 1, sizeof(diff_entry_t))) return;
+    size_t len = strlen(rel);
+    char* copy = arena_alloc(&list->arena, len + 1);
+    if (!copy) return;
+    memcpy(copy, rel, len + 1);
+    list->entries[list->count].path = copy;
+    list->entries[list->count].lang = lang;
+    list->count++;
+}
+
+static int diff_entry_cmp(const void* a, const void* b) {
+    return strcmp(((const diff_entry_t*)a)->path, ((const diff_entry_t*)b)->path);
+}
+
+// One side of a file diff: its classified lines and their hashes
+typedef struct {
+    line_class_t* lines;
+    unsigned long long* hashes; // never 0
+    unsigned char* changed;   // 1 for lines the other side doesn't share
+    unsigned long long* keys; // hashes of the lines the search runs over
+    int* map;                 // their line numbers
+    int count;
+    int kept;                 // lines in keys
+    int cap;
+} diff_side_t;
+
+typedef struct {
+    const lang_db_t* db;
+    const count_kernel_t* kernel;
+    long long* langs;         // DIFF_LANG_FIELDS per database language
+    long long stats[DIFF_STAT_FIELDS];
+    byte_buf_t text[2];       // old and new contents
+    diff_side_t sides[2];
+    unsigned long long* set;  // one side's hashes, open addressing, 0 for empty
+    int set_cap;
+    int* v;                   // forward and backward diagonals
+    int v_cap;
+} line_diff_t;
+
+// A line's content (less a trailing CR) and kind
+static unsigned long long line_hash(const unsigned char* p, int len, int kind) {
+    unsigned long long h = (unsigned long long)(kind + 1) * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        h = (h ^ load_u64(p + i)) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    unsigned long long tail = 0;
+    memcpy(&tail, p + i, len - i);
+    h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    return (h ^ (h >> 29)) | 1;
+}
+
+// Classify and hash a file's lines. Returns the line count, or -1 for a
+// binary file (or no memory), which the counter wouldn't count either.
+static int diff_side_load(line_diff_t* d, diff_side_t* side, const unsigned char* buf, int size,
+                          const dynamic_lang_t* lang) {
+    int bom_len;
+    int enc = detect_encoding(buf, size, &bom_len);
+    if (enc == ENC_BINARY) return -1;
+
+    // Every newline unit holds a 0x0A byte, so one more line than there are
+    // of those is room enough for any encoding, without counting twice
+    int count = 1;
+    for (const unsigned char *p = buf + bom_len, *end = buf + size; (p = memchr(p, '\n', end - p)); p++) count++;
+    if (count > side->cap) {
+        free(side->lines);
+        free(side->hashes);
+        free(side->changed);
+        free(side->keys);
+        free(side->map);
+        side->lines = malloc((size_t)count * sizeof(line_class_t));
+        side->hashes = malloc((size_t)count * sizeof(unsigned long long));
+        side->changed = malloc(count);
+        side->keys = malloc((size_t)count * sizeof(unsigned long long));
+        side->map = malloc((size_t)count * sizeof(int));
+        side->cap = side->lines && side->hashes && side->changed && side->keys && side->map ? count : 0;
+        if (!side->cap) return -1;
+    }
+    int result[5];
+    classify_lines(d->kernel, buf, size, enc, bom_len, lang, result, side->lines);
+    count = result[0];
+
+    const unsigned char* data = buf + bom_len;
+    int unit = encoding_unit_size(enc);
+    for (int i = 0; i < count; i++) {
+        const line_class_t* line = &side->lines[i];
+        int end = line->end;
+        if (end > line->start && load_unit(data, end - 1, enc) == '\r') end--;
+        side->hashes[i] = line_hash(data + line->start * unit, (end - line->start) * unit, line->kind);
+    }
+    memset(side->changed, 0, count);
+    side->count = count;
+    d->stats[DIFF_STAT_LINES] += count;
+    return count;
+}
+
+typedef struct {
+    int x0, y0;               // where the snake starts (before its edit, if any)
+    int x1, y1;               // and ends
+} diff_snake_t;
+
+// Find the middle snake of a shortest edit path through the box of old
+// lines [left, right) and new lines [top, bottom), searching from both
+// ends at once. Returns 0, or 1 if the cost cap was reached first and the
+// "snake" is just the furthest point the forward search got to, or -1 if
+// that point is a corner and the box has to be taken as a whole.
+static int diff_middle_snake(line_diff_t* d, int left, int top, int right, int bottom, int max_cost,
+                             diff_snake_t* s) {
+    const unsigned long long* a = d->sides[0].keys;
+    const unsigned long long* b = d->sides[1].keys;
+    int delta = (right - left) - (bottom - top);
+    int odd = delta & 1;
+    int max = (right - left + bottom - top + 1) / 2;
+    if (max > max_cost) max = max_cost;
+    int* vf = d->v + max_cost + 1;
+    int* vb = d->v + 3 * (max_cost + 1) + 1;
+    vf[1] = left;
+    vb[1] = bottom;
+
+    for (int dist = 0; dist <= max; dist++) {
+        for (int k = dist; k >= -dist; k -= 2) {
+            int c = k - delta;
+            int px, x;
+            if (k == -dist || (k != dist && vf[k - 1] < vf[k + 1])) {
+                px = x = vf[k + 1];
+            } else {
+                px = vf[k - 1];
+                x = px + 1;
+            }
+            int y = top + (x - left) - k;
+            int py = dist == 0 || x != px ? y : y - 1;
+            while (x < right && y < bottom && a[x] == b[y]) x++, y++;
+            vf[k] = x;
+            if (odd && c >= -(dist - 1) && c <= dist - 1 && y >= vb[c]) {
+                *s = (diff_snake_t){ px, py, x, y };
+                return 0;
+            }
+        }
+        for (int c = dist; c >= -dist; c -= 2) {
+            int k = c + delta;
+            int py, y;
+            if (c == -dist || (c != dist && vb[c - 1] > vb[c + 1])) {
+                py = y = vb[c + 1];
+            } else {
+                py = vb[c - 1];
+                y = py - 1;
+            }
+            int x = left + (y - top) + k;
+            int px = dist == 0 || y != py ? x : x + 1;
+            while (x > left && y > top && a[x - 1] == b[y - 1]) x--, y--;
+            vb[c] = y;
+            if (!odd && k >= -dist && k <= dist && x <= vf[k]) {
+                *s = (diff_snake_t){ x, y, px, py };
+                return 0;
+            }
+        }
+    }
+
+    // Too costly: split at the furthest point a forward path reached
+    int best = -1;
+    for (int k = -max; k <= max; k += 2) {
+        int x = vf[k];
+        int y = top + (x - left) - k;
+        if (x < left || x > right || y < top || y > bottom) continue;
+        if (best < 0 || x + y > s->x0 + s->y0) {
+            best = k;
+            *s = (diff_snake_t){ x, y, x, y };
+        }
+    }
+    if (best < 0 || (s->x0 == left && s->y0 == top) || (s->x0 == right && s->y0 == bottom)) return -1;
+    return 1;
+}
+
+// Mark every line of a box as changed
+static void diff_box_changed(line_diff_t* d, int left, int top, int right, int bottom) {
+    for (int x = left; x < right; x++) d->sides[0].changed[d->sides[0].map[x]] = 1;
+    for (int y = top; y < bottom; y++) d->sides[1].changed[d->sides[1].map[y]] = 1;
+}
+
+// Mark the lines of the box, in keys positions, that aren't on a (near)
+// shortest edit path
+static void diff_box(line_diff_t* d, int left, int top, int right, int bottom, int max_cost, int* approximate) {
+    const unsigned long long* a = d->sides[0].keys;
+    const unsigned long long* b = d->sides[1].keys;
+    while (left < right && top < bottom && a[left] == b[top]) left++, top++;
+    while (left < right && top < bottom && a[right - 1] == b[bottom - 1]) right--, bottom--;
+    if (left == right || top == bottom) {
+        diff_box_changed(d, left, top, right, bottom);
+        return;
+    }
+
+    diff_snake_t s;
+    int rc = diff_middle_snake(d, left, top, right, bottom, max_cost, &s);
+    if (rc != 0) *approximate = 1;
+    if (rc < 0) {
+        diff_box_changed(d, left, top, right, bottom);
+        return;
+    }
+    // The snake holds at most one edit, which its own box finds
+    diff_box(d, left, top, s.x0, s.y0, max_cost, approximate);
+    diff_box(d, s.x0, s.y0, s.x1, s.y1, max_cost, approximate);
+    diff_box(d, s.x1, s.y1, right, bottom, max_cost, approximate);
+}
+
+// Add every line of one side as added (k 1) or removed (k 0)
+static void diff_count_side(line_diff_t* d, const diff_side_t* side, long long* out, int k) {
+    out[k ? DIFF_FILES_ADDED : DIFF_FILES_REMOVED]++;
+    for (int i = 0; i < side->count; i++) {
+        out[DIFF_CODE_ADDED + 3 * side->lines[i].kind + (k ? 0 : 1)]++;
+    }
+}
+
+// Mark the lines of side k that the other side has no copy of, and keep
+// the rest for the search
+static int diff_discard(line_diff_t* d, int k) {
+    const diff_side_t* other = &d->sides[!k];
+    diff_side_t* side = &d->sides[k];
+    int cap = 16;
+    while (cap < 2 * other->count) cap *= 2;
+    if (cap > d->set_cap) {
+        free(d->set);
+        d->set = malloc((size_t)cap * sizeof(unsigned long long));
+        d->set_cap = d->set ? cap : 0;
+        if (!d->set) return -1;
+    }
+    memset(d->set, 0, (size_t)cap * sizeof(unsigned long long));
+    for (int i = 0; i < other->count; i++) {
+        unsigned long long h = other->hashes[i];
+        size_t j = (size_t)h & (cap - 1);
+        while (d->set[j] && d->set[j] != h) j = (j + 1) & (cap - 1);
+        d->set[j] = h;
+    }
+
+    side->kept = 0;
+    for (int i = 0; i < side->count; i++) {
+        unsigned long long h = side->hashes[i];
+        size_t j = (size_t)h & (cap - 1);
+        while (d->set[j] && d->set[j] != h) j = (j + 1) & (cap - 1);
+        if (!d->set[j]) {
+            side->changed[i] = 1;
+            continue;
+        }
+        side->keys[side->kept] = h;
+        side->map[side->kept++] = i;
+    }
+    return 0;
+}
+
+// Mark the changed lines of both sides. Returns 1 if the cost cap made the
+// result approximate, 0 if it is minimal, -1 if out of memory.
+static int diff_mark(line_diff_t* d) {
+    if (diff_discard(d, 0) != 0 || diff_discard(d, 1) != 0) return -1;
+    int left = d->sides[0].kept, right = d->sides[1].kept;
+    int max_cost = DIFF_MIN_COST;
+    while ((long long)max_cost * max_cost < (long long)left + right) max_cost *= 2;
+    if (4 * (max_cost + 1) + 2 > d->v_cap) {
+        free(d->v);
+        d->v = malloc((size_t)(4 * (max_cost + 1) + 2) * sizeof(int));
+        d->v_cap = d->v ? 4 * (max_cost + 1) + 2 : 0;
+        if (!d->v) return -1;
+    }
+
+    int approximate = 0;
+    diff_box(d, 0, 0, left, right, max_cost, &approximate);
+    return approximate;
+}
+
+// Diff two texts of a language and add the changes to its results
+static void diff_lines(line_diff_t* d, long long* out) {
+    diff_side_t* old = &d->sides[0];
+    diff_side_t* new = &d->sides[1];
+    int approximate = diff_mark(d);
+    if (approximate < 0) return;
+    d->stats[DIFF_STAT_FILES_DIFFED]++;
+    d->stats[DIFF_STAT_APPROXIMATE] += approximate;
+    out[DIFF_FILES_MODIFIED]++;
+
+    // Unchanged lines pair up in order; between them is a run of changes
+    int i = 0, j = 0;
+    while (i < old->count || j < new->count) {
+        int removed[3] = { 0, 0, 0 };
+        int added[3] = { 0, 0, 0 };
+        while (i < old->count && old->changed[i]) removed[old->lines[i++].kind]++;
+        while (j < new->count && new->changed[j]) added[new->lines[j++].kind]++;
+        for (int k = 0; k < 3; k++) {
+            int modified = removed[k] < added[k] ? removed[k] : added[k];
+            out[DIFF_CODE_ADDED + 3 * k] += added[k] - modified;
+            out[DIFF_CODE_REMOVED + 3 * k] += removed[k] - modified;
+            out[DIFF_CODE_MODIFIED + 3 * k] += modified;
+            d->stats[DIFF_STAT_EDITS] += added[k] + removed[k];
+        }
+        if (i >= old->count || j >= new->count) break;
+        i++;
+        j++;
+    }
+}
+
+// Compare the old and new versions of a file in d->text; have[k] is 0 for
+// the side that lacks it
+static void diff_file(line_diff_t* d, const dynamic_lang_t* lang, const int* have) {
+    long long* out = d->langs + (lang - d->db->langs) * DIFF_LANG_FIELDS;
+    int lines[2] = { -1, -1 };
+    for (int k = 0; k < 2; k++) {
+        if (!have[k]) continue;
+        d->stats[DIFF_STAT_BYTES] += d->text[k].len;
+        lines[k] = diff_side_load(d, &d->sides[k], d->text[k].data, (int)d->text[k].len, lang);
+    }
+    if (lines[0] >= 0 && lines[1] >= 0) {
+        diff_lines(d, out);
+    } else if (lines[0] >= 0) {
+        diff_count_side(d, &d->sides[0], out, 0);
+    } else if (lines[1] >= 0) {
+        diff_count_side(d, &d->sides[1], out, 1);
+    }
+}
+
+static void line_diff_free(line_diff_t* d) {
+    for (int k = 0; k < 2; k++) {
+        free(d->text[k].data);
+        free(d->sides[k].lines);
+        free(d->sides[k].hashes);
+        free(d->sides[k].changed);
+        free(d->sides[k].keys);
+        free(d->sides[k].map);
+    }
+    free(d->set);
+    free(d->v);
+    free(d->langs);
+}
+
+static int write_lang_diff(const lang_db_t* db, const long long* langs, char* lang_names_out,
+                           long long* lang_diff_out, int max_langs) {
+    int count = 0;
+    for (int i = 0; i < db->count && count < max_langs; i++) {
+        const long long* row = langs + i * DIFF_LANG_FIELDS;
+        int any = 0;
+        for (int f = 0; f < DIFF_LANG_FIELDS; f++) any |= row[f] != 0;
+        if (!any) continue;
+        str_copy(lang_names_out + count * 64, db->langs[i].name, 64);
+        memcpy(lang_diff_out + count * DIFF_LANG_FIELDS, row, DIFF_LANG_FIELDS * sizeof(long long));
+        count++;
+    }
+    return count;
+}
+
+// The files a walk of root would count, sorted by path. Returns 0, or -1
+// if root can't be walked.
+static int diff_list_tree(const lang_db_t* db, const char* root, int flags, diff_list_t* list) {
+    int rc = walk_visit_tree(db, root, flags, diff_list_add, list);
+    if (list->count > 1) qsort(list->entries, list->count, sizeof(diff_entry_t), diff_entry_cmp);
+    return rc;
+}
+
+// Read root/rel into buf; returns 0 or -1
+static int diff_read(const char* root, const char* rel, byte_buf_t* buf) {
+    char path[8192];
+    int len = snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if (len < 0 || len >= (int)sizeof(path)) return -1;
+    return read_whole_file(path, buf) < 0 || buf->len > 0x7FFFFFFF ? -1 : 0;
+}
+
+static int line_diff_init(line_diff_t* d, cloc_ctx_t* ctx, lang_db_t* db) {
+    memset(d, 0, sizeof(*d));
+    d->db = db;
+    d->kernel = ctx->kernel;
+    d->langs = calloc((db->count ? db->count : 1) * DIFF_LANG_FIELDS, sizeof(long long));
+    return d->langs ? 0 : -1;
+}
+
+// Compare the trees under two directories, walked with the same flags,
+// into per-language results (DIFF_LANG_FIELDS each) and DIFF_STAT_*
+// counters. Returns the number of languages written, or -1 if either
+// directory can't be walked.
+int cloc_diff_directories(
+    void* handle,
+    const char* old_root,
+    const char* new_root,
+    int flags,
+    char* lang_names_out,
+    long long* lang_diff_out,
+    int max_langs,
+    long long* diff_stats_out
+) {
+    cloc_ctx_t* ctx = handle;
+    lang_db_t* db = ctx_languages(ctx);
+    flags &= WALK_NO_IGNORE_FILES | WALK_HIDDEN | WALK_NO_FOLLOW;
+    diff_list_t lists[2];
+    memset(lists, 0, sizeof(lists));
+    line_diff_t d;
+    int count = -1;
+    if (line_diff_init(&d, ctx, db) == 0 && diff_list_tree(db, old_root, flags, &lists[0]) == 0 &&
+        diff_list_tree(db, new_root, flags, &lists[1]) == 0) {
+        const char* roots[2] = { old_root, new_root };
+        int i = 0, j = 0;
+        while (i < lists[0].count || j < lists[1].count) {
+            const diff_entry_t* old = i < lists[0].count ? &lists[0].entries[i] : 0;
+            const diff_entry_t* new = j < lists[1].count ? &lists[1].entries[j] : 0;
+            int c = !old ? 1 : !new ? -1 : strcmp(old->path, new->path);
+            const diff_entry_t* sides[2] = { c <= 0 ? old : 0, c >= 0 ? new : 0 };
+            if (c <= 0) i++;
+            if (c >= 0) j++;
+
+            int have[2];
+            unsigned long long hashes[2];
+            for (int k = 0; k < 2; k++) {
+                have[k] = sides[k] && diff_read(roots[k], sides[k]->path, &d.text[k]) == 0;
+                if (have[k]) hashes[k] = line_hash(d.text[k].data, (int)d.text[k].len, 0);
+            }
+            if (have[0] && have[1] && d.text[0].len == d.text[1].len && hashes[0] == hashes[1]) {
+                d.stats[DIFF_STAT_FILES_SAME]++;
+                continue;
+            }
+            if (have[0] || have[1]) diff_file(&d, &db->langs[(sides[0] ? sides[0] : sides[1])->lang], have);
+        }
+        count = write_lang_diff(db, d.langs, lang_names_out, lang_diff_out, max_langs);
+        memcpy(diff_stats_out, d.stats, sizeof(d.stats));
+    }
+    for (int k = 0; k < 2; k++) {
+        free(lists[k].entries);
+        arena_free(&lists[k].arena);
+    }
+    line_diff_free(&d);
+    lang_db_release(db);
+    return count;
+}
+
+typedef struct {
+    line_diff_t* diff;
+    git_repo_t* repo;
+} rev_diff_t;
+
+// tree_diff callback: read both blobs and compare them
+static void rev_diff_file(void* arg, const char* name, const unsigned char* old_id, const unsigned char* new_id) {
+    rev_diff_t* r = arg;
+    line_diff_t* d = r->diff;
+    if (old_id && new_id && memcmp(old_id, new_id, 20) == 0) {
+        d->stats[DIFF_STAT_FILES_SAME]++;
+        return;
+    }
+    const dynamic_lang_t* lang = detect_language(d->db, name);
+    if (!lang) return;
+
+    const unsigned char* ids[2] = { old_id, new_id };
+    int have[2];
+    for (int k = 0; k < 2; k++) {
+        int type;
+        have[k] = ids[k] && git_read_object(r->repo, ids[k], &type, &d->text[k]) == 0 && type == GIT_OBJ_BLOB &&
+                  d->text[k].len <= 0x7FFFFFFF;
+    }
+    if (have[0] || have[1]) diff_file(d, lang, have);
+}
+
+// cloc_diff_directories between two revisions of a repository, reading
+// only the trees and blobs that differ. Returns -1 if either revision
+// can't be resolved.
+int cloc_diff_revisions(
+    void* handle,
+    void* repo_handle,
+    const char* old_rev,
+    const char* new_rev,
+    int flags,
+    char* lang_names_out,
+    long long* lang_diff_out,
+    int max_langs,
+    long long* diff_stats_out
+) {
+    cloc_ctx_t* ctx = handle;
+    git_repo_t* repo = repo_handle;
+    unsigned char trees[2][20];
+    if (git_resolve(repo, old_rev, trees[0]) != 0 || git_peel(repo, trees[0], GIT_OBJ_TREE) != 0 ||
+        git_resolve(repo, new_rev, trees[1]) != 0 || git_peel(repo, trees[1], GIT_OBJ_TREE) != 0)
+        return -1;
+
+    lang_db_t* db = ctx_languages(ctx);
+    walker_t* w = calloc(1, sizeof(walker_t));
+    line_diff_t d;
+    int count = -1;
+    if (line_diff_init(&d, ctx, db) == 0 && w) {
+        w->flags = flags;
+        w->db = db;
+        w->kernel = ctx->kernel;
+        w->rel_off = 1;
+        rev_diff_t r = { &d, repo };
+        tree_diff_t td = { w, repo, rev_diff_file, &r, 0, 0 };
+
+        ignore_level_t defaults;
+        memset(&defaults, 0, sizeof(defaults));
+        compile_default_ignores(&defaults);
+        const unsigned char* ids[2] = { trees[0], trees[1] };
+        const ignore_level_t* rules[2] = { &defaults, &defaults };
+        tree_diff(&td, ids, 0, rules, 1);
+        ignore_level_free(&defaults);
+
+        d.stats[DIFF_STAT_TREES_SKIPPED] = td.trees_skipped;
+        count = write_lang_diff(db, d.langs, lang_names_out, lang_diff_out, max_langs);
+        memcpy(diff_stats_out, d.stats, sizeof(d.stats));
+    }
+    if (w) free(w->buf);
+    free(w);
+    line_diff_free(&d);
+    lang_db_release(db);
+    return count;
+}
+
+// RESULT FILES - mergeable per-language totals and per-file records
+//
+// cloc_result_save_directory writes a walk's totals and counters, and with
+// WALK_FILE_RECORDS every counted file's counts, to a compact binary file;
+// cloc_result_merge reduces any number of those into one. Languages are
+// keyed by name and files by root-relative path, both stored sorted, and
+// every counter merges by addition (the flag-like walk counters by maximum),
+// so merging is associative and commutative: shards of a path space reduced
+// in any grouping or order give byte-identical files with the totals of a
+// single walk over the whole space. A merge keeps per-file records only if
+// every input has them, and fails if two inputs hold the same file, which
+// means their shards overlapped.
+//
+// Fields are fixed-width in the writer's byte order, which the header
+// records so a foreign file is rejected rather than misread. The version
+// changes with the layout; walk counters added later are appended to the
+// enum, so older files read (and merge) with zeros for them.
+
+#define RESULT_MAGIC "CLOCRES"
+#define RESULT_VERSION 1
+#define RESULT_BYTE_ORDER 0x0102030405060708LL
+
+// Result file facts reported next to the totals
+enum {
+    RESULT_INFO_SHARDS,       // walks merged into the file
+    RESULT_INFO_FILES,        // per-file records, -1 if the file has none
+    RESULT_INFO_FIELDS
+};
+
+typedef struct {
+    char magic[8];
+    long long version;
+    long long byte_order;     // RESULT_BYTE_ORDER as the writer stores it
+    long long header_size;    // sizeof(result_header_t), a layout check
+    long long file_size;
+    long long shards;
+    long long has_files;
+    long long walk_count;     // counters at walk_off
+    long long walk_off;
+    long long lang_count;
+    long long langs_off;      // result_lang_t, sorted by name
+    long long file_count;
+    long long files_off;      // result_file_t, sorted by path
+} result_header_t;
+
+typedef struct {
+    char name[64];
+    long long totals[LANG_STAT_FIELDS];
+} result_lang_t;
+
+typedef struct {
+    long long path_off;       // NUL-terminated root-relative path
+    long long size;
+    int path_len;
+    int lang;                 // index into the file's languages
+    int counts[4];            // lines, code, comments, blanks
+} result_file_t;
+
+// A file's counts while a result is assembled
+typedef struct {
+    const char* path;
+    int path_len;
+    int lang;                 // database index while walking, then a language slot
+    int counts[4];
+    long long size;
+} result_record_t;
+
+typedef struct result_files {
+    arena_t arena;            // paths
+    result_record_t* records;
+    int count;
+    int cap;
+} result_files_t;
+
+typedef struct {
+    const unsigned char* map;
+    size_t size;
+    const result_header_t* header;
+    const long long* walk;
+    const result_lang_t* langs;
+    const result_file_t* files;
+} cloc_result_t;
+
+static void result_files_add(result_files_t* files, const char* rel, int lang, const int* counts, long long size) {
+    if (!grow_array((void**)&files->records, &files->cap, files->count + 1, sizeof(result_record_t))) return;
+    int len = (int)strlen(rel);
+    char* path = arena_alloc(&files->arena, len + 1);
+    if (!path) return;
+    memcpy(path, rel, len + 1);
+    result_record_t* r = &files->records[files->count++];
+    r->path = path;
+    r->path_len = len;
+    r->lang = lang;
+    memcpy(r->counts, counts, sizeof(r->counts));
+    r->size = size;
+}
+
+static int result_lang_cmp(const void* a, const void* b) {
+    return strncmp(((const result_lang_t*)a)->name, ((const result_lang_t*)b)->name, 64);
+}
+
+static int result_record_cmp(const void* a, const void* b) {
+    return strcmp(((const result_record_t*)a)->path, ((const result_record_t*)b)->path);
+}
+
+// Walk counters that say whether something happened rather than how often
+static int walk_stat_is_flag(int i) {
+    return i == WALK_ASYNC_IO || i == WALK_CANCELLED || i == WALK_NUMA_NODES;
+}
+
+// Lay a result out in memory and write it over path. langs are sorted by
+// name and records by path, with record langs indexing langs. Returns 0 or
+// -1.
+static int result_write(const char* path, long long shards, const long long* walk, const result_lang_t* langs,
+                        int lang_count, const result_record_t* records, int file_count, int has_files) {
+    result_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+    header.version = RESULT_VERSION;
+    header.byte_order = RESULT_BYTE_ORDER;
+    header.header_size = sizeof(result_header_t);
+    header.shards = shards;
+    header.has_files = has_files;
+    header.walk_count = WALK_STAT_FIELDS;
+    header.walk_off = sizeof(result_header_t);
+    header.lang_count = lang_count;
+    header.langs_off = header.walk_off + WALK_STAT_FIELDS * (long long)sizeof(long long);
+    header.file_count = has_files ? file_count : 0;
+    header.files_off = header.langs_off + lang_count * (long long)sizeof(result_lang_t);
+    long long paths_off = header.files_off + header.file_count * (long long)sizeof(result_file_t);
+    long long paths_size = 0;
+    for (long long i = 0; i < header.file_count; i++) paths_size += records[i].path_len + 1;
+    header.file_size = align8(paths_off + paths_size);
+
+    unsigned char* out = calloc(1, header.file_size);
+    if (!out) return -1;
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + header.walk_off, walk, WALK_STAT_FIELDS * sizeof(long long));
+    if (lang_count) memcpy(out + header.langs_off, langs, lang_count * sizeof(result_lang_t));
+    result_file_t* files = (result_file_t*)(out + header.files_off);
+    long long path_off = paths_off;
+    for (long long i = 0; i < header.file_count; i++) {
+        const result_record_t* r = &records[i];
+        files[i].path_off = path_off;
+        files[i].size = r->size;
+        files[i].path_len = r->path_len;
+        files[i].lang = r->lang;
+        memcpy(files[i].counts, r->counts, sizeof(r->counts));
+        memcpy(out + path_off, r->path, r->path_len + 1);
+        path_off += r->path_len + 1;
+    }
+
+    int rc = write_file_replace(path, out, header.file_size);
+    free(out);
+    return rc;
+}
+
+// Walk a tree (or one shard of it) and save the result to path
+static int result_save(cloc_ctx_t* ctx, const char* root, int flags, int threads, const walk_shard_t* shard,
+                       const char* path, long long* walk_stats_out) {
+    lang_db_t* db = ctx_languages(ctx);
+    file_cache_t* cache = flags & WALK_CACHED ? ctx_cache(ctx) : 0;
+    result_files_t files;
+    memset(&files, 0, sizeof(files));
+    int max_langs = db->count ? db->count : 1;
+    char* names = malloc((size_t)max_langs * 64);
+    long long* stats = malloc((size_t)max_langs * LANG_STAT_FIELDS * sizeof(long long));
+    result_lang_t* langs = malloc((size_t)max_langs * sizeof(result_lang_t));
+
+    int count = -1;
+    if (names && stats && langs) {
+        count = walk_tree(db, ctx->kernel, threads, cache, 0, flags & WALK_FILE_RECORDS ? &files : 0, shard,
+                          root, flags & ~WALK_BY_DIR, names, stats, max_langs, walk_stats_out, 0, 0, 0, 0);
+    }
+    if (count >= 0) {
+        for (int i = 0; i < count; i++) {
+            memset(langs[i].name, 0, 64);
+            str_copy(langs[i].name, names + i * 64, 64);
+            memcpy(langs[i].totals, stats + i * LANG_STAT_FIELDS, sizeof(langs[i].totals));
+        }
+        qsort(langs, count, sizeof(result_lang_t), result_lang_cmp);
+
+        // Records move from database indices to the sorted language slots
+        for (int i = 0; i < files.count; i++) {
+            result_lang_t key;
+            memset(key.name, 0, 64);
+            str_copy(key.name, db->langs[files.records[i].lang].name, 64);
+            const result_lang_t* slot = bsearch(&key, langs, count, sizeof(result_lang_t), result_lang_cmp);
+            files.records[i].lang = slot ? (int)(slot - langs) : 0;
+        }
+        if (files.count > 1) qsort(files.records, files.count, sizeof(result_record_t), result_record_cmp);
+
+        if (result_write(path, 1, walk_stats_out, langs, count, files.records, files.count,
+                         (flags & WALK_FILE_RECORDS) != 0) != 0)
+            count = -2;
+    }
+
+    free(names);
+    free(stats);
+    free(langs);
+    free(files.records);
+    arena_free(&files.arena);
+    file_cache_release(cache);
+    lang_db_release(db);
+    return count;
+}
+
+// Walk a tree like cloc_analyze_directory and save the result to path,
+// replacing it atomically; WALK_FILE_RECORDS adds a record per counted
+// file. Returns the number of languages, -1 if the root can't be walked or
+// -2 if the file can't be written.
+int cloc_result_save_directory(void* handle, const char* root, int flags, int threads, const char* path,
+                               long long* walk_stats_out) {
+    return result_save(handle, root, flags, threads, 0, path, walk_stats_out);
+}
+
+static int result_range_ok(const result_header_t* h, long long off, long long count, long long size) {
+    return off >= (long long)sizeof(result_header_t) && count >= 0 && off % 8 == 0 &&
+           count <= h->file_size / size && off + count * size <= h->file_size;
+}
+
+void cloc_result_close(void* handle) {
+    cloc_result_t* result = handle;
+    if (!result) return;
+    if (result->map) munmap((void*)result->map, result->size);
+    free(result);
+}
+
+// Map a result file and check it end to end. Returns it, or 0 if the file
+// is missing, foreign, from a newer engine or damaged.
+void* cloc_result_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    cloc_result_t* result = calloc(1, sizeof(cloc_result_t));
+    if (!result || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(result_header_t)) {
+        close(fd);
+        free(result);
+        return 0;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(result);
+        return 0;
+    }
+    result->map = map;
+    result->size = st.st_size;
+
+    const result_header_t* h = map;
+    int ok = memcmp(h->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) == 0 && h->version == RESULT_VERSION &&
+             h->byte_order == RESULT_BYTE_ORDER && h->header_size == sizeof(result_header_t) &&
+             h->file_size == st.st_size && h->shards >= 0 && (h->has_files == 0 || h->has_files == 1) &&
+             h->walk_count <= WALK_STAT_FIELDS && result_range_ok(h, h->walk_off, h->walk_count, sizeof(long long)) &&
+             result_range_ok(h, h->langs_off, h->lang_count, sizeof(result_lang_t)) &&
+             result_range_ok(h, h->files_off, h->file_count, sizeof(result_file_t)) &&
+             (h->has_files || h->file_count == 0);
+    if (ok) {
+        result->header = h;
+        result->walk = (const long long*)((const char*)map + h->walk_off);
+        result->langs = (const result_lang_t*)((const char*)map + h->langs_off);
+        result->files = (const result_file_t*)((const char*)map + h->files_off);
+    }
+    for (long long l = 0; ok && l < h->lang_count; l++) ok = memchr(result->langs[l].name, 0, 64) != 0;
+    for (long long i = 0; ok && i < h->file_count; i++) {
+        const result_file_t* f = &result->files[i];
+        ok = f->lang >= 0 && f->lang < h->lang_count && f->path_len >= 0 && f->path_off >= 0 &&
+             f->path_off <= h->file_size - f->path_len - 1 && ((const char*)map)[f->path_off + f->path_len] == 0;
+    }
+    if (!ok) {
+        cloc_result_close(result);
+        return 0;
+    }
+    return result;
+}
+
+// A result's totals in the analyze_directory layout, its walk counters
+// (WALK_STAT_FIELDS) and RESULT_INFO_* facts. Returns the number of
+// languages written.
+int cloc_result_read(void* handle, char* lang_names_out, long long* lang_stats_out, int max_langs,
+                     long long* walk_stats_out, long long* info_out) {
+    const cloc_result_t* result = handle;
+    const result_header_t* h = result->header;
+    int count = h->lang_count < max_langs ? (int)h->lang_count : max_langs;
+    for (int l = 0; l < count; l++) {
+        memcpy(lang_names_out + l * 64, result->langs[l].name, 64);
+        memcpy(lang_stats_out + l * LANG_STAT_FIELDS, result->langs[l].totals, sizeof(result->langs[l].totals));
+    }
+    memset(walk_stats_out, 0, WALK_STAT_FIELDS * sizeof(long long));
+    memcpy(walk_stats_out, result->walk, h->walk_count * sizeof(long long));
+    info_out[RESULT_INFO_SHARDS] = h->shards;
+    info_out[RESULT_INFO_FILES] = h->has_files ? h->file_count : -1;
+    return count;
+}
+
+// The i-th per-file record, in path order: its path into path_out and its
+// [lines, code, comments, blanks, size] into stats_out. Returns the index
+// of its language in cloc_result_read's output, or -1 if there is no such
+// record or the path doesn't fit.
+int cloc_result_file(void* handle, int i, char* path_out, int path_cap, long long* stats_out) {
+    const cloc_result_t* result = handle;
+    if (i < 0 || i >= result->header->file_count) return -1;
+    const result_file_t* f = &result->files[i];
+    if (f->path_len >= path_cap) return -1;
+    memcpy(path_out, (const char*)result->map + f->path_off, f->path_len + 1);
+    for (int k = 0; k < 4; k++) stats_out[k] = f->counts[k];
+    stats_out[4] = f->size;
+    return f->lang;
+}
+
+// A language of one input, while a merge sorts them by name
+typedef struct {
+    const result_lang_t* lang;
+    int input;
+    int index;
+} result_lang_ref_t;
+
+static int result_lang_ref_cmp(const void* a, const void* b) {
+    return strncmp(((const result_lang_ref_t*)a)->lang->name, ((const result_lang_ref_t*)b)->lang->name, 64);
+}
+
+// Merge input_count result files, named one after another in inputs (each
+// NUL-terminated), into path, replacing it atomically. Returns 0, -1 if an
+// input can't be read or the output written, or -2 if two inputs hold the
+// same file.
+int cloc_result_merge(const char* path, const char* inputs, int input_count) {
+    cloc_result_t** opened = calloc(input_count > 0 ? input_count : 1, sizeof(cloc_result_t*));
+    int** slots = calloc(input_count > 0 ? input_count : 1, sizeof(int*));
+    if (!opened || !slots) {
+        free(opened);
+        free(slots);
+        return -1;
+    }
+
+    int rc = 0;
+    long long shards = 0, lang_refs = 0, file_count = 0;
+    long long walk[WALK_STAT_FIELDS] = { 0 };
+    int has_files = 1;
+    const char* name = inputs;
+    for (int k = 0; k < input_count && rc == 0; k++, name += strlen(name) + 1) {
+        const cloc_result_t* in = opened[k] = cloc_result_open(name);
+        slots[k] = in ? malloc((in->header->lang_count ? in->header->lang_count : 1) * sizeof(int)) : 0;
+        if (!in || !slots[k]) {
+            rc = -1;
+            break;
+        }
+        const result_header_t* h = in->header;
+        shards += h->shards;
+        lang_refs += h->lang_count;
+        file_count += h->file_count;
+        has_files = has_files && h->has_files;
+        for (long long i = 0; i < h->walk_count; i++) {
+            if (walk_stat_is_flag((int)i))
+                walk[i] = walk[i] > in->walk[i] ? walk[i] : in->walk[i];
+            else
+                walk[i] += in->walk[i];
+        }
+    }
+    if (file_count > 0x7FFFFFFF) rc = -1;
+
+    // Languages of every input sorted by name; each run of a name is one
+    // merged language
+    result_lang_ref_t* refs = rc == 0 ? malloc((lang_refs ? lang_refs : 1) * sizeof(result_lang_ref_t)) : 0;
+    result_lang_t* langs = rc == 0 ? calloc(lang_refs ? lang_refs : 1, sizeof(result_lang_t)) : 0;
+    int lang_count = 0;
+    if (rc == 0 && (!refs || !langs)) rc = -1;
+    if (rc == 0) {
+        long long n = 0;
+        for (int k = 0; k < input_count; k++) {
+            for (int l = 0; l < opened[k]->header->lang_count; l++) {
+                refs[n].lang = &opened[k]->langs[l];
+                refs[n].input = k;
+                refs[n++].index = l;
+            }
+        }
+        qsort(refs, n, sizeof(result_lang_ref_t), result_lang_ref_cmp);
+        for (long long i = 0; i < n; i++) {
+            if (i == 0 || result_lang_ref_cmp(&refs[i - 1], &refs[i]) != 0) {
+                memcpy(langs[lang_count].name, refs[i].lang->name, 64);
+                lang_count++;
+            }
+            result_lang_t* dst = &langs[lang_count - 1];
+            for (int f = 0; f < LANG_STAT_FIELDS; f++) dst->totals[f] += refs[i].lang->totals[f];
+            slots[refs[i].input][refs[i].index] = lang_count - 1;
+        }
+    }
+
+    result_record_t* records = 0;
+    if (rc == 0 && has_files) {
+        records = malloc((file_count ? file_count : 1) * sizeof(result_record_t));
+        if (!records) rc = -1;
+    }
+    if (rc == 0 && has_files) {
+        long long n = 0;
+        for (int k = 0; k < input_count; k++) {
+            const cloc_result_t* in = opened[k];
+            for (long long i = 0; i < in->header->file_count; i++) {
+                const result_file_t* f = &in->files[i];
+                result_record_t* r = &records[n++];
+                r->path = (const char*)in->map + f->path_off;
+                r->path_len = f->path_len;
+                r->lang = slots[k][f->lang];
+                memcpy(r->counts, f->counts, sizeof(r->counts));
+                r->size = f->size;
+            }
+        }
+        if (n > 1) qsort(records, n, sizeof(result_record_t), result_record_cmp);
+        for (long long i = 1; i < n && rc == 0; i++) {
+            if (strcmp(records[i - 1].path, records[i].path) == 0) rc = -2;
+        }
+    }
+    if (rc == 0) rc = result_write(path, shards, walk, langs, lang_count, records, (int)file_count, has_files);
+
+    for (int k = 0; k < input_count; k++) {
+        cloc_result_close(opened[k]);
+        free(slots[k]);
+    }
+    free(opened);
+    free(slots);
+    free(refs);
+    free(langs);
+    free(records);
+    return rc;
+}
+
+// SHARDS - one tree split deterministically across worker processes
+//
+// A driver runs N processes over the same root, each saving the result file
+// of its shard, and merges them (see RESULT FILES above). Every path has
+// exactly one owner, decided from the root-relative path alone, so the same
+// tree and shard count always split the same way:
+//
+//   hash   each file and directory belongs to path_hash(rel) % N. Every
+//          worker walks the whole directory structure but reads only its
+//          own files, which balances well whatever the tree's shape.
+//   plan   top-level entries are handed out whole, from a plan the driver
+//          builds with cloc_shard_estimate; entries the plan doesn't name
+//          (created since, or ignored when it was made) fall back to the
+//          hash. Workers never enter each other's subtrees.
+//
+// The root directory itself belongs to shard 0. Merged totals and counters
+// equal a single walk's. With a plan, the exception is a file or directory
+// reached by hard or symbolic links from two top-level entries on different
+// shards, which both count rather than one reporting a duplicate; hashed
+// workers see every link and agree on which one a whole walk would count.
+
+// Walk one shard of a tree and save its result file, as
+// cloc_result_save_directory does for the whole tree. names holds
+// name_count NUL-separated top-level entries in strcmp order and owners
+// their shards; with no names every path is assigned by hash. Returns the
+// number of languages, -1 if the root can't be walked or the shard is
+// invalid, or -2 if the file can't be written.
+int cloc_result_save_shard(void* handle, const char* root, int flags, int threads, int shard_index, int shard_count,
+                           const char* names, const int* owners, int name_count, const char* path,
+                           long long* walk_stats_out) {
+    if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count || name_count < 0) return -1;
+    walk_shard_t shard = { shard_index, shard_count, 0, owners, 0 };
+    const char** planned = 0;
+    if (names && name_count > 0) {
+        planned = malloc((size_t)name_count * sizeof(char*));
+        if (!planned) return -1;
+        const char* p = names;
+        for (int i = 0; i < name_count; i++) {
+            if (owners[i] < 0 || owners[i] >= shard_count || (i && strcmp(planned[i - 1], p) >= 0)) {
+                free(planned);
+                return -1;
+            }
+            planned[i] = p;
+            p += strlen(p) + 1;
+        }
+        shard.names = planned;
+        shard.name_count = name_count;
+    } else if (names) {
+        // An empty plan still walks in plan mode, every entry by hash
+        static const char* none[1];
+        shard.names = none;
+    }
+
+    int count = result_save(handle, root, flags, threads, &shard, path, walk_stats_out);
+    free(planned);
+    return count;
+}
+
+typedef struct {
+    char name[256];
+    long long files;
+    long long bytes;
+} shard_entry_t;
+
+typedef struct {
+    shard_entry_t* entries;
+    int count;
+    int cap;
+} shard_estimate_t;
+
+static int shard_entry_cmp(const void* a, const void* b) {
+    return strcmp(((const shard_entry_t*)a)->name, ((const shard_entry_t*)b)->name);
+}
+
+// walk_visit_fn charging a file's size to its top-level entry. The walk is
+// depth first, so a top-level directory's files arrive together.
+static void shard_estimate_add(void* arg, const char* path, const char* rel, int lang) {
+    shard_estimate_t* e = arg;
+    const char* slash = strchr(rel, '/');
+    size_t len = slash ? (size_t)(slash - rel) : strlen(rel);
+    if (len >= sizeof(e->entries[0].name)) return;
+
+    shard_entry_t* last = e->count ? &e->entries[e->count - 1] : 0;
+    if (!last || strncmp(last->name, rel, len) != 0 || last->name[len] != '\0') {
+        if (!grow_array((void**)&e->entries, &e->cap, e->count + 1, sizeof(shard_entry_t))) return;
+        last = &e->entries[e->count++];
+        memcpy(last->name, rel, len);
+        last->name[len] = '\0';
+        last->files = 0;
+        last->bytes = 0;
+    }
+    struct stat st;
+    last->files++;
+    if (stat(path, &st) == 0) last->bytes += st.st_size;
+}
+
+// The files a walk of root would count and their bytes, per top-level
+// entry, from directory listings and stats alone, for planning shards.
+// Writes up to max_entries names (256 bytes each) in strcmp order with
+// files, bytes pairs in stats_out. Returns the number of entries, or -1 if
+// root can't be walked.
+int cloc_shard_estimate(void* handle, const char* root, int flags, char* names_out, long long* stats_out,
+                        int max_entries) {
+    cloc_ctx_t* ctx = handle;
+    lang_db_t* db = ctx_languages(ctx);
+    shard_estimate_t estimate;
+    memset(&estimate, 0, sizeof(estimate));
+    int rc = walk_visit_tree(db, root, flags & ~(WALK_BY_DIR | WALK_FILE_RECORDS), shard_estimate_add, &estimate);
+    lang_db_release(db);
+    if (rc != 0) {
+        free(estimate.entries);
+        return -1;
+    }
+
+    if (estimate.count > 1) qsort(estimate.entries, estimate.count, sizeof(shard_entry_t), shard_entry_cmp);
+    for (int i = 0; i < estimate.count && i < max_entries; i++) {
+        memcpy(names_out + (size_t)i * 256, estimate.entries[i].name, 256);
+        stats_out[i * 2] = estimate.entries[i].files;
+        stats_out[i * 2 + 1] = estimate.entries[i].bytes;
+    }
+    int count = estimate.count;
+    free(estimate.entries);
+    return count;
+}
+
+// ARCHIVES - count inside tar, tar.gz and zip files without extracting them
+//
+// Under WALK_ARCHIVES a file named *.tar, *.tar.gz, *.tgz or *.zip that no
+// language claims is mapped, and its members are counted as if they were
+// files in a directory of the archive's name: per-file records hold paths
+// like "dist/app.tar.gz/src/main.c", and rollups get a node for the archive
+// with every member's counts in it. Nothing is written to disk.
+//
+// A tar is parsed as a stream of 512-byte blocks (ustar, with pax extended
+// headers and GNU long names), so a plain tar's members are counted in
+// place in the mapping, and a gzip stream (RFC 1952, members concatenated)
+// is inflated through INFLATE's sliding window straight into the same
+// parser; a member is only gathered in the walker's buffer when it spans
+// windows, and the buffer grows as its data arrives. A zip is read from its
+// central directory, zip64 included: stored members are counted in place,
+// deflated ones inflated into the buffer. Members go through language
+// detection, the hidden-file rule and the ignore rules in force at the
+// archive like files on disk, but ignore files inside an archive are not
+// read, links are skipped, archives inside archives are not opened, and
+// encrypted or otherwise compressed members count as unreadable. Checksums
+// are not verified; an archive that turns out damaged counts as unreadable,
+// next to whatever members came before the damage. Archives are read on
+// the walking thread and never cached.
+
+enum { ARCHIVE_NONE, ARCHIVE_TAR, ARCHIVE_TAR_GZ, ARCHIVE_ZIP };
+
+#define TAR_BLOCK 512
+#define TAR_META_MAX (1 << 20)    // larger pax headers and long names are skipped
+
+enum {
+    TAR_SKIP,                 // data nobody reads: directories, links, oversized metadata
+    TAR_MEMBER,               // a member being gathered to count
+    TAR_PAX,                  // a pax extended header for the next member
+    TAR_LONG_NAME             // a GNU long name for the next member
+};
+
+typedef struct {
+    walker_t* w;
+    int base_len;             // w->path[0..base_len) is the archive
+    unsigned char header[TAR_BLOCK];
+    int header_fill;
+    long long left;           // data bytes of the current entry still to come
+    long long pad;            // then padding up to the next block
+    int target;               // TAR_* for the current entry's data
+    const dynamic_lang_t* lang;
+    long long size;           // the member's size
+    long long fill;           // of it gathered in w->buf
+    byte_buf_t meta;          // pax header or long name being gathered
+    char next_path[4096];     // from metadata, for the next member
+    int has_next_path;
+    long long next_size;
+    int has_next_size;
+    int zeros;                // zero blocks in a row; two end the archive
+    int done;
+} tar_stream_t;
+
+static unsigned archive_le16(const unsigned char* p) {
+    return (unsigned)p[0] | (unsigned)p[1] << 8;
+}
+
+static unsigned archive_le32(const unsigned char* p) {
+    return archive_le16(p) | archive_le16(p + 2) << 16;
+}
+
+static unsigned long long archive_le64(const unsigned char* p) {
+    return archive_le32(p) | (unsigned long long)archive_le32(p + 4) << 32;
+}
+
+static int has_suffix(const char* name, int len, const char* suffix) {
+    int n = (int)strlen(suffix);
+    if (len <= n) return 0;
+    for (int i = 0; i < n; i++) {
+        char c = name[len - n + i];
+        if ((c >= 'A' && c <= 'Z' ? c + 32 : c) != suffix[i]) return 0;
+    }
+    return 1;
+}
+
+// ARCHIVE_* for a file name, by extension
+static int archive_kind(const char* name) {
+    int len = (int)strlen(name);
+    if (has_suffix(name, len, ".tar")) return ARCHIVE_TAR;
+    if (has_suffix(name, len, ".tar.gz") || has_suffix(name, len, ".tgz")) return ARCHIVE_TAR_GZ;
+    if (has_suffix(name, len, ".zip")) return ARCHIVE_ZIP;
+    return ARCHIVE_NONE;
+}
+
+static int walker_reserve(walker_t* w, long long size) {
+    if (size <= w->buf_cap) return 0;
+    unsigned char* p = realloc(w->buf, size);
+    if (!p) return -1;
+    w->buf = p;
+    w->buf_cap = size;
+    return 0;
+}
+
+// Room for need bytes of a member that is gathered as it arrives, doubling
+// up to its size; a size the archive doesn't hold is never allocated
+static int walker_grow(walker_t* w, long long need, long long size) {
+    if (need <= w->buf_cap) return 0;
+    long long cap = w->buf_cap * 2 < size ? w->buf_cap * 2 : size;
+    return walker_reserve(w, cap > need ? cap : need);
+}
+
+// Whether the rules in force at the archive ignore the member at
+// w->path[0..base_len + 1 + len), or any directory it is in, as if the
+// archive were a directory
+static int archive_ignored(const walker_t* w, int base_len, int len) {
+    const char* rel = w->path + w->rel_off;
+    int start = base_len + 1;
+    int end = start + len;
+    for (int i = start; w->rules && i <= end; i++) {
+        if (i < end && w->path[i] != '/') continue;
+        if (ignore_check(w->rules, rel, i - w->rel_off, w->path + start, i - start, i < end)) return 1;
+        start = i + 1;
+    }
+    return 0;
+}
+
+// Put the member name[0..len) below the archive at w->path[0..base_len)
+// and detect its language. Returns 0 for members that aren't counted:
+// hidden or ignored ones, unknown languages, paths with a ".." component
+// or too long for the walker.
+static const dynamic_lang_t* archive_member(walker_t* w, int base_len, const char* name, int len) {
+    while (len > 0 && (name[0] == '/' || (name[0] == '.' && len > 1 && name[1] == '/'))) {
+        int skip = name[0] == '/' ? 1 : 2;
+        name += skip;
+        len -= skip;
+    }
+    if (len == 0 || memchr(name, '\0', len) || base_len + 1 + len >= (int)sizeof(w->path)) return 0;
+    for (int i = 0; i < len;) {
+        int end = i;
+        while (end < len && name[end] != '/') end++;
+        if (end - i == 2 && name[i] == '.' && name[i + 1] == '.') return 0;
+        if (name[i] == '.' && !(w->flags & WALK_HIDDEN)) return 0;
+        i = end + 1;
+    }
+
+    w->path[base_len] = '/';
+    memcpy(w->path + base_len + 1, name, len);
+    w->path[base_len + 1 + len] = '\0';
+    if (archive_ignored(w, base_len, len)) {
+        w->stats[WALK_FILES_IGNORED]++;
+        w->path[base_len] = '\0';
+        return 0;
+    }
+    const char* base = strrchr(w->path + base_len, '/') + 1;
+    w->times.items[PHASE_WALK]++;
+    int prev = walk_phase(w, PHASE_DETECT);
+    const dynamic_lang_t* lang = detect_language(w->db, base);
+    w->times.items[PHASE_DETECT]++;
+    walk_phase(w, prev);
+    if (!lang) {
+        w->stats[WALK_FILES_UNKNOWN]++;
+        w->path[base_len] = '\0';
+    }
+    return lang;
+}
+
+// Count the member at w->path from data, then cut w->path back to the archive
+static void archive_count(walker_t* w, int base_len, const dynamic_lang_t* lang, const unsigned char* data,
+                          long long size) {
+    w->times.items[PHASE_READ]++;
+    w->times.bytes[PHASE_READ] += size;
+    tally_file(w, w->path, lang, data, size, 0);
+    w->path[base_len] = '\0';
+}
+
+// Octal, space or NUL padded, or base-256 (GNU) when the top bit is set;
+// -1 if it doesn't fit
+static long long tar_number(const unsigned char* field, int len) {
+    long long v = 0;
+    if (field[0] & 0x80) {
+        if (field[0] & 0x40) return -1;
+        v = field[0] & 0x3f;
+        for (int i = 1; i < len; i++) {
+            if (v >> 54) return -1;
+            v = v << 8 | field[i];
+        }
+        return v;
+    }
+    int i = 0;
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (v >> 59) return -1;
+        v = v * 8 + (field[i] - '0');
+    }
+    return v;
+}
+
+// The header sum with the checksum field read as spaces; some old writers
+// summed signed bytes
+static int tar_checksum_ok(const unsigned char* h) {
+    long long want = tar_number(h + 148, 8);
+    long long sum = 0, signed_sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        int c = i >= 148 && i < 156 ? ' ' : h[i];
+        sum += c;
+        signed_sum += i >= 148 && i < 156 ? ' ' : (signed char)h[i];
+    }
+    return want == sum || want == signed_sum;
+}
+
+// Take "path" and "size" from pax records ("<len> <key>=<value>\n")
+static void tar_pax(tar_stream_t* t, const char* p, long long len) {
+    const char* end = p + len;
+    while (p < end) {
+        char* key;
+        long long n = strtoll(p, &key, 10);
+        if (n <= 0 || n > end - p || key >= p + n || *key != ' ') return;
+        const char* rec_end = p + n - 1; // the newline
+        key++;
+        const char* eq = memchr(key, '=', rec_end - key);
+        if (eq) {
+            int value_len = (int)(rec_end - eq - 1);
+            if (eq - key == 4 && memcmp(key, "path", 4) == 0 && value_len < (int)sizeof(t->next_path)) {
+                memcpy(t->next_path, eq + 1, value_len);
+                t->next_path[value_len] = '\0';
+                t->has_next_path = 1;
+            } else if (eq - key == 4 && memcmp(key, "size", 4) == 0) {
+                t->next_size = strtoll(eq + 1, 0, 10);
+                t->has_next_size = t->next_size >= 0;
+            }
+        }
+        p += n;
+    }
+}
+
+// An entry's data is all in: count the member or apply the metadata
+static void tar_entry_done(tar_stream_t* t) {
+    walker_t* w = t->w;
+    if (t->target == TAR_MEMBER) {
+        archive_count(w, t->base_len, t->lang, w->buf, t->size);
+    } else if (t->target == TAR_PAX) {
+        tar_pax(t, (const char*)t->meta.data, t->meta.len);
+    } else if (t->target == TAR_LONG_NAME) {
+        int len = (int)strnlen((const char*)t->meta.data, t->meta.len);
+        if (len < (int)sizeof(t->next_path)) {
+            memcpy(t->next_path, t->meta.data, len);
+            t->next_path[len] = '\0';
+            t->has_next_path = 1;
+        }
+    }
+    t->target = TAR_SKIP;
+    if (walk_cancelled(w)) t->done = 1;
+}
+
+// Start the entry in t->header. Returns -1 if it isn't a tar header.
+static int tar_entry(tar_stream_t* t) {
+    const unsigned char* h = t->header;
+    int zero = 1;
+    for (int i = 0; i < TAR_BLOCK && zero; i++) zero = h[i] == 0;
+    if (zero) {
+        if (++t->zeros == 2) t->done = 1;
+        return 0;
+    }
+    t->zeros = 0;
+    long long size = tar_number(h + 124, 12);
+    if (size < 0 || !tar_checksum_ok(h)) return -1;
+
+    walker_t* w = t->w;
+    int type = h[156];
+    t->target = TAR_SKIP;
+    if (type == 'x' || type == 'L') {
+        if (size <= TAR_META_MAX) {
+            t->meta.len = 0;
+            t->target = type == 'x' ? TAR_PAX : TAR_LONG_NAME;
+        }
+    } else if (type != 'g' && type != 'K') {
+        // Anything else takes the pending metadata, whether it's counted or not
+        if (t->has_next_size) size = t->next_size;
+        char name[155 + 1 + 100]; // ustar prefix, '/', name
+        const char* path = t->next_path;
+        int len;
+        if (t->has_next_path) {
+            len = (int)strlen(t->next_path);
+        } else {
+            int prefix = memcmp(h + 257, "ustar", 5) == 0 ? (int)strnlen((const char*)h + 345, 155) : 0;
+            len = 0;
+            if (prefix) {
+                memcpy(name, h + 345, prefix);
+                name[prefix] = '/';
+                len = prefix + 1;
+            }
+            int n = (int)strnlen((const char*)h, 100);
+            memcpy(name + len, h, n);
+            len += n;
+            path = name;
+        }
+        t->has_next_path = 0;
+        t->has_next_size = 0;
+
+        if (type == '1' || type == '2') {
+            w->stats[WALK_LINKS_SKIPPED]++;
+        } else if ((type == '0' || type == '7' || type == '\0') && len > 0 && path[len - 1] != '/') {
+            const dynamic_lang_t* lang = archive_member(w, t->base_len, path, len);
+            if (lang && size > 0x7FFFFFFF) {
+                w->stats[WALK_FILES_UNREADABLE]++;
+                w->path[t->base_len] = '\0';
+            } else if (lang) {
+                t->target = TAR_MEMBER;
+                t->lang = lang;
+                t->size = size;
+                t->fill = 0;
+            }
+        }
+    }
+    t->left = size;
+    t->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    if (size == 0) tar_entry_done(t);
+    return 0;
+}
+
+// Feed the next bytes of the tar stream; an INFLATE sink. Returns non-zero
+// once the archive has ended (or turned out not to be a tar) to stop the
+// input.
+static int tar_push(void* arg, const unsigned char* p, long long n) {
+    tar_stream_t* t = arg;
+    walker_t* w = t->w;
+    while (n > 0 && !t->done) {
+        long long take;
+        if (t->left > 0) {
+            take = n < t->left ? n : t->left;
+            if (t->target == TAR_MEMBER && t->fill == 0 && take == t->size) {
+                // The whole member is in this chunk: count it in place
+                archive_count(w, t->base_len, t->lang, p, t->size);
+                t->target = TAR_SKIP;
+            } else if (t->target == TAR_MEMBER && walker_grow(w, t->fill + take, t->size) != 0) {
+                w->stats[WALK_FILES_UNREADABLE]++;
+                w->path[t->base_len] = '\0';
+                t->target = TAR_SKIP;
+            } else if (t->target == TAR_MEMBER) {
+                // It spans chunks: gather it
+                memcpy(w->buf + t->fill, p, take);
+                t->fill += take;
+            } else if (t->target != TAR_SKIP) {
+                if (byte_buf_reserve(&t->meta, t->meta.len + take + 1) != 0) {
+                    t->target = TAR_SKIP;
+                } else {
+                    memcpy(t->meta.data + t->meta.len, p, take);
+                    t->meta.len += take;
+                    t->meta.data[t->meta.len] = '\0';
+                }
+            }
+            t->left -= take;
+            if (t->left == 0) tar_entry_done(t);
+        } else if (t->pad > 0) {
+            take = n < t->pad ? n : t->pad;
+            t->pad -= take;
+        } else {
+            take = TAR_BLOCK - t->header_fill;
+            if (take > n) take = n;
+            memcpy(t->header + t->header_fill, p, take);
+            t->header_fill += (int)take;
+            if (t->header_fill == TAR_BLOCK) {
+                t->header_fill = 0;
+                if (tar_entry(t) != 0) return -1;
+            }
+        }
+        p += take;
+        n -= take;
+    }
+    return t->done;
+}
+
+// Inflate every gzip member of data into the tar stream. Returns -1 if
+// the data isn't gzip or is damaged before the tar ended.
+static int gzip_walk(tar_stream_t* t, const unsigned char* data, long long len) {
+    unsigned char* window = malloc(INFLATE_WINDOW);
+    if (!window) return -1;
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    int rc = 0;
+    do {
+        // ID1 ID2 CM FLG MTIME(4) XFL OS, then the optional fields FLG names
+        if (end - p < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) {
+            rc = -1;
+            break;
+        }
+        int flags = p[3];
+        const unsigned char* q = p + 10;
+        if (flags & 4) q = end - q >= 2 ? q + 2 + archive_le16(q) : end + 1;
+        for (int bit = 8; bit <= 16 && q < end; bit <<= 1) {
+            if (!(flags & bit)) continue;
+            const unsigned char* nul = memchr(q, 0, end - q);
+            q = nul ? nul + 1 : end + 1;
+        }
+        if (flags & 2) q += 2;
+        if (q > end) {
+            rc = -1;
+            break;
+        }
+
+        inflate_state_t z;
+        memset(&z, 0, sizeof(z));
+        z.in = q;
+        z.in_end = end;
+        z.out = window;
+        z.out_cap = INFLATE_WINDOW;
+        z.sink = tar_push;
+        z.arg = t;
+        if (inflate_run(&z) != 0) {
+            if (!t->done) rc = -1;
+            break;
+        }
+        // Past the CRC-32 and size trailer, to the next member if any
+        p = z.in - z.bit_count / 8 + 8;
+    } while (!t->done && p < end);
+    free(window);
+    return rc;
+}
+
+// Count the members of a zip from its central directory. Returns -1 if it
+// has none that can be found, or an entry turns out damaged.
+static int zip_walk(walker_t* w, int base_len, const unsigned char* map, long long size) {
+    // The end record is the last 22 bytes, unless a comment of up to 64 KiB follows
+    long long eocd = -1;
+    for (long long i = size - 22; i >= 0 && i >= size - 22 - 65535; i--) {
+        if (archive_le32(map + i) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd < 0) return -1;
+    unsigned long long entries = archive_le16(map + eocd + 10);
+    unsigned long long cd_size = archive_le32(map + eocd + 12);
+    unsigned long long cd_off = archive_le32(map + eocd + 16);
+    if ((entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_off == 0xFFFFFFFF) && eocd >= 20 &&
+        archive_le32(map + eocd - 20) == 0x07064b50) {
+        unsigned long long z64 = archive_le64(map + eocd - 20 + 8);
+        if (size >= 56 && z64 <= (unsigned long long)size - 56 && archive_le32(map + z64) == 0x06064b50) {
+            entries = archive_le64(map + z64 + 32);
+            cd_size = archive_le64(map + z64 + 40);
+            cd_off = archive_le64(map + z64 + 48);
+        }
+    }
+    if (cd_off > (unsigned long long)size || cd_size > (unsigned long long)size - cd_off) return -1;
+
+    const unsigned char* p = map + cd_off;
+    const unsigned char* end = p + cd_size;
+    for (unsigned long long e = 0; e < entries; e++) {
+        if (walk_cancelled(w)) return 0;
+        if (end - p < 46 || archive_le32(p) != 0x02014b50) return -1;
+        int host = p[5];          // made-by 3 is Unix, with the file type in the external attributes
+        int flags = (int)archive_le16(p + 8);
+        int method = (int)archive_le16(p + 10);
+        unsigned long long csize = archive_le32(p + 20);
+        unsigned long long usize = archive_le32(p + 24);
+        int name_len = (int)archive_le16(p + 28);
+        int extra_len = (int)archive_le16(p + 30);
+        int comment_len = (int)archive_le16(p + 32);
+        unsigned mode = archive_le32(p + 38) >> 16;
+        unsigned long long local = archive_le32(p + 42);
+        const char* name = (const char*)p + 46;
+        if (end - p < 46 + name_len + extra_len + comment_len) return -1;
+
+        // The zip64 extra field holds, in order, whichever of these overflowed
+        const unsigned char* x = p + 46 + name_len;
+        const unsigned char* x_end = x + extra_len;
+        while (x_end - x >= 4) {
+            int id = (int)archive_le16(x);
+            int n = (int)archive_le16(x + 2);
+            const unsigned char* v = x + 4;
+            if (n > x_end - v) break;
+            if (id == 1) {
+                unsigned long long* fields[3] = { &usize, &csize, &local };
+                for (int f = 0; f < 3; f++) {
+                    if (*fields[f] != 0xFFFFFFFF || v + 8 > x + 4 + n) continue;
+                    *fields[f] = archive_le64(v);
+                    v += 8;
+                }
+            }
+            x += 4 + n;
+        }
+        p += 46 + name_len + extra_len + comment_len;
+
+        if (name_len == 0 || name[name_len - 1] == '/') continue;
+        if (host == 3 && (mode & S_IFMT) == S_IFLNK) {
+            w->stats[WALK_LINKS_SKIPPED]++;
+            continue;
+        }
+        const dynamic_lang_t* lang = archive_member(w, base_len, name, name_len);
+        if (!lang) continue;
+
+        const unsigned char* data = 0;
+        if (local <= (unsigned long long)size - 30 && archive_le32(map + local) == 0x04034b50) {
+            unsigned long long off = local + 30 + archive_le16(map + local + 26) + archive_le16(map + local + 28);
+            if (off <= (unsigned long long)size && csize <= (unsigned long long)size - off) data = map + off;
+        }
+        if (data && !(flags & 1) && method == 0 && csize == usize && usize <= 0x7FFFFFFF) {
+            archive_count(w, base_len, lang, data, (long long)usize);
+            continue;
+        }
+        // A size more than csize can inflate to is damage, not a reason to allocate it
+        if (data && !(flags & 1) && method == 8 && usize <= 0x7FFFFFFF && usize / INFLATE_MAX_RATIO <= csize &&
+            walker_reserve(w, (long long)usize) == 0) {
+            inflate_state_t z;
+            memset(&z, 0, sizeof(z));
+            z.in = data;
+            z.in_end = data + csize;
+            z.out = w->buf;
+            z.out_cap = (long long)usize;
+            if (inflate_run(&z) == 0 && z.out_pos == (long long)usize) {
+                archive_count(w, base_len, lang, w->buf, (long long)usize);
+                continue;
+            }
+        }
+        w->stats[WALK_FILES_UNREADABLE]++;
+        w->path[base_len] = '\0';
+    }
+    return 0;
+}
+
+// Count the members of the archive at w->path[0..len), of an ARCHIVE_* kind
+static void walk_archive(walker_t* w, int kind, int len) {
+    int prev = walk_phase(w, PHASE_READ);
+    long long size = 0;
+    const unsigned char* map = map_file(w->path, &size);
+    if (!map) {
+        w->stats[WALK_FILES_UNREADABLE]++;
+        walk_phase(w, prev);
+        return;
+    }
+    w->stats[WALK_ARCHIVES_READ]++;
+
+    dir_node_t* up = w->dir;
+    if (w->tree && len > w->rel_off) {
+        if (w->shared) pthread_mutex_lock(w->shared);
+        dir_node_t* node = dir_tree_enter(w->tree, up, w->path + w->rel_off, len - w->rel_off);
+        if (w->shared) pthread_mutex_unlock(w->shared);
+        if (node) w->dir = node;
+    }
+
+    int rc;
+    if (kind == ARCHIVE_ZIP) {
+        rc = zip_walk(w, len, map, size);
+    } else {
+        tar_stream_t* t = calloc(1, sizeof(tar_stream_t));
+        rc = -1;
+        if (t) {
+            t->w = w;
+            t->base_len = len;
+            rc = kind == ARCHIVE_TAR ? (tar_push(t, map, size) < 0 ? -1 : 0) : gzip_walk(t, map, size);
+            // Input that ends inside an entry is truncated; a missing end marker is tolerated
+            if (rc == 0 && (t->left > 0 || t->header_fill > 0)) rc = -1;
+            free(t->meta.data);
+            free(t);
+        }
+    }
+    if (rc != 0) w->stats[WALK_FILES_UNREADABLE]++;
+
+    munmap((void*)map, size);
+    w->path[len] = '\0';
+    w->dir = up;
+    walk_phase(w, prev);
+}
@@ -1,283 +1,345 @@
 #!/usr/bin/env bun
-import { readFileSync } from 'node:fs'
-import { join } from 'node:path'
-import { Glob } from 'bun'
+import { parseArgs } from 'node:util'
 import { bunnyLog } from 'bunny-log'
-import { cc, ptr } from 'bun:ffi'
-
-const LANGUAGES_JSON_PATH = './src/utils/languages.json'
-const languages: Record<string, LangDef> = JSON.parse(
-	readFileSync(LANGUAGES_JSON_PATH, 'utf-8')
-).languages
-
-// Compile C code with simplified dynamic language support
-const {
-	symbols: { add_language, analyze_file, get_language_name },
-} = cc({
-	source: './src/utils/cloc.c',
-	symbols: {
-		add_language: {
-			args: ['ptr', 'ptr', 'ptr', 'ptr', 'ptr'],
-			returns: 'void',
-		},
-		analyze_file: {
-			args: ['ptr', 'ptr', 'i32', 'ptr'],
-			returns: 'void',
-		},
-		get_language_name: {
-			args: ['ptr', 'ptr', 'i32'],
-			returns: 'void',
-		},
-	},
-})
-
-interface LangDef {
-	name?: string
-	extensions?: string[]
-	filenames?: string[]
-	line_comment?: string | string[]
-	multi_line_comments?: [string, string][]
-}
-
-// Initialize C language database
-let langDataInitialized = false
-function initLanguageDatabase() {
-	if (langDataInitialized) return
-
-	let count = 0
-	for (const [key, langDef] of Object.entries(languages)) {
-		const name = langDef.name || key
-
-		// Extensions (comma-separated)
-		const extensions = (langDef.extensions || []).join(',')
-
-		// Line comment (use first one if array)
-		const lineComment = Array.isArray(langDef.line_comment)
-			? langDef.line_comment[0] || ''
-			: langDef.line_comment || ''
-
-		// Block comments (use first one if multiple)
-		const blockComments = langDef.multi_line_comments?.[0]
-		const blockStart = blockComments?.[0] || ''
-		const blockEnd = blockComments?.[1] || ''
-
-		// Add language to C database (convert strings to C pointers)
-		add_language(
-			ptr(new TextEncoder().encode(`${name}\0`)),
-			ptr(new TextEncoder().encode(`${extensions}\0`)),
-			ptr(new TextEncoder().encode(`${lineComment}\0`)),
-			ptr(new TextEncoder().encode(`${blockStart}\0`)),
-			ptr(new TextEncoder().encode(`${blockEnd}\0`))
-		)
-		count++
-	}
-
-	langDataInitialized = true
-	bunnyLog.log(
-		'language',
-		`🗣️ Initialized ${count} language definitions from JSON`
-	)
+import { analyzeDiff } from './clocDiff.js'
+import {
+	type JobOptions,
+	type LangStats,
+	engine,
+	languageCount,
+	openIndex,
+	prepareEngine,
+	startCountTree,
+} from './clocEngine.js'
+import { analyzeHistory, analyzeRevision } from './clocGit.js'
+import {
+	fmt,
+	fmtBytes,
+	logDirTable,
+	logLanguageTable,
+	logPerfStats,
+	logTimingStats,
+	sumStats,
+} from './clocReport.js'
+import { analyzeToResult, mergeResults, reportResult } from './clocResult.js'
+import { watchCodebase } from './clocWatch.js'
+
+// Counts a tree with the native engine and reports it, and is the command
+// line for every mode: --watch, --rev, --history, --diff, --save-result,
+// --merge, --result and --index. The engine lives in clocEngine.ts, the
+// modes in clocGit.ts, clocDiff.ts, clocResult.ts and clocWatch.ts.
+
+export interface ReportOptions extends JobOptions {
+	/** Also report subtotals per directory down to this depth */
+	byDirDepth?: number
+	/** Save the per-directory rollup as an index file for openIndex */
+	saveIndex?: string
 }
 
-// --------- FORMATTERS ---------
-const fmt = (n: number) => n.toLocaleString()
-const fmtBytes = (b: number): string => {
-	if (b < 1024) return `${b} B`
-	if (b < 1048576) return `${(b / 1024).toFixed(2)} KB`
-	if (b < 1073741824) return `${(b / 1048576).toFixed(2)} MB`
-	return `${(b / 1073741824).toFixed(2)} GB`
-}
-
-// --------- MAIN ANALYZER ---------
-export async function analyzeCodebase(dir = './dist') {
+export async function analyzeCodebase(
+	dir = './dist',
+	options: ReportOptions = {}
+) {
 	const start = performance.now()
 
 	// Initialize language database from JSON
-	initLanguageDatabase()
+	const kernel = prepareEngine(options.kernel)
 
-	const files = [...new Glob('**/*').scanSync(dir)]
 	bunnyLog.log(
 		'analysis',
-		`⚡ Ultra-fast analyzing ${files.length} files with parallel C-powered counting (${Object.keys(languages).length} languages supported)`
+		`⚡ Ultra-fast analyzing ${dir} with native C walking and ${kernel} counting kernels from ${engine} (${languageCount} languages supported)`
 	)
 
-	// OPTIMIZATION 1: Lightweight filtering (only skip obvious non-code files)
-	const candidateFiles = files.filter((file) => {
-		// Quick check - only filter out obviously non-code files to avoid over-filtering
-		const lowerFile = file.toLowerCase()
-		return !(
-			lowerFile.endsWith('.png') ||
-			lowerFile.endsWith('.jpg') ||
-			lowerFile.endsWith('.gif') ||
-			lowerFile.endsWith('.pdf') ||
-			lowerFile.endsWith('.zip') ||
-			lowerFile.endsWith('.exe') ||
-			lowerFile.includes('node_modules') ||
-			lowerFile.includes('.git/')
+	const byDir =
+		options.byDir ||
+		options.byDirDepth !== undefined ||
+		options.saveIndex !== undefined
+	const job = startCountTree(dir, { ...options, byDir })
+	const counts = await job.result
+	if (!counts) {
+		bunnyLog.log('warning', `Cannot walk ${dir}`)
+		return
+	}
+	const { langStats, walk } = counts
+	const reportStart = performance.now()
+
+	if (walk.cancelled) {
+		bunnyLog.log(
+			'warning',
+			`⛔ Cancelled: partial results for the ${fmt(walk.files)} files counted so far`
 		)
-	})
+	}
 
 	bunnyLog.log(
 		'analysis',
-		`📁 Quick-filtered to ${candidateFiles.length} candidate files (${files.length - candidateFiles.length} obvious non-code files skipped)`
+		`📁 Walked ${fmt(walk.dirs)} directories (${fmt(walk.dirsIgnored)} ignored subtrees never entered), ${fmt(walk.files)} files counted (${fmt(walk.filesIgnored)} ignored, ${fmt(walk.filesUnknown)} unrecognised, ${fmt(walk.filesBinary)} binary, ${fmt(walk.filesUnreadable)} unreadable) via ${walk.asyncIo ? 'io_uring' : 'blocking reads'}`
+	)
+	bunnyLog.log(
+		'analysis',
+		`🔗 Links: ${fmt(walk.filesDuplicate)} duplicate files (${fmtBytes(walk.bytesDuplicate)} not re-read), ${fmt(walk.dirsDuplicate)} directories already walked, ${fmt(walk.linksSkipped)} symlinks skipped`
 	)
+	if (walk.archivesRead) {
+		bunnyLog.log(
+			'analysis',
+			`📦 Counted inside ${fmt(walk.archivesRead)} archives, members reported as archive/member paths`
+		)
+	}
+	if (walk.numaNodes) {
+		bunnyLog.log(
+			'analysis',
+			`🧵 Counted on ${walk.threads - 1} pool threads over ${walk.numaNodes} NUMA nodes, ${fmt(walk.stealsLocal)} batches stolen on the same node and ${fmt(walk.stealsRemote)} across nodes`
+		)
+	}
 
-	if (candidateFiles.length === 0) {
+	if (langStats.size === 0) {
+		counts.dirs?.free()
 		bunnyLog.log('warning', 'No valid files found to analyze')
 		return
 	}
 
-	// OPTIMIZATION 2: Fast synchronous file reading (async overhead not worth it)
-	const validFiles: { path: string; buffer: Uint8Array }[] = []
-
-	for (const file of candidateFiles) {
-		try {
-			const buffer = readFileSync(join(dir, file))
-			validFiles.push({ path: file, buffer })
-		} catch {
-			// Skip files that can't be read
+	logLanguageTable(langStats)
+	if (counts.dirs) {
+		if (options.byDirDepth !== undefined) {
+			logDirTable(counts.dirs, options.byDirDepth)
 		}
+		if (options.saveIndex) {
+			if (counts.dirs.save(options.saveIndex)) {
+				bunnyLog.log('success', `🗂️ Index saved to ${options.saveIndex}`)
+			} else {
+				bunnyLog.log('warning', `Cannot write ${options.saveIndex}`)
+			}
+		}
+		counts.dirs.free()
 	}
-
-	if (validFiles.length === 0) {
-		bunnyLog.log('warning', 'No valid files could be read')
-		return
+	if (options.perf) {
+		if (counts.perf) logPerfStats(counts.perf, sumStats(langStats)[4])
+		else bunnyLog.log('warning', 'Hardware counters unavailable')
 	}
+	logTimingStats(counts.threads, performance.now() - reportStart)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	bunnyLog.log(
+		'success',
+		`⚡ Optimized analysis completed! (${languageCount} languages available, efficient caching + buffer reuse)`
+	)
+}
 
-	// OPTIMIZATION 3: Maximum efficiency with smart caching and buffer reuse
-	const langStats = new Map<string, [number, number, number, number, number]>()
-
-	// Pre-allocate reusable buffers for maximum performance
-	const pathBuffer = new Uint8Array(512)
-	const langBuffer = new Uint8Array(64)
-	const resultBuffer = new Int32Array(5)
-	const encoder = new TextEncoder()
-	const decoder = new TextDecoder()
-
-	// Cache encoded paths to avoid repeated encoding
-	const pathEncodingCache = new Map<string, Uint8Array>()
+// Answer directory prefix queries from a saved index without walking.
+// Returns false if file is missing, unreadable or not a sound index.
+export function queryIndex(
+	file: string,
+	paths: string[],
+	language?: string
+): boolean {
+	const index = openIndex(file)
+	if (!index) {
+		bunnyLog.log('error', `${file} is missing or not a cloc index`)
+		return false
+	}
 
-	for (const { path, buffer } of validFiles) {
-		// Use cached encoded path or create new one
-		let encodedPath = pathEncodingCache.get(path)
-		if (!encodedPath) {
-			encodedPath = encoder.encode(`${path}\0`)
-			pathEncodingCache.set(path, encodedPath)
+	const rows = []
+	const row = (path: string, lang: string, stats: LangStats) => {
+		const [files, lines, code, comments, size] = stats
+		return {
+			Directory: path || '.',
+			Language: lang,
+			Files: fmt(files),
+			Lines: fmt(lines),
+			Code: fmt(code),
+			Comments: fmt(comments),
+			Size: fmtBytes(size),
+		}
+	}
+	for (const path of paths.length ? paths : ['']) {
+		if (language) {
+			const stats = index.queryLanguage(path, language)
+			if (stats) rows.push(row(path, language, stats))
+			else bunnyLog.log('warning', `${path} is not in the index`)
+			continue
+		}
+		const langStats = index.query(path)
+		if (!langStats) {
+			bunnyLog.log('warning', `${path} is not in the index`)
+			continue
 		}
+		const sorted = [...langStats].sort((a, b) => b[1][2] - a[1][2])
+		for (const [lang, stats] of sorted) rows.push(row(path, lang, stats))
+	}
+	index.close()
 
-		// Efficiently reuse path buffer
-		pathBuffer.fill(0) // Clear previous data
-		pathBuffer.set(encodedPath.slice(0, 511))
+	bunnyLog.log('analysis', `🗂️ ${file} (walked from ${index.root})`)
+	bunnyLog.table(rows)
+	return true
+}
 
-		// Get language name using buffer reuse
-		get_language_name(pathBuffer, langBuffer, 64)
+// ---- CLI Entrypoint ----
+if (import.meta.main) {
+	const { values, positionals } = parseArgs({
+		args: Bun.argv.slice(2),
+		options: {
+			'no-ignore': { type: 'boolean' },
+			hidden: { type: 'boolean' },
+			'no-follow': { type: 'boolean' },
+			'sync-io': { type: 'boolean' },
+			kernel: { type: 'string' },
+			threads: { type: 'string' },
+			perf: { type: 'boolean' },
+			watch: { type: 'boolean' },
+			'by-dir': { type: 'string' },
+			'save-index': { type: 'string' },
+			index: { type: 'string' },
+			lang: { type: 'string' },
+			rev: { type: 'string' },
+			history: { type: 'boolean' },
+			memo: { type: 'string' },
+			csv: { type: 'string' },
+			diff: { type: 'boolean' },
+			'max-changed': { type: 'string' },
+			'save-result': { type: 'string' },
+			'file-records': { type: 'boolean' },
+			archives: { type: 'boolean' },
+			merge: { type: 'string' },
+			result: { type: 'string' },
+		},
+		allowPositionals: true,
+	})
+	if (values.index) {
+		process.exit(queryIndex(values.index, positionals, values.lang) ? 0 : 1)
+	}
 
-		// Fast language extraction
-		const nameEnd = langBuffer.indexOf(0)
-		const langName = decoder.decode(
-			langBuffer.slice(0, nameEnd > 0 ? nameEnd : 64)
-		)
+	// --merge out a b ... reduces result files; --result shows one
+	if (values.merge) {
+		process.exit(mergeResults(values.merge, positionals) ? 0 : 1)
+	}
+	if (values.result) {
+		process.exit(reportResult(values.result) ? 0 : 1)
+	}
 
-		if (langName === 'Unknown') continue
+	// --threads N counts on a pool of N threads next to the walker
+	const threads =
+		values.threads === undefined ? undefined : Number(values.threads)
+	if (threads !== undefined && !(Number.isInteger(threads) && threads >= 0)) {
+		bunnyLog.log('error', '--threads takes a number of threads, 0 for none')
+		process.exit(2)
+	}
 
-		// Analyze file with efficient buffer reuse
-		analyze_file(pathBuffer, buffer, buffer.length, resultBuffer)
+	// --save-result file counts dir (default ./dist) into a result file
+	const saveResult = values['save-result']
+	if (values['file-records'] && !saveResult) {
+		bunnyLog.log('error', '--file-records only applies with --save-result')
+		process.exit(2)
+	}
+	if (saveResult) {
+		const ok = analyzeToResult(positionals[0] || './dist', saveResult, {
+			noIgnore: values['no-ignore'],
+			hidden: values.hidden,
+			noFollow: values['no-follow'],
+			syncIo: values['sync-io'],
+			kernel: values.kernel,
+			threads,
+			fileRecords: values['file-records'],
+			archives: values.archives,
+		})
+		process.exit(ok ? 0 : 1)
+	}
 
-		// Efficient result aggregation
-		if (!langStats.has(langName)) {
-			langStats.set(langName, [0, 0, 0, 0, 0])
+	// --diff old new compares two directories; with --rev old..new, two
+	// revisions of the repository at dir (default .)
+	if (values.diff) {
+		const range = values.rev?.split('..')
+		if (values.rev && (range?.length !== 2 || !range[0] || !range[1])) {
+			bunnyLog.log('error', '--diff --rev takes a range like HEAD~1..HEAD')
+			process.exit(2)
 		}
-
-		const stats = langStats.get(langName)
-		if (!stats) continue
-		stats[0]++ // files
-		stats[1] += resultBuffer[0] // lines
-		stats[2] += resultBuffer[1] // code
-		stats[3] += resultBuffer[2] // comments
-		stats[4] += resultBuffer[4] // size
+		if (!range && positionals.length !== 2) {
+			bunnyLog.log('error', '--diff takes two directories, or --rev a..b')
+			process.exit(2)
+		}
+		const [oldSide, newSide] = range ?? positionals
+		const maxChanged =
+			values['max-changed'] === undefined
+				? undefined
+				: Number(values['max-changed'])
+		if (
+			maxChanged !== undefined &&
+			!(Number.isInteger(maxChanged) && maxChanged >= 0)
+		) {
+			bunnyLog.log('error', '--max-changed takes a number of changed lines')
+			process.exit(2)
+		}
+		const ok = analyzeDiff(oldSide, newSide, {
+			repo: range ? positionals[0] || '.' : undefined,
+			noIgnore: values['no-ignore'],
+			hidden: values.hidden,
+			noFollow: values['no-follow'],
+			kernel: values.kernel,
+			maxChanged,
+		})
+		process.exit(ok ? 0 : 1)
 	}
 
-	// Display results
-	bunnyLog.log(
-		'analysis',
-		'📊 Code Analysis Results (Dynamic C-powered + JSON)'
-	)
-
-	let totalF = 0
-	let totalL = 0
-	let totalC = 0
-	let totalM = 0
-	let totalS = 0
-
-	const table = Array.from(langStats.entries())
-		.map(([lang, stats]) => {
-			const [files, lines, code, comments, size] = stats
-			totalF += files
-			totalL += lines
-			totalC += code
-			totalM += comments
-			totalS += size
-
-			return {
-				Language: lang,
-				Files: fmt(files),
-				Lines: fmt(lines),
-				Code: fmt(code),
-				Comments: fmt(comments),
-				Size: fmtBytes(size),
-			}
+	// --history counts every commit of --rev (default HEAD) the same way
+	if (values.history) {
+		const ok = analyzeHistory(positionals[0] || '.', values.rev ?? 'HEAD', {
+			noIgnore: values['no-ignore'],
+			hidden: values.hidden,
+			kernel: values.kernel,
+			memo: values.memo,
+			csv: values.csv,
 		})
-		.sort(
-			(a, b) =>
-				Number.parseInt(b.Code.replace(/,/g, '')) -
-				Number.parseInt(a.Code.replace(/,/g, ''))
-		)
-
-	table.push({
-		Language: 'Total',
-		Files: fmt(totalF),
-		Lines: fmt(totalL),
-		Code: fmt(totalC),
-		Comments: fmt(totalM),
-		Size: fmtBytes(totalS),
-	})
-
-	bunnyLog.table(table)
-
-	const pct = totalL ? 100 / totalL : 0
-	const totalB = totalL - totalC - totalM // blanks
-	bunnyLog.log('summary', `Files: ${fmt(totalF)}`)
-	bunnyLog.log('summary', `Lines: ${fmt(totalL)}`)
-	bunnyLog.log(
-		'summary',
-		`Code: ${fmt(totalC)} (${(totalC * pct).toFixed(1)}%)`
-	)
-	bunnyLog.log(
-		'summary',
-		`Comments: ${fmt(totalM)} (${(totalM * pct).toFixed(1)}%)`
-	)
-	bunnyLog.log(
-		'summary',
-		`Blanks: ${fmt(totalB)} (${(totalB * pct).toFixed(1)}%)`
-	)
-	bunnyLog.log('summary', `Size: ${fmtBytes(totalS)}`)
-	bunnyLog.log('summary', `Languages: ${langStats.size}`)
-	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
-	bunnyLog.log(
-		'success',
-		`⚡ Optimized analysis completed! (${Object.keys(languages).length} languages available, efficient caching + buffer reuse)`
-	)
-}
+		process.exit(ok ? 0 : 1)
+	}
 
-// Cleanup function
-process.on('exit', () => {
-	if (langDataInitialized) {
-		// cleanup_languages()
+	// --rev counts a revision of the repository at dir (default .) from .git
+	if (values.rev) {
+		const ok = analyzeRevision(positionals[0] || '.', values.rev, {
+			noIgnore: values['no-ignore'],
+			hidden: values.hidden,
+			kernel: values.kernel,
+		})
+		process.exit(ok ? 0 : 1)
 	}
-})
 
-// ---- CLI Entrypoint ----
-if (import.meta.main) {
-	const dir = Bun.argv[2] || './dist'
-	await analyzeCodebase(dir)
+	const dir = positionals[0] || './dist'
+	// --by-dir depth=N (or just N)
+	const byDir = values['by-dir']
+	const byDirMatch =
+		byDir === undefined ? null : /^(?:depth=)?(\d+)$/.exec(byDir)
+	if (byDir !== undefined && !byDirMatch) {
+		bunnyLog.log('error', '--by-dir takes a depth like depth=2 or 2')
+		process.exit(2)
+	}
+	const byDirDepth = byDirMatch ? Number(byDirMatch[1]) : undefined
+
+	// First Ctrl-C stops the walk (or the watch) and reports what was counted,
+	// the second exits. Once the walk is done Ctrl-C is back to its default.
+	const abort = new AbortController()
+	const onInterrupt = () => {
+		if (abort.signal.aborted) process.exit(130)
+		abort.abort()
+	}
+	process.on('SIGINT', onInterrupt)
+
+	let nextProgressLog = performance.now() + 1000
+	const analyze = values.watch ? watchCodebase : analyzeCodebase
+	await analyze(dir, {
+		signal: abort.signal,
+		onProgress: ({ dirs, files, bytes }) => {
+			if (performance.now() < nextProgressLog) return
+			nextProgressLog += 1000
+			bunnyLog.log(
+				'analysis',
+				`⏳ ${fmt(files)} files (${fmtBytes(bytes)}) counted in ${fmt(dirs)} directories so far...`
+			)
+		},
+		noIgnore: values['no-ignore'],
+		hidden: values.hidden,
+		noFollow: values['no-follow'],
+		syncIo: values['sync-io'],
+		kernel: values.kernel,
+		threads,
+		archives: values.archives,
+		perf: values.perf,
+		byDirDepth,
+		saveIndex: values['save-index'],
+	}).finally(() => process.off('SIGINT', onInterrupt))
 }
@@ -0,0 +1,119 @@
+#!/usr/bin/env bun
+import { $ } from 'bun'
+import { mkdir, readFile, writeFile } from 'node:fs/promises'
+import { resolve } from 'node:path'
+import { parseArgs } from 'node:util'
+import { generateCorpus, parseRange } from './clocCorpus.js'
+import {
+	formatLanguageTable,
+	loadLanguageDefinitions,
+} from './clocLanguages.js'
+
+// Benchmarks count_file_buffer per kernel and language family, and
+// detect_language lookups, through the native harness in cloc_bench.c.
+//
+//   bun run bench:cloc                            writes build/bench/results.jsonl
+//   bun run bench:cloc --compare old.jsonl        % change against an earlier run
+//   bun run bench:cloc --crlf 0.5 --block-nesting 2 --file-size 1024,8192
+//
+// Results are JSON lines: counts are deterministic for a given corpus, so a
+// diff between two result files shows exactly which rates moved.
+
+const WORK_DIR = resolve('build/bench')
+const HARNESS_SOURCE = resolve('src/utils/cloc_bench.c')
+const HARNESS = `${WORK_DIR}/cloc_bench`
+const LANGUAGES_TSV = `${WORK_DIR}/languages.tsv`
+const CORPUS_DIR = `${WORK_DIR}/corpus`
+
+interface BenchResult {
+	bench: string
+	kernel?: string
+	family?: string
+	mb_per_s?: number
+	files_per_s?: number
+	lookups_per_s?: number
+	[field: string]: string | number | undefined
+}
+
+const { values } = parseArgs({
+	args: Bun.argv.slice(2),
+	options: {
+		out: { type: 'string', default: `${WORK_DIR}/results.jsonl` },
+		compare: { type: 'string' },
+		'min-ms': { type: 'string', default: '200' },
+		seed: { type: 'string' },
+		files: { type: 'string', default: '200' },
+		'line-length': { type: 'string' },
+		'comment-density': { type: 'string' },
+		'block-nesting': { type: 'string' },
+		crlf: { type: 'string' },
+		'file-size': { type: 'string' },
+	},
+})
+const num = (v?: string) => (v === undefined ? undefined : Number(v))
+
+const key = (r: BenchResult) =>
+	[r.bench, r.kernel, r.family].filter(Boolean).join(' / ')
+const rate = (r: BenchResult) => r.mb_per_s ?? r.lookups_per_s ?? 0
+
+const parseResults = (text: string): BenchResult[] =>
+	text
+		.split('\n')
+		.filter((line) => line.startsWith('{'))
+		.map((line) => JSON.parse(line))
+
+await mkdir(WORK_DIR, { recursive: true })
+
+// The harness takes the same language table cloc.ts feeds the engine
+await writeFile(LANGUAGES_TSV, formatLanguageTable(loadLanguageDefinitions()))
+
+console.log('🌱 Generating benchmark corpus...')
+const bytes = await generateCorpus(CORPUS_DIR, {
+	seed: num(values.seed),
+	filesPerFamily: num(values.files),
+	lineLength: parseRange(values['line-length']),
+	commentDensity: num(values['comment-density']),
+	blockNesting: num(values['block-nesting']),
+	crlfRatio: num(values.crlf),
+	fileSize: parseRange(values['file-size']),
+})
+console.log(`   ${(bytes / 1048576).toFixed(2)} MB`)
+
+const compiler = process.env.CC || 'cc'
+console.log(`🔧 Building harness with ${compiler}...`)
+await $`${compiler} -O3 -Wall ${HARNESS_SOURCE} -o ${HARNESS}`
+
+console.log('⏱️ Running...')
+const output =
+	await $`${HARNESS} ${LANGUAGES_TSV} ${CORPUS_DIR} ${values['min-ms']}`.text()
+await writeFile(values.out as string, output)
+
+const results = parseResults(output)
+const baseline = values.compare
+	? new Map(
+			parseResults(await readFile(values.compare, 'utf-8')).map((r) => [
+				key(r),
+				r,
+			])
+		)
+	: undefined
+
+console.table(
+	results
+		.filter((r) => r.bench !== 'meta')
+		.map((r) => {
+			const row: Record<string, string> = {
+				Benchmark: key(r),
+				'MB/s': r.mb_per_s?.toFixed(1) ?? '',
+				'Files/s': r.files_per_s?.toLocaleString() ?? '',
+				'Lookups/s': r.lookups_per_s?.toLocaleString() ?? '',
+			}
+			const old = baseline?.get(key(r))
+			if (old) {
+				const delta = (rate(r) / rate(old) - 1) * 100
+				row.Change = `${delta >= 0 ? '+' : ''}${delta.toFixed(1)}%`
+			}
+			return row
+		})
+)
+console.log(`✅ Results written to ${values.out}`)
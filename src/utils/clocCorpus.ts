@@ -0,0 +1,306 @@
+#!/usr/bin/env bun
+import { mkdir, rm, writeFile } from 'node:fs/promises'
+import { join } from 'node:path'
+import { parseArgs } from 'node:util'
+
+// Deterministic synthetic source corpus for training (PGO) and benchmarking
+// the cloc engine. The same seed and options always produce byte-identical
+// files, so runs against it are comparable between commits and machines.
+
+export const CORPUS_FAMILIES = [
+	'c-like',
+	'hash-comment',
+	'sql',
+	'markup',
+	'minified-js',
+] as const
+export type CorpusFamily = (typeof CORPUS_FAMILIES)[number]
+
+export interface CorpusOptions {
+	seed?: number
+	filesPerFamily?: number
+	families?: readonly CorpusFamily[]
+	/** Code line width range in characters */
+	lineLength?: [number, number]
+	/** Fraction of non-blank lines that are comments (family default if unset) */
+	commentDensity?: number
+	/** Extra block-comment openers nested inside each block comment */
+	blockNesting?: number
+	/** Fraction of files written with CRLF line endings */
+	crlfRatio?: number
+	/** Log-uniform file size range in bytes */
+	fileSize?: [number, number]
+	/** Fraction of files drawn from the large range instead */
+	largeFileRatio?: number
+	largeFileSize?: [number, number]
+}
+
+interface FamilySyntax {
+	extension: string
+	lineComment?: string
+	block?: [string, string]
+	commentDensity: number
+	code: (rng: Rng, width: number) => string
+}
+
+// mulberry32: small, fast and good enough for synthetic text
+function createRng(seed: number) {
+	let state = seed >>> 0
+	const next = () => {
+		state = (state + 0x6d2b79f5) >>> 0
+		let t = state
+		t = Math.imul(t ^ (t >>> 15), t | 1)
+		t ^= t + Math.imul(t ^ (t >>> 7), t | 61)
+		return ((t ^ (t >>> 14)) >>> 0) / 4294967296
+	}
+	return {
+		next,
+		int: (min: number, max: number) => min + Math.floor(next() * (max - min + 1)),
+		pick: <T>(items: readonly T[]): T => items[Math.floor(next() * items.length)],
+	}
+}
+type Rng = ReturnType<typeof createRng>
+
+const WORDS = [
+	'value',
+	'count',
+	'buffer',
+	'index',
+	'result',
+	'config',
+	'handler',
+	'stream',
+	'offset',
+	'length',
+	'token',
+	'state',
+]
+
+const identifier = (rng: Rng) => `${rng.pick(WORDS)}_${rng.int(0, 99)}`
+const indent = (rng: Rng) => rng.pick(['', '    ', '        ', '\t', '\t\t'])
+
+// Words up to roughly `width` characters
+function text(rng: Rng, width: number): string {
+	let out = rng.pick(WORDS)
+	while (out.length < width) out += ` ${rng.pick(WORDS)}`
+	return out
+}
+
+// Repeat a statement template until the line reaches `width`
+function fill(width: number, part: () => string, sep: string): string {
+	let out = part()
+	while (out.length < width) out += `${sep}${part()}`
+	return out
+}
+
+const SYNTAX: Record<Exclude<CorpusFamily, 'minified-js'>, FamilySyntax> = {
+	'c-like': {
+		extension: 'c',
+		lineComment: '//',
+		block: ['/*', '*/'],
+		commentDensity: 0.3,
+		code: (rng, width) =>
+			`${fill(width, () => `${identifier(rng)} = ${identifier(rng)}(${rng.int(0, 4096)})`, ', ')};`,
+	},
+	'hash-comment': {
+		extension: 'py',
+		lineComment: '#',
+		commentDensity: 0.25,
+		code: (rng, width) =>
+			`${identifier(rng)} = ${fill(width, () => `${identifier(rng)}.${rng.pick(WORDS)}()`, ' + ')}`,
+	},
+	sql: {
+		extension: 'sql',
+		lineComment: '--',
+		block: ['/*', '*/'],
+		commentDensity: 0.25,
+		code: (rng, width) =>
+			`SELECT ${fill(width, () => identifier(rng), ', ')} FROM ${rng.pick(WORDS)} WHERE ${identifier(rng)} = ${rng.int(0, 999)};`,
+	},
+	markup: {
+		extension: 'html',
+		block: ['<!--', '-->'],
+		commentDensity: 0.15,
+		code: (rng, width) => {
+			const tag = rng.pick(['div', 'span', 'p', 'li', 'a'])
+			return `<${tag} class="${rng.pick(WORDS)}">${text(rng, width)}</${tag}>`
+		},
+	},
+}
+
+const EXTENSIONS: Record<CorpusFamily, string> = {
+	'c-like': SYNTAX['c-like'].extension,
+	'hash-comment': SYNTAX['hash-comment'].extension,
+	sql: SYNTAX.sql.extension,
+	markup: SYNTAX.markup.extension,
+	'minified-js': 'js',
+}
+
+type ResolvedOptions = Required<Omit<CorpusOptions, 'commentDensity'>> &
+	Pick<CorpusOptions, 'commentDensity'>
+
+function targetSize(rng: Rng, options: ResolvedOptions): number {
+	const [min, max] =
+		rng.next() < options.largeFileRatio
+			? options.largeFileSize
+			: options.fileSize
+	return Math.round(min * (max / min) ** rng.next())
+}
+
+function blockComment(
+	rng: Rng,
+	syntax: FamilySyntax,
+	options: ResolvedOptions,
+	out: string[]
+) {
+	const [open, close] = syntax.block as [string, string]
+	const [minWidth, maxWidth] = options.lineLength
+	const width = rng.int(minWidth, maxWidth)
+
+	if (rng.next() < 0.3) {
+		out.push(`${indent(rng)}${open} ${text(rng, width)} ${close}`)
+		return
+	}
+	const nested = ` ${open}`.repeat(options.blockNesting)
+	out.push(`${indent(rng)}${open}${nested}`)
+	for (let i = rng.int(1, 6); i > 0; i--) out.push(`   ${text(rng, width)}`)
+	out.push(` ${close}`)
+}
+
+function sourceLine(
+	rng: Rng,
+	syntax: FamilySyntax,
+	options: ResolvedOptions,
+	out: string[]
+) {
+	const density = options.commentDensity ?? syntax.commentDensity
+	const [minWidth, maxWidth] = options.lineLength
+
+	if (rng.next() < 0.12) {
+		out.push('')
+	} else if (rng.next() < density) {
+		if (syntax.block && (!syntax.lineComment || rng.next() < 0.3)) {
+			blockComment(rng, syntax, options, out)
+		} else {
+			out.push(
+				`${indent(rng)}${syntax.lineComment} ${text(rng, rng.int(minWidth, maxWidth))}`
+			)
+		}
+	} else {
+		out.push(`${indent(rng)}${syntax.code(rng, rng.int(minWidth, maxWidth))}`)
+	}
+}
+
+// Minified bundles: a licence header and a handful of very long lines
+function minifiedJs(rng: Rng, size: number): string[] {
+	const lines = [`/*! ${text(rng, 40)} */`]
+	let length = lines[0].length
+	let line = ''
+	while (length < size) {
+		const chunk = `var ${rng.pick(WORDS)}${rng.int(0, 9)}=function(a,b){return a.${rng.pick(WORDS)}(b)||${rng.int(0, 99)}};`
+		line += chunk
+		length += chunk.length
+		if (line.length > 32 * 1024 && rng.next() < 0.01) {
+			lines.push(line)
+			line = ''
+		}
+	}
+	lines.push(line)
+	return lines
+}
+
+function generateFile(
+	rng: Rng,
+	family: CorpusFamily,
+	options: ResolvedOptions
+): string {
+	const size = targetSize(rng, options)
+	const eol = rng.next() < options.crlfRatio ? '\r\n' : '\n'
+	if (family === 'minified-js') return `${minifiedJs(rng, size).join(eol)}${eol}`
+
+	const syntax = SYNTAX[family]
+	const lines: string[] = []
+	let length = 0
+	while (length < size) {
+		const before = lines.length
+		sourceLine(rng, syntax, options, lines)
+		for (let i = before; i < lines.length; i++) length += lines[i].length + 1
+	}
+	return `${lines.join(eol)}${eol}`
+}
+
+// Write the corpus to dir (replacing anything already there); returns the
+// number of bytes written
+export async function generateCorpus(
+	dir: string,
+	options: CorpusOptions = {}
+): Promise<number> {
+	const resolved: ResolvedOptions = {
+		seed: 0x5eed,
+		filesPerFamily: 200,
+		families: CORPUS_FAMILIES,
+		lineLength: [20, 100],
+		blockNesting: 0,
+		crlfRatio: 0,
+		fileSize: [256, 64 * 1024],
+		largeFileRatio: 0.02,
+		largeFileSize: [256 * 1024, 1024 * 1024],
+		...Object.fromEntries(
+			Object.entries(options).filter(([, v]) => v !== undefined)
+		),
+	}
+	const rng = createRng(resolved.seed)
+
+	await rm(dir, { recursive: true, force: true })
+
+	let bytes = 0
+	for (const family of resolved.families) {
+		const familyDir = join(dir, family)
+		await mkdir(familyDir, { recursive: true })
+		for (let i = 0; i < resolved.filesPerFamily; i++) {
+			const content = generateFile(rng, family, resolved)
+			bytes += Buffer.byteLength(content)
+			await writeFile(
+				join(familyDir, `file_${i}.${EXTENSIONS[family]}`),
+				content
+			)
+		}
+	}
+	return bytes
+}
+
+// Parse "a,b" into a numeric range for the CLIs
+export const parseRange = (value?: string): [number, number] | undefined => {
+	if (!value) return undefined
+	const [min, max] = value.split(',').map(Number)
+	return [min, max ?? min]
+}
+
+// ---- CLI Entrypoint ----
+if (import.meta.main) {
+	const { values, positionals } = parseArgs({
+		args: Bun.argv.slice(2),
+		options: {
+			seed: { type: 'string' },
+			files: { type: 'string' },
+			'line-length': { type: 'string' },
+			'comment-density': { type: 'string' },
+			'block-nesting': { type: 'string' },
+			crlf: { type: 'string' },
+			'file-size': { type: 'string' },
+		},
+		allowPositionals: true,
+	})
+	const num = (v?: string) => (v === undefined ? undefined : Number(v))
+	const dir = positionals[0] || './build/corpus'
+	const bytes = await generateCorpus(dir, {
+		seed: num(values.seed),
+		filesPerFamily: num(values.files),
+		lineLength: parseRange(values['line-length']),
+		commentDensity: num(values['comment-density']),
+		blockNesting: num(values['block-nesting']),
+		crlfRatio: num(values.crlf),
+		fileSize: parseRange(values['file-size']),
+	})
+	console.log(`✅ Wrote ${(bytes / 1048576).toFixed(2)} MB of corpus to ${dir}`)
+}
@@ -0,0 +1,618 @@
+#!/usr/bin/env bun
+import type { Socket } from 'bun'
+import { existsSync, mkdirSync, realpathSync, unlinkSync } from 'node:fs'
+import { dirname, resolve } from 'node:path'
+import { parseArgs } from 'node:util'
+import { bunnyLog } from 'bunny-log'
+import type { LangStats, TreeCounts } from './clocEngine.js'
+
+// Resident cloc engine answering count queries over a Unix socket, so
+// dashboards don't pay process start, engine load and a cold scan per query.
+//
+//   bun run cloc:daemon [roots...]                  serve (default root: .)
+//   bun run cloc:daemon --query src/utils           ask a running daemon
+//   bun run cloc:daemon --reload                    reload languages.json
+//
+// The daemon keeps the language database loaded, the engine's per-file
+// result cache warm and the encoded answer to every recent query in an
+// index. A query that accepts an answer up to maxAgeMs old is served from
+// the index without touching the tree; otherwise the tree is rescanned on
+// the engine thread, reading only files that changed since the last scan.
+// SIGHUP (or a RELOAD request) reloads languages.json and empties the index;
+// a languages.json that doesn't load leaves the current languages in place.
+//
+// The socket is created owner-only. A daemon won't start over a socket that
+// another daemon still answers PING on; a stale socket is replaced.
+//
+// Protocol: little-endian frames, each a u32 body length and the body.
+//   request   u8 op, then
+//     PING    -
+//     COUNT   u32 walk flags (noIgnore 1, hidden 2, noFollow 4),
+//             u32 maxAgeMs (0xffffffff: any age, clients default to
+//             5000), UTF-8 path at or below
+//             one of the daemon's roots
+//     RELOAD  -
+//   response  u8 status, then the UTF-8 message for errors, or
+//     PING    -
+//     COUNT   u8 1 if served from the index, u32 age in ms,
+//             u16 n, n × (u8 length, walk counter name, i64 value),
+//             u16 n, n × (u8 length, language name, i64 × 5 files, lines,
+//             code, comments, size)
+//     RELOAD  u32 languages loaded
+
+const DEFAULT_SOCKET = process.env.CLOC_SOCKET || resolve('build/cloc.sock')
+
+const OP_PING = 0
+const OP_COUNT = 1
+const OP_RELOAD = 2
+
+const STATUS_OK = 0
+const STATUS_NOT_FOUND = 1
+const STATUS_BAD_REQUEST = 2
+const STATUS_ERROR = 3
+
+// Walk flags a client may set (WALK_* in cloc.c)
+const FLAG_NO_IGNORE = 1
+const FLAG_HIDDEN = 2
+const FLAG_NO_FOLLOW = 4
+const QUERY_FLAGS = FLAG_NO_IGNORE | FLAG_HIDDEN | FLAG_NO_FOLLOW
+
+const ANY_AGE = 0xffffffff
+const DEFAULT_MAX_AGE_MS = 5000
+// A PING to an existing socket unanswered this long means no daemon is there
+const PING_TIMEOUT_MS = 1000
+const MAX_FRAME = 64 * 1024
+// Most recently used answers kept in the index
+const INDEX_ENTRIES = 1024
+
+class FrameWriter {
+	private bytes = new Uint8Array(256)
+	private view = new DataView(this.bytes.buffer)
+	private length = 4
+
+	private reserve(n: number) {
+		if (this.length + n <= this.bytes.length) return
+		const grown = new Uint8Array(
+			Math.max(this.bytes.length * 2, this.length + n)
+		)
+		grown.set(this.bytes)
+		this.bytes = grown
+		this.view = new DataView(grown.buffer)
+	}
+
+	u8(v: number) {
+		this.reserve(1)
+		this.view.setUint8(this.length, v)
+		this.length += 1
+		return this
+	}
+
+	u16(v: number) {
+		this.reserve(2)
+		this.view.setUint16(this.length, v, true)
+		this.length += 2
+		return this
+	}
+
+	u32(v: number) {
+		this.reserve(4)
+		this.view.setUint32(this.length, v, true)
+		this.length += 4
+		return this
+	}
+
+	i64(v: number) {
+		this.reserve(8)
+		this.view.setBigInt64(this.length, BigInt(v), true)
+		this.length += 8
+		return this
+	}
+
+	raw(bytes: Uint8Array) {
+		this.reserve(bytes.length)
+		this.bytes.set(bytes, this.length)
+		this.length += bytes.length
+		return this
+	}
+
+	// u8 length-prefixed, cut at 255 bytes
+	name(s: string) {
+		const bytes = new TextEncoder().encode(s).subarray(0, 255)
+		return this.u8(bytes.length).raw(bytes)
+	}
+
+	text(s: string) {
+		return this.raw(new TextEncoder().encode(s))
+	}
+
+	// The body alone, for embedding in another frame
+	body(): Uint8Array {
+		return this.bytes.slice(4, this.length)
+	}
+
+	frame(): Uint8Array {
+		this.view.setUint32(0, this.length - 4, true)
+		return this.bytes.subarray(0, this.length)
+	}
+}
+
+class FrameReader {
+	private bytes: Uint8Array
+	private view: DataView
+	private offset = 0
+
+	constructor(bytes: Uint8Array) {
+		this.bytes = bytes
+		this.view = new DataView(bytes.buffer, bytes.byteOffset, bytes.length)
+	}
+
+	u8() {
+		return this.view.getUint8(this.offset++)
+	}
+
+	u16() {
+		const v = this.view.getUint16(this.offset, true)
+		this.offset += 2
+		return v
+	}
+
+	u32() {
+		const v = this.view.getUint32(this.offset, true)
+		this.offset += 4
+		return v
+	}
+
+	i64() {
+		const v = Number(this.view.getBigInt64(this.offset, true))
+		this.offset += 8
+		return v
+	}
+
+	name() {
+		const length = this.u8()
+		const s = new TextDecoder().decode(
+			this.bytes.subarray(this.offset, this.offset + length)
+		)
+		this.offset += length
+		return s
+	}
+
+	rest() {
+		return new TextDecoder().decode(this.bytes.subarray(this.offset))
+	}
+}
+
+// Complete frame bodies at the front of buf, and whatever follows them
+function splitFrames(buf: Uint8Array): {
+	bodies: Uint8Array[]
+	rest: Uint8Array
+} {
+	const view = new DataView(buf.buffer, buf.byteOffset, buf.length)
+	const bodies: Uint8Array[] = []
+	let offset = 0
+	while (buf.length - offset >= 4) {
+		const length = view.getUint32(offset, true)
+		if (length > MAX_FRAME) throw new Error(`Frame of ${length} bytes`)
+		if (buf.length - offset - 4 < length) break
+		bodies.push(buf.slice(offset + 4, offset + 4 + length))
+		offset += 4 + length
+	}
+	return { bodies, rest: buf.subarray(offset) }
+}
+
+function concatBytes(a: Uint8Array, b: Uint8Array): Uint8Array {
+	if (a.length === 0) return b
+	const out = new Uint8Array(a.length + b.length)
+	out.set(a)
+	out.set(b, a.length)
+	return out
+}
+
+function encodeCounts({ walk, langStats }: TreeCounts): Uint8Array {
+	const w = new FrameWriter()
+	const counters = Object.entries(walk)
+	w.u16(counters.length)
+	for (const [name, value] of counters) w.name(name).i64(value)
+	w.u16(langStats.size)
+	for (const [name, stats] of langStats) {
+		w.name(name)
+		for (const v of stats) w.i64(v)
+	}
+	return w.body()
+}
+
+const errorFrame = (status: number, message: string) =>
+	new FrameWriter().u8(status).text(message).frame()
+
+// ---- Server ----
+
+interface IndexEntry {
+	payload: Uint8Array
+	at: number
+}
+
+interface Connection {
+	input: Uint8Array
+	output: Uint8Array
+	// Responses go out in request order
+	queue: Promise<void>
+}
+
+async function serve(roots: string[], socketPath: string, kernel?: string) {
+	const { loadLanguageDatabase, prepareEngine, startCountTree } = await import(
+		'./clocEngine.js'
+	)
+	const engineKernel = prepareEngine(kernel)
+	const rootPaths = roots.map((root) => realpathSync(root))
+
+	const index = new Map<string, IndexEntry>()
+	const inflight = new Map<string, Promise<IndexEntry | null>>()
+	// Bumped by reloads, so scans started before one don't refill the index
+	let indexGeneration = 0
+
+	const withinRoots = (path: string) =>
+		rootPaths.some((root) => {
+			const prefix = root.endsWith('/') ? root : `${root}/`
+			return path === root || path.startsWith(prefix)
+		})
+
+	// Rescan (reading only changed files) and index the answer; concurrent
+	// queries for the same tree share one scan
+	const scan = (dir: string, flags: number): Promise<IndexEntry | null> => {
+		const key = `${flags}:${dir}`
+		const pending = inflight.get(key)
+		if (pending) return pending
+
+		const generation = indexGeneration
+		const job = startCountTree(dir, {
+			noIgnore: (flags & FLAG_NO_IGNORE) !== 0,
+			hidden: (flags & FLAG_HIDDEN) !== 0,
+			noFollow: (flags & FLAG_NO_FOLLOW) !== 0,
+			cached: true,
+		})
+		const result = job.result
+			.then((counts) => {
+				if (!counts) return null
+				const entry = { payload: encodeCounts(counts), at: performance.now() }
+				if (generation === indexGeneration) {
+					index.delete(key)
+					index.set(key, entry)
+					if (index.size > INDEX_ENTRIES) {
+						index.delete(index.keys().next().value as string)
+					}
+				}
+				return entry
+			})
+			.finally(() => inflight.delete(key))
+		inflight.set(key, result)
+		return result
+	}
+
+	// Throws, keeping the current languages and index, if the table is bad
+	const reload = () => {
+		const count = loadLanguageDatabase()
+		indexGeneration++
+		index.clear()
+		return count
+	}
+
+	async function handle(body: Uint8Array): Promise<Uint8Array> {
+		if (body.length === 0) {
+			return errorFrame(STATUS_BAD_REQUEST, 'Empty request')
+		}
+		const request = new FrameReader(body)
+		const op = request.u8()
+
+		if (op === OP_PING) return new FrameWriter().u8(STATUS_OK).frame()
+		if (op === OP_RELOAD) {
+			return new FrameWriter().u8(STATUS_OK).u32(reload()).frame()
+		}
+		if (op !== OP_COUNT || body.length < 9) {
+			return errorFrame(STATUS_BAD_REQUEST, `Bad request (op ${op})`)
+		}
+
+		const flags = request.u32() & QUERY_FLAGS
+		const maxAge = request.u32()
+		let dir: string
+		try {
+			dir = realpathSync(request.rest())
+		} catch {
+			return errorFrame(STATUS_NOT_FOUND, 'No such directory')
+		}
+		if (!withinRoots(dir)) {
+			return errorFrame(STATUS_NOT_FOUND, `${dir} is outside the served roots`)
+		}
+
+		const key = `${flags}:${dir}`
+		let entry = index.get(key)
+		const fromIndex =
+			entry !== undefined &&
+			(maxAge === ANY_AGE || performance.now() - entry.at <= maxAge)
+		if (entry && fromIndex) {
+			index.delete(key)
+			index.set(key, entry)
+		} else {
+			const scanned = await scan(dir, flags)
+			if (!scanned) return errorFrame(STATUS_NOT_FOUND, `Cannot walk ${dir}`)
+			entry = scanned
+		}
+
+		return new FrameWriter()
+			.u8(STATUS_OK)
+			.u8(fromIndex ? 1 : 0)
+			.u32(Math.round(performance.now() - entry.at))
+			.raw(entry.payload)
+			.frame()
+	}
+
+	const flush = (socket: Socket<Connection>) => {
+		const conn = socket.data
+		if (conn.output.length === 0) return
+		const written = socket.write(conn.output)
+		conn.output = conn.output.subarray(Math.max(written, 0))
+	}
+	const send = (socket: Socket<Connection>, frame: Uint8Array) => {
+		socket.data.output = concatBytes(socket.data.output, frame)
+		flush(socket)
+	}
+
+	mkdirSync(dirname(socketPath), { recursive: true })
+	if (existsSync(socketPath)) {
+		if (await daemonAnswers(socketPath)) {
+			bunnyLog.log('error', `A cloc daemon is already serving ${socketPath}`)
+			process.exit(1)
+		}
+		unlinkSync(socketPath)
+	}
+	// Bound owner-only, so there is no window in which others can connect
+	const umask = process.umask(0o177)
+	const server = Bun.listen<Connection>({
+		unix: socketPath,
+		socket: {
+			open(socket) {
+				socket.data = {
+					input: new Uint8Array(0),
+					output: new Uint8Array(0),
+					queue: Promise.resolve(),
+				}
+			},
+			data(socket, data) {
+				const conn = socket.data
+				let frames: ReturnType<typeof splitFrames>
+				try {
+					frames = splitFrames(concatBytes(conn.input, data))
+				} catch (error) {
+					send(socket, errorFrame(STATUS_BAD_REQUEST, String(error)))
+					socket.end()
+					return
+				}
+				conn.input = frames.rest.slice()
+				for (const body of frames.bodies) {
+					conn.queue = conn.queue
+						.then(() => handle(body))
+						.catch((error) => errorFrame(STATUS_ERROR, String(error)))
+						.then((frame) => send(socket, frame))
+				}
+			},
+			drain: flush,
+			error(_socket, error) {
+				bunnyLog.log('warning', `cloc daemon connection error: ${error}`)
+			},
+		},
+	})
+	process.umask(umask)
+
+	process.on('SIGHUP', () => {
+		try {
+			reload()
+		} catch (error) {
+			bunnyLog.log(
+				'error',
+				`Reload failed, still serving the current languages: ${error}`
+			)
+		}
+	})
+	const stop = () => {
+		server.stop(true)
+		if (existsSync(socketPath)) unlinkSync(socketPath)
+		process.exit(0)
+	}
+	process.on('SIGINT', stop)
+	process.on('SIGTERM', stop)
+
+	bunnyLog.log(
+		'service',
+		`🐇 cloc daemon listening on ${socketPath} (${engineKernel} kernels), serving ${rootPaths.join(', ')}`
+	)
+
+	// Prime the result cache and the index before the first real query
+	for (const root of rootPaths) {
+		const start = performance.now()
+		const entry = await scan(root, 0)
+		bunnyLog.log(
+			'service',
+			entry
+				? `🔥 Warmed ${root} in ${(performance.now() - start).toFixed(1)}ms`
+				: `Cannot walk ${root}`
+		)
+	}
+}
+
+// ---- Client ----
+
+export interface DaemonQueryOptions {
+	socket?: string
+	/**
+	 * Accept an answer up to this old from the daemon's index (default 5 s,
+	 * Infinity for any age)
+	 */
+	maxAgeMs?: number
+	noIgnore?: boolean
+	hidden?: boolean
+	noFollow?: boolean
+}
+
+export interface DaemonCounts {
+	langStats: Map<string, LangStats>
+	walk: Record<string, number>
+	/** True if answered from the index rather than a rescan */
+	fromIndex: boolean
+	ageMs: number
+}
+
+// One request/response exchange on a fresh connection
+function exchange(socketPath: string, frame: Uint8Array): Promise<Uint8Array> {
+	return new Promise((resolveBody, reject) => {
+		let input = new Uint8Array(0)
+		let settled = false
+		const settle = (fn: () => void) => {
+			if (settled) return
+			settled = true
+			fn()
+		}
+
+		Bun.connect({
+			unix: socketPath,
+			socket: {
+				open(socket) {
+					socket.write(frame)
+				},
+				data(socket, data) {
+					input = concatBytes(input, data)
+					const { bodies } = splitFrames(input)
+					if (bodies.length === 0) return
+					settle(() => resolveBody(bodies[0]))
+					socket.end()
+				},
+				close() {
+					settle(() => reject(new Error('cloc daemon closed the connection')))
+				},
+				error(_socket, error) {
+					settle(() => reject(error))
+				},
+			},
+		}).catch((error) => settle(() => reject(error)))
+	})
+}
+
+// Whether a daemon answers PING on the socket in time
+async function daemonAnswers(socketPath: string): Promise<boolean> {
+	const ping = exchange(socketPath, new FrameWriter().u8(OP_PING).frame())
+	const timeout = new Promise<null>((resolveTimeout) =>
+		setTimeout(() => resolveTimeout(null), PING_TIMEOUT_MS)
+	)
+	try {
+		return (await Promise.race([ping, timeout])) !== null
+	} catch {
+		return false
+	}
+}
+
+function checkStatus(response: FrameReader) {
+	const status = response.u8()
+	if (status !== STATUS_OK) throw new Error(`cloc daemon: ${response.rest()}`)
+}
+
+export async function queryDaemon(
+	dir: string,
+	options: DaemonQueryOptions = {}
+): Promise<DaemonCounts> {
+	const flags =
+		(options.noIgnore ? FLAG_NO_IGNORE : 0) |
+		(options.hidden ? FLAG_HIDDEN : 0) |
+		(options.noFollow ? FLAG_NO_FOLLOW : 0)
+	const maxAgeMs = options.maxAgeMs ?? DEFAULT_MAX_AGE_MS
+	const frame = new FrameWriter()
+		.u8(OP_COUNT)
+		.u32(flags)
+		.u32(Math.min(Math.max(Math.round(maxAgeMs), 0), ANY_AGE))
+		.text(resolve(dir))
+		.frame()
+
+	const response = new FrameReader(
+		await exchange(options.socket ?? DEFAULT_SOCKET, frame)
+	)
+	checkStatus(response)
+	const fromIndex = response.u8() === 1
+	const ageMs = response.u32()
+
+	const walk: Record<string, number> = {}
+	for (let n = response.u16(); n > 0; n--) {
+		walk[response.name()] = response.i64()
+	}
+
+	const langStats = new Map<string, LangStats>()
+	for (let n = response.u16(); n > 0; n--) {
+		const name = response.name()
+		langStats.set(name, [
+			response.i64(),
+			response.i64(),
+			response.i64(),
+			response.i64(),
+			response.i64(),
+		])
+	}
+	return { langStats, walk, fromIndex, ageMs }
+}
+
+// Ask the daemon to reload languages.json; returns the language count
+export async function reloadDaemon(socket = DEFAULT_SOCKET): Promise<number> {
+	const frame = new FrameWriter().u8(OP_RELOAD).frame()
+	const response = new FrameReader(await exchange(socket, frame))
+	checkStatus(response)
+	return response.u32()
+}
+
+// ---- CLI Entrypoint ----
+if (import.meta.main) {
+	const { values, positionals } = parseArgs({
+		args: Bun.argv.slice(2),
+		options: {
+			socket: { type: 'string', default: DEFAULT_SOCKET },
+			query: { type: 'string' },
+			'max-age': { type: 'string' },
+			reload: { type: 'boolean' },
+			kernel: { type: 'string' },
+		},
+		allowPositionals: true,
+	})
+	const socket = values.socket as string
+
+	// --max-age ms, how old an indexed answer --query accepts
+	const maxAgeMs =
+		values['max-age'] === undefined ? undefined : Number(values['max-age'])
+	if (
+		maxAgeMs !== undefined &&
+		!(Number.isInteger(maxAgeMs) && maxAgeMs >= 0)
+	) {
+		bunnyLog.log('error', '--max-age takes a number of milliseconds')
+		process.exit(2)
+	}
+
+	if (values.query) {
+		const start = performance.now()
+		const counts = await queryDaemon(values.query, { socket, maxAgeMs })
+		const elapsed = performance.now() - start
+		bunnyLog.table(
+			[...counts.langStats]
+				.sort((a, b) => b[1][2] - a[1][2])
+				.map(([name, [files, lines, code, comments, size]]) => ({
+					Language: name,
+					Files: files,
+					Lines: lines,
+					Code: code,
+					Comments: comments,
+					Bytes: size,
+				}))
+		)
+		bunnyLog.log(
+			'timing',
+			`${counts.fromIndex ? `Index hit (${counts.ageMs}ms old)` : 'Rescanned'} in ${elapsed.toFixed(2)}ms`
+		)
+	} else if (values.reload) {
+		const count = await reloadDaemon(socket)
+		bunnyLog.log('language', `🗣️ Daemon reloaded ${count} language definitions`)
+	} else {
+		await serve(positionals.length ? positionals : ['.'], socket, values.kernel)
+	}
+}
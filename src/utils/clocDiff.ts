@@ -0,0 +1,159 @@
+import { bunnyLog } from 'bunny-log'
+import { ptr } from 'bun:ffi'
+import {
+	type AnalyzeOptions,
+	type DiffCounts,
+	type LangDiff,
+	MAX_LANGS,
+	type TreeDiff,
+	createDiffBuffers,
+	ctx,
+	decodeDiffResults,
+	engine,
+	prepareEngine,
+	symbols,
+	walkFlags,
+} from './clocEngine.js'
+import { openGitRepo } from './clocGit.js'
+import { fmt, fmtBytes } from './clocReport.js'
+
+// Line changes per language between two trees, or two revisions of a
+// repository, and the report with its CI gate on the number of changes
+
+const { cloc_diff_directories } = symbols
+
+// Added, removed and modified lines per language between two trees, each
+// walked with the same options. Files with identical bytes on both sides
+// are skipped; the rest are diffed line by line. Blocks the calling thread;
+// returns null if either directory can't be walked.
+export function diffTrees(
+	oldDir: string,
+	newDir: string,
+	options: AnalyzeOptions = {}
+): TreeDiff | null {
+	const buffers = createDiffBuffers()
+	const langCount = cloc_diff_directories(
+		ctx,
+		ptr(new TextEncoder().encode(`${oldDir}\0`)),
+		ptr(new TextEncoder().encode(`${newDir}\0`)),
+		walkFlags(options),
+		buffers.langNames,
+		buffers.langResults,
+		MAX_LANGS,
+		buffers.diffResults
+	)
+	if (langCount < 0) return null
+	return decodeDiffResults(langCount, buffers)
+}
+
+export interface DiffReportOptions extends AnalyzeOptions {
+	/** The sides are revisions of the repository at this directory */
+	repo?: string
+	/** Fail when more code and comment lines than this changed */
+	maxChanged?: number
+}
+
+// Code and comment lines added, removed or modified; blanks don't count
+const changedLines = ({ code, comments }: LangDiff) =>
+	code.added +
+	code.removed +
+	code.modified +
+	comments.added +
+	comments.removed +
+	comments.modified
+
+// Compare two directories (or, with options.repo, two revisions) and report
+// the line changes per language. Returns false if they can't be compared or
+// more lines changed than options.maxChanged allows.
+export function analyzeDiff(
+	oldSide: string,
+	newSide: string,
+	options: DiffReportOptions = {}
+): boolean {
+	const start = performance.now()
+	const kernel = prepareEngine(options.kernel)
+	let result: TreeDiff | null
+	if (options.repo) {
+		const repo = openGitRepo(options.repo)
+		if (typeof repo === 'string') {
+			bunnyLog.log('warning', repo)
+			return false
+		}
+		bunnyLog.log(
+			'analysis',
+			`⚡ Diffing ${oldSide}..${newSide} of ${options.repo} from its object store with ${kernel} counting kernels from ${engine}`
+		)
+		result = repo.diff(oldSide, newSide, options)
+		repo.close()
+	} else {
+		bunnyLog.log(
+			'analysis',
+			`⚡ Diffing ${oldSide} against ${newSide} with ${kernel} counting kernels from ${engine}`
+		)
+		result = diffTrees(oldSide, newSide, options)
+	}
+	if (!result) {
+		bunnyLog.log('warning', `Cannot compare ${oldSide} and ${newSide}`)
+		return false
+	}
+
+	const { langDiffs, diff } = result
+	bunnyLog.log(
+		'analysis',
+		`🧮 ${fmt(diff.filesDiffed)} files diffed (${fmt(diff.filesSame)} unchanged skipped, ${fmt(diff.treesSkipped)} unchanged subtrees), ${fmt(diff.lines)} lines and ${fmtBytes(diff.bytes)} compared, ${fmt(diff.edits)} edits`
+	)
+	if (diff.approximate) {
+		bunnyLog.log(
+			'warning',
+			`${fmt(diff.approximate)} files hit the diff cost cap; their changes may be overstated`
+		)
+	}
+
+	const cell = ({ added, removed, modified }: DiffCounts) =>
+		`+${fmt(added)} -${fmt(removed)} ~${fmt(modified)}`
+	const sum = (pick: (d: LangDiff) => DiffCounts): DiffCounts => {
+		const total = { added: 0, removed: 0, modified: 0 }
+		for (const d of langDiffs.values()) {
+			const counts = pick(d)
+			total.added += counts.added
+			total.removed += counts.removed
+			total.modified += counts.modified
+		}
+		return total
+	}
+	const total: LangDiff = {
+		files: sum((d) => d.files),
+		code: sum((d) => d.code),
+		comments: sum((d) => d.comments),
+		blanks: sum((d) => d.blanks),
+	}
+	const row = (lang: string, d: LangDiff) => ({
+		Language: lang,
+		Files: cell(d.files),
+		Code: cell(d.code),
+		Comments: cell(d.comments),
+		Blanks: cell(d.blanks),
+	})
+	const rows = [...langDiffs]
+		.filter(([, d]) => changedLines(d) || d.blanks.added || d.blanks.removed)
+		.sort((a, b) => changedLines(b[1]) - changedLines(a[1]))
+		.map(([lang, d]) => row(lang, d))
+	if (rows.length) {
+		rows.push(row('Total', total))
+		bunnyLog.table(rows)
+	} else {
+		bunnyLog.log('summary', 'No line changes')
+	}
+
+	const changed = changedLines(total)
+	bunnyLog.log('summary', `Changed code and comment lines: ${fmt(changed)}`)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	if (options.maxChanged !== undefined && changed > options.maxChanged) {
+		bunnyLog.log(
+			'error',
+			`${fmt(changed)} changed lines is over the limit of ${fmt(options.maxChanged)}`
+		)
+		return false
+	}
+	return true
+}
@@ -0,0 +1,984 @@
+import { createHash } from 'node:crypto'
+import { existsSync, readFileSync } from 'node:fs'
+import { bunnyLog } from 'bunny-log'
+import {
+	cc,
+	dlopen,
+	ptr,
+	suffix,
+	toArrayBuffer,
+	type FFIFunction,
+	type Pointer,
+} from 'bun:ffi'
+import {
+	formatLanguageTable,
+	loadLanguageDefinitions,
+} from './clocLanguages.js'
+
+// The native cloc engine every mode builds on: loading cloc.c, the engine
+// context with its language database and kernels, the layouts of the
+// buffers the engine fills in, and plain and background walks. The git,
+// diff, result and watch modes live in their own modules on top of it.
+
+const CLOC_SOURCE_PATH = './src/utils/cloc.c'
+// Built by `bun run build:cloc`; CLOC_LIB points at a specific build
+const CLOC_LIB_PATH = process.env.CLOC_LIB || `./build/libcloc.${suffix}`
+
+const clocSymbols = {
+	cloc_ctx_create: {
+		args: ['ptr'],
+		returns: 'ptr',
+	},
+	cloc_ctx_destroy: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_ctx_load_languages: {
+		args: ['ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_ctx_generation: {
+		args: ['ptr'],
+		returns: 'i64',
+	},
+	cloc_ctx_select_kernel: {
+		args: ['ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_analyze_directory: {
+		args: [
+			'ptr',
+			'ptr',
+			'i32',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+		],
+		returns: 'i32',
+	},
+	cloc_job_start: {
+		args: ['ptr', 'ptr', 'i32', 'i32', 'i32'],
+		returns: 'ptr',
+	},
+	cloc_job_progress: {
+		args: ['ptr'],
+		returns: 'ptr',
+	},
+	cloc_job_finish: {
+		args: ['ptr', 'ptr', 'ptr', 'i32', 'ptr', 'ptr', 'i32', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_job_dir_tree: {
+		args: ['ptr'],
+		returns: 'ptr',
+	},
+	cloc_dir_tree_count: {
+		args: ['ptr', 'i32', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_dir_tree_list: {
+		args: ['ptr', 'i32', 'ptr', 'i32', 'ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_dir_tree_query: {
+		args: ['ptr', 'ptr', 'ptr', 'ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_dir_tree_free: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_dir_tree_save: {
+		args: ['ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_index_open: {
+		args: ['ptr'],
+		returns: 'ptr',
+	},
+	cloc_index_root: {
+		args: ['ptr'],
+		returns: 'cstring',
+	},
+	cloc_index_query: {
+		args: ['ptr', 'ptr', 'ptr', 'ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_index_query_language: {
+		args: ['ptr', 'ptr', 'ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_index_close: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_watch_start: {
+		args: ['ptr', 'ptr', 'i32'],
+		returns: 'ptr',
+	},
+	cloc_watch_poll: {
+		args: ['ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_watch_results: {
+		args: ['ptr', 'ptr', 'ptr', 'i32', 'ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_watch_stop: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_git_open: {
+		args: ['ptr', 'ptr'],
+		returns: 'ptr',
+	},
+	cloc_git_resolve: {
+		args: ['ptr', 'ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_git_analyze: {
+		args: [
+			'ptr',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+		],
+		returns: 'i32',
+	},
+	cloc_git_stats: {
+		args: ['ptr', 'ptr'],
+		returns: 'void',
+	},
+	cloc_git_close: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_history_start: {
+		args: ['ptr', 'ptr', 'ptr', 'i32', 'ptr'],
+		returns: 'ptr',
+	},
+	cloc_history_next: {
+		args: ['ptr', 'ptr', 'ptr', 'ptr', 'ptr', 'i32', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_history_save: {
+		args: ['ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_history_free: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_result_save_directory: {
+		args: ['ptr', 'ptr', 'i32', 'i32', 'ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_result_save_shard: {
+		args: [
+			'ptr',
+			'ptr',
+			'i32',
+			'i32',
+			'i32',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+			'ptr',
+		],
+		returns: 'i32',
+	},
+	cloc_shard_estimate: {
+		args: ['ptr', 'ptr', 'i32', 'ptr', 'ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_result_merge: {
+		args: ['ptr', 'ptr', 'i32'],
+		returns: 'i32',
+	},
+	cloc_result_open: {
+		args: ['ptr'],
+		returns: 'ptr',
+	},
+	cloc_result_read: {
+		args: ['ptr', 'ptr', 'ptr', 'i32', 'ptr', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_result_file: {
+		args: ['ptr', 'i32', 'ptr', 'i32', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_result_close: {
+		args: ['ptr'],
+		returns: 'void',
+	},
+	cloc_diff_directories: {
+		args: ['ptr', 'ptr', 'ptr', 'i32', 'ptr', 'ptr', 'i32', 'ptr'],
+		returns: 'i32',
+	},
+	cloc_diff_revisions: {
+		args: [
+			'ptr',
+			'ptr',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+			'ptr',
+			'i32',
+			'ptr',
+		],
+		returns: 'i32',
+	},
+} satisfies Record<string, FFIFunction>
+
+// Whether the prebuilt library was built from cloc.c as it is now: buildCloc.ts
+// embeds the source's SHA-256, which file times can't be trusted to track
+// across checkouts, copies and clock skew. CLOC_LIB is always taken as is.
+function prebuiltIsCurrent() {
+	if (!existsSync(CLOC_LIB_PATH)) return false
+	if (process.env.CLOC_LIB) return true
+	try {
+		const lib = dlopen(CLOC_LIB_PATH, {
+			cloc_source_hash: { args: [], returns: 'cstring' },
+		})
+		const built = String(lib.symbols.cloc_source_hash())
+		lib.close()
+		const source = readFileSync(CLOC_SOURCE_PATH)
+		return built === createHash('sha256').update(source).digest('hex')
+	} catch {
+		// Built before the hash was embedded
+		return false
+	}
+}
+
+// Prefer the prebuilt optimized library; fall back to compiling cloc.c with
+// TinyCC when it is missing or was built from other source
+function loadEngine() {
+	if (prebuiltIsCurrent()) {
+		return {
+			engine: CLOC_LIB_PATH,
+			...dlopen(CLOC_LIB_PATH, clocSymbols),
+		}
+	}
+	return {
+		engine: 'TinyCC',
+		...cc({ source: CLOC_SOURCE_PATH, symbols: clocSymbols }),
+	}
+}
+
+const loaded = loadEngine()
+/** Where the engine was loaded from: the prebuilt library, or TinyCC */
+export const engine = loaded.engine
+/** Every FFI entry point, for the modes built on the engine */
+export const symbols = loaded.symbols
+const {
+	cloc_ctx_create,
+	cloc_ctx_destroy,
+	cloc_ctx_load_languages,
+	cloc_ctx_generation,
+	cloc_ctx_select_kernel,
+	cloc_analyze_directory,
+	cloc_job_start,
+	cloc_job_progress,
+	cloc_job_finish,
+	cloc_job_dir_tree,
+	cloc_dir_tree_count,
+	cloc_dir_tree_list,
+	cloc_dir_tree_query,
+	cloc_dir_tree_free,
+	cloc_dir_tree_save,
+	cloc_index_open,
+	cloc_index_root,
+	cloc_index_query,
+	cloc_index_query_language,
+	cloc_index_close,
+} = symbols
+
+// The engine context this module analyzes with: its language database and
+// kernel choice
+export const ctx = cloc_ctx_create(null)
+if (!ctx) throw new Error('Cannot create the cloc engine context')
+
+// Counting kernel variants, indexed like the KERNEL_* enum in cloc.c
+const KERNEL_NAMES = ['swar', 'sse2', 'avx2', 'avx512'] as const
+type KernelName = (typeof KERNEL_NAMES)[number]
+
+// Pick the counting kernels once: the best the CPU supports unless a variant
+// is forced (e.g. CLOC_KERNEL=sse2 for benchmarking)
+function selectKernel(forced?: string): string {
+	const requested = forced ? KERNEL_NAMES.indexOf(forced as KernelName) : -1
+	if (forced && requested < 0) {
+		bunnyLog.log(
+			'warning',
+			`Unknown kernel "${forced}", expected one of ${KERNEL_NAMES.join(', ')}`
+		)
+	}
+
+	let variant = cloc_ctx_select_kernel(ctx, requested)
+	if (variant < 0) {
+		bunnyLog.log(
+			'warning',
+			`Kernel "${forced}" is not supported on this CPU, using the best available`
+		)
+		variant = cloc_ctx_select_kernel(ctx, -1)
+	}
+	return KERNEL_NAMES[variant]
+}
+
+// (Re)load the C language database from languages.json. The engine builds
+// the new table off to the side and swaps it in; analyses already running
+// finish on the previous one. Returns the number of languages loaded.
+export let languageCount = 0
+export function loadLanguageDatabase(path?: string): number {
+	const table = formatLanguageTable(loadLanguageDefinitions(path))
+	const count = cloc_ctx_load_languages(
+		ctx,
+		ptr(new TextEncoder().encode(`${table}\0`))
+	)
+	if (count < 0) throw new Error('The cloc engine rejected the language table')
+
+	const generation = Number(cloc_ctx_generation(ctx))
+	languageCount = count
+	bunnyLog.log(
+		'language',
+		`🗣️ ${generation > 1 ? 'Reloaded' : 'Initialized'} ${count} language definitions from JSON`
+	)
+	return count
+}
+loadLanguageDatabase()
+
+// Layout of the buffers filled in by cloc_analyze_directory (see cloc.c)
+export const MAX_LANGS = 512
+export const MAX_THREADS = 64
+export const LANG_NAME_BYTES = 64
+export const LANG_STAT_FIELDS = 6 // files, lines, code, comments, blanks, size
+
+// Walk counters, in the order of the WALK_* enum in cloc.c
+export const WALK_STAT_NAMES = [
+	'dirs',
+	'dirsIgnored',
+	'files',
+	'filesIgnored',
+	'filesUnknown',
+	'filesBinary',
+	'filesUnreadable',
+	'filesDuplicate',
+	'bytesDuplicate',
+	'dirsDuplicate',
+	'linksSkipped',
+	'asyncIo',
+	'threads',
+	'cancelled',
+	'filesCached',
+	'numaNodes',
+	'stealsLocal',
+	'stealsRemote',
+	'archivesRead',
+] as const
+export type WalkStats = Record<(typeof WALK_STAT_NAMES)[number], number>
+
+// Engine phases, in the order of the PHASE_* enum in cloc.c
+export const PHASE_NAMES = [
+	'walk',
+	'read',
+	'sniff',
+	'detect',
+	'count',
+	'aggregate',
+] as const
+export type Phase = (typeof PHASE_NAMES)[number]
+
+export const PHASE_LABELS: Record<Phase, string> = {
+	walk: 'Traversal',
+	read: 'Ingestion',
+	sniff: 'Binary sniff',
+	detect: 'Detection',
+	count: 'Counting',
+	aggregate: 'Aggregation',
+}
+
+// Per-thread layout, matching thread_stats_t: thread id, NUMA node, wall
+// time, then ns, items and bytes per phase
+const THREAD_STAT_FIELDS = 3 + 3 * PHASE_NAMES.length
+
+export interface PhaseStats {
+	ns: number
+	items: number
+	bytes: number
+}
+export interface ThreadStats {
+	tid: number
+	/** The NUMA node the thread is pinned to, -1 if it isn't */
+	node: number
+	wallNs: number
+	phases: Record<Phase, PhaseStats>
+}
+
+// Hardware counter layout, matching perf_stats_t in cloc.c: an availability
+// bitmask, a user-only flag, then PERF_EVENT_NAMES per phase
+export const PERF_EVENT_NAMES = [
+	'cycles',
+	'instructions',
+	'branchMisses',
+	'l1dMisses',
+	'llcMisses',
+	'pageFaults',
+] as const
+const PERF_STAT_FIELDS = 2 + PHASE_NAMES.length * PERF_EVENT_NAMES.length
+
+export type PerfEvent = (typeof PERF_EVENT_NAMES)[number]
+/** Counter values per event; null where the counter could not be opened */
+export type PerfCounters = Record<PerfEvent, number | null>
+export interface PerfStats {
+	/** Kernel-mode work is excluded (perf_event_paranoid >= 2) */
+	userOnly: boolean
+	phases: Record<Phase, PerfCounters>
+}
+
+const WALK_NO_IGNORE_FILES = 1
+const WALK_HIDDEN = 2
+const WALK_NO_FOLLOW = 4
+const WALK_SYNC_IO = 8
+const WALK_CACHED = 16
+const WALK_BY_DIR = 32
+const WALK_FILE_RECORDS = 64
+const WALK_ARCHIVES = 128
+
+export interface AnalyzeOptions {
+	/** Don't apply .gitignore / .clocignore files */
+	noIgnore?: boolean
+	/** Enter dot-files and dot-directories */
+	hidden?: boolean
+	/** Skip symlinks instead of following them */
+	noFollow?: boolean
+	/** Read with blocking syscalls even when io_uring is available */
+	syncIo?: boolean
+	/** Reuse the counts of files unchanged since an earlier cached walk */
+	cached?: boolean
+	/** Roll the counts up per directory (background jobs only) */
+	byDir?: boolean
+	/** Keep every counted file's counts (result files only) */
+	fileRecords?: boolean
+	/** Count inside .tar, .tar.gz, .tgz and .zip files as archive/member paths */
+	archives?: boolean
+	/** Force a counting kernel variant (swar, sse2, avx2, avx512) */
+	kernel?: string
+	/** Collect hardware performance counters per engine phase */
+	perf?: boolean
+	/** Count on a pool of this many threads, spread over NUMA nodes */
+	threads?: number
+}
+
+/** Per-language [files, lines, code, comments, size] */
+export type LangStats = [number, number, number, number, number]
+
+export interface TreeCounts {
+	langStats: Map<string, LangStats>
+	walk: WalkStats
+	/** Time, items and bytes per phase for every engine thread */
+	threads: ThreadStats[]
+	/** Present when requested and at least one counter could be opened */
+	perf?: PerfStats
+	/** Present when requested with byDir; free it when done */
+	dirs?: DirRollup
+}
+
+export interface DirTotals {
+	/** Relative to the walked root, '' for the root itself */
+	path: string
+	depth: number
+	stats: LangStats
+}
+
+export interface DirRollup {
+	/** Per-language subtotals of a directory, null if the walk didn't enter it */
+	query(path: string): Map<string, LangStats> | null
+	/** Subtree totals of every directory at most depth levels below the root */
+	list(depth: number): DirTotals[]
+	/** Persist as an index file for openIndex; false if it can't be written */
+	save(file: string): boolean
+	/** Release the native tree */
+	free(): void
+}
+
+export interface ClocIndex {
+	/** The root the indexed walk started from */
+	root: string
+	/** Per-language totals under a directory, null if it isn't indexed */
+	query(path: string): Map<string, LangStats> | null
+	/** One language under a directory (zeros if absent), null if not indexed */
+	queryLanguage(path: string, language: string): LangStats | null
+	close(): void
+}
+
+// Pick the counting kernels; returns the kernel variant in use
+export function prepareEngine(kernel?: string): string {
+	return selectKernel(kernel ?? process.env.CLOC_KERNEL)
+}
+
+export function walkFlags(options: AnalyzeOptions): number {
+	return (
+		(options.noIgnore ? WALK_NO_IGNORE_FILES : 0) |
+		(options.hidden ? WALK_HIDDEN : 0) |
+		(options.noFollow ? WALK_NO_FOLLOW : 0) |
+		(options.syncIo ? WALK_SYNC_IO : 0) |
+		(options.cached ? WALK_CACHED : 0) |
+		(options.byDir ? WALK_BY_DIR : 0) |
+		(options.fileRecords ? WALK_FILE_RECORDS : 0) |
+		(options.archives ? WALK_ARCHIVES : 0)
+	)
+}
+
+// Output buffers in the layout cloc_analyze_directory and cloc_job_finish
+// fill in
+export function createResultBuffers(perf?: boolean) {
+	return {
+		langNames: new Uint8Array(MAX_LANGS * LANG_NAME_BYTES),
+		langResults: new BigInt64Array(MAX_LANGS * LANG_STAT_FIELDS),
+		walkResults: new BigInt64Array(WALK_STAT_NAMES.length),
+		threadResults: new BigInt64Array(MAX_THREADS * THREAD_STAT_FIELDS),
+		perfResults: perf ? new BigInt64Array(PERF_STAT_FIELDS) : null,
+	}
+}
+export type ResultBuffers = ReturnType<typeof createResultBuffers>
+
+// The i-th NUL-padded name of a language results buffer
+export function langName(langNames: Uint8Array, i: number): string {
+	const nameBytes = langNames.subarray(
+		i * LANG_NAME_BYTES,
+		(i + 1) * LANG_NAME_BYTES
+	)
+	const nameEnd = nameBytes.indexOf(0)
+	return new TextDecoder().decode(
+		nameBytes.subarray(0, nameEnd >= 0 ? nameEnd : LANG_NAME_BYTES)
+	)
+}
+
+export function decodeLangStats(
+	langCount: number,
+	langNames: Uint8Array,
+	langResults: BigInt64Array
+): Map<string, LangStats> {
+	const langStats = new Map<string, LangStats>()
+
+	for (let i = 0; i < langCount; i++) {
+		const [files, lines, code, comments, , size] = Array.from(
+			langResults.subarray(i * LANG_STAT_FIELDS, (i + 1) * LANG_STAT_FIELDS),
+			Number
+		)
+		langStats.set(langName(langNames, i), [files, lines, code, comments, size])
+	}
+	return langStats
+}
+
+export function decodeResults(
+	langCount: number,
+	buffers: ResultBuffers
+): TreeCounts {
+	const { langNames, langResults, walkResults, threadResults, perfResults } =
+		buffers
+
+	const walk = Object.fromEntries(
+		WALK_STAT_NAMES.map((name, i) => [name, Number(walkResults[i])])
+	) as WalkStats
+	const langStats = decodeLangStats(langCount, langNames, langResults)
+
+	const threads = Array.from({ length: walk.threads }, (_, t) =>
+		decodeThreadStats(
+			threadResults.subarray(
+				t * THREAD_STAT_FIELDS,
+				(t + 1) * THREAD_STAT_FIELDS
+			)
+		)
+	)
+	const perf = perfResults ? decodePerfStats(perfResults) : undefined
+	return { langStats, walk, threads, perf }
+}
+
+function decodeThreadStats(raw: BigInt64Array): ThreadStats {
+	const n = PHASE_NAMES.length
+	const phases = {} as ThreadStats['phases']
+	PHASE_NAMES.forEach((phase, p) => {
+		phases[phase] = {
+			ns: Number(raw[3 + p]),
+			items: Number(raw[3 + n + p]),
+			bytes: Number(raw[3 + 2 * n + p]),
+		}
+	})
+	return {
+		tid: Number(raw[0]),
+		node: Number(raw[1]),
+		wallNs: Number(raw[2]),
+		phases,
+	}
+}
+
+function decodePerfStats(raw: BigInt64Array): PerfStats | undefined {
+	const available = Number(raw[0])
+	if (!available) return undefined
+
+	const phases = {} as PerfStats['phases']
+	PHASE_NAMES.forEach((phase, p) => {
+		phases[phase] = Object.fromEntries(
+			PERF_EVENT_NAMES.map((event, e) => [
+				event,
+				available & (1 << e)
+					? Number(raw[2 + p * PERF_EVENT_NAMES.length + e])
+					: null,
+			])
+		) as PerfCounters
+	})
+	return { userOnly: raw[1] !== 0n, phases }
+}
+
+// Queries over a job's native directory tree, which stays alive (and O(1)
+// to query) until freed
+function createDirRollup(tree: Pointer): DirRollup {
+	let freed = false
+	const live = () => {
+		if (freed) throw new Error('The directory rollup was already freed')
+	}
+
+	return {
+		query: (path) => {
+			live()
+			const langNames = new Uint8Array(MAX_LANGS * LANG_NAME_BYTES)
+			const langResults = new BigInt64Array(MAX_LANGS * LANG_STAT_FIELDS)
+			const langCount = cloc_dir_tree_query(
+				tree,
+				ptr(new TextEncoder().encode(`${path}\0`)),
+				langNames,
+				langResults,
+				MAX_LANGS
+			)
+			if (langCount < 0) return null
+			return decodeLangStats(langCount, langNames, langResults)
+		},
+		list: (depth) => {
+			live()
+			const pathBytes = new BigInt64Array(1)
+			const count = cloc_dir_tree_count(tree, depth, pathBytes)
+			const paths = new Uint8Array(Math.max(1, Number(pathBytes[0])))
+			const stats = new BigInt64Array(Math.max(1, count) * LANG_STAT_FIELDS)
+			const written = cloc_dir_tree_list(
+				tree,
+				depth,
+				paths,
+				paths.length,
+				stats,
+				count
+			)
+
+			const names = new TextDecoder().decode(paths).split('\0')
+			return Array.from({ length: written }, (_, i) => {
+				const [files, lines, code, comments, , size] = Array.from(
+					stats.subarray(i * LANG_STAT_FIELDS, (i + 1) * LANG_STAT_FIELDS),
+					Number
+				)
+				const path = names[i]
+				return {
+					path,
+					depth: path ? path.split('/').length : 0,
+					stats: [files, lines, code, comments, size] as LangStats,
+				}
+			})
+		},
+		save: (file) => {
+			live()
+			const target = ptr(new TextEncoder().encode(`${file}\0`))
+			return cloc_dir_tree_save(tree, target) === 0
+		},
+		free: () => {
+			if (freed) return
+			freed = true
+			cloc_dir_tree_free(tree)
+		},
+	}
+}
+
+// Map an index saved from a rollup. Queries are binary searches over the
+// mapped file, with no walk and no parsing; returns null if the file is
+// missing, damaged or written by another build.
+export function openIndex(file: string): ClocIndex | null {
+	const index = cloc_index_open(ptr(new TextEncoder().encode(`${file}\0`)))
+	if (!index) return null
+
+	let closed = false
+	const open = () => {
+		if (closed) throw new Error('The cloc index was already closed')
+	}
+	const encodePath = (path: string) =>
+		ptr(new TextEncoder().encode(`${path}\0`))
+	const stats = new BigInt64Array(LANG_STAT_FIELDS)
+
+	return {
+		root: cloc_index_root(index).toString(),
+		query: (path) => {
+			open()
+			const langNames = new Uint8Array(MAX_LANGS * LANG_NAME_BYTES)
+			const langResults = new BigInt64Array(MAX_LANGS * LANG_STAT_FIELDS)
+			const langCount = cloc_index_query(
+				index,
+				encodePath(path),
+				langNames,
+				langResults,
+				MAX_LANGS
+			)
+			if (langCount < 0) return null
+			return decodeLangStats(langCount, langNames, langResults)
+		},
+		queryLanguage: (path, language) => {
+			open()
+			const found = cloc_index_query_language(
+				index,
+				encodePath(path),
+				encodePath(language),
+				stats
+			)
+			if (found < 0) return null
+			const [files, lines, code, comments, , size] = Array.from(stats, Number)
+			return [files, lines, code, comments, size]
+		},
+		close: () => {
+			if (closed) return
+			closed = true
+			cloc_index_close(index)
+		},
+	}
+}
+
+// Walk, filter, read and count a tree in one native call, without any
+// reporting. Blocks the calling thread; returns null if dir can't be walked.
+export function countTree(
+	dir: string,
+	options: AnalyzeOptions = {}
+): TreeCounts | null {
+	const buffers = createResultBuffers(options.perf)
+	const langCount = cloc_analyze_directory(
+		ctx,
+		ptr(new TextEncoder().encode(`${dir}\0`)),
+		walkFlags(options),
+		options.threads ?? 0,
+		buffers.langNames,
+		buffers.langResults,
+		MAX_LANGS,
+		buffers.walkResults,
+		buffers.threadResults,
+		MAX_THREADS,
+		buffers.perfResults
+	)
+	if (langCount < 0) return null
+	return decodeResults(langCount, buffers)
+}
+
+// Diff counters, in the order of the DIFF_STAT_* enum in cloc.c
+export const DIFF_STAT_NAMES = [
+	'filesDiffed',
+	'filesSame',
+	'treesSkipped',
+	'lines',
+	'edits',
+	'approximate',
+	'bytes',
+] as const
+export type DiffStats = Record<(typeof DIFF_STAT_NAMES)[number], number>
+
+// Files, then code, comment and blank lines, each added/removed/modified
+const DIFF_LANG_FIELDS = 12
+
+export interface DiffCounts {
+	added: number
+	removed: number
+	/** Changed in place: paired removed and added lines of the same kind */
+	modified: number
+}
+
+export interface LangDiff {
+	files: DiffCounts
+	code: DiffCounts
+	comments: DiffCounts
+	blanks: DiffCounts
+}
+
+export interface TreeDiff {
+	langDiffs: Map<string, LangDiff>
+	/** approximate: files whose diff hit the cost cap and may overstate */
+	diff: DiffStats
+}
+
+export function createDiffBuffers() {
+	return {
+		langNames: new Uint8Array(MAX_LANGS * LANG_NAME_BYTES),
+		langResults: new BigInt64Array(MAX_LANGS * DIFF_LANG_FIELDS),
+		diffResults: new BigInt64Array(DIFF_STAT_NAMES.length),
+	}
+}
+export type DiffBuffers = ReturnType<typeof createDiffBuffers>
+
+export function decodeDiffResults(
+	langCount: number,
+	buffers: DiffBuffers
+): TreeDiff {
+	const { langNames, langResults, diffResults } = buffers
+	const langDiffs = new Map<string, LangDiff>()
+	for (let i = 0; i < langCount; i++) {
+		const raw = langResults.subarray(
+			i * DIFF_LANG_FIELDS,
+			(i + 1) * DIFF_LANG_FIELDS
+		)
+		const counts = (k: number): DiffCounts => ({
+			added: Number(raw[3 * k]),
+			removed: Number(raw[3 * k + 1]),
+			modified: Number(raw[3 * k + 2]),
+		})
+		langDiffs.set(langName(langNames, i), {
+			files: counts(0),
+			code: counts(1),
+			comments: counts(2),
+			blanks: counts(3),
+		})
+	}
+	const diff = Object.fromEntries(
+		DIFF_STAT_NAMES.map((name, k) => [name, Number(diffResults[k])])
+	) as DiffStats
+	return { langDiffs, diff }
+}
+
+// How often a background job is polled from the event loop
+const JOB_POLL_MS = 20
+
+// walk_progress_t in cloc.c, read and written in place without FFI calls
+const PROGRESS_DIRS = 0
+const PROGRESS_FILES = 1
+const PROGRESS_BYTES = 2
+const PROGRESS_CANCEL = 3
+const PROGRESS_DONE = 4
+const PROGRESS_FIELDS = 5
+
+export interface JobProgress {
+	dirs: number
+	files: number
+	bytes: number
+}
+
+export interface JobOptions extends AnalyzeOptions {
+	/** Stops the job early; its result then holds partial totals */
+	signal?: AbortSignal
+	/** Called on every poll while the job runs */
+	onProgress?: (progress: JobProgress) => void
+}
+
+export interface AnalysisJob {
+	/** The counts (partial if walk.cancelled), or null if dir can't be walked */
+	result: Promise<TreeCounts | null>
+	progress(): JobProgress
+	cancel(): void
+	readonly cancelled: boolean
+}
+
+// Same as countTree, but the native walk runs on its own thread and the
+// event loop only polls it, so the bot keeps serving (and heartbeating)
+// while a large tree is counted
+export function startCountTree(
+	dir: string,
+	options: JobOptions = {}
+): AnalysisJob {
+	const job = cloc_job_start(
+		ctx,
+		ptr(new TextEncoder().encode(`${dir}\0`)),
+		walkFlags(options),
+		options.threads ?? 0,
+		options.perf ? 1 : 0
+	)
+	if (!job) throw new Error('Cannot start the cloc engine thread')
+
+	// The engine publishes progress with relaxed 64-bit stores; Atomics
+	// gives the matching untorn loads here
+	const block = new BigInt64Array(
+		toArrayBuffer(cloc_job_progress(job) as number, 0, PROGRESS_FIELDS * 8)
+	)
+	let last: JobProgress = { dirs: 0, files: 0, bytes: 0 }
+	let finished = false
+	let cancelled = false
+
+	const poll = () => {
+		last = {
+			dirs: Number(Atomics.load(block, PROGRESS_DIRS)),
+			files: Number(Atomics.load(block, PROGRESS_FILES)),
+			bytes: Number(Atomics.load(block, PROGRESS_BYTES)),
+		}
+		return Atomics.load(block, PROGRESS_DONE) !== 0n
+	}
+	const cancel = () => {
+		if (finished || cancelled) return
+		cancelled = true
+		Atomics.store(block, PROGRESS_CANCEL, 1n)
+	}
+	options.signal?.addEventListener('abort', cancel, { once: true })
+	if (options.signal?.aborted) cancel()
+
+	const result = new Promise<TreeCounts | null>((resolve) => {
+		const tick = () => {
+			if (!poll()) {
+				options.onProgress?.(last)
+				setTimeout(tick, JOB_POLL_MS)
+				return
+			}
+			// The block is freed with the job
+			finished = true
+			options.signal?.removeEventListener('abort', cancel)
+
+			const tree = options.byDir ? cloc_job_dir_tree(job) : null
+			const buffers = createResultBuffers(options.perf)
+			const langCount = cloc_job_finish(
+				job,
+				buffers.langNames,
+				buffers.langResults,
+				MAX_LANGS,
+				buffers.walkResults,
+				buffers.threadResults,
+				MAX_THREADS,
+				buffers.perfResults
+			)
+			if (langCount < 0) {
+				if (tree) cloc_dir_tree_free(tree)
+				resolve(null)
+				return
+			}
+			const counts = decodeResults(langCount, buffers)
+			if (tree) counts.dirs = createDirRollup(tree)
+			resolve(counts)
+		}
+		tick()
+	})
+
+	return {
+		result,
+		progress: () => {
+			if (!finished) poll()
+			return last
+		},
+		cancel,
+		get cancelled() {
+			return cancelled
+		},
+	}
+}
+
+// Running jobs hold their own references to the database and result cache
+process.on('exit', () => {
+	cloc_ctx_destroy(ctx)
+})
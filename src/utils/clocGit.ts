@@ -0,0 +1,436 @@
+import { writeFileSync } from 'node:fs'
+import { bunnyLog } from 'bunny-log'
+import { ptr } from 'bun:ffi'
+import {
+	type AnalyzeOptions,
+	LANG_NAME_BYTES,
+	LANG_STAT_FIELDS,
+	type LangStats,
+	MAX_LANGS,
+	MAX_THREADS,
+	type TreeCounts,
+	type TreeDiff,
+	createDiffBuffers,
+	createResultBuffers,
+	ctx,
+	decodeDiffResults,
+	decodeLangStats,
+	decodeResults,
+	engine,
+	prepareEngine,
+	symbols,
+	walkFlags,
+} from './clocEngine.js'
+import {
+	fmt,
+	fmtBytes,
+	logLanguageTable,
+	logTimingStats,
+	sumStats,
+} from './clocReport.js'
+
+// Counting revisions and whole histories of a git repository straight from
+// its object store, without a checkout
+
+const {
+	cloc_git_open,
+	cloc_git_resolve,
+	cloc_git_analyze,
+	cloc_git_stats,
+	cloc_git_close,
+	cloc_history_start,
+	cloc_history_next,
+	cloc_history_save,
+	cloc_history_free,
+	cloc_diff_revisions,
+} = symbols
+
+// Why cloc_git_open returned no repository, GIT_OPEN_* in cloc.c
+const GIT_OPEN_OBJECT_FORMAT = 2
+
+// Object store counters, in the order of the GIT_* enum in cloc.c
+const GIT_STAT_NAMES = [
+	'objectsPacked',
+	'objectsLoose',
+	'deltas',
+	'cacheHits',
+	'bytesInflated',
+	'packs',
+] as const
+export type GitStats = Record<(typeof GIT_STAT_NAMES)[number], number>
+
+export interface RevisionCounts extends TreeCounts {
+	/** Full id of the commit (or tree) the revision named */
+	commit: string
+	/** Object store counters since the repository was opened */
+	git: GitStats
+}
+
+// History counters, in the order of the HISTORY_* enum in cloc.c
+const HISTORY_STAT_NAMES = [
+	'commits',
+	'treesRead',
+	'treesSkipped',
+	'blobsCounted',
+	'memoHits',
+	'memoLoaded',
+	'memoEntries',
+] as const
+export type HistoryStats = Record<(typeof HISTORY_STAT_NAMES)[number], number>
+
+export interface HistoryCommit {
+	commit: string
+	/** Committer time, seconds since the epoch */
+	time: number
+	/** The tree's totals at this commit */
+	langStats: Map<string, LangStats>
+	/** Counters for the history so far (commits: the whole chain's length) */
+	history: HistoryStats
+}
+
+export interface HistoryOptions extends AnalyzeOptions {
+	/** Start from the per-blob counts saved in this file, if it exists */
+	memo?: string
+}
+
+// Commits come one per step, each continuing from the last one returned
+export interface GitHistory extends Iterable<HistoryCommit> {
+	/** Save the per-blob counts for a later history; false if it can't */
+	save(file: string): boolean
+	free(): void
+}
+
+export interface GitRepo {
+	/** Full id of the commit a revision names, null if it names none */
+	resolve(rev: string): string | null
+	/** Count a revision from the object store; null if rev doesn't resolve */
+	count(rev: string, options?: AnalyzeOptions): RevisionCounts | null
+	/**
+	 * The totals at every commit of rev's first-parent chain, oldest first.
+	 * Each commit is a tree diff against the one before, and a blob is only
+	 * counted the first time it turns up; null if rev names no commit.
+	 */
+	history(rev: string, options?: HistoryOptions): GitHistory | null
+	/**
+	 * diffTrees between two revisions, reading only the subtrees and blobs
+	 * whose ids differ; null if either doesn't resolve
+	 */
+	diff(
+		oldRev: string,
+		newRev: string,
+		options?: AnalyzeOptions
+	): TreeDiff | null
+	close(): void
+}
+
+// Open the repository of a work tree (or a bare one) to count revisions
+// straight from its packs and loose objects, without checking them out.
+// Counting blocks the calling thread. Returns why as a message if dir isn't
+// a repository or uses SHA-256 object ids, which can't be read.
+export function openGitRepo(dir: string): GitRepo | string {
+	const status = new Int32Array(1)
+	const repo = cloc_git_open(
+		ptr(new TextEncoder().encode(`${dir}\0`)),
+		status
+	)
+	if (!repo) {
+		return status[0] === GIT_OPEN_OBJECT_FORMAT
+			? `${dir} uses SHA-256 object ids, which are not supported`
+			: `${dir} is not a git repository`
+	}
+
+	let closed = false
+	const open = () => {
+		if (closed) throw new Error('The git repository was already closed')
+	}
+	const resolve = (rev: string) => {
+		open()
+		const id = new Uint8Array(41)
+		const found = cloc_git_resolve(
+			repo,
+			ptr(new TextEncoder().encode(`${rev}\0`)),
+			id
+		)
+		return found < 0 ? null : new TextDecoder().decode(id.subarray(0, 40))
+	}
+
+	return {
+		resolve,
+		count: (rev, options = {}) => {
+			const commit = resolve(rev)
+			if (!commit) return null
+			const buffers = createResultBuffers()
+			const langCount = cloc_git_analyze(
+				ctx,
+				repo,
+				ptr(new TextEncoder().encode(`${commit}\0`)),
+				walkFlags(options),
+				buffers.langNames,
+				buffers.langResults,
+				MAX_LANGS,
+				buffers.walkResults,
+				buffers.threadResults,
+				MAX_THREADS
+			)
+			if (langCount < 0) return null
+
+			const gitResults = new BigInt64Array(GIT_STAT_NAMES.length)
+			cloc_git_stats(repo, gitResults)
+			const git = Object.fromEntries(
+				GIT_STAT_NAMES.map((name, i) => [name, Number(gitResults[i])])
+			) as GitStats
+			return { ...decodeResults(langCount, buffers), commit, git }
+		},
+		history: (rev, options = {}) => {
+			open()
+			const memo = options.memo
+				? ptr(new TextEncoder().encode(`${options.memo}\0`))
+				: null
+			const history = cloc_history_start(
+				ctx,
+				repo,
+				ptr(new TextEncoder().encode(`${rev}\0`)),
+				walkFlags(options),
+				memo
+			)
+			if (!history) return null
+
+			let freed = false
+			const live = () => {
+				if (freed) throw new Error('The history was already freed')
+				open()
+			}
+			const id = new Uint8Array(41)
+			const time = new BigInt64Array(1)
+			const langNames = new Uint8Array(MAX_LANGS * LANG_NAME_BYTES)
+			const langResults = new BigInt64Array(MAX_LANGS * LANG_STAT_FIELDS)
+			const historyResults = new BigInt64Array(HISTORY_STAT_NAMES.length)
+			const next = () => {
+				live()
+				const langCount = cloc_history_next(
+					history,
+					id,
+					time,
+					langNames,
+					langResults,
+					MAX_LANGS,
+					historyResults
+				)
+				if (langCount < 0) return null
+				return {
+					commit: new TextDecoder().decode(id.subarray(0, 40)),
+					time: Number(time[0]),
+					langStats: decodeLangStats(langCount, langNames, langResults),
+					history: Object.fromEntries(
+						HISTORY_STAT_NAMES.map((name, i) => [
+							name,
+							Number(historyResults[i]),
+						])
+					) as HistoryStats,
+				}
+			}
+
+			return {
+				*[Symbol.iterator]() {
+					for (let commit = next(); commit; commit = next()) yield commit
+				},
+				save: (file) => {
+					live()
+					const target = ptr(new TextEncoder().encode(`${file}\0`))
+					return cloc_history_save(history, target) === 0
+				},
+				free: () => {
+					if (freed) return
+					freed = true
+					cloc_history_free(history)
+				},
+			}
+		},
+		diff: (oldRev, newRev, options = {}) => {
+			open()
+			const buffers = createDiffBuffers()
+			const langCount = cloc_diff_revisions(
+				ctx,
+				repo,
+				ptr(new TextEncoder().encode(`${oldRev}\0`)),
+				ptr(new TextEncoder().encode(`${newRev}\0`)),
+				walkFlags(options),
+				buffers.langNames,
+				buffers.langResults,
+				MAX_LANGS,
+				buffers.diffResults
+			)
+			if (langCount < 0) return null
+			return decodeDiffResults(langCount, buffers)
+		},
+		close: () => {
+			if (closed) return
+			closed = true
+			cloc_git_close(repo)
+		},
+	}
+}
+
+// Count one revision of the repository at dir from its object store and
+// report it like a walk of its checkout. Returns false if the repository
+// can't be opened or rev can't be resolved and read.
+export function analyzeRevision(
+	dir: string,
+	rev: string,
+	options: AnalyzeOptions = {}
+): boolean {
+	const start = performance.now()
+	const kernel = prepareEngine(options.kernel)
+	const repo = openGitRepo(dir)
+	if (typeof repo === 'string') {
+		bunnyLog.log('warning', repo)
+		return false
+	}
+	const commit = repo.resolve(rev)
+	if (!commit) {
+		repo.close()
+		bunnyLog.log('warning', `Cannot resolve ${rev} in ${dir}`)
+		return false
+	}
+
+	bunnyLog.log(
+		'analysis',
+		`⚡ Analyzing ${rev} (${commit.slice(0, 12)}) of ${dir} from its object store with ${kernel} counting kernels from ${engine}`
+	)
+	const counts = repo.count(commit, options)
+	repo.close()
+	if (!counts) {
+		bunnyLog.log('warning', `Cannot read the tree of ${rev}`)
+		return false
+	}
+	const { langStats, walk, git } = counts
+	const reportStart = performance.now()
+
+	bunnyLog.log(
+		'analysis',
+		`📁 Walked ${fmt(walk.dirs)} trees, ${fmt(walk.files)} files counted (${fmt(walk.filesIgnored)} ignored, ${fmt(walk.filesUnknown)} unrecognised, ${fmt(walk.filesBinary)} binary, ${fmt(walk.filesUnreadable)} unreadable, ${fmt(walk.linksSkipped)} symlinks skipped)`
+	)
+	bunnyLog.log(
+		'analysis',
+		`📦 ${fmt(git.objectsPacked)} packed and ${fmt(git.objectsLoose)} loose objects from ${fmt(git.packs)} packs, ${fmt(git.deltas)} deltas applied (${fmt(git.cacheHits)} cached bases), ${fmtBytes(git.bytesInflated)} inflated`
+	)
+	if (langStats.size === 0) {
+		bunnyLog.log('warning', 'No valid files found to analyze')
+		return true
+	}
+
+	logLanguageTable(langStats)
+	logTimingStats(counts.threads, performance.now() - reportStart)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	return true
+}
+
+// Commits shown in the history report's table; the CSV has all of them
+const HISTORY_TABLE_ROWS = 20
+
+export interface HistoryReportOptions extends HistoryOptions {
+	/** Also write every commit's per-language totals to this CSV file */
+	csv?: string
+}
+
+function historyRow({ commit, time, langStats }: HistoryCommit) {
+	const [files, lines, code, comments, size] = sumStats(langStats)
+	return {
+		Commit: commit.slice(0, 12),
+		Date: new Date(time * 1000).toISOString().slice(0, 10),
+		Files: fmt(files),
+		Lines: fmt(lines),
+		Code: fmt(code),
+		Comments: fmt(comments),
+		Size: fmtBytes(size),
+	}
+}
+
+// Count every commit of rev's first-parent chain and report how the totals
+// grew, saving the blob memo for the next run if options.memo is set.
+// Returns false if the repository, rev or the memo save fails.
+export function analyzeHistory(
+	dir: string,
+	rev: string,
+	options: HistoryReportOptions = {}
+): boolean {
+	const start = performance.now()
+	const kernel = prepareEngine(options.kernel)
+	const repo = openGitRepo(dir)
+	if (typeof repo === 'string') {
+		bunnyLog.log('warning', repo)
+		return false
+	}
+	const history = repo.history(rev, options)
+	if (!history) {
+		repo.close()
+		bunnyLog.log('warning', `Cannot resolve ${rev} to a commit in ${dir}`)
+		return false
+	}
+
+	bunnyLog.log(
+		'analysis',
+		`⚡ Counting every commit of ${rev} in ${dir} from its object store with ${kernel} counting kernels from ${engine}`
+	)
+
+	const csv = options.csv
+		? ['commit,time,language,files,lines,code,comments,bytes']
+		: null
+	const rows: ReturnType<typeof historyRow>[] = []
+	let last: HistoryCommit | null = null
+	let index = 0
+	let nextProgressLog = performance.now() + 1000
+	for (const commit of history) {
+		const total = commit.history.commits
+		const every = Math.ceil(total / HISTORY_TABLE_ROWS)
+		if (index % every === 0 || index === total - 1) {
+			rows.push(historyRow(commit))
+		}
+		if (csv) {
+			const time = new Date(commit.time * 1000).toISOString()
+			for (const [lang, stats] of commit.langStats) {
+				const [files, lines, code, comments, size] = stats
+				const name = lang.includes(',') ? `"${lang}"` : lang
+				csv.push(
+					`${commit.commit},${time},${name},${files},${lines},${code},${comments},${size}`
+				)
+			}
+		}
+		if (performance.now() >= nextProgressLog) {
+			nextProgressLog += 1000
+			bunnyLog.log(
+				'analysis',
+				`⏳ ${fmt(index + 1)} of ${fmt(total)} commits counted so far...`
+			)
+		}
+		last = commit
+		index++
+	}
+
+	let saved = true
+	if (options.memo) {
+		saved = history.save(options.memo)
+		if (saved) {
+			bunnyLog.log('success', `🧠 Blob memo saved to ${options.memo}`)
+		} else {
+			bunnyLog.log('warning', `Cannot write ${options.memo}`)
+		}
+	}
+	history.free()
+	repo.close()
+	if (!last) return saved
+
+	bunnyLog.table(rows)
+	if (csv && options.csv) {
+		writeFileSync(options.csv, `${csv.join('\n')}\n`)
+		bunnyLog.log('success', `📈 Per-commit totals written to ${options.csv}`)
+	}
+	const stats = last.history
+	bunnyLog.log(
+		'analysis',
+		`🧮 ${fmt(stats.commits)} commits: ${fmt(stats.treesRead)} trees read (${fmt(stats.treesSkipped)} unchanged subtrees skipped), ${fmt(stats.blobsCounted)} blobs counted, ${fmt(stats.memoHits)} memo hits (${fmt(stats.memoLoaded)} entries loaded, ${fmt(stats.memoEntries)} now)`
+	)
+	if (last.langStats.size) logLanguageTable(last.langStats)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	return saved
+}
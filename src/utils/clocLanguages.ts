@@ -0,0 +1,58 @@
+import { readFileSync } from 'node:fs'
+
+// Language definitions from languages.json, reduced to what the C engine
+// understands: one line comment and one block comment pair per language.
+
+const LANGUAGES_JSON_PATH = './src/utils/languages.json'
+
+interface LangDef {
+	name?: string
+	extensions?: string[]
+	filenames?: string[]
+	line_comment?: string | string[]
+	multi_line_comments?: [string, string][]
+}
+
+export interface EngineLanguage {
+	name: string
+	/** Comma-separated, without dots */
+	extensions: string
+	lineComment: string
+	blockStart: string
+	blockEnd: string
+}
+
+export function loadLanguageDefinitions(
+	path = LANGUAGES_JSON_PATH
+): EngineLanguage[] {
+	const languages: Record<string, LangDef> = JSON.parse(
+		readFileSync(path, 'utf-8')
+	).languages
+
+	return Object.entries(languages).map(([key, langDef]) => {
+		// Line comment (use first one if array)
+		const lineComment = Array.isArray(langDef.line_comment)
+			? langDef.line_comment[0] || ''
+			: langDef.line_comment || ''
+
+		// Block comments (use first one if multiple)
+		const blockComments = langDef.multi_line_comments?.[0]
+
+		return {
+			name: langDef.name || key,
+			extensions: (langDef.extensions || []).join(','),
+			lineComment,
+			blockStart: blockComments?.[0] || '',
+			blockEnd: blockComments?.[1] || '',
+		}
+	})
+}
+
+// The table format cloc_ctx_load_languages parses: one language per line,
+// fields separated by tabs
+export const formatLanguageTable = (languages: EngineLanguage[]): string =>
+	languages
+		.map((l) =>
+			[l.name, l.extensions, l.lineComment, l.blockStart, l.blockEnd].join('\t')
+		)
+		.join('\n')
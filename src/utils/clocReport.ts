@@ -0,0 +1,271 @@
+import { bunnyLog } from 'bunny-log'
+import {
+	type DirRollup,
+	type LangStats,
+	PERF_EVENT_NAMES,
+	PHASE_LABELS,
+	PHASE_NAMES,
+	type Phase,
+	type PerfCounters,
+	type PerfStats,
+	type PhaseStats,
+	type ThreadStats,
+} from './clocEngine.js'
+
+// The tables and summary lines every cloc mode reports with
+
+export const fmt = (n: number) => n.toLocaleString()
+export const fmtBytes = (b: number): string => {
+	if (b < 1024) return `${b} B`
+	if (b < 1048576) return `${(b / 1024).toFixed(2)} KB`
+	if (b < 1073741824) return `${(b / 1048576).toFixed(2)} MB`
+	return `${(b / 1073741824).toFixed(2)} GB`
+}
+
+// Stage totals across threads plus the report stage measured here, then
+// the per-thread split. Ingestion time that dominates counting means the
+// run was waiting on storage rather than on the kernels.
+export function logTimingStats(threads: ThreadStats[], reportMs: number) {
+	const ms = (ns: number) => `${(ns / 1e6).toFixed(2)} ms`
+	const perSecond = (n: number, ns: number) => (ns > 0 ? n / (ns / 1e9) : 0)
+
+	const stages = PHASE_NAMES.map((phase) => {
+		const total: PhaseStats = { ns: 0, items: 0, bytes: 0 }
+		for (const thread of threads) {
+			total.ns += thread.phases[phase].ns
+			total.items += thread.phases[phase].items
+			total.bytes += thread.phases[phase].bytes
+		}
+		return { label: PHASE_LABELS[phase], ...total }
+	})
+	stages.push({ label: 'Report', ns: reportMs * 1e6, items: 0, bytes: 0 })
+	const totalNs = stages.reduce((sum, stage) => sum + stage.ns, 0)
+
+	bunnyLog.log('timing', '⏱️ Time per stage')
+	bunnyLog.table(
+		stages.map((stage) => ({
+			Stage: stage.label,
+			Time: ms(stage.ns),
+			Share: `${totalNs ? ((stage.ns / totalNs) * 100).toFixed(1) : '0.0'}%`,
+			Items: stage.items ? fmt(stage.items) : '',
+			Bytes: stage.bytes ? fmtBytes(stage.bytes) : '',
+			'MB/s': stage.bytes
+				? (perSecond(stage.bytes, stage.ns) / 1048576).toFixed(1)
+				: '',
+			'Items/s': stage.items
+				? fmt(Math.round(perSecond(stage.items, stage.ns)))
+				: '',
+		}))
+	)
+
+	bunnyLog.log('timing', '🧵 Time per engine thread')
+	bunnyLog.table(
+		threads.map((thread) => ({
+			Thread: thread.tid,
+			Node: thread.node < 0 ? '-' : thread.node,
+			Wall: ms(thread.wallNs),
+			...Object.fromEntries(
+				PHASE_NAMES.map((phase) => [
+					PHASE_LABELS[phase],
+					ms(thread.phases[phase].ns),
+				])
+			),
+		}))
+	)
+
+	// Pool workers grouped by the node they ran on. A node well behind the
+	// others in MB/s is reading remote memory or sharing its cores.
+	const nodes = new Map<number, PhaseStats & { threads: number }>()
+	for (const thread of threads) {
+		if (thread.node < 0) continue
+		const node = nodes.get(thread.node) ?? {
+			threads: 0,
+			ns: 0,
+			items: 0,
+			bytes: 0,
+		}
+		node.threads++
+		node.ns += thread.phases.count.ns
+		node.items += thread.phases.count.items
+		node.bytes += thread.phases.count.bytes
+		nodes.set(thread.node, node)
+	}
+	if (nodes.size > 0) {
+		bunnyLog.log('timing', '🧩 Counting per NUMA node')
+		bunnyLog.table(
+			[...nodes]
+				.sort((a, b) => a[0] - b[0])
+				.map(([id, node]) => ({
+					Node: id,
+					Threads: node.threads,
+					Files: fmt(node.items),
+					Bytes: fmtBytes(node.bytes),
+					'MB/s': (perSecond(node.bytes, node.ns) / 1048576).toFixed(1),
+				}))
+		)
+	}
+
+	const share = (...phases: Phase[]) => {
+		const ns = phases.reduce(
+			(sum, phase) => sum + stages[PHASE_NAMES.indexOf(phase)].ns,
+			0
+		)
+		return totalNs ? (ns / totalNs) * 100 : 0
+	}
+	const io = share('walk', 'read')
+	const cpu = share('sniff', 'detect', 'count', 'aggregate')
+	bunnyLog.log(
+		'timing',
+		`${io > cpu ? 'I/O-bound' : 'CPU-bound'}: ${io.toFixed(1)}% traversal + ingestion, ${cpu.toFixed(1)}% sniff + detection + counting + aggregation`
+	)
+}
+
+// Per-phase counter table with the derived ratios used when tuning kernels
+export function logPerfStats(perf: PerfStats, bytes: number) {
+	const mb = bytes / 1048576
+	const cell = (v: number | null) => (v === null ? 'n/a' : fmt(v))
+	const ratio = (a: number | null, b: number | null, digits: number) =>
+		a === null || b === null || b === 0 ? 'n/a' : (a / b).toFixed(digits)
+
+	// Availability is per event, so a counter is either in every phase or none
+	const total = Object.fromEntries(
+		PERF_EVENT_NAMES.map((event) => [
+			event,
+			perf.phases.walk[event] === null
+				? null
+				: PHASE_NAMES.reduce(
+						(sum, phase) => sum + (perf.phases[phase][event] ?? 0),
+						0
+					),
+		])
+	) as PerfCounters
+
+	const rows = [
+		...PHASE_NAMES.map((phase) => [phase, perf.phases[phase]] as const),
+		['total', total] as const,
+	]
+	bunnyLog.log(
+		'analysis',
+		`🔬 Hardware counters per phase${perf.userOnly ? ' (user space only)' : ''}`
+	)
+	bunnyLog.table(
+		rows.map(([phase, c]) => ({
+			Phase: phase,
+			Cycles: cell(c.cycles),
+			Instructions: cell(c.instructions),
+			IPC: ratio(c.instructions, c.cycles, 2),
+			'Branch misses': cell(c.branchMisses),
+			'Br. miss/MB': ratio(c.branchMisses, mb, 0),
+			'L1D misses': cell(c.l1dMisses),
+			'LLC misses': cell(c.llcMisses),
+			'Page faults': cell(c.pageFaults),
+		}))
+	)
+}
+
+// Totals over every language
+export function sumStats(langStats: Map<string, LangStats>): LangStats {
+	const total: LangStats = [0, 0, 0, 0, 0]
+	for (const stats of langStats.values()) {
+		for (let i = 0; i < total.length; i++) total[i] += stats[i]
+	}
+	return total
+}
+
+// Results table sorted by code lines, then the summary lines
+export function logLanguageTable(langStats: Map<string, LangStats>) {
+	bunnyLog.log(
+		'analysis',
+		'📊 Code Analysis Results (Dynamic C-powered + JSON)'
+	)
+
+	const table = Array.from(langStats.entries())
+		.map(([lang, stats]) => {
+			const [files, lines, code, comments, size] = stats
+			return {
+				Language: lang,
+				Files: fmt(files),
+				Lines: fmt(lines),
+				Code: fmt(code),
+				Comments: fmt(comments),
+				Size: fmtBytes(size),
+			}
+		})
+		.sort(
+			(a, b) =>
+				Number.parseInt(b.Code.replace(/,/g, '')) -
+				Number.parseInt(a.Code.replace(/,/g, ''))
+		)
+
+	const [totalF, totalL, totalC, totalM, totalS] = sumStats(langStats)
+	table.push({
+		Language: 'Total',
+		Files: fmt(totalF),
+		Lines: fmt(totalL),
+		Code: fmt(totalC),
+		Comments: fmt(totalM),
+		Size: fmtBytes(totalS),
+	})
+
+	bunnyLog.table(table)
+
+	const pct = totalL ? 100 / totalL : 0
+	const totalB = totalL - totalC - totalM // blanks
+	bunnyLog.log('summary', `Files: ${fmt(totalF)}`)
+	bunnyLog.log('summary', `Lines: ${fmt(totalL)}`)
+	bunnyLog.log(
+		'summary',
+		`Code: ${fmt(totalC)} (${(totalC * pct).toFixed(1)}%)`
+	)
+	bunnyLog.log(
+		'summary',
+		`Comments: ${fmt(totalM)} (${(totalM * pct).toFixed(1)}%)`
+	)
+	bunnyLog.log(
+		'summary',
+		`Blanks: ${fmt(totalB)} (${(totalB * pct).toFixed(1)}%)`
+	)
+	bunnyLog.log('summary', `Size: ${fmtBytes(totalS)}`)
+	bunnyLog.log('summary', `Languages: ${langStats.size}`)
+}
+
+// Segment-wise, so a directory's subdirectories follow it directly
+function comparePaths(a: string, b: string): number {
+	const x = a.split('/')
+	const y = b.split('/')
+	for (let i = 0; i < Math.min(x.length, y.length); i++) {
+		if (x[i] !== y[i]) return x[i] < y[i] ? -1 : 1
+	}
+	return x.length - y.length
+}
+
+// Subtree totals per directory down to depth, with each directory's main
+// language (most code); every row is a lookup in the native rollup
+export function logDirTable(dirs: DirRollup, depth: number) {
+	const rows = dirs
+		.list(depth)
+		.filter((dir) => dir.stats[0] > 0)
+		.sort((a, b) => comparePaths(a.path, b.path))
+		.map(({ path, stats }) => {
+			const [files, lines, code, comments, size] = stats
+			let main = ''
+			let mainCode = -1
+			for (const [lang, langStats] of dirs.query(path) ?? []) {
+				if (langStats[2] <= mainCode) continue
+				main = lang
+				mainCode = langStats[2]
+			}
+			return {
+				Directory: path || '.',
+				Files: fmt(files),
+				Lines: fmt(lines),
+				Code: fmt(code),
+				Comments: fmt(comments),
+				Size: fmtBytes(size),
+				'Main language': main,
+			}
+		})
+
+	bunnyLog.log('analysis', `📂 Totals by directory (depth ${depth})`)
+	bunnyLog.table(rows)
+}
@@ -0,0 +1,257 @@
+import { bunnyLog } from 'bunny-log'
+import { ptr } from 'bun:ffi'
+import {
+	type AnalyzeOptions,
+	LANG_NAME_BYTES,
+	LANG_STAT_FIELDS,
+	type LangStats,
+	MAX_LANGS,
+	WALK_STAT_NAMES,
+	type WalkStats,
+	ctx,
+	decodeLangStats,
+	engine,
+	langName,
+	prepareEngine,
+	symbols,
+	walkFlags,
+} from './clocEngine.js'
+import { fmt, logLanguageTable } from './clocReport.js'
+
+// Binary result files: a walk's totals (and per-file records) saved for a
+// later exact merge, whole or one shard of a tree at a time
+
+const {
+	cloc_result_save_directory,
+	cloc_result_save_shard,
+	cloc_result_merge,
+	cloc_result_open,
+	cloc_result_read,
+	cloc_result_file,
+	cloc_result_close,
+} = symbols
+
+// Longest root-relative path the walker produces
+const RESULT_PATH_BYTES = 4096
+
+export interface ResultFileRecord {
+	/** Relative to the walked root */
+	path: string
+	language: string
+	/** [files (always 1), lines, code, comments, size] */
+	stats: LangStats
+}
+
+export interface ResultFile {
+	langStats: Map<string, LangStats>
+	walk: WalkStats
+	/** Walks merged into the file, 1 for a single walk */
+	shards: number
+	/** Per-file records, null if any merged walk didn't keep them */
+	fileCount: number | null
+	/** The per-file records in path order */
+	files(): Iterable<ResultFileRecord>
+	close(): void
+}
+
+// One worker's part of a tree (see SHARDS in cloc.c). Every path belongs to
+// exactly one of count shards, decided from the path alone.
+export interface ShardSpec {
+	index: number
+	count: number
+	/**
+	 * Top-level entries handed out whole, to their shard index; entries not
+	 * in the plan are assigned by hash. Unset to hash every path.
+	 */
+	plan?: Record<string, number>
+}
+
+export interface SaveResultOptions extends AnalyzeOptions {
+	/** Walk only this shard of the tree */
+	shard?: ShardSpec
+}
+
+// Walk a tree and save its totals (and, with fileRecords, every file's
+// counts) as a result file that mergeResultFiles can combine with others.
+// Blocks the calling thread; returns null if dir can't be walked, the shard
+// is invalid or the file can't be written.
+export function saveResultFile(
+	dir: string,
+	file: string,
+	options: SaveResultOptions = {}
+): WalkStats | null {
+	const walkResults = new BigInt64Array(WALK_STAT_NAMES.length)
+	const dirArg = ptr(new TextEncoder().encode(`${dir}\0`))
+	const fileArg = ptr(new TextEncoder().encode(`${file}\0`))
+	const { shard } = options
+	let langCount: number
+	if (shard) {
+		// The engine looks plan entries up in byte order. Both arrays get a
+		// trailing zero, since an empty plan still can't be a null pointer.
+		const plan = Object.entries(shard.plan ?? {})
+			.map(([name, owner]) => [Buffer.from(`${name}\0`), owner] as const)
+			.sort((a, b) => Buffer.compare(a[0], b[0]))
+		const names = Buffer.concat([
+			...plan.map(([name]) => name),
+			Buffer.alloc(1),
+		])
+		const owners = new Int32Array([...plan.map(([, owner]) => owner), 0])
+		langCount = cloc_result_save_shard(
+			ctx,
+			dirArg,
+			walkFlags(options),
+			options.threads ?? 0,
+			shard.index,
+			shard.count,
+			shard.plan ? ptr(names) : null,
+			ptr(owners),
+			plan.length,
+			fileArg,
+			walkResults
+		)
+	} else {
+		langCount = cloc_result_save_directory(
+			ctx,
+			dirArg,
+			walkFlags(options),
+			options.threads ?? 0,
+			fileArg,
+			walkResults
+		)
+	}
+	if (langCount < 0) return null
+	return Object.fromEntries(
+		WALK_STAT_NAMES.map((name, i) => [name, Number(walkResults[i])])
+	) as WalkStats
+}
+
+// Combine result files of disjoint shards into one, exactly and in any
+// order or grouping. Returns null on success, or why the merge failed.
+export function mergeResultFiles(out: string, inputs: string[]): string | null {
+	const rc = cloc_result_merge(
+		ptr(new TextEncoder().encode(`${out}\0`)),
+		ptr(new TextEncoder().encode(inputs.map((input) => `${input}\0`).join(''))),
+		inputs.length
+	)
+	if (rc === -2) return 'Two inputs count the same file; their shards overlap'
+	if (rc < 0) return `Cannot read the inputs or write ${out}`
+	return null
+}
+
+// Map a result file written by saveResultFile or mergeResultFiles; null if
+// it is missing, damaged or from an incompatible engine
+export function openResultFile(file: string): ResultFile | null {
+	const result = cloc_result_open(ptr(new TextEncoder().encode(`${file}\0`)))
+	if (!result) return null
+
+	const langNames = new Uint8Array(MAX_LANGS * LANG_NAME_BYTES)
+	const langResults = new BigInt64Array(MAX_LANGS * LANG_STAT_FIELDS)
+	const walkResults = new BigInt64Array(WALK_STAT_NAMES.length)
+	const info = new BigInt64Array(2) // RESULT_INFO_*
+	const langCount = cloc_result_read(
+		result,
+		langNames,
+		langResults,
+		MAX_LANGS,
+		walkResults,
+		info
+	)
+	const names = Array.from({ length: langCount }, (_, i) =>
+		langName(langNames, i)
+	)
+	const fileCount = Number(info[1])
+
+	let closed = false
+	return {
+		langStats: decodeLangStats(langCount, langNames, langResults),
+		walk: Object.fromEntries(
+			WALK_STAT_NAMES.map((name, i) => [name, Number(walkResults[i])])
+		) as WalkStats,
+		shards: Number(info[0]),
+		fileCount: fileCount < 0 ? null : fileCount,
+		*files() {
+			const path = new Uint8Array(RESULT_PATH_BYTES)
+			const stats = new BigInt64Array(5)
+			for (let i = 0; i < fileCount; i++) {
+				if (closed) throw new Error('The result file was already closed')
+				const lang = cloc_result_file(result, i, path, path.length, stats)
+				if (lang < 0) continue
+				const [lines, code, comments, , size] = Array.from(stats, Number)
+				yield {
+					path: new TextDecoder().decode(path.subarray(0, path.indexOf(0))),
+					language: names[lang],
+					stats: [1, lines, code, comments, size],
+				}
+			}
+		},
+		close: () => {
+			if (closed) return
+			closed = true
+			cloc_result_close(result)
+		},
+	}
+}
+
+// Report a result file's totals like those of a walk
+export function reportResult(file: string): boolean {
+	const result = openResultFile(file)
+	if (!result) {
+		bunnyLog.log('error', `${file} is not a cloc result file`)
+		return false
+	}
+	const { langStats, walk, shards, fileCount } = result
+	result.close()
+
+	const records =
+		fileCount === null
+			? 'no per-file records'
+			: `${fmt(fileCount)} file records`
+	bunnyLog.log(
+		'analysis',
+		`🧩 ${file}: ${fmt(shards)} shards, ${fmt(walk.files)} files counted in ${fmt(walk.dirs)} directories, ${records}`
+	)
+	if (langStats.size === 0) {
+		bunnyLog.log('warning', 'No valid files found to analyze')
+		return true
+	}
+	logLanguageTable(langStats)
+	return true
+}
+
+// Count a tree into a result file for a later merge, then report it
+export function analyzeToResult(
+	dir: string,
+	file: string,
+	options: AnalyzeOptions = {}
+): boolean {
+	const start = performance.now()
+	const kernel = prepareEngine(options.kernel)
+	bunnyLog.log(
+		'analysis',
+		`⚡ Analyzing ${dir} into ${file} with native C walking and ${kernel} counting kernels from ${engine}`
+	)
+	if (!saveResultFile(dir, file, options)) {
+		bunnyLog.log('warning', `Cannot walk ${dir} or write ${file}`)
+		return false
+	}
+	const ok = reportResult(file)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	return ok
+}
+
+// Reduce the result files of several shards into one and report it
+export function mergeResults(out: string, inputs: string[]): boolean {
+	const start = performance.now()
+	const error = mergeResultFiles(out, inputs)
+	if (error) {
+		bunnyLog.log('error', error)
+		return false
+	}
+	bunnyLog.log(
+		'success',
+		`🧩 Merged ${fmt(inputs.length)} result files into ${out}`
+	)
+	const ok = reportResult(out)
+	bunnyLog.log('timing', `Time: ${(performance.now() - start).toFixed(2)}ms`)
+	return ok
+}
@@ -0,0 +1,287 @@
+#!/usr/bin/env bun
+import { $ } from 'bun'
+import { existsSync, readFileSync } from 'node:fs'
+import { mkdir, writeFile } from 'node:fs/promises'
+import { availableParallelism } from 'node:os'
+import { resolve } from 'node:path'
+import { parseArgs } from 'node:util'
+import { bunnyLog } from 'bunny-log'
+import { ptr } from 'bun:ffi'
+import {
+	type AnalyzeOptions,
+	ctx,
+	prepareEngine,
+	symbols,
+	walkFlags,
+} from './clocEngine.js'
+import { mergeResults, saveResultFile } from './clocResult.js'
+
+// Counts one tree with N worker processes and merges their result files, for
+// trees big enough that a single process's allocator and page cache stop
+// scaling.
+//
+//   bun run shard:cloc [dir] --workers 8              plan by size (default)
+//   bun run shard:cloc [dir] --workers 8 --by hash    every path by hash
+//   bun run shard:cloc [dir] --file-records --out build/shards
+//
+// The split is deterministic. With --by size, top-level entries are
+// estimated from listings and stats, then handed out largest first to the
+// least loaded worker (ties to the lower index), and the plan is written
+// next to the results. With --by hash, every worker walks the directory
+// structure but reads only the files whose path hashes to it. Worker i runs
+// on NUMA node i % nodes, bound with numactl if it is installed, otherwise
+// to the node's CPUs with taskset.
+
+const DEFAULT_OUT_DIR = resolve('build/shards')
+
+const { cloc_shard_estimate } = symbols
+
+interface NumaNode {
+	id: number
+	cpus: string
+}
+
+// Parse a sysfs list like "0-3,8" into numbers
+const parseList = (list: string): number[] =>
+	list
+		.trim()
+		.split(',')
+		.filter(Boolean)
+		.flatMap((part) => {
+			const [lo, hi = lo] = part.split('-').map(Number)
+			return Array.from({ length: hi - lo + 1 }, (_, i) => lo + i)
+		})
+
+// Online NUMA nodes with CPUs, from sysfs; empty where there's no NUMA
+function numaNodes(): NumaNode[] {
+	const sys = '/sys/devices/system/node'
+	if (!existsSync(`${sys}/online`)) return []
+	return parseList(readFileSync(`${sys}/online`, 'utf-8'))
+		.map((id) => ({
+			id,
+			cpus: readFileSync(`${sys}/node${id}/cpulist`, 'utf-8').trim(),
+		}))
+		.filter((node) => node.cpus !== '')
+}
+
+// The command prefix that keeps a worker (and its memory) on node
+function pinCommand(node: NumaNode | undefined): string[] {
+	if (!node) return []
+	if (Bun.which('numactl')) {
+		return ['numactl', `--cpunodebind=${node.id}`, `--membind=${node.id}`]
+	}
+	if (Bun.which('taskset')) return ['taskset', '-c', node.cpus]
+	return []
+}
+
+interface EntryEstimate {
+	files: number
+	bytes: number
+}
+
+// Top-level entry names are single path components
+const ENTRY_NAME_BYTES = 256
+
+// The files a walk of dir would count and their total size, per top-level
+// entry, from listings and stats alone (no file is read), for planning
+// shards. Returns null if dir can't be walked.
+function estimateTopLevel(
+	dir: string,
+	options: AnalyzeOptions = {}
+): Map<string, EntryEstimate> | null {
+	let max = 1024
+	for (;;) {
+		const names = new Uint8Array(max * ENTRY_NAME_BYTES)
+		const stats = new BigInt64Array(max * 2)
+		const count = cloc_shard_estimate(
+			ctx,
+			ptr(new TextEncoder().encode(`${dir}\0`)),
+			walkFlags(options),
+			names,
+			stats,
+			max
+		)
+		if (count < 0) return null
+		if (count > max) {
+			max = count
+			continue
+		}
+		const entries = new Map<string, EntryEstimate>()
+		for (let i = 0; i < count; i++) {
+			const name = names.subarray(
+				i * ENTRY_NAME_BYTES,
+				(i + 1) * ENTRY_NAME_BYTES
+			)
+			entries.set(new TextDecoder().decode(name.subarray(0, name.indexOf(0))), {
+				files: Number(stats[i * 2]),
+				bytes: Number(stats[i * 2 + 1]),
+			})
+		}
+		return entries
+	}
+}
+
+// Longest processing time first: biggest entries to the least loaded
+// worker. Names break ties, so the same estimate always gives the same plan.
+function planShards(
+	estimate: Map<string, EntryEstimate>,
+	workers: number
+): Record<string, number> {
+	const load = new Array<number>(workers).fill(0)
+	const plan: Record<string, number> = {}
+	const entries = [...estimate].sort(
+		(a, b) => b[1].bytes - a[1].bytes || (a[0] < b[0] ? -1 : 1)
+	)
+	for (const [name, { bytes }] of entries) {
+		const worker = load.indexOf(Math.min(...load))
+		plan[name] = worker
+		load[worker] += bytes
+	}
+	return plan
+}
+
+const { values, positionals } = parseArgs({
+	args: Bun.argv.slice(2),
+	options: {
+		workers: { type: 'string', default: String(availableParallelism()) },
+		by: { type: 'string', default: 'size' },
+		out: { type: 'string', default: DEFAULT_OUT_DIR },
+		'file-records': { type: 'boolean' },
+		archives: { type: 'boolean' },
+		'no-ignore': { type: 'boolean' },
+		hidden: { type: 'boolean' },
+		'no-follow': { type: 'boolean' },
+		kernel: { type: 'string' },
+		threads: { type: 'string' },
+		// Child mode: count one shard and print its timing as JSON
+		worker: { type: 'string' },
+		plan: { type: 'string' },
+	},
+	allowPositionals: true,
+})
+
+const dir = resolve(positionals[0] || './dist')
+const outDir = resolve(values.out as string)
+const workers = Number(values.workers)
+const shardFile = (i: number) => `${outDir}/shard-${i}.clocres`
+// --threads N counts each shard on a pool of N threads, as in cloc.ts
+const threads =
+	values.threads === undefined ? undefined : Number(values.threads)
+if (threads !== undefined && !(Number.isInteger(threads) && threads >= 0)) {
+	bunnyLog.log('error', '--threads takes a number of threads, 0 for none')
+	process.exit(2)
+}
+const options: AnalyzeOptions = {
+	noIgnore: values['no-ignore'],
+	hidden: values.hidden,
+	noFollow: values['no-follow'],
+	kernel: values.kernel,
+	threads,
+	fileRecords: values['file-records'],
+	archives: values.archives,
+}
+
+if (values.worker !== undefined) {
+	const index = Number(values.worker)
+	const start = performance.now()
+	prepareEngine(options.kernel)
+	const walk = saveResultFile(dir, shardFile(index), {
+		...options,
+		shard: {
+			index,
+			count: workers,
+			plan: values.plan
+				? JSON.parse(readFileSync(values.plan, 'utf-8'))
+				: undefined,
+		},
+	})
+	if (!walk) process.exit(1)
+	console.log(
+		JSON.stringify({ files: walk.files, ms: performance.now() - start })
+	)
+	process.exit(0)
+}
+
+if (!Number.isInteger(workers) || workers < 1) {
+	bunnyLog.log('error', '--workers takes a positive number')
+	process.exit(2)
+}
+if (values.by !== 'size' && values.by !== 'hash') {
+	bunnyLog.log('error', '--by takes size or hash')
+	process.exit(2)
+}
+
+const start = performance.now()
+await mkdir(outDir, { recursive: true })
+
+const args = ['--workers', String(workers), '--out', outDir]
+const flags = ['file-records', 'archives', 'no-ignore', 'hidden', 'no-follow']
+for (const flag of flags) {
+	if (values[flag as keyof typeof values]) args.push(`--${flag}`)
+}
+if (values.kernel) args.push('--kernel', values.kernel)
+if (threads !== undefined) args.push('--threads', String(threads))
+
+if (values.by === 'size') {
+	const estimate = estimateTopLevel(dir, options)
+	if (!estimate) {
+		bunnyLog.log('error', `Cannot walk ${dir}`)
+		process.exit(1)
+	}
+	const planFile = `${outDir}/plan.json`
+	await writeFile(planFile, JSON.stringify(planShards(estimate, workers)))
+	args.push('--plan', planFile)
+	bunnyLog.log(
+		'analysis',
+		`📐 Planned ${estimate.size} top-level entries across ${workers} workers in ${(performance.now() - start).toFixed(1)}ms`
+	)
+}
+
+const nodes = numaNodes()
+const pinned = nodes.length > 1
+bunnyLog.log(
+	'analysis',
+	`⚡ Counting ${dir} with ${workers} workers by ${values.by}${pinned ? ` over ${nodes.length} NUMA nodes` : ''}`
+)
+
+const runs = await Promise.all(
+	Array.from({ length: workers }, async (_, i) => {
+		const node = pinned ? nodes[i % nodes.length] : undefined
+		const pin = pinCommand(node)
+		const { exitCode, stdout, stderr } =
+			await $`${pin} ${process.execPath} run ${import.meta.path} ${dir} --worker ${i} ${args}`
+				.nothrow()
+				.quiet()
+		const line = stdout.toString().trim().split('\n').pop() ?? ''
+		return {
+			node,
+			stderr: stderr.toString().trim(),
+			result:
+				exitCode === 0 && line.startsWith('{')
+					? (JSON.parse(line) as { files: number; ms: number })
+					: null,
+		}
+	})
+)
+
+// A worker's own messages say why it failed (or what pinning went wrong)
+runs.forEach(({ result, stderr }, i) => {
+	if (!result) bunnyLog.log('error', `Worker ${i} could not count its shard`)
+	if (stderr) console.error(stderr)
+})
+if (runs.some((run) => !run.result)) process.exit(1)
+bunnyLog.table(
+	runs.map(({ node, result }, i) => ({
+		Worker: i,
+		Node: node?.id ?? '-',
+		Files: result?.files,
+		Time: `${result?.ms.toFixed(1)}ms`,
+	}))
+)
+
+const ok = mergeResults(
+	`${outDir}/merged.clocres`,
+	runs.map((_, i) => shardFile(i))
+)
+bunnyLog.log('timing', `Total: ${(performance.now() - start).toFixed(2)}ms`)
+process.exit(ok ? 0 : 1)
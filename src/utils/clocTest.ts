@@ -0,0 +1,126 @@
+#!/usr/bin/env bun
+import { $ } from 'bun'
+import { mkdir, rm, writeFile } from 'node:fs/promises'
+import { resolve } from 'node:path'
+import { parseArgs } from 'node:util'
+import { constants, deflateSync, gzipSync } from 'node:zlib'
+import {
+	formatLanguageTable,
+	loadLanguageDefinitions,
+} from './clocLanguages.js'
+
+// Tests the cloc engine's parsers and file formats through the native
+// harness in cloc_test.c, built with the sanitizers.
+//
+//   bun run test:cloc                   every group
+//   bun run test:cloc --filter archive  only the groups matching a name
+//
+// The work dir is recreated on every run, so a failure leaves its fixtures
+// and outputs behind for a look.
+
+const WORK_DIR = resolve('build/test')
+const HARNESS_SOURCE = resolve('src/utils/cloc_test.c')
+const HARNESS = `${WORK_DIR}/cloc_test`
+const LANGUAGES_TSV = `${WORK_DIR}/languages.tsv`
+
+const { values } = parseArgs({
+	args: Bun.argv.slice(2),
+	options: {
+		filter: { type: 'string' },
+	},
+})
+
+await rm(WORK_DIR, { recursive: true, force: true })
+await mkdir(WORK_DIR, { recursive: true })
+
+// The harness takes the same language table cloc.ts feeds the engine
+await writeFile(LANGUAGES_TSV, formatLanguageTable(loadLanguageDefinitions()))
+
+// zlib streams from another encoder, one per DEFLATE block type, all of
+// inflate/text
+const INFLATE_DIR = `${WORK_DIR}/inflate`
+const inflateText = Array.from(
+	{ length: 400 },
+	(_, i) => `line ${i % 37} of the inflate fixture\n`
+).join('')
+await mkdir(INFLATE_DIR)
+await writeFile(`${INFLATE_DIR}/text`, inflateText)
+await writeFile(
+	`${INFLATE_DIR}/stored.zz`,
+	deflateSync(inflateText, { level: 0 })
+)
+await writeFile(
+	`${INFLATE_DIR}/fixed.zz`,
+	deflateSync(inflateText, { strategy: constants.Z_FIXED })
+)
+await writeFile(`${INFLATE_DIR}/dynamic.zz`, deflateSync(inflateText))
+
+// A repository whose history covers packed deltas and loose objects: the
+// first two commits are repacked (so main.c's first version is stored as
+// a delta of its second), the third stays loose. git-old is a linked work
+// tree checked out at the first commit.
+const GIT_REPO = `${WORK_DIR}/git`
+const git = (...args: string[]) =>
+	$`git -C ${GIT_REPO} -c user.name=cloc -c user.email=cloc@test -c commit.gpgsign=false ${args}`.quiet()
+const mainLines = (n: number) =>
+	Array.from({ length: n }, (_, i) => `int f${i}(void) { return ${i}; }\n`)
+await mkdir(`${GIT_REPO}/src`, { recursive: true })
+await git('init', '-q')
+await writeFile(`${GIT_REPO}/.gitignore`, 'build/\n')
+await writeFile(`${GIT_REPO}/src/main.c`, mainLines(100).join(''))
+await writeFile(`${GIT_REPO}/util.py`, '# helpers\nx = 1\n')
+await git('add', '-A')
+await git('commit', '-q', '-m', 'first')
+await writeFile(`${GIT_REPO}/src/main.c`, mainLines(200).join(''))
+await git('commit', '-q', '-am', 'second')
+await git('repack', '-q', '-a', '-d', '-f')
+await writeFile(`${GIT_REPO}/util.py`, '# helpers\nx = 1\ny = 2\n')
+await git('commit', '-q', '-am', 'third')
+await git('worktree', 'add', '-q', `${WORK_DIR}/git-old`, 'HEAD~2')
+// Untracked and ignored, so the walk must skip it as the tree never had it
+await mkdir(`${GIT_REPO}/build`)
+await writeFile(`${GIT_REPO}/build/out.c`, 'int out;\n')
+
+// One tree, and the same tree in every kind of archive the walk opens:
+// GNU tar (long names), pax tar, tgz, a gzip of two members split inside a
+// tar entry, and a zip with deflated and stored members. main.c spans
+// several inflate windows; the path under nested/ is too long for ustar.
+const ARCHIVE_DIR = `${WORK_DIR}/archives`
+const ARCHIVE_TREE = `${ARCHIVE_DIR}/tree`
+const longDir = `${ARCHIVE_TREE}/${'nested/'.repeat(40)}deep`
+await mkdir(longDir, { recursive: true })
+await mkdir(`${ARCHIVE_TREE}/node_modules/dep`, { recursive: true })
+await writeFile(`${ARCHIVE_TREE}/main.c`, mainLines(8000).join(''))
+await writeFile(`${longDir}/leaf.py`, '# leaf\nx = 1\n\n')
+await writeFile(`${ARCHIVE_TREE}/node_modules/dep/index.js`, 'exports.x = 1\n')
+await writeFile(`${ARCHIVE_TREE}/.hidden.c`, 'int hidden;\n')
+for (const kind of ['tar', 'pax', 'tgz', 'multi', 'zip']) {
+	await mkdir(`${ARCHIVE_DIR}/${kind}`)
+}
+const tar = (format: string) =>
+	$`tar -c --format=${format} -C ${ARCHIVE_TREE} .`.arrayBuffer()
+const gnuTar = new Uint8Array(await tar('gnu'))
+const paxTar = new Uint8Array(await tar('pax'))
+await writeFile(`${ARCHIVE_DIR}/tar/tree.tar`, gnuTar)
+await writeFile(`${ARCHIVE_DIR}/pax/tree.tar`, paxTar)
+await writeFile(`${ARCHIVE_DIR}/tgz/tree.tgz`, gzipSync(paxTar))
+const split = Math.floor(gnuTar.length / 3) + 100
+await writeFile(
+	`${ARCHIVE_DIR}/multi/tree.tar.gz`,
+	Buffer.concat([
+		gzipSync(gnuTar.subarray(0, split)),
+		gzipSync(gnuTar.subarray(split)),
+	])
+)
+await $`cd ${ARCHIVE_TREE} && zip -q -r -X -n .py ${ARCHIVE_DIR}/zip/tree.zip .`
+
+const compiler = process.env.CC || 'cc'
+console.log(`🔧 Building harness with ${compiler}...`)
+await $`${compiler} -O1 -g -Wall -fsanitize=address,undefined ${HARNESS_SOURCE} -o ${HARNESS} -lpthread -lm`
+
+const filter = values.filter ? [values.filter] : []
+const { exitCode } = await $`${HARNESS} ${LANGUAGES_TSV} ${WORK_DIR} ${filter}`
+	.env({ ...process.env, ASAN_OPTIONS: 'detect_leaks=1' })
+	.nothrow()
+console.log(exitCode === 0 ? '✅ All checks passed' : '❌ Checks failed')
+process.exit(exitCode)
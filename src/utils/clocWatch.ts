@@ -0,0 +1,207 @@
+import { bunnyLog } from 'bunny-log'
+import { ptr } from 'bun:ffi'
+import {
+	type AnalyzeOptions,
+	type JobOptions,
+	type LangStats,
+	MAX_LANGS,
+	type WalkStats,
+	createResultBuffers,
+	ctx,
+	decodeResults,
+	engine,
+	prepareEngine,
+	symbols,
+	walkFlags,
+} from './clocEngine.js'
+import { fmt, logLanguageTable, sumStats } from './clocReport.js'
+
+// Keeping a tree's totals current from inotify events after one full count
+
+const {
+	cloc_watch_start,
+	cloc_watch_poll,
+	cloc_watch_results,
+	cloc_watch_stop,
+} = symbols
+
+// How often a watch's inotify queue is drained from the event loop
+const WATCH_POLL_MS = 50
+
+// Watch counters, in the order of the WATCH_* enum in cloc.c
+const WATCH_STAT_NAMES = [
+	'events',
+	'filesUpdated',
+	'filesRemoved',
+	'rescans',
+	'overflows',
+	'dirs',
+	'dirsUnwatched',
+	'files',
+	'rootGone',
+] as const
+export type WatchStats = Record<(typeof WATCH_STAT_NAMES)[number], number>
+
+export interface WatchCounts {
+	langStats: Map<string, LangStats>
+	/** Walk counters accumulated since the watch started */
+	walk: WalkStats
+	watch: WatchStats
+}
+
+export interface TreeWatch {
+	/** The totals as of the last applied event */
+	counts(): WatchCounts
+	/** Settles once the root was deleted or moved away; events stop there */
+	gone: Promise<void>
+	stop(): void
+}
+
+const sameTotals = (a: Map<string, LangStats>, b: Map<string, LangStats>) =>
+	a.size === b.size &&
+	Array.from(a).every(([lang, stats]) =>
+		b.get(lang)?.every((value, i) => value === stats[i])
+	)
+
+// Count dir once, then keep its totals current from inotify events: the
+// engine reads and counts again only the files an event names and adjusts
+// their languages' totals by the difference. onChange gets the new and the
+// previous totals whenever a batch of events moved them. A file is counted
+// again when its writer closes it, so writes through a shared mapping or
+// by a writer that keeps the file open wait for the next close. Returns
+// null if dir can't be walked or inotify is unavailable.
+export function watchTree(
+	dir: string,
+	options: AnalyzeOptions = {},
+	onChange?: (counts: WatchCounts, previous: WatchCounts) => void
+): TreeWatch | null {
+	const watch = cloc_watch_start(
+		ctx,
+		ptr(new TextEncoder().encode(`${dir}\0`)),
+		walkFlags(options)
+	)
+	if (!watch) return null
+
+	const read = (): WatchCounts => {
+		const buffers = createResultBuffers()
+		const watchResults = new BigInt64Array(WATCH_STAT_NAMES.length)
+		const langCount = cloc_watch_results(
+			watch,
+			buffers.langNames,
+			buffers.langResults,
+			MAX_LANGS,
+			buffers.walkResults,
+			watchResults
+		)
+		const { langStats, walk } = decodeResults(langCount, buffers)
+		const stats = Object.fromEntries(
+			WATCH_STAT_NAMES.map((name, i) => [name, Number(watchResults[i])])
+		) as WatchStats
+		return { langStats, walk, watch: stats }
+	}
+
+	let current = read()
+	let stopped = false
+	let rootGone = () => {}
+	const gone = new Promise<void>((resolve) => {
+		rootGone = resolve
+	})
+	const timer = setInterval(() => {
+		if (cloc_watch_poll(watch, 0) <= 0) return
+		const previous = current
+		current = read()
+		if (!sameTotals(previous.langStats, current.langStats)) {
+			onChange?.(current, previous)
+		}
+		if (current.watch.rootGone) {
+			clearInterval(timer)
+			rootGone()
+		}
+	}, WATCH_POLL_MS)
+
+	return {
+		counts: () => current,
+		gone,
+		stop: () => {
+			if (stopped) return
+			stopped = true
+			clearInterval(timer)
+			cloc_watch_stop(watch)
+		},
+	}
+}
+
+// One line per change: the languages whose totals moved, then the new total
+function logWatchChange(counts: WatchCounts, previous: WatchCounts) {
+	const signed = (n: number) => `${n >= 0 ? '+' : ''}${fmt(n)}`
+	const none: LangStats = [0, 0, 0, 0, 0]
+	const langs = new Set([
+		...previous.langStats.keys(),
+		...counts.langStats.keys(),
+	])
+	const changes: string[] = []
+	for (const lang of langs) {
+		const [files, lines, code] = counts.langStats.get(lang) ?? none
+		const [oldFiles, oldLines, oldCode] = previous.langStats.get(lang) ?? none
+		if (files === oldFiles && lines === oldLines && code === oldCode) continue
+		const fileDelta =
+			files !== oldFiles ? `, ${signed(files - oldFiles)} files` : ''
+		changes.push(
+			`${lang} ${signed(lines - oldLines)} lines (${signed(code - oldCode)} code${fileDelta})`
+		)
+	}
+
+	const [totalF, totalL, totalC] = sumStats(counts.langStats)
+	bunnyLog.log(
+		'analysis',
+		`✏️ ${changes.length ? changes.join(', ') : 'Sizes changed'} → ${fmt(totalL)} lines (${fmt(totalC)} code) in ${fmt(totalF)} files`
+	)
+}
+
+// Report dir once, then a line per change until the signal aborts, when the
+// final totals are reported
+export async function watchCodebase(dir = './dist', options: JobOptions = {}) {
+	const kernel = prepareEngine(options.kernel)
+	bunnyLog.log(
+		'analysis',
+		`⚡ Analyzing ${dir} with native C walking and ${kernel} counting kernels from ${engine}, then watching it for changes`
+	)
+
+	const watch = watchTree(dir, options, logWatchChange)
+	if (!watch) {
+		bunnyLog.log('warning', `Cannot watch ${dir}`)
+		return
+	}
+	const initial = watch.counts()
+	logLanguageTable(initial.langStats)
+	if (initial.watch.dirsUnwatched) {
+		bunnyLog.log(
+			'warning',
+			`${fmt(initial.watch.dirsUnwatched)} directories could not be watched (raise fs.inotify.max_user_watches)`
+		)
+	}
+	bunnyLog.log(
+		'analysis',
+		`👀 Watching ${fmt(initial.watch.dirs)} directories (files are counted again once written and closed), Ctrl-C to stop`
+	)
+
+	await Promise.race([
+		watch.gone,
+		new Promise<void>((resolve) => {
+			if (options.signal?.aborted) resolve()
+			options.signal?.addEventListener('abort', () => resolve(), {
+				once: true,
+			})
+		}),
+	])
+	const final = watch.counts()
+	watch.stop()
+	if (final.watch.rootGone) {
+		bunnyLog.log('warning', `${dir} was deleted or moved away, watch stopped`)
+	}
+	logLanguageTable(final.langStats)
+	bunnyLog.log(
+		'summary',
+		`${fmt(final.watch.events)} events: ${fmt(final.watch.filesUpdated)} files counted again, ${fmt(final.watch.filesRemoved)} removed, ${fmt(final.watch.rescans)} directories rescanned for ignore rules, ${fmt(final.watch.overflows)} full rescans`
+	)
+}
@@ -0,0 +1,252 @@
+// Native benchmark harness for the cloc counting kernels and language
+// detection. Built and driven by clocBench.ts; compiled as a single unit
+// with cloc.c so the static kernels are benchmarked directly, without the
+// FFI or the directory walker in the way.
+//
+//   cloc_bench <languages.tsv> <corpus dir> [min ms per sample]
+//
+// The corpus is a directory per language family (see clocCorpus.ts). Output
+// is one JSON object per line: the counts are deterministic for a given
+// corpus, the rates are the best of BENCH_SAMPLES samples.
+
+#include "cloc.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_SAMPLES 3
+#define BENCH_MAX_FAMILIES 16
+
+static const char* const kernel_names[KERNEL_COUNT] = { "swar", "sse2", "avx2", "avx512" };
+
+typedef struct {
+    char path[512];
+    int family;
+    const dynamic_lang_t* lang;
+    unsigned char* data;
+    int size;
+} bench_file_t;
+
+static bench_file_t* g_files;
+static int g_file_count;
+static int g_file_cap;
+static char g_families[BENCH_MAX_FAMILIES][64];
+static int g_family_count;
+static cloc_ctx_t* g_ctx;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// The same language table cloc.ts hands the engine
+static int load_languages(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+
+    size_t len = 0, cap = 1 << 16;
+    char* table = malloc(cap);
+    size_t n;
+    while (table && (n = fread(table + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (len + 1 < cap) continue;
+        char* grown = realloc(table, cap *= 2);
+        if (!grown) free(table);
+        table = grown;
+    }
+    fclose(f);
+    if (!table) return -1;
+    table[len] = '\0';
+
+    int count = cloc_ctx_load_languages(g_ctx, table);
+    free(table);
+    return count < 0 ? -1 : 0;
+}
+
+static int load_file(const char* path, int family) {
+    if (g_file_count == g_file_cap) {
+        int cap = g_file_cap ? g_file_cap * 2 : 256;
+        bench_file_t* files = realloc(g_files, cap * sizeof *files);
+        if (!files) return -1;
+        g_files = files;
+        g_file_cap = cap;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > 0x7fffffff) {
+        close(fd);
+        return 0;
+    }
+
+    bench_file_t* file = &g_files[g_file_count];
+    file->data = malloc(st.st_size ? st.st_size : 1);
+    file->size = (int)st.st_size;
+    long long got = 0;
+    while (file->data && got < st.st_size) {
+        ssize_t n = read(fd, file->data + got, st.st_size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    if (!file->data || got != st.st_size) {
+        free(file->data);
+        return -1;
+    }
+
+    str_copy(file->path, path, sizeof file->path);
+    file->family = family;
+    file->lang = detect_language(g_ctx->db, path);
+    g_file_count++;
+    return 0;
+}
+
+// Every regular file under corpus/<family>/, families in name order so the
+// output is stable
+static int cmp_names(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+static int load_corpus(const char* root) {
+    DIR* dir = opendir(root);
+    if (!dir) return -1;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) && g_family_count < BENCH_MAX_FAMILIES) {
+        if (ent->d_name[0] == '.') continue;
+        str_copy(g_families[g_family_count++], ent->d_name, 64);
+    }
+    closedir(dir);
+    qsort(g_families, g_family_count, sizeof g_families[0], cmp_names);
+
+    char path[1024];
+    for (int f = 0; f < g_family_count; f++) {
+        snprintf(path, sizeof path, "%s/%s", root, g_families[f]);
+        DIR* sub = opendir(path);
+        if (!sub) continue;
+        while ((ent = readdir(sub))) {
+            if (ent->d_name[0] == '.') continue;
+            snprintf(path, sizeof path, "%s/%s/%s", root, g_families[f], ent->d_name);
+            if (load_file(path, f) != 0) {
+                closedir(sub);
+                return -1;
+            }
+        }
+        closedir(sub);
+    }
+    return 0;
+}
+
+// Count every file of `family` (-1 for all) once; returns the bytes touched
+static long long count_pass(int family, long long* totals) {
+    long long bytes = 0;
+    int result[5];
+    for (int i = 0; i < g_file_count; i++) {
+        const bench_file_t* file = &g_files[i];
+        if (family >= 0 && file->family != family) continue;
+        count_file_buffer(g_ctx->kernel, file->data, file->size, file->lang, result);
+        totals[0]++;
+        for (int k = 0; k < 4; k++) totals[k + 1] += result[k];
+        bytes += file->size;
+    }
+    return bytes;
+}
+
+static void bench_count(int kernel, int family, double min_ms) {
+    long long totals[5] = { 0 };
+    long long bytes = count_pass(family, totals); // warm-up, and the counts
+    if (totals[0] == 0) return;
+
+    double best = 0; // passes per millisecond
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        long long scratch[5];
+        int passes = 0;
+        double start = now_ms(), elapsed;
+        do {
+            count_pass(family, scratch);
+            passes++;
+            elapsed = now_ms() - start;
+        } while (elapsed < min_ms);
+        if (passes / elapsed > best) best = passes / elapsed;
+    }
+
+    printf("{\"bench\":\"count\",\"kernel\":\"%s\",\"family\":\"%s\",\"files\":%lld,\"bytes\":%lld,"
+           "\"lines\":%lld,\"code\":%lld,\"comments\":%lld,\"blanks\":%lld,"
+           "\"mb_per_s\":%.1f,\"files_per_s\":%.0f}\n",
+           kernel_names[kernel], family < 0 ? "all" : g_families[family], totals[0], bytes,
+           totals[1], totals[2], totals[3], totals[4],
+           bytes * best * 1000.0 / 1048576.0, totals[0] * best * 1000.0);
+}
+
+// Lookups per second over the corpus paths (hits) and the same paths with
+// an unknown extension (misses), which probe the index and find nothing
+static void bench_detect(const char* name, char (*paths)[512], int count, double min_ms) {
+    int found = 0;
+    for (int i = 0; i < count; i++) found += detect_language(g_ctx->db, paths[i]) != 0;
+
+    double best = 0;
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        long long lookups = 0;
+        volatile int sink = 0;
+        double start = now_ms(), elapsed;
+        do {
+            for (int i = 0; i < count; i++) sink += detect_language(g_ctx->db, paths[i]) != 0;
+            lookups += count;
+            elapsed = now_ms() - start;
+        } while (elapsed < min_ms);
+        if (lookups / elapsed > best) best = lookups / elapsed;
+    }
+
+    printf("{\"bench\":\"%s\",\"paths\":%d,\"found\":%d,\"languages\":%d,\"lookups_per_s\":%.0f}\n",
+           name, count, found, g_ctx->db->count, best * 1000.0);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <languages.tsv> <corpus dir> [min ms]\n", argv[0]);
+        return 2;
+    }
+    double min_ms = argc > 3 ? atof(argv[3]) : 200.0;
+
+    g_ctx = cloc_ctx_create(0);
+    if (!g_ctx) return 1;
+
+    if (load_languages(argv[1]) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+    if (load_corpus(argv[2]) != 0 || g_file_count == 0) {
+        fprintf(stderr, "cannot load corpus from %s\n", argv[2]);
+        return 1;
+    }
+
+    long long corpus_bytes = 0;
+    for (int i = 0; i < g_file_count; i++) corpus_bytes += g_files[i].size;
+    printf("{\"bench\":\"meta\",\"files\":%d,\"bytes\":%lld,\"families\":%d,\"languages\":%d,"
+           "\"best_kernel\":\"%s\",\"min_ms\":%.0f,\"samples\":%d}\n",
+           g_file_count, corpus_bytes, g_family_count, g_ctx->db->count,
+           kernel_names[cpu_best_kernel()], min_ms, BENCH_SAMPLES);
+
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+        if (cloc_ctx_select_kernel(g_ctx, k) != k) continue;
+        for (int f = 0; f < g_family_count; f++) bench_count(k, f, min_ms);
+        bench_count(k, -1, min_ms);
+    }
+
+    char (*paths)[512] = malloc((size_t)g_file_count * sizeof *paths);
+    if (!paths) return 1;
+    for (int i = 0; i < g_file_count; i++) str_copy(paths[i], g_files[i].path, 512);
+    bench_detect("detect-hit", paths, g_file_count, min_ms);
+    for (int i = 0; i < g_file_count; i++) {
+        char* dot = strrchr(paths[i], '.');
+        if (dot && dot - paths[i] < 500) strcpy(dot, ".unknownext");
+    }
+    bench_detect("detect-miss", paths, g_file_count, min_ms);
+
+    free(paths);
+    for (int i = 0; i < g_file_count; i++) free(g_files[i].data);
+    free(g_files);
+    cloc_ctx_destroy(g_ctx);
+    return 0;
+}
@@ -0,0 +1,1098 @@
+// Native test harness for the cloc engine. Built and driven by clocTest.ts;
+// compiled as a single unit with cloc.c so the static parsers and file
+// formats are tested directly, without the FFI in the way.
+//
+//   cloc_test <languages.tsv> <work dir> [filter]
+//
+// The work dir holds the fixtures clocTest.ts prepares and whatever the
+// tests write. Output is TAP: one "ok" or "not ok" line per check, the
+// exit status is 1 if any check failed. A filter runs only the groups whose
+// name contains it.
+
+#include "cloc.c"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static cloc_ctx_t* g_ctx;
+static const char* g_work;
+static const char* g_group;
+static int g_checks;
+static int g_failed;
+
+static void check(int ok, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%s %d - %s: ", ok ? "ok" : "not ok", ++g_checks, g_group);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    if (!ok) g_failed++;
+}
+
+// The same language table cloc.ts hands the engine
+static int load_languages(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+
+    size_t len = 0, cap = 1 << 16;
+    char* table = malloc(cap);
+    size_t n;
+    while (table && (n = fread(table + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (len + 1 < cap) continue;
+        char* grown = realloc(table, cap *= 2);
+        if (!grown) free(table);
+        table = grown;
+    }
+    fclose(f);
+    if (!table) return -1;
+    table[len] = '\0';
+
+    int count = cloc_ctx_load_languages(g_ctx, table);
+    free(table);
+    return count < 0 ? -1 : 0;
+}
+
+// Totals of a walk over every language: files, lines, code, comments,
+// blanks, size. Returns the languages counted, or -1 if root can't be walked.
+static int count_tree(const char* root, int flags, long long totals[6], long long walk[WALK_STAT_FIELDS]) {
+    static char names[MAX_LANGUAGES * 64];
+    static long long stats[MAX_LANGUAGES * 6];
+    int count = cloc_analyze_directory(g_ctx, root, flags, 0, names, stats, MAX_LANGUAGES, walk, 0, 0, 0);
+    memset(totals, 0, 6 * sizeof(long long));
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < 6; k++) totals[k] += stats[i * 6 + k];
+    }
+    return count;
+}
+
+// A path in the work dir; the result is reused by the next call
+static const char* work_path(const char* rel) {
+    static char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", g_work, rel);
+    return path;
+}
+
+static int write_text(const char* rel, const char* text) {
+    FILE* f = fopen(work_path(rel), "w");
+    if (!f) return -1;
+    fputs(text, f);
+    return fclose(f);
+}
+
+// ENCODINGS - detection with and without a BOM, counting in code units
+
+static const char* const g_utf8_source =
+    "// 注释 comment\n"
+    "int main(void) {\n"
+    "    /* 块注释\n"
+    "       über zwei Zeilen */\n"
+    "\n"
+    "    return 0; // 零\n"
+    "}\n";
+
+// Append one code unit in the given encoding; returns the new length
+static int put_unit(unsigned char* out, int len, unsigned cp, int enc) {
+    int unit = encoding_unit_size(enc);
+    int big = enc == ENC_UTF16BE || enc == ENC_UTF32BE;
+    for (int i = 0; i < unit; i++) out[len++] = (unsigned char)(cp >> 8 * (big ? unit - 1 - i : i));
+    return len;
+}
+
+// Re-encode UTF-8 text (BMP only) as UTF-16 or UTF-32. Returns the bytes
+// written to out, which must hold 4 bytes per input byte plus a BOM.
+static int encode_text(const char* text, int enc, int bom, unsigned char* out) {
+    int len = bom ? put_unit(out, 0, 0xFEFF, enc) : 0;
+    for (const unsigned char* p = (const unsigned char*)text; *p;) {
+        int extra = *p >= 0xE0 ? 2 : *p >= 0xC0 ? 1 : 0;
+        unsigned cp = extra ? *p & (0x3F >> extra) : *p;
+        for (p++; extra-- > 0; p++) cp = cp << 6 | (*p & 0x3F);
+        len = put_unit(out, len, cp, enc);
+    }
+    return len;
+}
+
+static void test_encodings(void) {
+    static const struct {
+        const char* name;
+        int enc;
+    } encodings[] = {
+        { "utf-16le", ENC_UTF16LE },
+        { "utf-16be", ENC_UTF16BE },
+        { "utf-32le", ENC_UTF32LE },
+        { "utf-32be", ENC_UTF32BE },
+    };
+    const dynamic_lang_t* c = detect_language(g_ctx->db, "main.c");
+    int expected[5], result[5], bom_len;
+    count_file_buffer(g_ctx->kernel, (const unsigned char*)g_utf8_source, (int)strlen(g_utf8_source), c, expected);
+    check(c && expected[0] == 8 && expected[1] + expected[2] + expected[3] == 8, "utf-8 reference is text");
+
+    unsigned char buf[1024];
+    for (int i = 0; i < 4; i++) {
+        for (int bom = 1; bom >= 0; bom--) {
+            int len = encode_text(g_utf8_source, encodings[i].enc, bom, buf);
+            int enc = detect_encoding(buf, len, &bom_len);
+            check(enc == encodings[i].enc && bom_len == (bom ? encoding_unit_size(enc) : 0),
+                  "%s %s is detected", encodings[i].name, bom ? "with a BOM" : "without a BOM");
+            count_file_buffer(g_ctx->kernel, buf, len, c, result);
+            check(!memcmp(result, expected, 4 * sizeof(int)), "%s %s counts like utf-8", encodings[i].name,
+                  bom ? "with a BOM" : "without a BOM");
+        }
+    }
+
+    // Text in a script without ASCII has few zero bytes, all on one parity
+    const char* cjk = "漢字のテキスト、改行は少ない。\n二行目も漢字だけで書かれている。\n";
+    int len = encode_text(cjk, ENC_UTF16LE, 0, buf);
+    check(detect_encoding(buf, len, &bom_len) == ENC_UTF16LE, "bom-less utf-16le without ascii is text");
+    len = encode_text(cjk, ENC_UTF16BE, 0, buf);
+    check(detect_encoding(buf, len, &bom_len) == ENC_UTF16BE, "bom-less utf-16be without ascii is text");
+    len = encode_text(cjk, ENC_UTF32LE, 0, buf);
+    check(detect_encoding(buf, len, &bom_len) == ENC_UTF32LE, "bom-less utf-32le without ascii is text");
+
+    // Malformed input: too short for a code unit, truncated, or binary
+    check(detect_encoding((const unsigned char*)"A\0", 2, &bom_len) != ENC_UTF32LE,
+          "two bytes with a NUL are not utf-32");
+    check(detect_encoding((const unsigned char*)"AB\0", 3, &bom_len) != ENC_UTF32LE,
+          "three bytes with a NUL are not utf-32");
+    len = encode_text(g_utf8_source, ENC_UTF16LE, 1, buf);
+    count_file_buffer(g_ctx->kernel, buf, len - 1, c, result);
+    check(result[0] == expected[0] - 1 && result[4] == len - 1, "truncated utf-16 drops the partial code unit");
+    unsigned state = 12345;
+    for (int i = 0; i < (int)sizeof(buf); i++) {
+        state = state * 1103515245 + 12345;
+        buf[i] = (state >> 16) % 7 ? (unsigned char)(state >> 24) : 0;
+    }
+    check(detect_encoding(buf, sizeof(buf), &bom_len) == ENC_BINARY, "random bytes with zeros are binary");
+}
+
+// IGNORE RULES - the gitignore matcher over a level chain
+
+// Whether rel (relative to the walk root) is ignored under the level chain
+static int ignored(const ignore_level_t* lv, const char* rel, int is_dir) {
+    const char* slash = strrchr(rel, '/');
+    const char* name = slash ? slash + 1 : rel;
+    return ignore_check(lv, rel, (int)strlen(rel), name, (int)strlen(name), is_dir);
+}
+
+static void test_ignore(void) {
+    ignore_level_t defaults, root, sub;
+    memset(&defaults, 0, sizeof(defaults));
+    memset(&root, 0, sizeof(root));
+    memset(&sub, 0, sizeof(sub));
+
+    // The built-in rules, whole: the last one once lost its final byte
+    compile_default_ignores(&defaults);
+    check(defaults.rule_count == 2, "two default rules");
+    check(ignored(&defaults, ".git", 1) && ignored(&defaults, "a/b/node_modules", 1),
+          "defaults ignore .git and node_modules");
+    check(!ignored(&defaults, "node_modules", 0) && !ignored(&defaults, "node_module", 1),
+          "defaults only match the whole directory name");
+
+    static const char rules[] = "# comment\n"
+                                "*.log\n"
+                                "!keep.log\n"
+                                "/build\n"
+                                "docs/**/*.tmp\n"
+                                "foo?\n"
+                                "[a-c]x\n"
+                                "**/cache/\n"
+                                "\\#hash\n"
+                                "trailing  \n"
+                                "crlf.o\r\n"
+                                "!node_modules/\n";
+    root.parent = &defaults;
+    compile_ignore_text(&root, rules, (int)sizeof(rules) - 1);
+    check(root.rule_count == 11, "comment skipped, %d rules compiled", root.rule_count);
+    check(ignored(&root, "a/b.log", 0) && !ignored(&root, "keep.log", 0), "suffix rule and its negation");
+    check(ignored(&root, "build", 1) && !ignored(&root, "src/build", 1), "leading slash anchors to the level");
+    check(ignored(&root, "docs/z.tmp", 0) && ignored(&root, "docs/x/y/z.tmp", 0) && !ignored(&root, "src/z.tmp", 0),
+          "**/ matches zero or more directories");
+    check(ignored(&root, "foo1", 0) && !ignored(&root, "foo", 0) && !ignored(&root, "foo12", 0), "? matches one byte");
+    check(ignored(&root, "bx", 0) && !ignored(&root, "dx", 0), "class range");
+    check(ignored(&root, "a/cache", 1) && !ignored(&root, "a/cache", 0), "trailing slash only matches directories");
+    check(ignored(&root, "#hash", 0) && ignored(&root, "trailing", 0) && ignored(&root, "crlf.o", 0),
+          "escapes, trailing spaces and CR");
+    check(!ignored(&root, "node_modules", 1) && ignored(&root, ".git", 1), "a level negates a default");
+
+    // A nested level matches paths relative to its own directory
+    static const char nested[] = "/only\n*.c\n";
+    sub.parent = &root;
+    sub.base_len = 3;
+    compile_ignore_text(&sub, nested, (int)sizeof(nested) - 1);
+    check(ignored(&sub, "sub/only", 0) && !ignored(&sub, "sub/x/only", 0) && ignored(&sub, "sub/x/y.c", 0),
+          "nested level anchors below its directory");
+    check(ignored(&sub, "sub/q.log", 0), "nested level falls back to its parents");
+
+    // Malformed input: unterminated classes are literal, empty patterns are dropped
+    ignore_level_t bad;
+    memset(&bad, 0, sizeof(bad));
+    static const char malformed[] = "[abc\n!\n/\n\n \n[]\n[!]\n";
+    compile_ignore_text(&bad, malformed, (int)sizeof(malformed) - 1);
+    check(ignored(&bad, "[abc", 0) && !ignored(&bad, "a", 0), "unterminated class matches literally");
+    check(bad.rule_count == 3, "empty patterns are dropped, %d rules left", bad.rule_count);
+
+    ignore_level_free(&defaults);
+    ignore_level_free(&root);
+    ignore_level_free(&sub);
+    ignore_level_free(&bad);
+}
+
+// LINKS - every physical file and directory is counted once
+
+static void test_links(void) {
+    char target[4096];
+    mkdir(work_path("links"), 0755);
+    write_text("links/a.c", "int a;\n// one\n");
+    snprintf(target, sizeof(target), "%s", work_path("links/a.c"));
+    link(target, work_path("links/hard.c"));
+    symlink("a.c", work_path("links/soft.c"));
+    symlink(".", work_path("links/loop"));
+
+    long long totals[6], walk[WALK_STAT_FIELDS];
+    int count = count_tree(work_path("links"), 0, totals, walk);
+    check(count == 1 && totals[0] == 1 && totals[1] == 3, "a file and its links count once");
+    check(walk[WALK_FILES_DUPLICATE] == 2 && walk[WALK_BYTES_DUPLICATE] == 2 * 14,
+          "hard link and symlink are duplicates");
+    check(walk[WALK_DIRS_DUPLICATE] == 1, "a symlink loop is entered once");
+
+    count_tree(work_path("links"), WALK_NO_FOLLOW, totals, walk);
+    check(totals[0] == 1 && walk[WALK_FILES_DUPLICATE] == 1 && walk[WALK_LINKS_SKIPPED] == 2,
+          "without following, only the hard link is a duplicate");
+
+    count_tree(work_path("links"), WALK_CACHED, totals, walk);
+    count_tree(work_path("links"), WALK_CACHED, totals, walk);
+    check(totals[0] == 1 && walk[WALK_FILES_CACHED] == 1 && walk[WALK_FILES_DUPLICATE] == 2,
+          "cached walk keys files the same way");
+
+    check(count_tree(work_path("links/a.c"), 0, totals, walk) < 0, "a file is not a root");
+}
+
+// CANCEL - a cancelled walk stops inside large reads and queued async I/O
+
+static int open_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    int count = 0;
+    while (dir && readdir(dir)) count++;
+    if (dir) closedir(dir);
+    return count;
+}
+
+static void test_cancel(void) {
+    walk_progress_t progress;
+    memset(&progress, 0, sizeof(progress));
+    walker_t* w = calloc(1, sizeof(walker_t));
+    w->db = g_ctx->db;
+    w->kernel = g_ctx->kernel;
+    w->totals = calloc(w->db->count, sizeof(lang_totals_t));
+    w->progress = &progress;
+    const dynamic_lang_t* c = detect_language(w->db, "big.c");
+
+    // Three chunks, so a cancel is seen between them
+    FILE* f = fopen(work_path("big.c"), "w");
+    for (int i = 0; i < 3 * READ_CHUNK / 8; i++) fputs("int x;\n", f);
+    long long size = ftell(f);
+    fclose(f);
+    check(read_file(w, work_path("big.c")) == size, "a large file is read whole");
+    progress.cancel = 1;
+    check(read_file(w, work_path("big.c")) == READ_CANCELLED && w->stats[WALK_CANCELLED],
+          "a cancelled large read stops between chunks");
+    ingest_sync(w, work_path("big.c"), c, 0);
+    check(w->stats[WALK_FILES_UNREADABLE] == 0 && w->totals[c - w->db->langs].files == 0,
+          "a cancelled file is neither counted nor unreadable");
+
+#ifdef CLOC_HAVE_URING
+    uring_ingest_t* u = uring_create();
+    if (!u) {
+        check(1, "# SKIP io_uring unavailable");
+    } else {
+        mkdir(work_path("queued"), 0755);
+        char name[64];
+        for (int i = 0; i < 200; i++) {
+            snprintf(name, sizeof(name), "queued/f%d.c", i);
+            write_text(name, "int y;\n");
+        }
+        int fds = open_fds();
+        progress.cancel = 0;
+        for (int i = 0; i < 200; i++) {
+            snprintf(name, sizeof(name), "queued/f%d.c", i);
+            str_copy(w->path, work_path(name), sizeof(w->path));
+            uring_push(w, u, c, 0, 7);
+        }
+        progress.cancel = 1;
+        uring_drain(w, u);
+        check(u->inflight == 0 && u->free_count == URING_SLOTS && !u->orphaned,
+              "a cancelled drain leaves nothing in flight");
+        check(open_fds() == fds, "a cancelled drain closes every file it opened");
+        uring_destroy(u);
+    }
+#endif
+
+    free(w->buf);
+    free(w->totals);
+    free(w);
+}
+
+// LANGUAGES - adding definitions, freezing on first use, reloading
+
+static int g_adds_accepted;
+
+static void* add_languages_main(void* ctx) {
+    char name[16];
+    for (int i = 0; i < MAX_LANGUAGES; i++) {
+        snprintf(name, sizeof(name), "Lang%d", i);
+        if (cloc_ctx_add_language(ctx, name, name, "#", "", "") == 0)
+            __atomic_fetch_add(&g_adds_accepted, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void test_languages(void) {
+    cloc_ctx_t* ctx = cloc_ctx_create(0);
+    check(cloc_ctx_add_language(ctx, "Foo", "foo,.bar", "#", "", "") == 0, "added before first use");
+    lang_db_t* db = ctx_languages(ctx);
+    const dynamic_lang_t* foo = detect_language(db, "x.bar");
+    check(foo && !strcmp(foo->name, "Foo") && detect_language(db, "x.FOO") == foo,
+          "extensions with and without a dot, any case");
+    lang_db_release(db);
+    check(cloc_ctx_add_language(ctx, "Late", "late", "#", "", "") == -1 && cloc_ctx_language_count(ctx) == 1,
+          "refused after first use");
+
+    // Malformed input: a table that doesn't fit leaves the database alone
+    char* table = malloc(8192);
+    memset(table, 'x', 8191);
+    table[8191] = '\0';
+    check(cloc_ctx_load_languages(ctx, table) == -1 && cloc_ctx_language_count(ctx) == 1,
+          "an overlong line is rejected whole");
+    free(table);
+    check(cloc_ctx_load_languages(ctx, "A\ta\t#\r\n\nB\tb\n") == 2 && cloc_ctx_generation(ctx) == 1,
+          "a reload publishes a new generation");
+    check(cloc_ctx_add_language(ctx, "C", "c", "#", "", "") == -1, "refused on a loaded table");
+    cloc_ctx_destroy(ctx);
+
+    // Adds racing the first use land whole or are refused
+    ctx = cloc_ctx_create(0);
+    pthread_t adder;
+    pthread_create(&adder, 0, add_languages_main, ctx);
+    while (__atomic_load_n(&g_adds_accepted, __ATOMIC_RELAXED) < 50) {
+    }
+    db = ctx_languages(ctx);
+    int frozen_count = db->count;
+    pthread_join(adder, 0);
+    int whole = 1;
+    for (int i = 0; i < db->count; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "Lang%d", i);
+        whole &= !strcmp(db->langs[i].name, name) && db->langs[i].ext_count == 1;
+    }
+    check(frozen_count == g_adds_accepted && db->count == frozen_count && whole,
+          "%d adds accepted before the freeze, all whole", g_adds_accepted);
+    lang_db_release(db);
+    cloc_ctx_destroy(ctx);
+}
+
+// CACHE - per-file results reused across walks, evicted once not found
+
+static void test_cache(void) {
+    cloc_ctx_t* ctx = cloc_ctx_create(g_ctx);
+    long long stats[MAX_LANGUAGES * 6], walk[WALK_STAT_FIELDS];
+    char names[MAX_LANGUAGES * 64];
+    mkdir(work_path("cached"), 0755);
+    write_text("cached/kept.c", "int a;\n");
+    write_text("cached/gone.c", "int b;\n");
+
+    cloc_analyze_directory(ctx, work_path("cached"), WALK_CACHED, 0, names, stats, MAX_LANGUAGES, walk, 0, 0, 0);
+    cloc_analyze_directory(ctx, work_path("cached"), WALK_CACHED, 0, names, stats, MAX_LANGUAGES, walk, 0, 0, 0);
+    check(walk[WALK_FILES_CACHED] == 2 && ctx->cache->count == 2, "a warm walk reads nothing");
+
+    // Round trip: a changed file is re-read, not served stale
+    write_text("cached/kept.c", "int a;\nint c;\n");
+    cloc_analyze_directory(ctx, work_path("cached"), WALK_CACHED, 0, names, stats, MAX_LANGUAGES, walk, 0, 0, 0);
+    check(walk[WALK_FILES_CACHED] == 1 && stats[1] == 5, "a changed file is counted afresh");
+
+    unlink(work_path("cached/gone.c"));
+    for (int i = 0; i < 2 * FILE_CACHE_SWEEP_WALKS; i++)
+        cloc_analyze_directory(ctx, work_path("cached"), WALK_CACHED, 0, names, stats, MAX_LANGUAGES, walk, 0, 0, 0);
+    check(ctx->cache->count == 1 && walk[WALK_FILES_CACHED] == 1, "a deleted file's entry is evicted");
+    cloc_ctx_destroy(ctx);
+}
+
+// INDEX - a saved rollup answers prefix queries, damage is refused
+
+// The entries of dir whose names contain part
+static int count_entries(const char* dir, const char* part) {
+    DIR* d = opendir(dir);
+    int count = 0;
+    struct dirent* e;
+    while (d && (e = readdir(d))) count += strstr(e->d_name, part) != 0;
+    if (d) closedir(d);
+    return count;
+}
+
+static void test_index(void) {
+    char index_path[4096], names[MAX_LANGUAGES * 64];
+    long long stats[MAX_LANGUAGES * 6], walk[WALK_STAT_FIELDS], threads[64 * 8], one[6];
+    mkdir(work_path("indexed"), 0755);
+    mkdir(work_path("indexed/src"), 0755);
+    mkdir(work_path("indexed/src/deep"), 0755);
+    write_text("indexed/top.c", "int a;\n");
+    write_text("indexed/src/b.c", "int b;\n// two\n");
+    write_text("indexed/src/deep/c.py", "x = 1\n");
+    write_text("indexed/src/deep/d.c", "int d;\n");
+
+    void* job = cloc_job_start(g_ctx, work_path("indexed"), WALK_BY_DIR, 0, 0);
+    void* tree = cloc_job_dir_tree(job);
+    cloc_job_finish(job, names, stats, MAX_LANGUAGES, walk, threads, 64, 0);
+    snprintf(index_path, sizeof(index_path), "%s", work_path("rollup.idx"));
+
+    // A stale or hostile fixed temporary name must not get in the way
+    mkdir(work_path("rollup.idx.tmp"), 0755);
+    check(cloc_dir_tree_save(tree, index_path) == 0, "an index is saved");
+    check(cloc_dir_tree_save(tree, index_path) == 0, "an index is replaced");
+    check(count_entries(g_work, "rollup.idx.") == 1, "saving leaves no temporary files");
+    cloc_dir_tree_free(tree);
+
+    void* index = cloc_index_open(index_path);
+    check(index != 0, "a saved index opens");
+    if (!index) return;
+    int count = cloc_index_query(index, "", names, stats, MAX_LANGUAGES);
+    long long files = 0;
+    for (int i = 0; i < count; i++) files += stats[i * 6];
+    check(count == 2 && files == 4, "the root holds every file");
+    count = cloc_index_query(index, "src", names, stats, MAX_LANGUAGES);
+    files = 0;
+    for (int i = 0; i < count; i++) files += stats[i * 6];
+    check(count == 2 && files == 3, "a directory holds its subtree");
+    check(cloc_index_query_language(index, "src/deep/", "C", one) == 0 && one[0] == 1 && one[2] == 1,
+          "one language under a directory");
+    check(cloc_index_query_language(index, "src/deep", "Rust", one) == 0 && one[0] == 0,
+          "an absent language is zeros");
+    check(cloc_index_query(index, "nope", names, stats, MAX_LANGUAGES) < 0, "an unknown directory is refused");
+    cloc_index_close(index);
+
+    // Damage anywhere in the header or past the end is caught at open
+    FILE* f = fopen(index_path, "r+b");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    unsigned char* bytes = malloc(size);
+    fseek(f, 0, SEEK_SET);
+    check(fread(bytes, 1, size, f) == (size_t)size, "the index reads back");
+    fclose(f);
+    const struct {
+        long off;
+        const char* what;
+    } damage[] = {
+        { 0, "a foreign magic is refused" },
+        { 8, "another version is refused" },
+        { 16, "another layout is refused" },
+        { 24, "a wrong file size is refused" },
+        { 64, "a bad directory count is refused" },
+    };
+    for (int i = 0; i < (int)(sizeof(damage) / sizeof(damage[0])); i++) {
+        bytes[damage[i].off] ^= 0x40;
+        f = fopen(index_path, "wb");
+        fwrite(bytes, 1, size, f);
+        fclose(f);
+        index = cloc_index_open(index_path);
+        check(index == 0, "%s", damage[i].what);
+        cloc_index_close(index);
+        bytes[damage[i].off] ^= 0x40;
+    }
+    f = fopen(index_path, "wb");
+    fwrite(bytes, 1, size - 1, f);
+    fclose(f);
+    check(cloc_index_open(index_path) == 0, "a truncated index is refused");
+    check(cloc_index_open(work_path("missing.idx")) == 0, "a missing index is refused");
+    free(bytes);
+}
+
+// INFLATE - zlib streams from another encoder, trailers checked
+
+// A whole fixture file into a new buffer; its size goes to len
+static unsigned char* read_fixture(const char* rel, long long* len) {
+    byte_buf_t b;
+    memset(&b, 0, sizeof(b));
+    *len = read_whole_file(work_path(rel), &b);
+    if (*len < 0) free(b.data);
+    return *len < 0 ? 0 : b.data;
+}
+
+static void test_inflate(void) {
+    static const char* const streams[] = { "inflate/stored.zz", "inflate/fixed.zz", "inflate/dynamic.zz" };
+    long long text_len, len;
+    unsigned char* text = read_fixture("inflate/text", &text_len);
+    check(text != 0, "the inflate fixtures are there");
+    if (!text) return;
+    unsigned char* out = malloc(text_len);
+    for (int i = 0; i < 3; i++) {
+        unsigned char* z = read_fixture(streams[i], &len);
+        check(z && zlib_inflate(z, len, out, text_len) == 0 && memcmp(out, text, text_len) == 0, "%s inflates",
+              streams[i]);
+        if (!z) continue;
+        check(zlib_inflate(z, len - 1, out, text_len) != 0, "%s without its last byte is refused", streams[i]);
+        z[len - 1] ^= 1;
+        check(zlib_inflate(z, len, out, text_len) != 0, "%s with a bad Adler-32 is refused", streams[i]);
+        free(z);
+    }
+    check(adler32((const unsigned char*)"Wikipedia", 9) == 0x11e60398, "Adler-32 of a known string");
+    free(out);
+    free(text);
+}
+
+// GIT - a revision counts as its checkout does, from packs, deltas and
+// loose objects alike
+
+static int count_rev(void* repo, const char* rev, long long totals[6]) {
+    static char names[MAX_LANGUAGES * 64];
+    static long long stats[MAX_LANGUAGES * 6];
+    long long walk[WALK_STAT_FIELDS];
+    thread_stats_t threads[1];
+    int count = cloc_git_analyze(g_ctx, repo, rev, 0, names, stats, MAX_LANGUAGES, walk, (long long*)threads, 1);
+    memset(totals, 0, 6 * sizeof(long long));
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < 6; k++) totals[k] += stats[i * 6 + k];
+    }
+    return count;
+}
+
+static void test_git(void) {
+    long long tree[6], walk_totals[6], walk[WALK_STAT_FIELDS], stats[GIT_STAT_FIELDS];
+    int status;
+    void* repo = cloc_git_open(work_path("git"), &status);
+    check(repo != 0 && status == GIT_OPEN_OK, "the fixture repository opens");
+    if (!repo) return;
+
+    int count = count_rev(repo, "HEAD", tree);
+    check(count_tree(work_path("git"), 0, walk_totals, walk) == count && count == 2 &&
+              memcmp(tree, walk_totals, sizeof(tree)) == 0,
+          "HEAD counts as its checkout");
+    cloc_git_stats(repo, stats);
+    check(stats[GIT_OBJECTS_LOOSE] > 0, "HEAD is read from loose objects");
+
+    count = count_rev(repo, "HEAD~2", tree);
+    check(count_tree(work_path("git-old"), 0, walk_totals, walk) == count &&
+              memcmp(tree, walk_totals, sizeof(tree)) == 0,
+          "an older commit counts as its checkout");
+    cloc_git_stats(repo, stats);
+    check(stats[GIT_DELTAS] > 0 && stats[GIT_OBJECTS_PACKED] > 0, "the older blob is rebuilt from a delta");
+    check(count_rev(repo, "no-such-branch", tree) < 0, "an unknown revision is refused");
+    cloc_git_close(repo);
+
+    // A linked work tree reads the main repository's objects
+    repo = cloc_git_open(work_path("git-old"), 0);
+    check(repo && count_rev(repo, "HEAD", tree) == count && memcmp(tree, walk_totals, sizeof(tree)) == 0,
+          "a linked work tree counts its own HEAD");
+    cloc_git_close(repo);
+
+    // Ids are SHA-1 throughout, so other object formats are refused up front
+    mkdir(work_path("git-sha256"), 0755);
+    mkdir(work_path("git-sha256/objects"), 0755);
+    write_text("git-sha256/HEAD", "ref: refs/heads/main\n");
+    write_text("git-sha256/config", "[core]\n\trepositoryformatversion = 1\n[extensions]\n\tobjectFormat = sha256\n");
+    check(cloc_git_open(work_path("git-sha256"), &status) == 0 && status == GIT_OPEN_OBJECT_FORMAT,
+          "a SHA-256 repository is refused");
+    write_text("git-sha256/config", "[extensions]\n\tobjectformat = sha1\n");
+    repo = cloc_git_open(work_path("git-sha256"), &status);
+    check(repo && status == GIT_OPEN_OK, "an explicit SHA-1 format opens");
+    cloc_git_close(repo);
+    check(cloc_git_open(work_path("inflate"), &status) == 0 && status == GIT_OPEN_NOT_FOUND,
+          "a plain directory is not a repository");
+}
+
+// HISTORY - every commit's totals by tree diffs, and the blob memo
+
+// Run a whole history, checking each commit against a count of its tree.
+// Returns the commits whose totals matched, or -1 if it can't start; the
+// history counters go to stats.
+static int run_history(void* repo, const char* memo, long long stats[HISTORY_STAT_FIELDS]) {
+    static char names[MAX_LANGUAGES * 64];
+    static long long lang_stats[MAX_LANGUAGES * 6];
+    char id[41];
+    long long time, totals[6], tree[6];
+    void* h = cloc_history_start(g_ctx, repo, "HEAD", 0, memo);
+    if (!h) return -1;
+    int matched = 0, count;
+    while ((count = cloc_history_next(h, id, &time, names, lang_stats, MAX_LANGUAGES, stats)) >= 0) {
+        memset(totals, 0, sizeof(totals));
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < 6; k++) totals[k] += lang_stats[i * 6 + k];
+        }
+        id[40] = '\0';
+        matched += count_rev(repo, id, tree) == count && memcmp(tree, totals, sizeof(tree)) == 0;
+    }
+    if (memo) cloc_history_save(h, memo);
+    cloc_history_free(h);
+    return matched;
+}
+
+static void test_history(void) {
+    char memo[4096];
+    long long stats[HISTORY_STAT_FIELDS];
+    void* repo = cloc_git_open(work_path("git"), 0);
+    check(repo != 0, "the fixture repository opens");
+    if (!repo) return;
+    snprintf(memo, sizeof(memo), "%s", work_path("history.memo"));
+
+    check(run_history(repo, memo, stats) == 3 && stats[HISTORY_COMMITS] == 3, "every commit counts as its tree");
+    long long entries = stats[HISTORY_MEMO_ENTRIES];
+    check(entries > 0 && stats[HISTORY_MEMO_LOADED] == 0, "a missing memo starts empty");
+    check(run_history(repo, memo, stats) == 3 && stats[HISTORY_MEMO_LOADED] == entries &&
+              stats[HISTORY_BLOBS_COUNTED] == 0,
+          "a saved memo answers every blob");
+
+    // A memo that isn't this layout, or from another byte order, is ignored
+    long long size;
+    unsigned char* bytes = read_fixture("history.memo", &size);
+    const struct {
+        long off;
+        const char* what;
+    } damage[] = {
+        { 0, "a foreign magic is ignored" },
+        { 8, "another version is ignored" },
+        { 16, "another byte order is ignored" },
+        { 24, "another layout is ignored" },
+    };
+    for (int i = 0; bytes && i < (int)(sizeof(damage) / sizeof(damage[0])); i++) {
+        bytes[damage[i].off] ^= 0x40;
+        FILE* f = fopen(memo, "wb");
+        fwrite(bytes, 1, size, f);
+        fclose(f);
+        void* h = cloc_history_start(g_ctx, repo, "HEAD", 0, memo);
+        char id[41];
+        long long time;
+        static char names[MAX_LANGUAGES * 64];
+        static long long lang_stats[MAX_LANGUAGES * 6];
+        while (cloc_history_next(h, id, &time, names, lang_stats, MAX_LANGUAGES, stats) >= 0) continue;
+        cloc_history_free(h);
+        check(stats[HISTORY_MEMO_LOADED] == 0 && stats[HISTORY_BLOBS_COUNTED] == entries, "%s", damage[i].what);
+        bytes[damage[i].off] ^= 0x40;
+    }
+    FILE* f = fopen(memo, "wb");
+    if (bytes) fwrite(bytes, 1, size - 1, f);
+    fclose(f);
+    check(run_history(repo, memo, stats) == 3 && stats[HISTORY_MEMO_LOADED] == 0, "a truncated memo is ignored");
+    free(bytes);
+    cloc_git_close(repo);
+}
+
+// DIFF - Myers over classified lines, checked against a plain LCS
+
+// Diff old against new as C and return the file's DIFF_LANG_FIELDS row;
+// the edits the search made go to edits
+static const long long* diff_texts(line_diff_t* d, const char* old, int old_len, const char* new, int new_len,
+                                   long long* edits) {
+    const dynamic_lang_t* c = detect_language(d->db, "x.c");
+    long long* row = d->langs + (c - d->db->langs) * DIFF_LANG_FIELDS;
+    memset(row, 0, DIFF_LANG_FIELDS * sizeof(long long));
+    long long before = d->stats[DIFF_STAT_EDITS];
+    const char* texts[2] = { old, new };
+    int lens[2] = { old_len, new_len };
+    int have[2] = { 1, 1 };
+    for (int k = 0; k < 2; k++) {
+        byte_buf_reserve(&d->text[k], lens[k] + 1);
+        memcpy(d->text[k].data, texts[k], lens[k]);
+        d->text[k].len = lens[k];
+    }
+    diff_file(d, c, have);
+    *edits = d->stats[DIFF_STAT_EDITS] - before;
+    return row;
+}
+
+// Lines of a text over a small alphabet, so lines repeat a lot
+static int random_lines(unsigned* seed, char* out, int* lines) {
+    int len = 0;
+    *lines = 1 + (int)((*seed = *seed * 1103515245 + 12345) >> 16) % 40;
+    for (int i = 0; i < *lines; i++) {
+        *seed = *seed * 1103515245 + 12345;
+        out[len++] = (char)('a' + (*seed >> 16) % 4);
+        out[len++] = '\n';
+    }
+    return len - 1; // the last line has no newline, so lines stay lines
+}
+
+static int lcs_length(const char* a, int n, const char* b, int m) {
+    static int table[41][41];
+    for (int i = 0; i <= n; i++) {
+        for (int j = 0; j <= m; j++) {
+            if (!i || !j) table[i][j] = 0;
+            else if (a[2 * (i - 1)] == b[2 * (j - 1)]) table[i][j] = table[i - 1][j - 1] + 1;
+            else table[i][j] = table[i - 1][j] > table[i][j - 1] ? table[i - 1][j] : table[i][j - 1];
+        }
+    }
+    return table[n][m];
+}
+
+static void test_diff(void) {
+    line_diff_t d;
+    line_diff_init(&d, g_ctx, g_ctx->db);
+    long long edits;
+    const long long* row = diff_texts(&d, "int a;\nint b;\nint c;\n", 21, "int a;\nint b;\nint c;\n", 21, &edits);
+    check(row[DIFF_FILES_MODIFIED] == 1 && edits == 0, "identical texts have no edits");
+    row = diff_texts(&d, "int a;\nint b;\nint c;\n", 21, "int a;\nint x;\nint c;\n", 21, &edits);
+    check(row[DIFF_CODE_MODIFIED] == 1 && row[DIFF_CODE_ADDED] == 0 && row[DIFF_CODE_REMOVED] == 0,
+          "a changed line is modified");
+    row = diff_texts(&d, "int a;\nint c;\n", 14, "int a;\nint b;\n// b\n\nint c;\n", 27, &edits);
+    check(row[DIFF_CODE_ADDED] == 1 && row[DIFF_COMMENTS_ADDED] == 1 && row[DIFF_BLANKS_ADDED] == 1 && edits == 3,
+          "inserted lines are added by kind");
+    row = diff_texts(&d, "int a;\nint b;\n", 14, "/*\nint a;\n*/\nint b;\n", 20, &edits);
+    // "int a;" is now a comment line; the closing "*/" line counts as code
+    check(row[DIFF_COMMENTS_ADDED] == 2 && row[DIFF_CODE_MODIFIED] == 1 && edits == 4,
+          "a line moved into a block comment is a change");
+
+    // UTF-16 lines are diffed in their own code units
+    static const char utf16_old[] = "\xff\xfe" "a\0\n\0b\0\n\0";
+    static const char utf16_new[] = "\xff\xfe" "a\0\n\0c\0\n\0";
+    row = diff_texts(&d, utf16_old, 10, utf16_new, 10, &edits);
+    check(row[DIFF_CODE_MODIFIED] == 1 && edits == 2, "UTF-16 lines diff like UTF-8 ones");
+
+    // Below the cost cap the search is minimal: its edits are exactly the
+    // lines outside a longest common subsequence
+    char a[128], b[128];
+    unsigned seed = 1;
+    int minimal = 0, runs = 300;
+    for (int r = 0; r < runs; r++) {
+        int n, m;
+        int a_len = random_lines(&seed, a, &n);
+        int b_len = random_lines(&seed, b, &m);
+        diff_texts(&d, a, a_len, b, b_len, &edits);
+        minimal += edits == n + m - 2 * lcs_length(a, n, b, m);
+    }
+    check(minimal == runs, "edits match a plain LCS on %d random pairs (%d did)", runs, minimal);
+
+    // Past the cap the result is approximate, but still accounts for every line
+    int lines = 6000;
+    char* fwd = malloc(lines * 8);
+    char* rev = malloc(lines * 8);
+    for (int i = 0; i < lines; i++) {
+        char line[16];
+        snprintf(line, sizeof(line), "x%05d;\n", i);
+        memcpy(fwd + i * 8, line, 8);
+        memcpy(rev + (lines - 1 - i) * 8, line, 8);
+    }
+    long long approximate = d.stats[DIFF_STAT_APPROXIMATE];
+    row = diff_texts(&d, fwd, lines * 8, rev, lines * 8, &edits);
+    check(d.stats[DIFF_STAT_APPROXIMATE] == approximate + 1, "a reversed file hits the cost cap");
+    check(row[DIFF_CODE_ADDED] == row[DIFF_CODE_REMOVED] &&
+              row[DIFF_CODE_ADDED] + row[DIFF_CODE_MODIFIED] <= lines && edits >= 2 * (lines - 1) - 2 * DIFF_MIN_COST,
+          "an approximate diff still balances");
+    free(fwd);
+    free(rev);
+    line_diff_free(&d);
+
+    // Directories pair files by path and skip the ones with equal content
+    long long langs[MAX_LANGUAGES * DIFF_LANG_FIELDS], stats[DIFF_STAT_FIELDS];
+    char names[MAX_LANGUAGES * 64];
+    mkdir(work_path("diff-old"), 0755);
+    mkdir(work_path("diff-new"), 0755);
+    write_text("diff-old/same.c", "int same;\n");
+    write_text("diff-new/same.c", "int same;\n");
+    write_text("diff-old/edit.c", "int a;\nint b;\n");
+    write_text("diff-new/edit.c", "int a;\nint c;\n");
+    write_text("diff-old/gone.c", "int gone;\n");
+    write_text("diff-new/new.c", "int n;\n// n\n");
+    char old_root[4096];
+    snprintf(old_root, sizeof(old_root), "%s", work_path("diff-old"));
+    int count = cloc_diff_directories(g_ctx, old_root, work_path("diff-new"), 0, names, langs, MAX_LANGUAGES, stats);
+    check(count == 1 && stats[DIFF_STAT_FILES_SAME] == 1 && stats[DIFF_STAT_FILES_DIFFED] == 1,
+          "one file same, one diffed");
+    check(langs[DIFF_FILES_ADDED] == 1 && langs[DIFF_FILES_REMOVED] == 1 && langs[DIFF_CODE_MODIFIED] == 1 &&
+              langs[DIFF_CODE_ADDED] == 1 && langs[DIFF_CODE_REMOVED] == 1 && langs[DIFF_COMMENTS_ADDED] == 1,
+          "added, removed and modified files by kind");
+}
+
+// RESULT FILES - round trips, order-free merges, damaged files refused
+
+// Sum a result file's language totals; returns its language count or -1
+static int read_result(const char* path, long long totals[6], long long info[RESULT_INFO_FIELDS]) {
+    static char names[MAX_LANGUAGES * 64];
+    static long long stats[MAX_LANGUAGES * 6];
+    long long walk[WALK_STAT_FIELDS];
+    void* result = cloc_result_open(path);
+    if (!result) return -1;
+    int count = cloc_result_read(result, names, stats, MAX_LANGUAGES, walk, info);
+    memset(totals, 0, 6 * sizeof(long long));
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < 6; k++) totals[k] += stats[i * 6 + k];
+    }
+    cloc_result_close(result);
+    return count;
+}
+
+static int same_file_bytes(const char* a_rel, const char* b_rel) {
+    long long a_len, b_len;
+    unsigned char* a = read_fixture(a_rel, &a_len);
+    unsigned char* b = read_fixture(b_rel, &b_len);
+    int same = a && b && a_len == b_len && memcmp(a, b, a_len) == 0;
+    free(a);
+    free(b);
+    return same;
+}
+
+static void test_result(void) {
+    char whole[4096], part0[4096], part1[4096], inputs[8192];
+    long long walk[WALK_STAT_FIELDS], walk_totals[6], totals[6], info[RESULT_INFO_FIELDS];
+    mkdir(work_path("results"), 0755);
+    mkdir(work_path("results/lib"), 0755);
+    mkdir(work_path("results/app"), 0755);
+    write_text("results/lib/a.c", "int a;\n// a\n");
+    write_text("results/lib/b.py", "b = 1\n\n");
+    write_text("results/app/main.c", "int main(void) {\n    return 0;\n}\n");
+    write_text("results/app/x.c", "int x;\n");
+    write_text("results/top.py", "# top\n");
+    count_tree(work_path("results"), 0, walk_totals, walk);
+
+    char root[4096];
+    snprintf(root, sizeof(root), "%s", work_path("results"));
+    snprintf(whole, sizeof(whole), "%s", work_path("whole.res"));
+    snprintf(part0, sizeof(part0), "%s", work_path("part0.res"));
+    snprintf(part1, sizeof(part1), "%s", work_path("part1.res"));
+    check(cloc_result_save_directory(g_ctx, root, WALK_FILE_RECORDS, 0, whole, walk) == 2, "a walk is saved");
+    check(read_result(whole, totals, info) == 2 && memcmp(totals, walk_totals, sizeof(totals)) == 0 &&
+              info[RESULT_INFO_SHARDS] == 1 && info[RESULT_INFO_FILES] == 5,
+          "a saved result reads back as the walk");
+
+    // A counting pool is asked for per call and gives the same totals and records
+    static char pool_names[MAX_LANGUAGES * 64];
+    static long long pool_stats[MAX_LANGUAGES * 6];
+    static thread_stats_t pool_threads[8];
+    int pool_langs = cloc_analyze_directory(g_ctx, root, 0, 3, pool_names, pool_stats, MAX_LANGUAGES, walk,
+                                            (long long*)pool_threads, 8, 0);
+    check(pool_langs == 2 && walk[WALK_THREADS] == 4, "a walk counts on the pool it asks for");
+    check(cloc_result_save_directory(g_ctx, root, WALK_FILE_RECORDS, 3, work_path("pooled.res"), walk) == 2 &&
+              read_result(work_path("pooled.res"), totals, info) == 2 &&
+              memcmp(totals, walk_totals, sizeof(totals)) == 0 && info[RESULT_INFO_FILES] == 5,
+          "a pooled walk saves the same result");
+    cloc_analyze_directory(g_ctx, root, 0, 0, pool_names, pool_stats, MAX_LANGUAGES, walk, (long long*)pool_threads,
+                           8, 0);
+    check(walk[WALK_THREADS] == 1, "and the next walk doesn't inherit it");
+
+    // Records come back in path order with their counts
+    void* result = cloc_result_open(whole);
+    char path[256], last[256] = "";
+    long long stats[5], lines = 0;
+    int ordered = 1;
+    for (int i = 0; result && cloc_result_file(result, i, path, sizeof(path), stats) >= 0; i++) {
+        ordered &= strcmp(last, path) < 0;
+        snprintf(last, sizeof(last), "%s", path);
+        lines += stats[0];
+    }
+    cloc_result_close(result);
+    check(ordered && lines == walk_totals[1], "file records are sorted and add up");
+
+    // Shards merge to the whole walk's totals in either order, byte for byte
+    cloc_result_save_shard(g_ctx, root, WALK_FILE_RECORDS, 0, 0, 2, 0, 0, 0, part0, walk);
+    cloc_result_save_shard(g_ctx, root, WALK_FILE_RECORDS, 0, 1, 2, 0, 0, 0, part1, walk);
+    // Hashed or planned, the root directory is shard 0's whatever its hash
+    mkdir(work_path("results-empty"), 0755);
+    int root_owners = 0;
+    for (int i = 0; i < 3; i++) {
+        cloc_result_save_shard(g_ctx, work_path("results-empty"), 0, 0, i, 3, 0, 0, 0, work_path("empty.res"), walk);
+        root_owners += walk[WALK_DIRS] << i;
+    }
+    check(root_owners == 1, "only shard 0 counts the root");
+
+    int len0 = (int)strlen(part0) + 1;
+    memcpy(inputs, part0, len0);
+    memcpy(inputs + len0, part1, strlen(part1) + 1);
+    check(cloc_result_merge(work_path("ab.res"), inputs, 2) == 0, "two shards merge");
+    memcpy(inputs, part1, strlen(part1) + 1);
+    memcpy(inputs + strlen(part1) + 1, part0, len0);
+    check(cloc_result_merge(work_path("ba.res"), inputs, 2) == 0, "in either order");
+    check(same_file_bytes("ab.res", "ba.res"), "merge order doesn't change a byte");
+    check(read_result(work_path("ab.res"), totals, info) == 2 && memcmp(totals, walk_totals, sizeof(totals)) == 0 &&
+              info[RESULT_INFO_SHARDS] == 2 && info[RESULT_INFO_FILES] == 5,
+          "merged shards hold the whole walk");
+    memcpy(inputs, part0, len0);
+    memcpy(inputs + len0, part0, len0);
+    check(cloc_result_merge(work_path("aa.res"), inputs, 2) == -2, "overlapping shards are refused");
+    cloc_result_save_directory(g_ctx, root, 0, 0, part1, walk);
+    memcpy(inputs, whole, strlen(whole) + 1);
+    memcpy(inputs + strlen(whole) + 1, part1, strlen(part1) + 1);
+    check(cloc_result_merge(work_path("mixed.res"), inputs, 2) == 0 &&
+              read_result(work_path("mixed.res"), totals, info) == 2 && info[RESULT_INFO_FILES] == -1 &&
+              totals[1] == 2 * walk_totals[1],
+          "records are kept only if every input has them");
+
+    // Damage anywhere is caught at open
+    long long size;
+    unsigned char* bytes = read_fixture("whole.res", &size);
+    const result_header_t* h = (const result_header_t*)bytes;
+    const struct {
+        long long off;
+        int len;
+        const char* what;
+    } damage[] = {
+        { 0, 1, "a foreign magic is refused" },
+        { 8, 1, "another version is refused" },
+        { 16, 1, "another byte order is refused" },
+        { 24, 1, "another layout is refused" },
+        { 32, 1, "a wrong file size is refused" },
+        { 48, 1, "a bad has_files flag is refused" },
+        { bytes ? h->langs_off : 0, 64, "an unterminated language name is refused" },
+        { bytes ? h->files_off + 20 : 0, 1, "a record's language out of range is refused" },
+        { bytes ? h->files_off + 16 : 0, 1, "a record's path past the end is refused" },
+    };
+    // Flipping 0x40 makes every byte of a name nonzero
+    for (int i = 0; bytes && i < (int)(sizeof(damage) / sizeof(damage[0])); i++) {
+        for (int k = 0; k < damage[i].len; k++) bytes[damage[i].off + k] ^= 0x40;
+        FILE* f = fopen(work_path("bad.res"), "wb");
+        fwrite(bytes, 1, size, f);
+        fclose(f);
+        result = cloc_result_open(work_path("bad.res"));
+        check(result == 0, "%s", damage[i].what);
+        cloc_result_close(result);
+        for (int k = 0; k < damage[i].len; k++) bytes[damage[i].off + k] ^= 0x40;
+    }
+    FILE* f = fopen(work_path("bad.res"), "wb");
+    if (bytes) fwrite(bytes, 1, size - 8, f);
+    fclose(f);
+    check(cloc_result_open(work_path("bad.res")) == 0, "a truncated result is refused");
+    memcpy(inputs, whole, strlen(whole) + 1);
+    memcpy(inputs + strlen(whole) + 1, work_path("bad.res"), strlen(work_path("bad.res")) + 1);
+    check(cloc_result_merge(work_path("never.res"), inputs, 2) == -1, "a merge with a bad input fails");
+    free(bytes);
+}
+
+// ARCHIVES - members count like the tree they were made from
+
+// Write a damaged copy of an archive fixture as <dir>/<name>
+static void write_fixture(const char* dir, const char* name, const unsigned char* data, long long len) {
+    char rel[256];
+    mkdir(work_path(dir), 0755);
+    snprintf(rel, sizeof(rel), "%s/%s", dir, name);
+    FILE* f = fopen(work_path(rel), "wb");
+    if (!f) return;
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+static void test_archives(void) {
+    static const char* const kinds[] = { "tar", "pax", "tgz", "multi", "zip" };
+    long long want[6], got[6], walk[WALK_STAT_FIELDS];
+    check(count_tree(work_path("archives/tree"), 0, want, walk) == 2 && want[0] == 2, "the archive fixtures are there");
+    for (int i = 0; i < 5; i++) {
+        char dir[64];
+        snprintf(dir, sizeof(dir), "archives/%s", kinds[i]);
+        count_tree(work_path(dir), WALK_ARCHIVES, got, walk);
+        check(memcmp(got, want, sizeof(got)) == 0 && walk[WALK_ARCHIVES_READ] == 1 &&
+                  walk[WALK_FILES_UNREADABLE] == 0,
+              "a %s counts like the tree", kinds[i]);
+        check(walk[WALK_FILES_IGNORED] == 1, "a %s's node_modules is ignored", kinds[i]);
+        count_tree(work_path(dir), 0, got, walk);
+        check(got[0] == 0 && walk[WALK_ARCHIVES_READ] == 0, "a %s is opened only when asked", kinds[i]);
+    }
+
+    // A tar header claiming more than the archive holds is truncation, and
+    // the members before it still count
+    long long len;
+    unsigned char* tar = read_fixture("archives/tar/tree.tar", &len);
+    unsigned char* h = 0;
+    for (long long off = 0; tar && !h && off + 512 <= len; off += 512) {
+        if (memcmp(tar + off, "./main.c", 9) == 0) h = tar + off;
+    }
+    if (h) {
+        snprintf((char*)h + 124, 12, "%011o", 0x7FFFFFF0);
+        unsigned sum = 0;
+        memset(h + 148, ' ', 8);
+        for (int i = 0; i < 512; i++) sum += h[i];
+        snprintf((char*)h + 148, 8, "%06o", sum);
+        write_fixture("archives/huge", "tree.tar", tar, len);
+    }
+    count_tree(work_path("archives/huge"), WALK_ARCHIVES, got, walk);
+    check(h && walk[WALK_FILES_UNREADABLE] == 1 && got[0] < want[0], "an oversized tar member is truncation");
+    free(tar);
+
+    // So is a zip member claiming more than its data can inflate to
+    unsigned char* zip = read_fixture("archives/zip/tree.zip", &len);
+    int patched = 0;
+    for (long long i = 0; zip && i + 46 <= len; i++) {
+        if (memcmp(zip + i, "PK\1\2", 4) != 0 || zip[i + 10] != 8) continue;
+        memcpy(zip + i + 24, "\xf0\xff\xff\x7f", 4);
+        patched++;
+    }
+    if (patched == 1) write_fixture("archives/bomb", "tree.zip", zip, len);
+    count_tree(work_path("archives/bomb"), WALK_ARCHIVES, got, walk);
+    check(patched == 1 && walk[WALK_FILES_UNREADABLE] == 1 && got[0] == want[0] - 1,
+          "a zip member's impossible size is damage");
+    free(zip);
+}
+
+// WATCH - totals kept current from events, links and a vanished root
+
+static void test_watch(void) {
+    char moved[4096];
+    mkdir(work_path("watched"), 0755);
+    write_text("watched/a.c", "int a;\n");
+    cloc_watch_t* watch = cloc_watch_start(g_ctx, work_path("watched"), 0);
+    check(watch != 0, "a watch starts");
+    if (!watch) return;
+    const lang_totals_t* c = &watch->totals[detect_language(watch->db, "a.c") - watch->db->langs];
+    check(watch->stats[WATCH_FILES] == 1 && c->files == 1, "the first walk counts the tree");
+
+    // The new directory's walk must not enter the root again through it
+    mkdir(work_path("watched/sub"), 0755);
+    symlink("..", work_path("watched/sub/up"));
+    cloc_watch_poll(watch, 0);
+    check(watch->stats[WATCH_FILES] == 1 && c->files == 1 && watch->w->stats[WALK_DIRS_DUPLICATE] == 1,
+          "a symlink to an ancestor adds nothing");
+
+    write_text("watched/sub/b.c", "int b;\nint c;\n");
+    cloc_watch_poll(watch, 0);
+    check(watch->stats[WATCH_FILES] == 2 && c->files == 2 && c->lines == 5, "a written file is counted");
+
+    snprintf(moved, sizeof(moved), "%s", work_path("watched-moved"));
+    rename(work_path("watched"), moved);
+    cloc_watch_poll(watch, 0);
+    check(watch->stats[WATCH_ROOT_GONE] == 1 && watch->stats[WATCH_FILES] == 0 && c->files == 0,
+          "a moved root clears the totals");
+    write_text("watched-moved/d.c", "int d;\n");
+    cloc_watch_poll(watch, 0);
+    check(watch->stats[WATCH_FILES] == 0 && watch->stats[WATCH_DIRS] == 0, "events after the root left are ignored");
+    cloc_watch_stop(watch);
+}
+
+static const struct {
+    const char* name;
+    void (*run)(void);
+} g_groups[] = {
+    { "encodings", test_encodings },
+    { "languages", test_languages },
+    { "ignore", test_ignore },
+    { "links", test_links },
+    { "cancel", test_cancel },
+    { "cache", test_cache },
+    { "index", test_index },
+    { "inflate", test_inflate },
+    { "git", test_git },
+    { "history", test_history },
+    { "diff", test_diff },
+    { "result", test_result },
+    { "archives", test_archives },
+    { "watch", test_watch },
+};
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <languages.tsv> <work dir> [filter]\n", argv[0]);
+        return 2;
+    }
+    g_work = argv[2];
+    const char* filter = argc > 3 ? argv[3] : 0;
+
+    g_ctx = cloc_ctx_create(0);
+    if (!g_ctx) return 1;
+    if (load_languages(argv[1]) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    for (int i = 0; i < (int)(sizeof(g_groups) / sizeof(g_groups[0])); i++) {
+        if (filter && !strstr(g_groups[i].name, filter)) continue;
+        g_group = g_groups[i].name;
+        g_groups[i].run();
+    }
+    printf("1..%d\n", g_checks);
+
+    cloc_ctx_destroy(g_ctx);
+    return g_failed ? 1 : 0;
+}